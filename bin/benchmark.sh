@@ -13,4 +13,12 @@ for DOCUMENT in $1/*; do
         "unlz4 -f ${BASENAME}.lz4 ${BASENAME}.out" \
         --warmup 64 \
         --export-csv ${BASENAME}.csv
+    hyperfine \
+        --parameter-list io mmap,pwrite,io_uring \
+        "md --io={io} ${DOCUMENT} ${BASENAME}.zlib" \
+        "mi --io={io} ${BASENAME}.zlib ${BASENAME}.out" \
+        "mlc --io={io} ${DOCUMENT} ${BASENAME}.lz4" \
+        "mld --io={io} ${BASENAME}.lz4 ${BASENAME}.out" \
+        --warmup 64 \
+        --export-csv ${BASENAME}.io.csv
 done
@@ -0,0 +1,45 @@
+find_package(PkgConfig)
+if(PKG_CONFIG_FOUND)
+    pkg_check_modules(PC_libdeflate QUIET libdeflate)
+endif()
+
+find_path(libdeflate_INCLUDE_DIR
+    NAMES libdeflate.h
+    PATHS ${PC_libdeflate_INCLUDE_DIRS}
+)
+
+# older releases don't install a pkg-config file
+find_library(libdeflate_LIBRARY
+    NAMES deflate
+    PATHS ${PC_libdeflate_LIBRARY_DIRS}
+)
+
+if(PC_libdeflate_VERSION)
+    set(libdeflate_VERSION ${PC_libdeflate_VERSION})
+elseif(libdeflate_INCLUDE_DIR)
+    file(STRINGS ${libdeflate_INCLUDE_DIR}/libdeflate.h
+        libdeflate_VERSION_LINE
+        REGEX "^#define LIBDEFLATE_VERSION_STRING"
+    )
+    string(REGEX MATCH "[0-9]+\\.[0-9]+(\\.[0-9]+)?" libdeflate_VERSION
+        "${libdeflate_VERSION_LINE}")
+endif()
+
+mark_as_advanced(libdeflate_FOUND libdeflate_INCLUDE_DIR libdeflate_LIBRARY
+    libdeflate_VERSION)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(libdeflate
+    REQUIRED_VARS libdeflate_INCLUDE_DIR libdeflate_LIBRARY
+    VERSION_VAR libdeflate_VERSION
+)
+
+if(libdeflate_FOUND AND NOT TARGET libdeflate::libdeflate)
+    add_library(libdeflate::libdeflate INTERFACE IMPORTED)
+    target_include_directories(libdeflate::libdeflate INTERFACE
+        ${libdeflate_INCLUDE_DIR})
+    target_link_libraries(libdeflate::libdeflate INTERFACE
+        ${libdeflate_LIBRARY})
+
+    set(libdeflate_LIBRARIES libdeflate::libdeflate)
+endif()
@@ -28,11 +28,28 @@
 
 typedef struct AppIOState AppIOState;
 
-typedef size_t(AppSizeFunc)(size_t input_file_size, void *arg);
+// returns the initial size of the output file. the input is already mapped, so
+// decompressors can read sizes recorded in it; the output is grown as needed if
+// the estimate is too small and truncated to fit once the run is over
+typedef size_t(AppSizeFunc)(const FileAndMapping *input_file, void *arg);
 typedef Error(AppInitFunc)(AppIOState *app_state, void *arg);
 typedef Error(AppRunFunc)(AppIOState *app_state, bool *finished, void *arg);
 typedef void(AppCleanupFunc)(AppIOState *app_state, void *arg);
 
+// readies the contexts that init created for another file in batch mode, in
+// place of calling cleanup and init again. only called after a successful run.
+// when reset is given, cleanup may run once after the last of many files and
+// must not touch app_state
+typedef Error(AppResetFunc)(AppIOState *app_state, void *arg);
+
+// loads whatever a codec shares between all of the files it transforms, such
+// as a digested dictionary, once the arguments are parsed and before arg is
+// copied for batch mode. release is called once before exiting if prepare
+// succeeded. copies of arg share what prepare loaded, so neither cleanup nor
+// reset may free it
+typedef Error(AppPrepareFunc)(void *arg);
+typedef void(AppReleaseFunc)(void *arg);
+
 typedef struct AppParams {
   const char *executable_name;
   const char *version;
@@ -46,8 +63,15 @@ typedef struct AppParams {
   AppInitFunc *init;
   AppRunFunc *run;
   AppCleanupFunc *cleanup;
+  AppResetFunc *reset;
+  AppPrepareFunc *prepare;
+  AppReleaseFunc *release;
 
+  // batch mode copies arg once per file it transforms at a time, after the
+  // arguments are parsed and before init is called. if arg_size is 0, batch
+  // mode transforms one file at a time
   void *arg;
+  size_t arg_size;
 } AppParams;
 
 struct AppIOState {
@@ -57,6 +81,11 @@ struct AppIOState {
   size_t input_mapping_first_unused_offset;
   size_t output_mapping_first_unused_offset;
   size_t output_bytes_written;
+
+  // set by init, reset or run while the next run will consume all of the
+  // input in one call into the codec's library, which reports no progress
+  // until it returns. the driver doesn't start --readahead until it's clear
+  bool runs_in_one_call;
 };
 
 int run_compression_app(int argc, const char *const argv[argc],
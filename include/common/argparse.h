@@ -40,6 +40,43 @@ typedef struct IntegerArgumentParser {
   long long value;
 } IntegerArgumentParser;
 
+typedef struct ThreadCountArgumentParser {
+  ArgumentParser argument_parser;
+  long long max_value;
+
+  long long value;
+} ThreadCountArgumentParser;
+
+// parses MIN:MAX, where both ends are in [min_value, max_value] and MIN is no
+// greater than MAX
+typedef struct RangeArgumentParser {
+  ArgumentParser argument_parser;
+  long long min_value;
+  long long max_value;
+
+  long long lower_value;
+  long long upper_value;
+} RangeArgumentParser;
+
+// one setting of a ParameterArgumentParser
+typedef struct Parameter {
+  const char *name;
+  long long min_value;
+  long long max_value;
+
+  long long value;
+  bool was_set;
+} Parameter;
+
+// parses NAME=VALUE, where NAME is one of parameters and VALUE is an integer in
+// its range. the option can be given any number of times, and a later setting
+// of a parameter replaces an earlier one
+typedef struct ParameterArgumentParser {
+  ArgumentParser argument_parser;
+  Parameter *parameters;
+  size_t num_parameters;
+} ParameterArgumentParser;
+
 typedef struct StringArgumentParser {
   ArgumentParser argument_parser;
   const char *const *possible_values;
@@ -61,10 +98,13 @@ typedef struct PositionalArgument {
 } PositionalArgument;
 
 typedef struct KeywordArgument {
-  char short_name;
+  char short_name; // '\0' for options that can only be given by long name
   const char *long_name;
   const char *help_text;
   ArgumentParser *parser;
+  // if set, the value can be left out, and can only be given as --key=VALUE.
+  // for options that can only be given by long name
+  bool has_optional_value;
 
   bool was_found;
 } KeywordArgument;
@@ -78,6 +118,12 @@ typedef struct Arguments {
   PositionalArgument **positional_args;
   size_t num_positional_args;
 
+  // if set, positional arguments are stored here in order instead of being
+  // parsed, and any number of them is accepted. it must have room for argc - 1
+  // arguments. positional_args then only describe them in the help text
+  const char **collected_positional_args;
+  size_t num_collected_positional_args;
+
   KeywordArgument **keyword_args;
   size_t num_keyword_args;
 
@@ -89,6 +135,16 @@ IntegerArgumentParser make_integer_parser(const char *name,
                                           const char *metavariable,
                                           long long min_value,
                                           long long max_value);
+ThreadCountArgumentParser make_thread_count_parser(const char *name,
+                                                  const char *metavariable,
+                                                  long long max_value);
+RangeArgumentParser make_range_parser(const char *name,
+                                      const char *metavariable,
+                                      long long min_value, long long max_value);
+ParameterArgumentParser
+make_parameter_parser(const char *name, const char *metavariable,
+                      size_t num_parameters,
+                      Parameter parameters[num_parameters]);
 StringArgumentParser
 make_string_parser(const char *name, const char *metavariable,
                    size_t num_possible_values,
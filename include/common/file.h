@@ -23,10 +23,71 @@
 
 #include <common/error.h>
 
+#include <stdbool.h>
 #include <stddef.h>
 
+typedef enum FileAllocation {
+  // blocks are allocated by the filesystem when pages are first written back
+  FILE_ALLOCATION_SPARSE,
+  // extents are reserved with fallocate ahead of the output cursor
+  FILE_ALLOCATION_RESERVE,
+} FileAllocation;
+
+typedef enum FileIO {
+  // codecs write straight into a shared mapping of the file
+  FILE_IO_MMAP,
+  // codecs write into a pair of anonymous staging buffers that are written
+  // back with pwrite
+  FILE_IO_PWRITE,
+  // like FILE_IO_PWRITE, but the writes are submitted to an io_uring and run
+  // while the codec fills the other staging buffer
+  FILE_IO_URING,
+  // like FILE_IO_PWRITE, but for pipes and other files that can only be
+  // written in order. staging buffers are spliced into pipes with vmsplice
+  FILE_IO_STREAM,
+  // codecs write into an anonymous mapping that is never written anywhere,
+  // which benchmarks leave mapped from one run to the next
+  FILE_IO_MEMORY,
+} FileIO;
+
+typedef enum FileCache {
+  // pages of the file stay in the page cache as usual
+  FILE_CACHE_KEEP,
+  // pages of the file are dropped from the page cache once they have been
+  // read or written back
+  FILE_CACHE_DROP,
+  // the staging buffers are written with O_DIRECT, bypassing the page cache
+  FILE_CACHE_BYPASS,
+} FileCache;
+
+typedef enum FileSync {
+  // the kernel writes the output back whenever it sees fit
+  FILE_SYNC_NONE,
+  // write back is started as the output is retired, and the data and size of
+  // the output are on stable storage before exiting
+  FILE_SYNC_DATA,
+  // like FILE_SYNC_DATA, but all of the output's metadata and its directory
+  // entry are also on stable storage
+  FILE_SYNC_FULL,
+} FileSync;
+
+// how an input file is mapped. the flags can be combined
+typedef enum FileMapping {
+  FILE_MAPPING_DEFAULT = 0,
+  // map at a huge page boundary and ask for transparent huge pages, which
+  // cuts down on TLB misses where the filesystem supports them
+  FILE_MAPPING_HUGE_PAGES = 1 << 0,
+  // fault pages in ahead of the codec instead of one at a time, all at once
+  // for small files and through a sliding window for large ones
+  FILE_MAPPING_PREFAULT = 1 << 1,
+} FileMapping;
+
+struct Uring;
+
 typedef struct FileAndMapping {
   const char *filename;
+  // stdin or stdout, which have no directory entry of their own
+  bool is_standard_stream;
 
   int fd;
   size_t file_size;
@@ -34,13 +95,56 @@ typedef struct FileAndMapping {
   void *mapping;
   size_t mapping_size;
   size_t mapping_offset;
+
+  FileAllocation allocation;
+  size_t allocated_size;
+
+  // with a staging backend, mapping is the staging buffer being filled and
+  // mapping_offset is where it goes in the file. everything before that has
+  // already been handed to the kernel
+  FileIO io;
+  void *spare_mapping;
+  size_t spare_mapping_size;
+  struct Uring *uring;
+  bool is_pipe;
+
+  FileCache cache;
+  size_t dropped_size;
+
+  FileMapping mapping_flags;
+  size_t prefaulted_size;
+
+  FileSync sync;
+  size_t written_back_size;
+  size_t waited_size;
+
+  // system calls that resized or unmapped part of the file or its mapping,
+  // for --stats
+  size_t num_remaps;
+  size_t num_unmaps;
+  size_t num_truncates;
 } FileAndMapping;
 
 Error open_and_map_file(const char *filename, FileAndMapping *file);
+Error open_and_map_stdin(FileAndMapping *file);
+Error set_input_mapping(FileAndMapping *file, FileMapping flags);
+Error prefault_input(FileAndMapping *file, size_t first_unused_offset);
+Error map_file_range(FileAndMapping *file, size_t offset, size_t size,
+                     size_t *offset_in_mapping);
 Error create_and_map_file(const char *filename, size_t size,
                           FileAndMapping *file);
+Error create_and_map_stdout(size_t size, FileAndMapping *file);
+Error create_memory_output(size_t size, FileAndMapping *file);
+Error set_output_io(FileAndMapping *file, FileIO io);
+Error flush_output(FileAndMapping *file, size_t *first_unused_offset);
+Error set_file_cache(FileAndMapping *file, FileCache cache);
+Error finish_output_writes(FileAndMapping *file, size_t first_unused_offset);
 Error unmap_unused_pages(FileAndMapping *file, size_t *first_unused_offset);
 Error expand_output_mapping(FileAndMapping *file, size_t first_unused_offset);
+Error reserve_output_mapping(FileAndMapping *file, size_t first_unused_offset,
+                             size_t size);
+Error reserve_output_extents(FileAndMapping *file, size_t first_unused_offset);
+Error sync_output(FileAndMapping *file);
 Error free_file(FileAndMapping file);
 
 #endif
@@ -0,0 +1,60 @@
+// Copyright (c) 2019 Gregory Meyer
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef COMMON_THREAD_POOL_H
+#define COMMON_THREAD_POOL_H
+
+#include <common/error.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <pthread.h>
+
+typedef void(ThreadPoolTaskFunc)(void *arg);
+
+typedef struct ThreadPoolTask {
+  ThreadPoolTaskFunc *func;
+  void *arg;
+} ThreadPoolTask;
+
+typedef struct ThreadPool {
+  pthread_t *threads;
+  size_t num_threads;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t task_available;
+  pthread_cond_t tasks_finished;
+
+  ThreadPoolTask *tasks;
+  size_t tasks_capacity;
+  size_t first_task_index;
+  size_t num_queued_tasks;
+  size_t num_running_tasks;
+
+  bool is_stopping;
+} ThreadPool;
+
+Error create_thread_pool(size_t num_threads, ThreadPool *pool);
+Error submit_task(ThreadPool *pool, ThreadPoolTaskFunc *func, void *arg);
+void wait_for_tasks(ThreadPool *pool);
+void free_thread_pool(ThreadPool *pool);
+
+#endif
@@ -21,53 +21,335 @@
 #include <common/app.h>
 
 #include <common/argparse.h>
+#include <common/thread_pool.h>
+
+#include "readahead.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #define COMPRESSION_INPUT_HELP_TEXT                                            \
   "Uncompressed file to read from. The current user must have the correct "    \
-  "permissions to read from this file."
+  "permissions to read from this file. If '-', reads from stdin, which is "    \
+  "first copied to a temporary file unless it is a regular file."
 #define COMPRESSION_OUTPUT_HELP_TEXT_FORMAT                                    \
   "Filename of the compressed file to create. If this file already exists, "   \
   "it is truncated to length 0 before being written to. Should %s exit with "  \
   "an error after truncating this file, it will be deleted. The current user " \
   "must have write permissions in this file's parent directory and, if the "   \
-  "file already exists, write permissions on this file."
+  "file already exists, write permissions on this file. If '-', writes to "    \
+  "stdout, which is written as a stream unless it is a regular file."
 
 #define DECOMPRESSION_INPUT_HELP_TEXT                                          \
   "Compressed file to read from. The current user must have the correct "      \
-  "permissions to read from this file."
+  "permissions to read from this file. If '-', reads from stdin, which is "    \
+  "first copied to a temporary file unless it is a regular file."
 #define DECOMPRESSION_OUTPUT_HELP_TEXT_FORMAT                                  \
   "Filename of the uncompressed file to create. If this file already exists, " \
   "it is truncated to length 0 before being written to. Should %s exit with "  \
   "an error after truncating this file, it will be deleted. The current user " \
   "must have write permissions in this file's parent directory and, if the "   \
-  "file already exists, write permissions on this file."
+  "file already exists, write permissions on this file. If '-', writes to "    \
+  "stdout, which is written as a stream unless it is a regular file."
+
+static const char *const ALLOCATION_VALUES[] = {"sparse", "reserve"};
+static const FileAllocation ALLOCATION_MAPPING[] = {FILE_ALLOCATION_SPARSE,
+                                                    FILE_ALLOCATION_RESERVE};
+
+static const char *const SYNC_VALUES[] = {"none", "data", "full"};
+static const FileSync SYNC_MAPPING[] = {FILE_SYNC_NONE, FILE_SYNC_DATA,
+                                        FILE_SYNC_FULL};
+
+static const char *const IO_VALUES[] = {"mmap", "pwrite", "io_uring"};
+static const FileIO IO_MAPPING[] = {FILE_IO_MMAP, FILE_IO_PWRITE,
+                                    FILE_IO_URING};
+
+typedef enum BenchOutput {
+  // a reusable anonymous mapping that is never written anywhere
+  BENCH_OUTPUT_MEMORY,
+  // the output file, created again for every run like without --bench
+  BENCH_OUTPUT_FILE,
+} BenchOutput;
+
+typedef enum BenchFormat {
+  BENCH_FORMAT_CSV,
+  BENCH_FORMAT_JSON,
+} BenchFormat;
+
+static const char *const BENCH_OUTPUT_VALUES[] = {"memory", "file"};
+static const BenchOutput BENCH_OUTPUT_MAPPING[] = {BENCH_OUTPUT_MEMORY,
+                                                   BENCH_OUTPUT_FILE};
+
+static const char *const BENCH_FORMAT_VALUES[] = {"csv", "json"};
+static const BenchFormat BENCH_FORMAT_MAPPING[] = {BENCH_FORMAT_CSV,
+                                                   BENCH_FORMAT_JSON};
+
+// options that every frontend accepts in addition to its codec's own
+typedef struct AppOptions {
+  StringArgumentParser allocation_parser;
+  KeywordArgument allocation;
+
+  StringArgumentParser io_parser;
+  KeywordArgument io;
+
+  KeywordArgument direct;
+
+  KeywordArgument huge_pages;
+  KeywordArgument prefault;
+  KeywordArgument fault_stats;
+  KeywordArgument stats;
+  KeywordArgument perf_counters;
+
+  IntegerArgumentParser readahead_parser;
+  KeywordArgument readahead;
+
+  StringArgumentParser sync_parser;
+  KeywordArgument sync;
+
+  KeywordArgument batch;
+
+  ThreadCountArgumentParser jobs_parser;
+  KeywordArgument jobs;
+
+  IntegerArgumentParser bench_parser;
+  KeywordArgument bench;
+
+  StringArgumentParser bench_output_parser;
+  KeywordArgument bench_output;
+
+  StringArgumentParser bench_format_parser;
+  KeywordArgument bench_format;
+} AppOptions;
+
+#define NUM_APP_KEYWORD_ARGS 15
+
+#define DEFAULT_BENCH_RUNS 10
+
+#define DTLB_LOAD_MISSES                                                       \
+  (PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |            \
+   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+// the readahead distance can grow to this many times its initial value
+#define MAX_READAHEAD_GROWTH 16
+
+// the wall and CPU time of the driver thread and the major faults of the
+// process when a run started
+typedef struct RunClock {
+  struct timespec wall_time;
+  struct timespec cpu_time;
+  long num_major_faults;
+} RunClock;
+
+// the parts of a transform that --stats times separately
+typedef enum Phase {
+  PHASE_MAP_INPUT,
+  PHASE_CREATE_OUTPUT,
+  PHASE_INIT,
+  PHASE_RUN,
+  PHASE_FLUSH,
+  PHASE_UNMAP,
+  PHASE_PREFETCH,
+  PHASE_EXPAND,
+  PHASE_FINISH,
+  PHASE_TRUNCATE,
+  PHASE_SYNC,
+  PHASE_CLEANUP,
+  NUM_PHASES,
+} Phase;
+
+static const char *const PHASE_NAMES[] = {
+    "map input", "create output", "init",     "run",
+    "flush",     "unmap",         "prefetch", "expand output",
+    "finish",    "truncate",      "sync",     "cleanup",
+};
+
+typedef enum PerfEvent {
+  PERF_EVENT_CYCLES,
+  PERF_EVENT_INSTRUCTIONS,
+  PERF_EVENT_LLC_MISSES,
+  PERF_EVENT_DTLB_MISSES,
+  NUM_PERF_EVENTS,
+} PerfEvent;
+
+// what --perf-counters counts. the codec group counts every thread while the
+// codec runs, and the io group counts the driver thread while it maps, flushes
+// and resizes files
+typedef enum PerfGroup {
+  PERF_GROUP_NONE = -1,
+  PERF_GROUP_CODEC,
+  PERF_GROUP_IO,
+  NUM_PERF_GROUPS,
+} PerfGroup;
+
+static const char *const PERF_GROUP_NAMES[] = {"codec", "io"};
+
+// init and cleanup are neither the codec running nor file bookkeeping
+static const PerfGroup PHASE_PERF_GROUPS[] = {
+    PERF_GROUP_IO,    PERF_GROUP_IO, PERF_GROUP_NONE, PERF_GROUP_CODEC,
+    PERF_GROUP_IO,    PERF_GROUP_IO, PERF_GROUP_IO,   PERF_GROUP_IO,
+    PERF_GROUP_IO,    PERF_GROUP_IO, PERF_GROUP_IO,   PERF_GROUP_NONE,
+};
+
+// counters that are scheduled together, so that they cover the same stretches
+// of time. fds[PERF_EVENT_CYCLES] leads the group, and an fd is -1 if the
+// hardware or perf_event_paranoid doesn't allow its event
+typedef struct PerfCounterGroup {
+  int fds[NUM_PERF_EVENTS];
+  uint64_t counts[NUM_PERF_EVENTS];
+  bool has_counts[NUM_PERF_EVENTS];
+} PerfCounterGroup;
+
+// where the time of one or more transforms went. each phase is charged the
+// time until the next one is entered, so together they cover the whole
+// transform. batch workers keep their own and add them to the batch's
+typedef struct Stats {
+  double phase_seconds[NUM_PHASES];
+  Phase phase;
+  struct timespec phase_start_time;
+  bool is_timing;
+
+  // opened by whichever thread transforms files, and enabled by phase
+  bool counts_perf_events;
+  PerfCounterGroup perf_groups[NUM_PERF_GROUPS];
+
+  size_t num_files;
+  size_t num_runs;
+  size_t input_bytes;
+  size_t output_bytes;
+
+  size_t num_remaps;
+  size_t num_unmaps;
+  size_t num_truncates;
+} Stats;
+
+// a codec's arg, which holds the contexts init created until cleanup is called
+typedef struct Codec {
+  void *arg;
+  bool has_contexts;
+  bool keeps_contexts; // reset instead of cleaning up after a successful run
+} Codec;
+
+typedef struct BatchFile {
+  const char *input_filename;
+  const char *output_filename;
+  off_t input_size;
+} BatchFile;
+
+// the files of a batch, sorted largest-first, and the index of the next one
+// to hand out to a worker
+typedef struct Batch {
+  const AppParams *params;
+  const AppOptions *options;
+  FileIO io;
+
+  BatchFile *files;
+  size_t num_files;
+
+  pthread_mutex_t mutex;
+  size_t next_file_index;
+  bool has_failed;
+  Stats *stats; // NULL unless --stats or --perf-counters was given
+} Batch;
+
+// each worker reuses the contexts in its own copy of the codec's arg
+typedef struct BatchWorker {
+  Batch *batch;
+  Codec codec;
+  Stats stats;
+} BatchWorker;
 
 static int run_transformer_app(int argc, const char *const argv[argc],
-                               const AppParams *params,
+                               const AppParams *params, bool compresses,
                                const char *input_help_text,
                                const char *output_help_text_format);
+static int transform_file(const AppParams *params, const AppOptions *options,
+                          FileIO io, const char *input_filename,
+                          const char *output_filename, Codec *codec,
+                          Stats *stats);
+static int transform_input(const AppParams *params, const AppOptions *options,
+                           FileIO io, FileAndMapping *input_file,
+                           const char *output_filename, Codec *codec,
+                           Stats *stats);
+static Error map_input(const AppOptions *options, const char *filename,
+                       FileAndMapping *file);
+static Error run_codec(const AppParams *params, const AppOptions *options,
+                       AppIOState *io_state, void *arg, Stats *stats);
+static int run_bench(const AppParams *params, const AppOptions *options,
+                     FileIO io, bool compresses, const char *input_filename,
+                     const char *output_filename);
+static int transform_into_memory(const AppParams *params,
+                                 const AppOptions *options,
+                                 FileAndMapping *input_file,
+                                 FileAndMapping *output_file, Codec *codec,
+                                 size_t *output_size);
+static int compare_doubles(const void *lhs_v, const void *rhs_v);
+static void print_bench_results(const AppParams *params,
+                                const AppOptions *options, bool compresses,
+                                const char *input_filename,
+                                const char *output_filename,
+                                BenchOutput output, size_t input_size,
+                                size_t output_size, size_t num_runs,
+                                double seconds[num_runs]);
+static void print_csv_field(const char *field);
+static void print_json_string(const char *string);
+static int run_batch(const AppParams *params, const AppOptions *options,
+                     FileIO io, size_t num_filenames,
+                     const char *const filenames[num_filenames],
+                     Stats *stats);
+static void run_batch_worker(void *worker_v);
+static int compare_batch_files(const void *lhs_v, const void *rhs_v);
+static Error read_filename_list(char **list, const char ***filenames,
+                                size_t *num_filenames);
+static Error reserve_extents(FileAndMapping *file, size_t first_unused_offset);
+static int open_dtlb_miss_counter(void);
+static int open_perf_counter(uint32_t type, uint64_t config, bool inherits,
+                             int group_fd);
+static bool read_perf_counter(int fd, uint64_t *count);
+static void start_run_clock(RunClock *clock);
+static bool run_has_stalled(const RunClock *clock);
+static void print_fault_stats(const struct rusage *usage_before,
+                              int dtlb_miss_counter);
+static void enter_phase(Stats *stats, Phase phase);
+static void stop_phases(Stats *stats);
+static void add_file_stats(Stats *stats, const FileAndMapping *file);
+static void add_stats(Stats *total, const Stats *stats);
+static void print_stats(const Stats *stats, const struct rusage *usage_before);
+static void open_perf_groups(Stats *stats);
+static void close_perf_groups(Stats *stats);
+static void set_perf_group_enabled(Stats *stats, PerfGroup group,
+                                   bool is_enabled);
+static void print_perf_counters(const Stats *stats);
 
 int run_compression_app(int argc, const char *const argv[argc],
                         const AppParams *params) {
-  return run_transformer_app(argc, argv, params, COMPRESSION_INPUT_HELP_TEXT,
+  return run_transformer_app(argc, argv, params, true,
+                             COMPRESSION_INPUT_HELP_TEXT,
                              COMPRESSION_OUTPUT_HELP_TEXT_FORMAT);
 }
 
 int run_decompression_app(int argc, const char *const argv[argc],
                           const AppParams *params) {
-  return run_transformer_app(argc, argv, params, DECOMPRESSION_INPUT_HELP_TEXT,
+  return run_transformer_app(argc, argv, params, false,
+                             DECOMPRESSION_INPUT_HELP_TEXT,
                              DECOMPRESSION_OUTPUT_HELP_TEXT_FORMAT);
 }
 
 static int run_transformer_app(int argc, const char *const argv[argc],
-                               const AppParams *params,
+                               const AppParams *params, bool compresses,
                                const char *input_help_text,
                                const char *output_help_text_format) {
 #ifndef NDEBUG
@@ -105,11 +387,257 @@ static int run_transformer_app(int argc, const char *const argv[argc],
                            output_help_text_format, params->executable_name);
   assert(ret == required_buffer_length);
 
+  AppOptions options = {
+      .allocation_parser = make_string_parser(
+          "--allocation", "POLICY",
+          sizeof(ALLOCATION_VALUES) / sizeof(ALLOCATION_VALUES[0]),
+          ALLOCATION_VALUES),
+      .allocation =
+          {
+              .short_name = '\0',
+              .long_name = "allocation",
+              .help_text =
+                  "How disk space for the output file is allocated. One of "
+                  "'sparse' or 'reserve'. 'sparse', the default, lets the "
+                  "filesystem allocate blocks as pages of the output are "
+                  "first written back. 'reserve' uses fallocate to reserve "
+                  "extents in 64 MiB steps ahead of the output cursor, which "
+                  "keeps block allocation out of the page fault path and "
+                  "the output less fragmented. Falls back to 'sparse' if the "
+                  "filesystem doesn't support fallocate.",
+              .parser = &options.allocation_parser.argument_parser,
+          },
+      .io_parser = make_string_parser(
+          "--io", "BACKEND", sizeof(IO_VALUES) / sizeof(IO_VALUES[0]),
+          IO_VALUES),
+      .io =
+          {
+              .short_name = '\0',
+              .long_name = "io",
+              .help_text =
+                  "How the output file is written. One of 'mmap', 'pwrite' "
+                  "or 'io_uring'. 'mmap', the default, has the codec write "
+                  "straight into a shared mapping of the output file. "
+                  "'pwrite' has it write into a pair of reusable 4 MiB "
+                  "staging buffers instead, which are written to the file "
+                  "with pwrite after every step, avoiding a page fault per "
+                  "page of output. 'io_uring' submits those writes to an "
+                  "io_uring so that they run while the codec fills the "
+                  "other buffer, falling back to 'pwrite' if io_uring is "
+                  "unavailable.",
+              .parser = &options.io_parser.argument_parser,
+          },
+      .direct =
+          {
+              .short_name = '\0',
+              .long_name = "direct",
+              .help_text =
+                  "If set, keeps the input and output files out of the page "
+                  "cache. The output is written with O_DIRECT, using 'pwrite' "
+                  "unless --io=io_uring is given. The input is still mapped, "
+                  "but its pages are dropped from the page cache as soon as "
+                  "they have been read. Falls back to dropping the output "
+                  "from the page cache once it has been written if the "
+                  "filesystem doesn't support O_DIRECT.",
+          },
+      .huge_pages =
+          {
+              .short_name = '\0',
+              .long_name = "huge-pages",
+              .help_text =
+                  "If set, maps the input file at a huge page boundary and "
+                  "asks for transparent huge pages, which cuts down on TLB "
+                  "misses where the filesystem supports them.",
+          },
+      .prefault =
+          {
+              .short_name = '\0',
+              .long_name = "prefault",
+              .help_text =
+                  "If set, faults the input file in ahead of the codec "
+                  "instead of one page at a time: all at once for files of "
+                  "up to 256 MiB, and in 64 MiB steps ahead of the input "
+                  "cursor for larger ones.",
+          },
+      .fault_stats =
+          {
+              .short_name = '\0',
+              .long_name = "fault-stats",
+              .help_text =
+                  "If set, prints the number of minor and major page faults "
+                  "and, where performance counters are available, dTLB load "
+                  "misses taken by the whole run to stderr.",
+          },
+      .stats =
+          {
+              .short_name = '\0',
+              .long_name = "stats",
+              .help_text =
+                  "If set, prints where the time of the run went to stderr: "
+                  "the time spent in each phase, such as mapping the input, "
+                  "running the codec and growing the output, the number of "
+                  "times the codec ran and the bytes it went through each "
+                  "time, the mremap, munmap and ftruncate calls made on the "
+                  "files, and the page faults and peak RSS of the process. "
+                  "With --batch, the phases and counts of all files are "
+                  "added up.",
+          },
+      .perf_counters =
+          {
+              .short_name = '\0',
+              .long_name = "perf-counters",
+              .help_text =
+                  "If set, prints the cycles, instructions, instructions per "
+                  "cycle, LLC misses and dTLB load misses in user space to "
+                  "stderr, counted once over the codec on all of its threads "
+                  "and once over the driver thread mapping, flushing and "
+                  "resizing files. Counters that the hardware or "
+                  "perf_event_paranoid doesn't allow are left out.",
+          },
+      .readahead_parser =
+          make_integer_parser("--readahead", "MIB", 1, 1024),
+      .readahead =
+          {
+              .short_name = '\0',
+              .long_name = "readahead",
+              .help_text =
+                  "If set, a helper thread reads the input this many MiB "
+                  "ahead of the codec with readahead(2), so that the codec "
+                  "doesn't stall on major faults. Whenever the codec still "
+                  "stalls, the distance doubles, up to 16 times its initial "
+                  "value. The codec reports its progress after every step, "
+                  "which happens more often with --io=pwrite or "
+                  "--io=io_uring. Not started while the codec takes the whole "
+                  "input in one call, which reports no progress.",
+              .parser = &options.readahead_parser.argument_parser,
+          },
+      .sync_parser = make_string_parser(
+          "--sync", "MODE", sizeof(SYNC_VALUES) / sizeof(SYNC_VALUES[0]),
+          SYNC_VALUES),
+      .sync =
+          {
+              .short_name = '\0',
+              .long_name = "sync",
+              .help_text =
+                  "How durable the output file is once this program exits. "
+                  "One of 'none', 'data' or 'full'. 'none', the default, "
+                  "leaves writing the output back to the kernel. 'data' "
+                  "starts writing back the output as it is produced, keeps "
+                  "at most 64 MiB of it waiting to be written back, and "
+                  "syncs the rest with fdatasync before exiting. 'full' "
+                  "also syncs all of the output's metadata with fsync, as "
+                  "well as the directory that contains it.",
+              .parser = &options.sync_parser.argument_parser,
+          },
+      .batch =
+          {
+              .short_name = '\0',
+              .long_name = "batch",
+              .help_text =
+                  "If set, transforms many files in one process. The "
+                  "positional arguments are then any number of INPUT_FILE "
+                  "OUTPUT_FILE pairs, or, if none are given, the pairs are "
+                  "read from stdin with every filename ended by a NUL "
+                  "character. Files are handed out largest first to --jobs "
+                  "workers, each of which reuses its codec contexts from "
+                  "file to file. A file that fails is reported and its "
+                  "output removed, and the others still run.",
+          },
+      .jobs_parser = make_thread_count_parser("--jobs", "JOBS", 1024),
+      .jobs =
+          {
+              .short_name = '\0',
+              .long_name = "jobs",
+              .help_text =
+                  "Number of files to transform at once with --batch, or "
+                  "'auto', the default, for one per online processor. An "
+                  "integer in the range [1, 1024]. Codecs that take "
+                  "--threads still use that many threads for each file.",
+              .parser = &options.jobs_parser.argument_parser,
+          },
+      .bench_parser = make_integer_parser("--bench", "RUNS", 1, 1000000),
+      .bench =
+          {
+              .short_name = '\0',
+              .long_name = "bench",
+              .help_text =
+                  "If set, maps the input once and transforms it this many "
+                  "times, 10 by default, after one untimed run that faults "
+                  "in the input and output. The minimum, median and 99th "
+                  "percentile time of a run, the uncompressed megabytes "
+                  "per second at the median, and the compression ratio are "
+                  "printed to stdout. Each run includes resetting the "
+                  "codec, but not mapping the input.",
+              .parser = &options.bench_parser.argument_parser,
+              .has_optional_value = true,
+          },
+      .bench_output_parser = make_string_parser(
+          "--bench-output", "OUTPUT",
+          sizeof(BENCH_OUTPUT_VALUES) / sizeof(BENCH_OUTPUT_VALUES[0]),
+          BENCH_OUTPUT_VALUES),
+      .bench_output =
+          {
+              .short_name = '\0',
+              .long_name = "bench-output",
+              .help_text =
+                  "Where --bench writes the output. One of 'memory' or "
+                  "'file'. 'memory', the default, reuses one anonymous "
+                  "mapping for every run and leaves OUTPUT_FILE alone, so "
+                  "only the codec is measured. 'file' creates OUTPUT_FILE "
+                  "for every run as usual, including --io, --direct, "
+                  "--allocation and --sync, and keeps the last one.",
+              .parser = &options.bench_output_parser.argument_parser,
+          },
+      .bench_format_parser = make_string_parser(
+          "--bench-format", "FORMAT",
+          sizeof(BENCH_FORMAT_VALUES) / sizeof(BENCH_FORMAT_VALUES[0]),
+          BENCH_FORMAT_VALUES),
+      .bench_format =
+          {
+              .short_name = '\0',
+              .long_name = "bench-format",
+              .help_text =
+                  "How --bench prints its results. One of 'csv', the "
+                  "default, which prints a header line and one line of "
+                  "results, or 'json', which prints one object on a line.",
+              .parser = &options.bench_format_parser.argument_parser,
+          },
+  };
+
+  // for --bench without a value
+  options.bench_parser.value = DEFAULT_BENCH_RUNS;
+
+  KeywordArgument *keyword_args[params->num_keyword_args +
+                                NUM_APP_KEYWORD_ARGS];
+
+  for (size_t i = 0; i < params->num_keyword_args; ++i) {
+    keyword_args[i] = params->keyword_args[i];
+  }
+
+  keyword_args[params->num_keyword_args] = &options.allocation;
+  keyword_args[params->num_keyword_args + 1] = &options.io;
+  keyword_args[params->num_keyword_args + 2] = &options.direct;
+  keyword_args[params->num_keyword_args + 3] = &options.huge_pages;
+  keyword_args[params->num_keyword_args + 4] = &options.prefault;
+  keyword_args[params->num_keyword_args + 5] = &options.fault_stats;
+  keyword_args[params->num_keyword_args + 6] = &options.stats;
+  keyword_args[params->num_keyword_args + 7] = &options.perf_counters;
+  keyword_args[params->num_keyword_args + 8] = &options.readahead;
+  keyword_args[params->num_keyword_args + 9] = &options.sync;
+  keyword_args[params->num_keyword_args + 10] = &options.batch;
+  keyword_args[params->num_keyword_args + 11] = &options.jobs;
+  keyword_args[params->num_keyword_args + 12] = &options.bench;
+  keyword_args[params->num_keyword_args + 13] = &options.bench_output;
+  keyword_args[params->num_keyword_args + 14] = &options.bench_format;
+
   PassthroughArgumentParser input_filename_parser =
       make_passthrough_parser("INPUT_FILE", NULL);
   PassthroughArgumentParser output_filename_parser =
       make_passthrough_parser("OUTPUT_FILE", NULL);
 
+  // checked below, since --batch takes any number of pairs
+  const char *filenames[argc];
+
   Arguments arguments = {
       .executable_name = params->executable_name,
       .version = params->version,
@@ -130,9 +658,10 @@ static int run_transformer_app(int argc, const char *const argv[argc],
               },
           },
       .num_positional_args = 2,
+      .collected_positional_args = filenames,
 
-      .keyword_args = params->keyword_args,
-      .num_keyword_args = params->num_keyword_args,
+      .keyword_args = keyword_args,
+      .num_keyword_args = params->num_keyword_args + NUM_APP_KEYWORD_ARGS,
   };
 
   int return_code = EXIT_SUCCESS;
@@ -155,114 +684,1614 @@ static int run_transformer_app(int argc, const char *const argv[argc],
     goto cleanup_help;
   }
 
+  const size_t num_filenames = arguments.num_collected_positional_args;
+
+  if (options.bench.was_found) {
+    if (options.batch.was_found) {
+      print_error(STATIC_ERROR("--bench can't be used with --batch"));
+      return_code = EXIT_FAILURE;
+
+      goto cleanup_help;
+    } else if (options.readahead.was_found) {
+      print_error(STATIC_ERROR("--bench can't be used with --readahead"));
+      return_code = EXIT_FAILURE;
+
+      goto cleanup_help;
+    } else if (options.stats.was_found) {
+      print_error(STATIC_ERROR("--bench can't be used with --stats"));
+      return_code = EXIT_FAILURE;
+
+      goto cleanup_help;
+    } else if (options.perf_counters.was_found) {
+      print_error(STATIC_ERROR("--bench can't be used with --perf-counters"));
+      return_code = EXIT_FAILURE;
+
+      goto cleanup_help;
+    }
+  } else if (options.bench_output.was_found) {
+    print_error(STATIC_ERROR("--bench-output can only be used with --bench"));
+    return_code = EXIT_FAILURE;
+
+    goto cleanup_help;
+  } else if (options.bench_format.was_found) {
+    print_error(STATIC_ERROR("--bench-format can only be used with --bench"));
+    return_code = EXIT_FAILURE;
+
+    goto cleanup_help;
+  }
+
+  if (options.batch.was_found) {
+    if (num_filenames % 2 != 0) {
+      print_error(eformat("expected pairs of input and output files, got %zu "
+                          "filenames",
+                          num_filenames));
+      return_code = EXIT_FAILURE;
+
+      goto cleanup_help;
+    }
+  } else if (options.jobs.was_found) {
+    print_error(STATIC_ERROR("--jobs can only be used with --batch"));
+    return_code = EXIT_FAILURE;
+
+    goto cleanup_help;
+  } else if (num_filenames < 2) {
+    print_error(eformat("missing required positional argument %s",
+                        num_filenames == 0 ? "INPUT_FILE" : "OUTPUT_FILE"));
+    return_code = EXIT_FAILURE;
+
+    goto cleanup_help;
+  } else if (num_filenames > 2) {
+    print_error(
+        eformat("expected 2 positional arguments, got %zu", num_filenames));
+    return_code = EXIT_FAILURE;
+
+    goto cleanup_help;
+  }
+
+  FileIO io = FILE_IO_MMAP;
+
+  if (options.io.was_found) {
+    io = IO_MAPPING[options.io_parser.value_index];
+  }
+
+  if (options.direct.was_found) {
+    if (io == FILE_IO_MMAP && options.io.was_found) {
+      print_error(STATIC_ERROR("--direct can't be used with --io=mmap"));
+      return_code = EXIT_FAILURE;
+
+      goto cleanup_help;
+    }
+
+    // O_DIRECT needs aligned buffers to write from
+    if (io == FILE_IO_MMAP) {
+      io = FILE_IO_PWRITE;
+    }
+  }
+
   free(output_help_text);
 
-  AppIOState io_state = {.input_mapping_first_unused_offset = 0,
-                         .output_mapping_first_unused_offset = 0,
-                         .output_bytes_written = 0};
+  if (params->prepare) {
+    if ((error = params->prepare(params->arg)), error.what) {
+      print_error(error);
 
-  if ((error = open_and_map_file(input_filename_parser.value,
-                                 &io_state.input_file)),
-      error.what) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  struct rusage usage_before;
+  int dtlb_miss_counter = -1;
+
+  if (options.fault_stats.was_found || options.stats.was_found) {
+    getrusage(RUSAGE_SELF, &usage_before);
+  }
+
+  if (options.fault_stats.was_found) {
+    dtlb_miss_counter = open_dtlb_miss_counter();
+  }
+
+  Stats stats = {.is_timing = false,
+                 .counts_perf_events = options.perf_counters.was_found};
+  Stats *const maybe_stats =
+      options.stats.was_found || options.perf_counters.was_found ? &stats
+                                                                 : NULL;
+
+  if (options.batch.was_found) {
+    return_code = run_batch(params, &options, io, num_filenames, filenames,
+                            maybe_stats);
+  } else if (options.bench.was_found) {
+    return_code = run_bench(params, &options, io, compresses, filenames[0],
+                            filenames[1]);
+  } else {
+    Codec codec = {.arg = params->arg,
+                   .has_contexts = false,
+                   .keeps_contexts = false};
+
+    open_perf_groups(&stats);
+    return_code = transform_file(params, &options, io, filenames[0],
+                                 filenames[1], &codec, maybe_stats);
+    close_perf_groups(&stats);
+  }
+
+  // worker threads only add their counts to the counter once they've exited
+  if (options.fault_stats.was_found && return_code == EXIT_SUCCESS) {
+    print_fault_stats(&usage_before, dtlb_miss_counter);
+  }
+
+  if (options.stats.was_found && return_code == EXIT_SUCCESS) {
+    print_stats(&stats, &usage_before);
+  }
+
+  if (options.perf_counters.was_found && return_code == EXIT_SUCCESS) {
+    print_perf_counters(&stats);
+  }
+
+  if (dtlb_miss_counter != -1) {
+    close(dtlb_miss_counter);
+  }
+
+  if (params->release) {
+    params->release(params->arg);
+  }
+
+  return return_code;
+
+cleanup_help:
+  free(output_help_text);
+
+  return return_code;
+}
+
+// prints its own errors, since warnings can come up along the way. the output
+// file is removed if anything goes wrong. stats may be NULL
+static int transform_file(const AppParams *params, const AppOptions *options,
+                          FileIO io, const char *input_filename,
+                          const char *output_filename, Codec *codec,
+                          Stats *stats) {
+  assert(params);
+  assert(options);
+  assert(input_filename);
+  assert(output_filename);
+  assert(codec);
+
+  FileAndMapping input_file;
+  Error error;
+
+  enter_phase(stats, PHASE_MAP_INPUT);
+
+  if ((error = map_input(options, input_filename, &input_file)), error.what) {
     print_error(error);
+    stop_phases(stats);
 
     return EXIT_FAILURE;
   }
 
-  const size_t output_file_size =
-      params->size(io_state.input_file.file_size, params->arg);
+  int return_code = transform_input(params, options, io, &input_file,
+                                    output_filename, codec, stats);
 
-  if ((error = create_and_map_file(output_filename_parser.value,
-                                   output_file_size, &io_state.output_file)),
-      error.what) {
+  enter_phase(stats, PHASE_CLEANUP);
+
+  if (stats) {
+    add_file_stats(stats, &input_file);
+    stats->input_bytes += input_file.file_size;
+    ++stats->num_files;
+  }
+
+  if ((error = free_file(input_file)), error.what) {
     print_error(error);
     return_code = EXIT_FAILURE;
+  }
+
+  stop_phases(stats);
+
+  return return_code;
+}
+
+// transforms an input that is already mapped into a new output file. what's
+// left of the input mapping is put back in input_file afterwards. stats may be
+// NULL
+static int transform_input(const AppParams *params, const AppOptions *options,
+                           FileIO io, FileAndMapping *input_file,
+                           const char *output_filename, Codec *codec,
+                           Stats *stats) {
+  assert(params);
+  assert(options);
+  assert(input_file);
+  assert(output_filename);
+  assert(codec);
+
+  int return_code = EXIT_SUCCESS;
+  Error error;
+
+  AppIOState io_state = {.input_file = *input_file,
+                         .input_mapping_first_unused_offset = 0,
+                         .output_mapping_first_unused_offset = 0,
+                         .output_bytes_written = 0};
 
-    goto cleanup_input_only;
+  const bool is_output_stdout = strcmp(output_filename, "-") == 0;
+
+  enter_phase(stats, PHASE_CREATE_OUTPUT);
+
+  size_t output_file_size = params->size(&io_state.input_file, codec->arg);
+
+  // mmap can't create an empty mapping
+  if (output_file_size == 0) {
+    output_file_size = 1;
+  }
+
+  if ((error = is_output_stdout
+                   ? create_and_map_stdout(output_file_size,
+                                           &io_state.output_file)
+                   : create_and_map_file(output_filename, output_file_size,
+                                         &io_state.output_file)),
+      error.what) {
+    print_error(error);
+
+    return EXIT_FAILURE;
   }
 
-  if (params->init) {
-    if ((error = params->init(&io_state, params->arg)), error.what) {
+  if ((error = set_output_io(&io_state.output_file, io)), error.what) {
+    // the only errors that leave a staging backend in place are falling back
+    // from io_uring to pwrite and from either of them to a stream
+    if (io_state.output_file.io == FILE_IO_MMAP) {
       print_error(error);
       return_code = EXIT_FAILURE;
 
       goto cleanup_files;
     }
+
+    print_warning(error);
   }
 
-  bool finished = false;
+  if (options->direct.was_found) {
+    // codecs read the input at random, so it has to stay mapped
+    set_file_cache(&io_state.input_file, FILE_CACHE_DROP);
 
-  while (!finished) {
-    if ((error = params->run(&io_state, &finished, params->arg)), error.what) {
+    if ((error = set_file_cache(&io_state.output_file, FILE_CACHE_BYPASS)),
+        error.what) {
+      print_warning(error);
+    }
+  }
+
+  if (options->allocation.was_found) {
+    io_state.output_file.allocation =
+        ALLOCATION_MAPPING[options->allocation_parser.value_index];
+  }
+
+  if (options->sync.was_found) {
+    io_state.output_file.sync = SYNC_MAPPING[options->sync_parser.value_index];
+  }
+
+  if ((error = reserve_extents(&io_state.output_file, 0)), error.what) {
+    print_error(error);
+    return_code = EXIT_FAILURE;
+
+    goto cleanup_files;
+  }
+
+  enter_phase(stats, PHASE_INIT);
+
+  if (codec->has_contexts) {
+    if ((error = params->reset(&io_state, codec->arg)), error.what) {
       print_error(error);
       return_code = EXIT_FAILURE;
 
       goto cleanup;
     }
+  } else if (params->init) {
+    if ((error = params->init(&io_state, codec->arg)), error.what) {
+      print_error(error);
+      return_code = EXIT_FAILURE;
 
-    // not the end of the world if we can't unmap unused pages
-    if ((error =
-             unmap_unused_pages(&io_state.input_file,
-                                &io_state.input_mapping_first_unused_offset)),
-        error.what) {
-      print_warning(error);
+      goto cleanup_files;
     }
+  }
 
-    if ((error =
-             unmap_unused_pages(&io_state.output_file,
-                                &io_state.output_mapping_first_unused_offset)),
-        error.what) {
-      print_warning(error);
+  codec->has_contexts = true;
+
+  if ((error = run_codec(params, options, &io_state, codec->arg, stats)),
+      error.what) {
+    print_error(error);
+    return_code = EXIT_FAILURE;
+
+    goto cleanup;
+  }
+
+  enter_phase(stats, PHASE_TRUNCATE);
+
+  // also releases any extents reserved past the end of the output. streams
+  // are never written past it
+  if (io_state.output_file.io != FILE_IO_STREAM) {
+    ++io_state.output_file.num_truncates;
+
+    if (ftruncate(io_state.output_file.fd,
+                  (off_t)io_state.output_bytes_written) == -1) {
+      print_error(ERRNO_EFORMAT("couldn't resize output file '%s'",
+                                io_state.output_file.filename));
+      return_code = EXIT_FAILURE;
+
+      goto cleanup;
     }
 
-    if ((error = expand_output_mapping(
-             &io_state.output_file,
-             io_state.output_mapping_first_unused_offset)),
-        error.what) {
-      print_error(error);
+    // a mapped stdout was reopened through /proc, so the offset of the
+    // descriptor we were given hasn't moved. leave it after the output so the
+    // next writer of a shared redirection appends instead of overwriting
+    if (io_state.output_file.is_standard_stream &&
+        lseek(STDOUT_FILENO, (off_t)io_state.output_bytes_written, SEEK_SET) ==
+            -1) {
+      print_error(ERRNO_EFORMAT("couldn't seek in output file '%s'",
+                                io_state.output_file.filename));
       return_code = EXIT_FAILURE;
 
       goto cleanup;
     }
   }
 
-  if (ftruncate(io_state.output_file.fd,
-                (off_t)io_state.output_bytes_written) == -1) {
-    print_error(ERRNO_EFORMAT("couldn't resize output file '%s'",
-                              output_filename_parser.value));
+  enter_phase(stats, PHASE_SYNC);
+
+  if ((error = sync_output(&io_state.output_file)), error.what) {
+    print_error(error);
     return_code = EXIT_FAILURE;
   }
 
 cleanup:
-  if (params->cleanup) {
-    params->cleanup(&io_state, params->arg);
+  enter_phase(stats, PHASE_CLEANUP);
+
+  // batch mode keeps the contexts of a successful run for the next file
+  if (!codec->keeps_contexts || return_code != EXIT_SUCCESS) {
+    if (params->cleanup) {
+      params->cleanup(&io_state, codec->arg);
+    }
+
+    codec->has_contexts = false;
   }
 
 cleanup_files:
+  if (stats) {
+    add_file_stats(stats, &io_state.output_file);
+    stats->output_bytes += io_state.output_bytes_written;
+  }
+
   if ((error = free_file(io_state.output_file)), error.what) {
     print_error(error);
     return_code = EXIT_FAILURE;
   }
 
-  if (return_code != EXIT_SUCCESS) {
-    if (unlink(output_filename_parser.value) == -1) {
-      print_error(ERRNO_EFORMAT("couldn't remove file '%s'",
-                                output_filename_parser.value));
+  if (return_code != EXIT_SUCCESS && !is_output_stdout) {
+    if (unlink(output_filename) == -1) {
+      print_error(ERRNO_EFORMAT("couldn't remove file '%s'", output_filename));
       // no need to set return_code, it is already != EXIT_SUCCESS
     }
   }
 
-cleanup_input_only:;
-  if ((error = free_file(io_state.input_file)), error.what) {
-    print_error(error);
+  *input_file = io_state.input_file;
 
-    return EXIT_FAILURE;
+  return return_code;
+}
+
+// maps stdin or a file, then sets up huge pages and prefaulting if asked to
+static Error map_input(const AppOptions *options, const char *filename,
+                       FileAndMapping *file) {
+  assert(options);
+  assert(filename);
+  assert(file);
+
+  Error error = strcmp(filename, "-") == 0 ? open_and_map_stdin(file)
+                                           : open_and_map_file(filename, file);
+
+  if (error.what) {
+    return error;
   }
 
-  return return_code;
+  FileMapping mapping_flags = FILE_MAPPING_DEFAULT;
 
-cleanup_help:
-  free(output_help_text);
+  if (options->huge_pages.was_found) {
+    mapping_flags |= FILE_MAPPING_HUGE_PAGES;
+  }
 
-  return return_code;
+  if (options->prefault.was_found) {
+    mapping_flags |= FILE_MAPPING_PREFAULT;
+  }
+
+  if (mapping_flags != FILE_MAPPING_DEFAULT) {
+    // huge pages and prefaulting are only worth a warning
+    if ((error = set_input_mapping(file, mapping_flags)), error.what) {
+      print_warning(error);
+    }
+
+    if ((error = prefault_input(file, 0)), error.what) {
+      print_warning(error);
+    }
+  }
+
+  return NULL_ERROR;
+}
+
+// calls the codec until it's finished, keeping the mappings in step with it,
+// then waits for the output to be written. stats may be NULL
+static Error run_codec(const AppParams *params, const AppOptions *options,
+                       AppIOState *io_state, void *arg, Stats *stats) {
+  assert(params);
+  assert(options);
+  assert(io_state);
+
+  Error error = NULL_ERROR;
+  bool finished = false;
+
+  Readahead readahead_storage;
+  Readahead *readahead = NULL;
+
+  while (!finished) {
+    RunClock run_clock;
+
+    // a codec that takes the whole input in one call never reports the
+    // progress that moves the helper ahead of it
+    if (options->readahead.was_found && !readahead &&
+        !io_state->runs_in_one_call) {
+      enter_phase(stats, PHASE_PREFETCH);
+
+      const size_t distance = (size_t)options->readahead_parser.value << 20;
+
+      if ((error = create_readahead(
+               io_state->input_file.fd, io_state->input_file.file_size,
+               distance, distance * MAX_READAHEAD_GROWTH, &readahead_storage)),
+          error.what) {
+        goto cleanup;
+      }
+
+      readahead = &readahead_storage;
+    }
+
+    if (readahead) {
+      start_run_clock(&run_clock);
+    }
+
+    enter_phase(stats, PHASE_RUN);
+
+    if ((error = params->run(io_state, &finished, arg)), error.what) {
+      goto cleanup;
+    }
+
+    if (stats) {
+      ++stats->num_runs;
+    }
+
+    enter_phase(stats, PHASE_PREFETCH);
+
+    if (readahead) {
+      advance_readahead(readahead,
+                        io_state->input_file.mapping_offset +
+                            io_state->input_mapping_first_unused_offset,
+                        run_has_stalled(&run_clock));
+    }
+
+    enter_phase(stats, PHASE_FLUSH);
+
+    if ((error = flush_output(&io_state->output_file,
+                              &io_state->output_mapping_first_unused_offset)),
+        error.what) {
+      goto cleanup;
+    }
+
+    enter_phase(stats, PHASE_UNMAP);
+
+    // not the end of the world if we can't unmap unused pages. --bench runs
+    // the codec over the same mapping of the input again
+    if (!options->bench.was_found) {
+      if ((error = unmap_unused_pages(
+               &io_state->input_file,
+               &io_state->input_mapping_first_unused_offset)),
+          error.what) {
+        print_warning(error);
+      }
+    }
+
+    if ((error = unmap_unused_pages(
+             &io_state->output_file,
+             &io_state->output_mapping_first_unused_offset)),
+        error.what) {
+      print_warning(error);
+    }
+
+    enter_phase(stats, PHASE_PREFETCH);
+
+    if ((error = prefault_input(&io_state->input_file,
+                                io_state->input_mapping_first_unused_offset)),
+        error.what) {
+      print_warning(error);
+    }
+
+    // an exactly sized output is full once the last run is done
+    if (finished) {
+      break;
+    }
+
+    enter_phase(stats, PHASE_EXPAND);
+
+    if ((error = expand_output_mapping(
+             &io_state->output_file,
+             io_state->output_mapping_first_unused_offset)),
+        error.what) {
+      goto cleanup;
+    }
+
+    if ((error = reserve_extents(&io_state->output_file,
+                                 io_state->output_mapping_first_unused_offset)),
+        error.what) {
+      goto cleanup;
+    }
+  }
+
+  enter_phase(stats, PHASE_FINISH);
+
+  error = finish_output_writes(&io_state->output_file,
+                               io_state->output_mapping_first_unused_offset);
+
+cleanup:
+  if (readahead) {
+    free_readahead(readahead);
+  }
+
+  return error;
+}
+
+// maps the input once and transforms it one more time than asked for, timing
+// every run but the first, then prints the results to stdout
+static int run_bench(const AppParams *params, const AppOptions *options,
+                     FileIO io, bool compresses, const char *input_filename,
+                     const char *output_filename) {
+  assert(params);
+  assert(options);
+  assert(input_filename);
+  assert(output_filename);
+
+  BenchOutput output = BENCH_OUTPUT_MEMORY;
+
+  if (options->bench_output.was_found) {
+    output = BENCH_OUTPUT_MAPPING[options->bench_output_parser.value_index];
+  }
+
+  if (output == BENCH_OUTPUT_FILE && strcmp(output_filename, "-") == 0) {
+    print_error(STATIC_ERROR("--bench-output=file can't write to stdout, "
+                             "which the results are printed to"));
+
+    return EXIT_FAILURE;
+  }
+
+  const size_t num_runs = (size_t)options->bench_parser.value;
+  double *const seconds = malloc(num_runs * sizeof(double));
+
+  if (!seconds) {
+    print_error(ERROR_OUT_OF_MEMORY);
+
+    return EXIT_FAILURE;
+  }
+
+  FileAndMapping input_file;
+  Error error;
+
+  if ((error = map_input(options, input_filename, &input_file)), error.what) {
+    print_error(error);
+    free(seconds);
+
+    return EXIT_FAILURE;
+  }
+
+  int return_code = EXIT_SUCCESS;
+
+  FileAndMapping output_file;
+  bool has_output_file = false;
+
+  if (output == BENCH_OUTPUT_MEMORY) {
+    size_t output_file_size = params->size(&input_file, params->arg);
+
+    // mmap can't create an empty mapping
+    if (output_file_size == 0) {
+      output_file_size = 1;
+    }
+
+    if ((error = create_memory_output(output_file_size, &output_file)),
+        error.what) {
+      print_error(error);
+      return_code = EXIT_FAILURE;
+
+      goto cleanup;
+    }
+
+    has_output_file = true;
+  }
+
+  Codec codec = {.arg = params->arg,
+                 .has_contexts = false,
+                 .keeps_contexts = params->reset != NULL};
+  size_t output_size = 0;
+
+  for (size_t i = 0; i <= num_runs && return_code == EXIT_SUCCESS; ++i) {
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    if (output == BENCH_OUTPUT_MEMORY) {
+      return_code = transform_into_memory(params, options, &input_file,
+                                          &output_file, &codec, &output_size);
+    } else {
+      return_code = transform_input(params, options, io, &input_file,
+                                    output_filename, &codec, NULL);
+    }
+
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+    if (i > 0) {
+      seconds[i - 1] =
+          (double)(end_time.tv_sec - start_time.tv_sec) +
+          (double)(end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+    }
+  }
+
+  if (codec.has_contexts && params->cleanup) {
+    AppIOState no_files = {.input_mapping_first_unused_offset = 0,
+                           .output_mapping_first_unused_offset = 0,
+                           .output_bytes_written = 0};
+
+    params->cleanup(&no_files, codec.arg);
+  }
+
+  if (return_code != EXIT_SUCCESS) {
+    goto cleanup;
+  }
+
+  if (output == BENCH_OUTPUT_FILE) {
+    struct stat output_stat;
+
+    if (stat(output_filename, &output_stat) == -1) {
+      print_error(ERRNO_EFORMAT("couldn't stat file '%s'", output_filename));
+      return_code = EXIT_FAILURE;
+
+      goto cleanup;
+    }
+
+    output_size = (size_t)output_stat.st_size;
+  }
+
+  print_bench_results(params, options, compresses, input_filename,
+                      output == BENCH_OUTPUT_MEMORY ? NULL : output_filename,
+                      output, input_file.file_size, output_size, num_runs, seconds);
+
+cleanup:
+  if (has_output_file) {
+    if ((error = free_file(output_file)), error.what) {
+      print_warning(error);
+    }
+  }
+
+  if ((error = free_file(input_file)), error.what) {
+    print_error(error);
+    return_code = EXIT_FAILURE;
+  }
+
+  free(seconds);
+
+  return return_code;
+}
+
+// like transform_input, but into output_file, which was created by
+// create_memory_output and is kept for the next run
+static int transform_into_memory(const AppParams *params,
+                                 const AppOptions *options,
+                                 FileAndMapping *input_file,
+                                 FileAndMapping *output_file, Codec *codec,
+                                 size_t *output_size) {
+  assert(params);
+  assert(options);
+  assert(input_file);
+  assert(output_file);
+  assert(output_file->io == FILE_IO_MEMORY);
+  assert(codec);
+  assert(output_size);
+
+  AppIOState io_state = {.input_file = *input_file,
+                         .output_file = *output_file,
+                         .input_mapping_first_unused_offset = 0,
+                         .output_mapping_first_unused_offset = 0,
+                         .output_bytes_written = 0};
+  Error error = NULL_ERROR;
+
+  if (codec->has_contexts) {
+    if ((error = params->reset(&io_state, codec->arg)), error.what) {
+      goto cleanup;
+    }
+  } else if (params->init) {
+    if ((error = params->init(&io_state, codec->arg)), error.what) {
+      goto cleanup_mappings;
+    }
+  }
+
+  codec->has_contexts = true;
+  error = run_codec(params, options, &io_state, codec->arg, NULL);
+
+cleanup:
+  if (!codec->keeps_contexts || error.what) {
+    if (params->cleanup) {
+      params->cleanup(&io_state, codec->arg);
+    }
+
+    codec->has_contexts = false;
+  }
+
+cleanup_mappings:
+  *input_file = io_state.input_file;
+  *output_file = io_state.output_file;
+  *output_size = io_state.output_bytes_written;
+
+  if (error.what) {
+    print_error(error);
+
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static int compare_doubles(const void *lhs_v, const void *rhs_v) {
+  assert(lhs_v);
+  assert(rhs_v);
+
+  const double lhs = *(const double *)lhs_v;
+  const double rhs = *(const double *)rhs_v;
+
+  if (lhs < rhs) {
+    return -1;
+  } else if (lhs > rhs) {
+    return 1;
+  }
+
+  return 0;
+}
+
+// output_filename is NULL if the output went to memory. sorts seconds
+static void print_bench_results(const AppParams *params,
+                                const AppOptions *options, bool compresses,
+                                const char *input_filename,
+                                const char *output_filename,
+                                BenchOutput output, size_t input_size,
+                                size_t output_size, size_t num_runs,
+                                double seconds[num_runs]) {
+  assert(params);
+  assert(options);
+  assert(input_filename);
+  assert(num_runs > 0);
+  assert(seconds);
+
+  qsort(seconds, num_runs, sizeof(double), compare_doubles);
+
+  const double min_seconds = seconds[0];
+  const double median_seconds =
+      (seconds[(num_runs - 1) / 2] + seconds[num_runs / 2]) / 2;
+  // the nearest rank, rounded up
+  const double p99_seconds = seconds[(num_runs * 99 + 99) / 100 - 1];
+
+  const size_t uncompressed_size = compresses ? input_size : output_size;
+  const size_t compressed_size = compresses ? output_size : input_size;
+  const double ratio =
+      compressed_size > 0 ? (double)uncompressed_size / (double)compressed_size
+                          : 0;
+  const double megabytes_per_second =
+      median_seconds > 0 ? (double)uncompressed_size / 1e6 / median_seconds
+                         : 0;
+
+  BenchFormat format = BENCH_FORMAT_CSV;
+
+  if (options->bench_format.was_found) {
+    format = BENCH_FORMAT_MAPPING[options->bench_format_parser.value_index];
+  }
+
+  // the --bench-output value, in its own field so that an output file named
+  // like one of the values can't be mistaken for it
+  const char *const bench_output = BENCH_OUTPUT_VALUES[output];
+
+  if (format == BENCH_FORMAT_CSV) {
+    puts("executable,input,output,bench_output,runs,input_bytes,output_bytes,"
+         "ratio,min_seconds,median_seconds,p99_seconds,megabytes_per_second");
+    print_csv_field(params->executable_name);
+    putchar(',');
+    print_csv_field(input_filename);
+    putchar(',');
+
+    // empty when the output only went to memory
+    if (output_filename) {
+      print_csv_field(output_filename);
+    }
+
+    putchar(',');
+    print_csv_field(bench_output);
+    printf(",%zu,%zu,%zu,%.6f,%.9f,%.9f,%.9f,%.3f\n", num_runs, input_size,
+           output_size, ratio, min_seconds, median_seconds, p99_seconds,
+           megabytes_per_second);
+  } else {
+    fputs("{\"executable\":", stdout);
+    print_json_string(params->executable_name);
+    fputs(",\"input\":", stdout);
+    print_json_string(input_filename);
+    fputs(",\"output\":", stdout);
+
+    if (output_filename) {
+      print_json_string(output_filename);
+    } else {
+      fputs("null", stdout);
+    }
+
+    fputs(",\"bench_output\":", stdout);
+    print_json_string(bench_output);
+
+    printf(",\"runs\":%zu,\"input_bytes\":%zu,\"output_bytes\":%zu,"
+           "\"ratio\":%.6f,\"min_seconds\":%.9f,\"median_seconds\":%.9f,"
+           "\"p99_seconds\":%.9f,\"megabytes_per_second\":%.3f,"
+           "\"seconds\":[",
+           num_runs, input_size, output_size, ratio, min_seconds,
+           median_seconds, p99_seconds, megabytes_per_second);
+
+    // every sample, sorted, so runs can be compared as distributions
+    for (size_t i = 0; i < num_runs; ++i) {
+      printf(i == 0 ? "%.9f" : ",%.9f", seconds[i]);
+    }
+
+    puts("]}");
+  }
+
+  fflush(stdout);
+}
+
+// quotes fields with commas, quotes or line breaks in them, per RFC 4180
+static void print_csv_field(const char *field) {
+  assert(field);
+
+  if (!strpbrk(field, ",\"\r\n")) {
+    fputs(field, stdout);
+
+    return;
+  }
+
+  putchar('"');
+
+  for (const char *c = field; *c != '\0'; ++c) {
+    if (*c == '"') {
+      putchar('"');
+    }
+
+    putchar(*c);
+  }
+
+  putchar('"');
+}
+
+static void print_json_string(const char *string) {
+  assert(string);
+
+  putchar('"');
+
+  for (const unsigned char *c = (const unsigned char *)string; *c != '\0';
+       ++c) {
+    if (*c == '"' || *c == '\\') {
+      putchar('\\');
+      putchar(*c);
+    } else if (*c < 0x20) {
+      printf("\\u%04x", (unsigned)*c);
+    } else {
+      putchar(*c);
+    }
+  }
+
+  putchar('"');
+}
+
+// transforms every pair of files, given on the command line or read from stdin,
+// on a pool of batch workers. files that fail are reported and skipped
+static int run_batch(const AppParams *params, const AppOptions *options,
+                     FileIO io, size_t num_filenames,
+                     const char *const filenames[num_filenames],
+                     Stats *stats) {
+  assert(params);
+  assert(options);
+
+  char *list = NULL;
+  const char **listed_filenames = NULL;
+  Error error;
+
+  if (num_filenames == 0) {
+    if ((error = read_filename_list(&list, &listed_filenames, &num_filenames)),
+        error.what) {
+      print_error(error);
+
+      return EXIT_FAILURE;
+    }
+
+    if (num_filenames % 2 != 0) {
+      print_error(eformat("expected pairs of input and output files, got %zu "
+                          "filenames",
+                          num_filenames));
+      free(listed_filenames);
+      free(list);
+
+      return EXIT_FAILURE;
+    }
+
+    filenames = listed_filenames;
+  }
+
+  // workers can't share stdin or stdout, and stdin may hold the list
+  for (size_t i = 0; i < num_filenames; ++i) {
+    if (strcmp(filenames[i], "-") == 0) {
+      print_error(STATIC_ERROR("'-' can't be used with --batch"));
+      free(listed_filenames);
+      free(list);
+
+      return EXIT_FAILURE;
+    }
+  }
+
+  Batch batch = {.params = params,
+                 .options = options,
+                 .io = io,
+                 .files = NULL,
+                 .num_files = num_filenames / 2,
+                 .next_file_index = 0,
+                 .has_failed = false,
+                 .stats = stats};
+
+  if (batch.num_files == 0) {
+    free(listed_filenames);
+    free(list);
+
+    return EXIT_SUCCESS;
+  }
+
+  size_t num_workers = batch.num_files;
+
+  if (params->arg_size == 0) {
+    num_workers = 1;
+  } else if (options->jobs.was_found &&
+             (size_t)options->jobs_parser.value < num_workers) {
+    num_workers = (size_t)options->jobs_parser.value;
+  } else if (!options->jobs.was_found) {
+    const long num_processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (num_processors > 0 && (size_t)num_processors < num_workers) {
+      num_workers = (size_t)num_processors;
+    }
+  }
+
+  batch.files = malloc(batch.num_files * sizeof(BatchFile));
+  BatchWorker *const workers = calloc(num_workers, sizeof(BatchWorker));
+
+  if (!batch.files || !workers) {
+    print_error(ERROR_OUT_OF_MEMORY);
+    free(batch.files);
+    free(workers);
+    free(listed_filenames);
+    free(list);
+
+    return EXIT_FAILURE;
+  }
+
+  for (size_t i = 0; i < batch.num_files; ++i) {
+    BatchFile *const file = &batch.files[i];
+
+    file->input_filename = filenames[i * 2];
+    file->output_filename = filenames[i * 2 + 1];
+
+    // inputs that can't be statted are reported when they're opened
+    struct stat input_stat;
+    file->input_size = (stat(file->input_filename, &input_stat) == -1)
+                           ? 0
+                           : input_stat.st_size;
+  }
+
+  // handing out the largest files first keeps one large file from starting
+  // last and running on its own
+  qsort(batch.files, batch.num_files, sizeof(BatchFile), compare_batch_files);
+
+  // the first worker uses the codec's own arg. the others get copies, which
+  // have to be made before any of them is initialized
+  size_t num_ready_workers = 0;
+
+  for (; num_ready_workers < num_workers; ++num_ready_workers) {
+    BatchWorker *const worker = &workers[num_ready_workers];
+
+    worker->batch = &batch;
+    worker->codec = (Codec){.arg = params->arg,
+                            .has_contexts = false,
+                            .keeps_contexts = params->reset != NULL};
+
+    if (num_ready_workers == 0) {
+      continue;
+    }
+
+    worker->codec.arg = malloc(params->arg_size);
+
+    if (!worker->codec.arg) {
+      break;
+    }
+
+    memcpy(worker->codec.arg, params->arg, params->arg_size);
+  }
+
+  ThreadPool pool;
+  bool has_pool = false;
+
+  if (num_ready_workers > 1) {
+    // the calling thread is the first worker
+    if ((error = create_thread_pool(num_ready_workers - 1, &pool)),
+        error.what) {
+      print_warning(error);
+    } else {
+      has_pool = true;
+
+      for (size_t i = 1; i < num_ready_workers; ++i) {
+        if ((error = submit_task(&pool, run_batch_worker, &workers[i])),
+            error.what) {
+          print_warning(error);
+
+          break;
+        }
+      }
+    }
+  }
+
+  pthread_mutex_init(&batch.mutex, NULL);
+  run_batch_worker(&workers[0]);
+
+  if (has_pool) {
+    wait_for_tasks(&pool);
+    free_thread_pool(&pool);
+  }
+
+  pthread_mutex_destroy(&batch.mutex);
+
+  for (size_t i = 1; i < num_ready_workers; ++i) {
+    free(workers[i].codec.arg);
+  }
+
+  free(workers);
+  free(batch.files);
+  free(listed_filenames);
+  free(list);
+
+  return batch.has_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void run_batch_worker(void *worker_v) {
+  assert(worker_v);
+
+  BatchWorker *const worker = (BatchWorker *)worker_v;
+  Batch *const batch = worker->batch;
+
+  // counters follow the threads of whoever opens them
+  if (batch->stats) {
+    worker->stats.counts_perf_events = batch->stats->counts_perf_events;
+    open_perf_groups(&worker->stats);
+  }
+
+  while (true) {
+    pthread_mutex_lock(&batch->mutex);
+
+    if (batch->next_file_index == batch->num_files) {
+      pthread_mutex_unlock(&batch->mutex);
+
+      break;
+    }
+
+    const BatchFile *const file = &batch->files[batch->next_file_index];
+    ++batch->next_file_index;
+
+    pthread_mutex_unlock(&batch->mutex);
+
+    if (transform_file(batch->params, batch->options, batch->io,
+                       file->input_filename, file->output_filename,
+                       &worker->codec,
+                       batch->stats ? &worker->stats : NULL) != EXIT_SUCCESS) {
+      pthread_mutex_lock(&batch->mutex);
+      batch->has_failed = true;
+      pthread_mutex_unlock(&batch->mutex);
+    }
+  }
+
+  // contexts kept for another file outlive the files they were last used for
+  if (worker->codec.has_contexts && batch->params->cleanup) {
+    AppIOState no_files = {.input_mapping_first_unused_offset = 0,
+                           .output_mapping_first_unused_offset = 0,
+                           .output_bytes_written = 0};
+
+    batch->params->cleanup(&no_files, worker->codec.arg);
+  }
+
+  // the codec's threads only add their counts once they've exited
+  if (batch->stats) {
+    close_perf_groups(&worker->stats);
+
+    pthread_mutex_lock(&batch->mutex);
+    add_stats(batch->stats, &worker->stats);
+    pthread_mutex_unlock(&batch->mutex);
+  }
+}
+
+static int compare_batch_files(const void *lhs_v, const void *rhs_v) {
+  assert(lhs_v);
+  assert(rhs_v);
+
+  const BatchFile *const lhs = (const BatchFile *)lhs_v;
+  const BatchFile *const rhs = (const BatchFile *)rhs_v;
+
+  if (lhs->input_size > rhs->input_size) {
+    return -1;
+  } else if (lhs->input_size < rhs->input_size) {
+    return 1;
+  }
+
+  return 0;
+}
+
+// reads filenames separated by NUL characters from stdin, as printed by
+// find -print0. the last one may be ended by the end of the input instead
+static Error read_filename_list(char **list, const char ***filenames,
+                                size_t *num_filenames) {
+  assert(list);
+  assert(filenames);
+  assert(num_filenames);
+
+  size_t size = 0;
+  size_t capacity = 4096;
+  char *buffer = malloc(capacity);
+
+  if (!buffer) {
+    return ERROR_OUT_OF_MEMORY;
+  }
+
+  while (true) {
+    // one spare byte to end the last filename with
+    if (capacity - size < 2) {
+      char *const new_buffer = realloc(buffer, capacity * 2);
+
+      if (!new_buffer) {
+        free(buffer);
+
+        return ERROR_OUT_OF_MEMORY;
+      }
+
+      buffer = new_buffer;
+      capacity *= 2;
+    }
+
+    const ssize_t num_read =
+        read(STDIN_FILENO, buffer + size, capacity - size - 1);
+
+    if (num_read == -1 && errno == EINTR) {
+      continue;
+    } else if (num_read == -1) {
+      const Error error = ERRNO_EFORMAT("couldn't read filenames from stdin");
+      free(buffer);
+
+      return error;
+    } else if (num_read == 0) {
+      break;
+    }
+
+    size += (size_t)num_read;
+  }
+
+  if (size > 0 && buffer[size - 1] != '\0') {
+    buffer[size++] = '\0';
+  }
+
+  size_t count = 0;
+
+  for (size_t i = 0; i < size; ++i) {
+    if (buffer[i] == '\0') {
+      ++count;
+    }
+  }
+
+  // malloc(0) may return NULL
+  const char **const pointers =
+      malloc((count > 0 ? count : 1) * sizeof(const char *));
+
+  if (!pointers) {
+    free(buffer);
+
+    return ERROR_OUT_OF_MEMORY;
+  }
+
+  const char *filename = buffer;
+
+  for (size_t i = 0; i < count; ++i) {
+    if (*filename == '\0') {
+      free(pointers);
+      free(buffer);
+
+      return STATIC_ERROR("empty filename in the list read from stdin");
+    }
+
+    pointers[i] = filename;
+    filename += strlen(filename) + 1;
+  }
+
+  *list = buffer;
+  *filenames = pointers;
+  *num_filenames = count;
+
+  return NULL_ERROR;
+}
+
+// falling back to sparse allocation is only worth a warning, but running out
+// of space is better reported now than as a SIGBUS from a page fault later
+static Error reserve_extents(FileAndMapping *file, size_t first_unused_offset) {
+  assert(file);
+
+  const Error error = reserve_output_extents(file, first_unused_offset);
+
+  if (error.what && file->allocation == FILE_ALLOCATION_SPARSE) {
+    print_warning(error);
+
+    return NULL_ERROR;
+  }
+
+  return error;
+}
+
+// counts dTLB load misses in user space, including those of threads that are
+// created later. returns -1 if the hardware or perf_event_paranoid doesn't
+// allow it
+static int open_dtlb_miss_counter(void) {
+  return open_perf_counter(PERF_TYPE_HW_CACHE, DTLB_LOAD_MISSES, true, -1);
+}
+
+// counts an event in user space on the calling thread, and on the threads it
+// creates later if inherits is set. members of a group (group_fd != -1) are
+// enabled and disabled along with their leader. returns -1 if the hardware or
+// perf_event_paranoid doesn't allow it
+static int open_perf_counter(uint32_t type, uint64_t config, bool inherits,
+                             int group_fd) {
+  struct perf_event_attr attributes;
+  memset(&attributes, 0, sizeof(attributes));
+
+  attributes.size = sizeof(attributes);
+  attributes.type = type;
+  attributes.config = config;
+  attributes.exclude_kernel = 1;
+  attributes.exclude_hv = 1;
+  attributes.inherit = inherits ? 1 : 0;
+  attributes.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  return (int)syscall(__NR_perf_event_open, &attributes, 0, -1, group_fd,
+                      PERF_FLAG_FD_CLOEXEC);
+}
+
+// scales the count up to the whole time the counter was enabled if it had to
+// share the hardware with other counters for some of it
+static bool read_perf_counter(int fd, uint64_t *count) {
+  assert(count);
+
+  uint64_t values[3]; // the count, time enabled and time running
+
+  if (read(fd, values, sizeof(values)) != (ssize_t)sizeof(values)) {
+    return false;
+  }
+
+  if (values[2] > 0 && values[2] < values[1]) {
+    values[0] = (uint64_t)((double)values[0] * (double)values[1] /
+                           (double)values[2]);
+  }
+
+  *count = values[0];
+
+  return true;
+}
+
+static void start_run_clock(RunClock *clock) {
+  assert(clock);
+
+  clock_gettime(CLOCK_MONOTONIC, &clock->wall_time);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &clock->cpu_time);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  clock->num_major_faults = usage.ru_majflt;
+}
+
+// a run stalled on its input if the process took major faults and the driver
+// thread spent more than a sixteenth of the run off the CPU. waiting for
+// worker threads also takes the driver thread off the CPU, hence the faults
+static bool run_has_stalled(const RunClock *clock) {
+  assert(clock);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  if (usage.ru_majflt == clock->num_major_faults) {
+    return false;
+  }
+
+  struct timespec wall_time;
+  struct timespec cpu_time;
+  clock_gettime(CLOCK_MONOTONIC, &wall_time);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_time);
+
+  const double wall_elapsed =
+      (double)(wall_time.tv_sec - clock->wall_time.tv_sec) +
+      (double)(wall_time.tv_nsec - clock->wall_time.tv_nsec) / 1e9;
+  const double cpu_elapsed =
+      (double)(cpu_time.tv_sec - clock->cpu_time.tv_sec) +
+      (double)(cpu_time.tv_nsec - clock->cpu_time.tv_nsec) / 1e9;
+
+  return (wall_elapsed - cpu_elapsed) * 16 > wall_elapsed;
+}
+
+static void print_fault_stats(const struct rusage *usage_before,
+                              int dtlb_miss_counter) {
+  assert(usage_before);
+
+  struct rusage usage_after;
+  getrusage(RUSAGE_SELF, &usage_after);
+
+  fprintf(stderr, "%s: %ld minor page faults, %ld major page faults",
+          executable_name, usage_after.ru_minflt - usage_before->ru_minflt,
+          usage_after.ru_majflt - usage_before->ru_majflt);
+
+  uint64_t dtlb_misses;
+
+  if (dtlb_miss_counter != -1 &&
+      read_perf_counter(dtlb_miss_counter, &dtlb_misses)) {
+    fprintf(stderr, ", %llu dTLB load misses\n",
+            (unsigned long long)dtlb_misses);
+  } else {
+    fputs(", dTLB load misses unavailable\n", stderr);
+  }
+}
+
+// stats may be NULL, in which case nothing is timed
+static void enter_phase(Stats *stats, Phase phase) {
+  if (!stats) {
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  if (stats->is_timing) {
+    stats->phase_seconds[stats->phase] +=
+        (double)(now.tv_sec - stats->phase_start_time.tv_sec) +
+        (double)(now.tv_nsec - stats->phase_start_time.tv_nsec) / 1e9;
+  }
+
+  const PerfGroup previous_group =
+      stats->is_timing ? PHASE_PERF_GROUPS[stats->phase] : PERF_GROUP_NONE;
+
+  if (PHASE_PERF_GROUPS[phase] != previous_group) {
+    set_perf_group_enabled(stats, previous_group, false);
+    set_perf_group_enabled(stats, PHASE_PERF_GROUPS[phase], true);
+  }
+
+  stats->phase = phase;
+  stats->phase_start_time = now;
+  stats->is_timing = true;
+}
+
+// charges the current phase up to now, so that the time between transforms
+// isn't charged to it
+static void stop_phases(Stats *stats) {
+  if (!stats || !stats->is_timing) {
+    return;
+  }
+
+  enter_phase(stats, stats->phase);
+  set_perf_group_enabled(stats, PHASE_PERF_GROUPS[stats->phase], false);
+  stats->is_timing = false;
+}
+
+static void add_file_stats(Stats *stats, const FileAndMapping *file) {
+  assert(stats);
+  assert(file);
+
+  stats->num_remaps += file->num_remaps;
+  stats->num_unmaps += file->num_unmaps;
+  stats->num_truncates += file->num_truncates;
+}
+
+static void add_stats(Stats *total, const Stats *stats) {
+  assert(total);
+  assert(stats);
+
+  for (size_t i = 0; i < NUM_PHASES; ++i) {
+    total->phase_seconds[i] += stats->phase_seconds[i];
+  }
+
+  total->num_files += stats->num_files;
+  total->num_runs += stats->num_runs;
+  total->input_bytes += stats->input_bytes;
+  total->output_bytes += stats->output_bytes;
+  total->num_remaps += stats->num_remaps;
+  total->num_unmaps += stats->num_unmaps;
+  total->num_truncates += stats->num_truncates;
+
+  for (size_t i = 0; i < NUM_PERF_GROUPS; ++i) {
+    for (size_t j = 0; j < NUM_PERF_EVENTS; ++j) {
+      total->perf_groups[i].counts[j] += stats->perf_groups[i].counts[j];
+      total->perf_groups[i].has_counts[j] |=
+          stats->perf_groups[i].has_counts[j];
+    }
+  }
+}
+
+static void print_stats(const Stats *stats, const struct rusage *usage_before) {
+  assert(stats);
+  assert(usage_before);
+
+  struct rusage usage_after;
+  getrusage(RUSAGE_SELF, &usage_after);
+
+  double total_seconds = 0;
+
+  for (size_t i = 0; i < NUM_PHASES; ++i) {
+    total_seconds += stats->phase_seconds[i];
+  }
+
+  for (size_t i = 0; i < NUM_PHASES; ++i) {
+    fprintf(stderr, "%s: %-13s %12.6f s %5.1f%%\n", executable_name,
+            PHASE_NAMES[i], stats->phase_seconds[i],
+            total_seconds > 0 ? stats->phase_seconds[i] / total_seconds * 100
+                              : 0);
+  }
+
+  fprintf(stderr, "%s: %-13s %12.6f s", executable_name, "total",
+          total_seconds);
+
+  if (stats->num_files != 1) {
+    fprintf(stderr, " over %zu files\n", stats->num_files);
+  } else {
+    fputc('\n', stderr);
+  }
+
+  const size_t num_runs = stats->num_runs > 0 ? stats->num_runs : 1;
+
+  fprintf(stderr,
+          "%s: %zu runs of the codec, %zu input and %zu output bytes per "
+          "run\n",
+          executable_name, stats->num_runs, stats->input_bytes / num_runs,
+          stats->output_bytes / num_runs);
+  fprintf(stderr, "%s: %zu mremap, %zu munmap and %zu ftruncate calls\n",
+          executable_name, stats->num_remaps, stats->num_unmaps,
+          stats->num_truncates);
+  fprintf(stderr,
+          "%s: %ld minor page faults, %ld major page faults, %ld KiB peak "
+          "RSS\n",
+          executable_name, usage_after.ru_minflt - usage_before->ru_minflt,
+          usage_after.ru_majflt - usage_before->ru_majflt,
+          usage_after.ru_maxrss);
+}
+
+// opens both counter groups on the calling thread if stats->counts_perf_events
+// is set. events that can't be counted are skipped without a word
+static void open_perf_groups(Stats *stats) {
+  assert(stats);
+
+  static const struct {
+    uint32_t type;
+    uint64_t config;
+  } EVENTS[NUM_PERF_EVENTS] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      {PERF_TYPE_HW_CACHE, DTLB_LOAD_MISSES},
+  };
+
+  for (size_t i = 0; i < NUM_PERF_GROUPS; ++i) {
+    PerfCounterGroup *const group = &stats->perf_groups[i];
+
+    for (size_t j = 0; j < NUM_PERF_EVENTS; ++j) {
+      group->fds[j] = -1;
+    }
+
+    if (!stats->counts_perf_events) {
+      continue;
+    }
+
+    // codecs can have threads of their own, but file bookkeeping doesn't
+    const bool inherits = i == PERF_GROUP_CODEC;
+    const int leader_fd =
+        open_perf_counter(EVENTS[0].type, EVENTS[0].config, inherits, -1);
+
+    if (leader_fd == -1) {
+      continue;
+    }
+
+    // a leader starts out counting, and phases enable it when they need it
+    ioctl(leader_fd, PERF_EVENT_IOC_DISABLE, 0);
+    group->fds[0] = leader_fd;
+
+    for (size_t j = 1; j < NUM_PERF_EVENTS; ++j) {
+      group->fds[j] = open_perf_counter(EVENTS[j].type, EVENTS[j].config,
+                                        inherits, leader_fd);
+    }
+  }
+}
+
+// adds what the counters counted to stats and closes them
+static void close_perf_groups(Stats *stats) {
+  assert(stats);
+
+  for (size_t i = 0; i < NUM_PERF_GROUPS; ++i) {
+    PerfCounterGroup *const group = &stats->perf_groups[i];
+
+    for (size_t j = 0; j < NUM_PERF_EVENTS; ++j) {
+      if (group->fds[j] == -1) {
+        continue;
+      }
+
+      uint64_t count;
+
+      if (read_perf_counter(group->fds[j], &count)) {
+        group->counts[j] += count;
+        group->has_counts[j] = true;
+      }
+
+      close(group->fds[j]);
+      group->fds[j] = -1;
+    }
+  }
+}
+
+static void set_perf_group_enabled(Stats *stats, PerfGroup group,
+                                   bool is_enabled) {
+  assert(stats);
+
+  if (group == PERF_GROUP_NONE) {
+    return;
+  }
+
+  const int leader_fd = stats->perf_groups[group].fds[PERF_EVENT_CYCLES];
+
+  if (leader_fd != -1) {
+    ioctl(leader_fd,
+          is_enabled ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE,
+          PERF_IOC_FLAG_GROUP);
+  }
+}
+
+static void print_perf_counters(const Stats *stats) {
+  assert(stats);
+
+  for (size_t i = 0; i < NUM_PERF_GROUPS; ++i) {
+    const PerfCounterGroup *const group = &stats->perf_groups[i];
+
+    if (!group->has_counts[PERF_EVENT_CYCLES]) {
+      fprintf(stderr, "%s: %-5s performance counters unavailable\n",
+              executable_name, PERF_GROUP_NAMES[i]);
+
+      continue;
+    }
+
+    fprintf(stderr, "%s: %-5s %llu cycles", executable_name,
+            PERF_GROUP_NAMES[i],
+            (unsigned long long)group->counts[PERF_EVENT_CYCLES]);
+
+    if (group->has_counts[PERF_EVENT_INSTRUCTIONS]) {
+      const uint64_t cycles = group->counts[PERF_EVENT_CYCLES];
+      const uint64_t instructions = group->counts[PERF_EVENT_INSTRUCTIONS];
+
+      fprintf(stderr, ", %llu instructions, %.2f IPC",
+              (unsigned long long)instructions,
+              cycles > 0 ? (double)instructions / (double)cycles : 0);
+    }
+
+    if (group->has_counts[PERF_EVENT_LLC_MISSES]) {
+      fprintf(stderr, ", %llu LLC misses",
+              (unsigned long long)group->counts[PERF_EVENT_LLC_MISSES]);
+    }
+
+    if (group->has_counts[PERF_EVENT_DTLB_MISSES]) {
+      fprintf(stderr, ", %llu dTLB load misses",
+              (unsigned long long)group->counts[PERF_EVENT_DTLB_MISSES]);
+    }
+
+    fputc('\n', stderr);
+  }
 }
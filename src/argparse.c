@@ -28,8 +28,16 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <unistd.h>
+
 static Error do_parse_integer(ArgumentParser *self_base,
                               const char *maybe_value_str);
+static Error do_parse_thread_count(ArgumentParser *self_base,
+                                   const char *maybe_value_str);
+static Error do_parse_range(ArgumentParser *self_base,
+                            const char *maybe_value_str);
+static Error do_parse_parameter(ArgumentParser *self_base,
+                                const char *maybe_value_str);
 static Error do_parse_string(ArgumentParser *self_base,
                              const char *maybe_value_str);
 static Error do_parse_passthrough(ArgumentParser *self_base,
@@ -52,6 +60,62 @@ IntegerArgumentParser make_integer_parser(const char *name,
   };
 }
 
+ThreadCountArgumentParser make_thread_count_parser(const char *name,
+                                                  const char *metavariable,
+                                                  long long max_value) {
+  assert(name);
+  assert(metavariable);
+  assert(max_value >= 1);
+
+  return (ThreadCountArgumentParser){
+      .argument_parser = {.name = name,
+                          .metavariable = metavariable,
+                          .parser = do_parse_thread_count},
+      .max_value = max_value,
+  };
+}
+
+RangeArgumentParser make_range_parser(const char *name,
+                                      const char *metavariable,
+                                      long long min_value,
+                                      long long max_value) {
+  assert(name);
+  assert(metavariable);
+  assert(min_value <= max_value);
+
+  return (RangeArgumentParser){
+      .argument_parser = {.name = name,
+                          .metavariable = metavariable,
+                          .parser = do_parse_range},
+      .min_value = min_value,
+      .max_value = max_value,
+  };
+}
+
+ParameterArgumentParser
+make_parameter_parser(const char *name, const char *metavariable,
+                      size_t num_parameters,
+                      Parameter parameters[num_parameters]) {
+  assert(name);
+  assert(metavariable);
+  assert(parameters);
+
+  for (size_t i = 0; i < num_parameters; ++i) {
+    assert(parameters[i].name);
+    assert(parameters[i].min_value <= parameters[i].max_value);
+
+    parameters[i].was_set = false;
+  }
+
+  return (ParameterArgumentParser){
+      .argument_parser = {.name = name,
+                          .metavariable = metavariable,
+                          .parser = do_parse_parameter},
+      .parameters = parameters,
+      .num_parameters = num_parameters,
+  };
+}
+
 StringArgumentParser
 make_string_parser(const char *name, const char *metavariable,
                    size_t num_possible_values,
@@ -117,7 +181,8 @@ Error parse_arguments(Arguments *arguments, int argc,
 
     assert(this_keyword_arg->short_name != 'h');
     assert(this_keyword_arg->short_name != 'v');
-    assert(char_to_index(this_keyword_arg->short_name) != SIZE_MAX);
+    assert(this_keyword_arg->short_name == '\0' ||
+           char_to_index(this_keyword_arg->short_name) != SIZE_MAX);
 
     assert(this_keyword_arg->long_name);
     assert(strcmp(this_keyword_arg->long_name, "help") != 0);
@@ -132,6 +197,9 @@ Error parse_arguments(Arguments *arguments, int argc,
       assert(this_keyword_arg->parser->name);
       assert(this_keyword_arg->parser->metavariable);
     }
+
+    assert(!this_keyword_arg->has_optional_value ||
+           (this_keyword_arg->parser && this_keyword_arg->short_name == '\0'));
   }
 
   // check for positional argument programmer errors
@@ -158,7 +226,8 @@ Error parse_arguments(Arguments *arguments, int argc,
     const KeywordArgument *const second_keyword_arg =
         arguments->keyword_args[i];
 
-    assert(first_keyword_arg->short_name != second_keyword_arg->short_name);
+    assert(first_keyword_arg->short_name == '\0' ||
+           first_keyword_arg->short_name != second_keyword_arg->short_name);
   }
 #endif
 
@@ -183,6 +252,11 @@ Error parse_arguments(Arguments *arguments, int argc,
 
   for (size_t i = 0; i < arguments->num_keyword_args; ++i) {
     KeywordArgument *const this_keyword_arg = arguments->keyword_args[i];
+
+    if (this_keyword_arg->short_name == '\0') {
+      continue;
+    }
+
     const size_t index = char_to_index(this_keyword_arg->short_name);
 
     short_option_mapping[index] = this_keyword_arg;
@@ -199,8 +273,8 @@ Error parse_arguments(Arguments *arguments, int argc,
       last_index = i;
 
       break;
-    } else if (this_argument[0] != '-') {
-      // positional argument
+    } else if (this_argument[0] != '-' || this_argument[1] == '\0') {
+      // positional argument, '-' being the conventional name for stdin
       continue;
     }
 
@@ -276,11 +350,20 @@ Error parse_arguments(Arguments *arguments, int argc,
   }
 
   size_t positional_arg_index = 0;
+  arguments->num_collected_positional_args = 0;
+
   for (size_t i = 1; i < last_index; ++i) {
     const char *const this_argument = argv[i];
 
-    if (this_argument[0] != '-') {
+    if (this_argument[0] != '-' || this_argument[1] == '\0') {
       // positional argument
+      if (arguments->collected_positional_args) {
+        arguments->collected_positional_args
+            [arguments->num_collected_positional_args++] = this_argument;
+
+        continue;
+      }
+
       if (positional_arg_index >= arguments->num_positional_args) {
         error =
             eformat("expected %zu positional arguments, got at least %zu",
@@ -320,9 +403,39 @@ Error parse_arguments(Arguments *arguments, int argc,
         goto cleanup;
       }
 
-      if (!maybe_value) {
+      if (!this_keyword_arg->parser) {
+        if (maybe_value && this_keyword_arg->short_name == '\0') {
+          error = eformat("option --%s doesn't take an argument",
+                          this_keyword_arg->long_name);
+
+          goto cleanup;
+        } else if (maybe_value) {
+          error = eformat("option -%c, --%s doesn't take an argument",
+                          this_keyword_arg->short_name,
+                          this_keyword_arg->long_name);
+
+          goto cleanup;
+        }
+
+        this_keyword_arg->was_found = true;
+
+        continue;
+      }
+
+      if (!maybe_value && this_keyword_arg->has_optional_value) {
+        // --key, which leaves the value to the caller
+        this_keyword_arg->was_found = true;
+
+        continue;
+      } else if (!maybe_value) {
         // --key value
-        if (i + 1 >= last_index) {
+        if (i + 1 >= last_index && this_keyword_arg->short_name == '\0') {
+          error = eformat("missing required argument %s for option --%s",
+                          this_keyword_arg->parser->metavariable,
+                          this_keyword_arg->long_name);
+
+          goto cleanup;
+        } else if (i + 1 >= last_index) {
           error = eformat("missing required argument %s for option -%c, --%s",
                           this_keyword_arg->parser->metavariable,
                           this_keyword_arg->short_name,
@@ -341,6 +454,8 @@ Error parse_arguments(Arguments *arguments, int argc,
       if (error.what) {
         goto cleanup;
       }
+
+      this_keyword_arg->was_found = true;
     } else {
       // short option(s)
       if (arguments->num_keyword_args == 0) {
@@ -407,6 +522,8 @@ Error parse_arguments(Arguments *arguments, int argc,
           goto cleanup;
         }
 
+        this_keyword_arg->was_found = true;
+
         if (contains_value) {
           break;
         }
@@ -415,6 +532,13 @@ Error parse_arguments(Arguments *arguments, int argc,
   }
 
   for (size_t i = last_index + 1; i < (size_t)argc; ++i) {
+    if (arguments->collected_positional_args) {
+      arguments->collected_positional_args
+          [arguments->num_collected_positional_args++] = argv[i];
+
+      continue;
+    }
+
     if (positional_arg_index >= arguments->num_positional_args) {
       const size_t num_positional_args = (size_t)argc - (last_index + 1);
 
@@ -439,7 +563,8 @@ Error parse_arguments(Arguments *arguments, int argc,
     }
   }
 
-  if (positional_arg_index < arguments->num_positional_args) {
+  if (!arguments->collected_positional_args &&
+      positional_arg_index < arguments->num_positional_args) {
     const PositionalArgument *const this_positional_arg =
         arguments->positional_args[positional_arg_index];
 
@@ -578,7 +703,21 @@ Error print_help(const Arguments *arguments) {
     const KeywordArgument *const this_keyword_arg = arguments->keyword_args[i];
     assert(this_keyword_arg);
 
-    if (this_keyword_arg->parser) {
+    if (this_keyword_arg->short_name == '\0') {
+      // line up with the long names of options that have a short name
+      if (printf("\n        --%s", this_keyword_arg->long_name) < 0) {
+        return UNWRITEABLE_HELP_TEXT();
+      }
+
+      if (this_keyword_arg->parser) {
+        assert(this_keyword_arg->parser->metavariable);
+
+        if (printf(this_keyword_arg->has_optional_value ? "[=%s]" : "=%s",
+                   this_keyword_arg->parser->metavariable) < 0) {
+          return UNWRITEABLE_HELP_TEXT();
+        }
+      }
+    } else if (this_keyword_arg->parser) {
       assert(this_keyword_arg->parser->metavariable);
 
       if (printf("\n    -%c, --%s=%s", this_keyword_arg->short_name,
@@ -802,9 +941,145 @@ static Error do_parse_integer(ArgumentParser *self_base,
   return NULL_ERROR;
 }
 
+static Error do_parse_thread_count(ArgumentParser *self_base,
+                                   const char *maybe_value_str) {
+  assert(self_base);
+  assert(maybe_value_str);
+
+  ThreadCountArgumentParser *const self =
+      (ThreadCountArgumentParser *)self_base;
+
+  if (strcmp(maybe_value_str, "auto") == 0) {
+    const long num_processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (num_processors < 1) {
+      self->value = 1;
+    } else if ((long long)num_processors > self->max_value) {
+      self->value = self->max_value;
+    } else {
+      self->value = (long long)num_processors;
+    }
+
+    return NULL_ERROR;
+  }
+
+  IntegerArgumentParser integer_parser = make_integer_parser(
+      self_base->name, self_base->metavariable, 1, self->max_value);
+
+  const Error error =
+      do_parse_integer(&integer_parser.argument_parser, maybe_value_str);
+
+  if (error.what) {
+    return error;
+  }
+
+  self->value = integer_parser.value;
+
+  return NULL_ERROR;
+}
+
+static Error do_parse_range(ArgumentParser *self_base,
+                            const char *maybe_value_str) {
+  assert(self_base);
+  assert(maybe_value_str);
+
+  RangeArgumentParser *const self = (RangeArgumentParser *)self_base;
+
+  errno = 0;
+  char *lower_end;
+  const long long lower_value = strtoll(maybe_value_str, &lower_end, 10);
+
+  char *upper_end = lower_end;
+  long long upper_value = 0;
+
+  if (lower_end != maybe_value_str && *lower_end == ':') {
+    upper_value = strtoll(lower_end + 1, &upper_end, 10);
+  }
+
+  if (upper_end == lower_end || upper_end == lower_end + 1 ||
+      *upper_end != '\0') {
+    return eformat("invalid argument for %s: couldn't parse '%s' as two "
+                   "integers separated by ':'",
+                   self_base->name, maybe_value_str);
+  }
+
+  if (errno != 0 || lower_value < self->min_value ||
+      upper_value > self->max_value || lower_value > upper_value) {
+    return eformat("invalid argument for %s: expected MIN:MAX with %lld <= "
+                   "MIN <= MAX <= %lld, got %s",
+                   self_base->name, self->min_value, self->max_value,
+                   maybe_value_str);
+  }
+
+  self->lower_value = lower_value;
+  self->upper_value = upper_value;
+
+  return NULL_ERROR;
+}
+
 static char *stringify_string_array(const char *const *strings,
                                     size_t num_strings);
 
+static Error do_parse_parameter(ArgumentParser *self_base,
+                                const char *maybe_value_str) {
+  assert(self_base);
+  assert(maybe_value_str);
+
+  ParameterArgumentParser *const self = (ParameterArgumentParser *)self_base;
+  const char *const equals = strchr(maybe_value_str, '=');
+
+  if (!equals) {
+    return eformat("invalid argument for %s: expected NAME=VALUE, got '%s'",
+                   self_base->name, maybe_value_str);
+  }
+
+  const size_t name_length = (size_t)(equals - maybe_value_str);
+
+  for (size_t i = 0; i < self->num_parameters; ++i) {
+    Parameter *const parameter = &self->parameters[i];
+
+    if (strlen(parameter->name) != name_length ||
+        strncmp(maybe_value_str, parameter->name, name_length) != 0) {
+      continue;
+    }
+
+    IntegerArgumentParser integer_parser =
+        make_integer_parser(parameter->name, self_base->metavariable,
+                            parameter->min_value, parameter->max_value);
+
+    const Error error =
+        do_parse_integer(&integer_parser.argument_parser, equals + 1);
+
+    if (error.what) {
+      return error;
+    }
+
+    parameter->value = integer_parser.value;
+    parameter->was_set = true;
+
+    return NULL_ERROR;
+  }
+
+  const char *names[self->num_parameters];
+
+  for (size_t i = 0; i < self->num_parameters; ++i) {
+    names[i] = self->parameters[i].name;
+  }
+
+  char *names_str = stringify_string_array(names, self->num_parameters);
+
+  if (!names_str) {
+    return ERROR_OUT_OF_MEMORY;
+  }
+
+  const Error error =
+      eformat("invalid argument for %s: expected a NAME in %s, got '%.*s'",
+              self_base->name, names_str, (int)name_length, maybe_value_str);
+  free(names_str);
+
+  return error;
+}
+
 static Error do_parse_string(ArgumentParser *self_base,
                              const char *maybe_value_str) {
   assert(self_base);
@@ -23,14 +23,55 @@
 #include <common/error.h>
 #include <common/mmc.h>
 
+#include <common/thread_pool.h>
+
+#include "frontends.h"
+
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <pthread.h>
 #include <zlib.h>
 
+#ifdef MMC_HAS_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
 #define MIN(X, Y) (((Y) < (X)) ? (Y) : (X))
 
+// deflate can't refer back further than its 32 KiB window
+#define DICTIONARY_SIZE ((size_t)1 << 15)
+#define DEFAULT_CHUNK_SIZE ((size_t)1 << 17)
+#define CHUNKS_PER_THREAD 4
+
+#ifdef MMC_HAS_LIBDEFLATE
+// the largest input compressed with libdeflate when the output isn't mapped
+#define ONE_CALL_MAX_STAGED_SIZE ((size_t)1 << 26)
+#endif
+
+typedef struct Chunk {
+  const Bytef *input;
+  size_t input_size;
+  const Bytef *dictionary;
+  size_t dictionary_size;
+  bool is_last;
+
+  Bytef *output;
+  size_t output_capacity;
+  size_t output_size;
+
+  uLong adler;
+  Error error;
+} Chunk;
+
+typedef struct Worker {
+  struct State *state;
+  z_stream stream;
+} Worker;
+
 typedef struct State {
   IntegerArgumentParser level_parser;
   KeywordArgument level;
@@ -38,22 +79,87 @@ typedef struct State {
   StringArgumentParser strategy_parser;
   KeywordArgument strategy;
 
+  ThreadCountArgumentParser threads_parser;
+  KeywordArgument threads;
+
+  IntegerArgumentParser chunk_size_parser;
+  KeywordArgument chunk_size;
+
+  PassthroughArgumentParser dictionary_parser;
+  KeywordArgument dictionary;
+
+  // loaded by prepare and shared by every copy of the state in batch mode
+  FileAndMapping dictionary_file;
+  const Bytef *dictionary_data;
+  uInt dictionary_size;
+  uLong dictionary_id;
+
   z_stream stream;
+
+#ifdef MMC_HAS_LIBDEFLATE
+  // used instead of stream when neither a dictionary nor a strategy is given
+  // and the file fits in one call. stream is still set up for files that don't
+  struct libdeflate_compressor *compressor;
+  bool uses_compressor;
+#endif
+
+  // only used when compressing with multiple threads. has_pool is set once
+  // pool and chunks_mutex are created
+  ThreadPool pool;
+  bool has_pool;
+  Worker *workers;
+  size_t num_workers;
+
+  pthread_mutex_t chunks_mutex;
+  Chunk *chunks;
+  size_t num_chunks;
+  size_t chunks_capacity;
+  size_t next_chunk_index;
+
+  size_t input_offset;
+  uLong adler;
+  int level_value;
+  int strategy_value;
 } State;
 
-size_t size(size_t input_file_size, void *state_v);
-Error init(AppIOState *io_state, void *state_v);
-Error run(AppIOState *io_state, bool *finished, void *state_v);
-void cleanup(AppIOState *io_state, void *state_v);
+static size_t size(const FileAndMapping *input_file, void *state_v);
+static Error init(AppIOState *io_state, void *state_v);
+static Error run(AppIOState *io_state, bool *finished, void *state_v);
+static void cleanup(AppIOState *io_state, void *state_v);
+static Error reset(AppIOState *io_state, void *state_v);
+static Error prepare(void *state_v);
+static void release(void *state_v);
 
-size_t max_compressed_size(size_t uncompressed_size);
+static size_t max_compressed_size(size_t uncompressed_size);
+
+static size_t chunk_size_of(const State *state);
+static size_t max_chunk_compressed_size(size_t uncompressed_size);
+static Error init_parallel(State *state);
+static Error run_parallel(AppIOState *io_state, bool *finished, State *state);
+static void cleanup_parallel(State *state);
+static void compress_chunks(void *worker_v);
+static Error compress_chunk(z_stream *stream, Chunk *chunk);
+#ifdef MMC_HAS_LIBDEFLATE
+static bool fits_in_one_call(const AppIOState *io_state);
+static Error compress_in_one_call(AppIOState *io_state, State *state);
+#endif
+static Error set_dictionary(z_stream *stream, const State *state);
+static size_t write_zlib_header(Bytef *output, const State *state);
+static Error make_deflate_error(const char *action, int errc,
+                                const z_stream *stream);
 
 static const char *const STRATEGY_VALUES[] = {"default", "filtered",
                                               "huffman-only", "rle", "fixed"};
 static const int STRATEGY_MAPPING[] = {Z_DEFAULT_STRATEGY, Z_FILTERED,
                                        Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED};
 
+#ifndef MMC_MULTI_CALL
 int main(int argc, const char *const argv[]) {
+  return deflate_main(argc, argv);
+}
+#endif
+
+int deflate_main(int argc, const char *const argv[]) {
   State state = {
       .level_parser = make_integer_parser("-l, --level", "LEVEL",
                                           Z_NO_COMPRESSION, Z_BEST_COMPRESSION),
@@ -77,9 +183,53 @@ int main(int argc, const char *const argv[]) {
                "'huffman-only', 'rle', or 'fixed', corresponding to the "
                "zlib compression strategies.",
            .parser = &state.strategy_parser.argument_parser},
+
+      .threads_parser =
+          make_thread_count_parser("-t, --threads", "THREADS", 1024),
+      .threads =
+          {.short_name = 't',
+           .long_name = "threads",
+           .help_text =
+               "Number of threads to compress with, or 'auto' to use one "
+               "thread per online processor. An integer in the range [1, "
+               "1024]. If set, the input is split into chunks that are "
+               "compressed independently, each primed with the last 32 KiB "
+               "of the chunk before it and ended with a sync flush. The "
+               "output is still a single zlib stream.",
+           .parser = &state.threads_parser.argument_parser},
+
+      .chunk_size_parser = make_integer_parser(
+          "-c, --chunk-size", "SIZE", (long long)DICTIONARY_SIZE, 1LL << 29),
+      .chunk_size =
+          {.short_name = 'c',
+           .long_name = "chunk-size",
+           .help_text =
+               "Size in bytes of each chunk when compressing with multiple "
+               "threads. An integer in the range [32768, 536870912]. Defaults "
+               "to 131072. Larger chunks compress slightly better, but limit "
+               "parallelism for small inputs.",
+           .parser = &state.chunk_size_parser.argument_parser},
+
+      .dictionary_parser = make_passthrough_parser("-D, --dict", "FILE"),
+      .dictionary =
+          {.short_name = 'D',
+           .long_name = "dict",
+           .help_text =
+               "Preset dictionary to compress with, such as one trained by "
+               "mzt. Only its last 32 KiB are used. The file is mapped "
+               "read-only once for every file compressed with --batch, and "
+               "its Adler-32 checksum is recorded in the zlib header. The "
+               "same dictionary must be passed to mi to decompress the "
+               "output. With --threads, it primes the first chunk.",
+           .parser = &state.dictionary_parser.argument_parser},
+
+      .dictionary_data = NULL,
+      .dictionary_size = 0,
   };
 
-  KeywordArgument *keyword_args[] = {&state.level, &state.strategy};
+  KeywordArgument *keyword_args[] = {&state.level, &state.strategy,
+                                     &state.threads, &state.chunk_size,
+                                     &state.dictionary};
 
   return run_compression_app(
       argc, argv,
@@ -100,17 +250,37 @@ int main(int argc, const char *const argv[]) {
           .init = init,
           .run = run,
           .cleanup = cleanup,
+          .reset = reset,
+          .prepare = prepare,
+          .release = release,
           .arg = &state,
+          .arg_size = sizeof(state),
       });
 }
 
-size_t size(size_t input_file_size, void *state_v) {
-  (void)state_v;
+static size_t size(const FileAndMapping *input_file, void *state_v) {
+  assert(input_file);
+  assert(state_v);
+
+  const State *const state = (const State *)state_v;
+  const size_t input_file_size = input_file->file_size;
+
+  if (!state->threads.was_found) {
+    return max_compressed_size(input_file_size);
+  }
 
-  return max_compressed_size(input_file_size);
+  const size_t chunk_size = chunk_size_of(state);
+  const size_t num_full_chunks = input_file_size / chunk_size;
+  const size_t last_chunk_size = input_file_size % chunk_size;
+  const size_t header_size = state->dictionary_data ? 6 : 2;
+
+  // zlib header and adler32 trailer
+  return header_size +
+         num_full_chunks * max_chunk_compressed_size(chunk_size) +
+         max_chunk_compressed_size(last_chunk_size) + 4;
 }
 
-Error init(AppIOState *io_state, void *state_v) {
+static Error init(AppIOState *io_state, void *state_v) {
   assert(io_state);
   assert(state_v);
 
@@ -126,6 +296,29 @@ Error init(AppIOState *io_state, void *state_v) {
     level_value = (int)state->level_parser.value;
   }
 
+  if (state->threads.was_found) {
+    state->level_value = level_value;
+    state->strategy_value = strategy_value;
+
+    return init_parallel(state);
+  }
+
+#ifdef MMC_HAS_LIBDEFLATE
+  // libdeflate has no strategies or preset dictionaries, but its levels 0
+  // through 9 line up with zlib's
+  if (strategy_value == Z_DEFAULT_STRATEGY && !state->dictionary_data) {
+    state->compressor = libdeflate_alloc_compressor(
+        level_value == Z_DEFAULT_COMPRESSION ? 6 : level_value);
+
+    if (!state->compressor) {
+      return ERROR_OUT_OF_MEMORY;
+    }
+
+    state->uses_compressor = fits_in_one_call(io_state);
+    io_state->runs_in_one_call = state->uses_compressor;
+  }
+#endif
+
   state->stream =
       (z_stream){.zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL};
 
@@ -150,6 +343,13 @@ Error init(AppIOState *io_state, void *state_v) {
       assert(false);
     }
 
+#ifdef MMC_HAS_LIBDEFLATE
+    if (state->compressor) {
+      libdeflate_free_compressor(state->compressor);
+      state->compressor = NULL;
+    }
+#endif
+
     if (state->stream.msg) {
       return eformat("couldn't initialize deflate stream: %s (%d): %s", what,
                      init_errc, state->stream.msg);
@@ -159,16 +359,34 @@ Error init(AppIOState *io_state, void *state_v) {
     }
   }
 
-  return NULL_ERROR;
+  const Error error = set_dictionary(&state->stream, state);
+
+  if (error.what) {
+    deflateEnd(&state->stream);
+  }
+
+  return error;
 }
 
-Error run(AppIOState *io_state, bool *finished, void *state_v) {
+static Error run(AppIOState *io_state, bool *finished, void *state_v) {
   assert(io_state);
   assert(finished);
   assert(state_v);
 
   State *const state = (State *)state_v;
 
+  if (state->threads.was_found) {
+    return run_parallel(io_state, finished, state);
+  }
+
+#ifdef MMC_HAS_LIBDEFLATE
+  if (state->uses_compressor) {
+    *finished = true;
+
+    return compress_in_one_call(io_state, state);
+  }
+#endif
+
   z_stream *const stream = &state->stream;
 
   stream->next_in = (z_const Bytef *)io_state->input_file.mapping +
@@ -246,17 +464,113 @@ Error run(AppIOState *io_state, bool *finished, void *state_v) {
   return NULL_ERROR;
 }
 
-void cleanup(AppIOState *io_state, void *state_v) {
+static void cleanup(AppIOState *io_state, void *state_v) {
   assert(io_state);
   assert(state_v);
 
   (void)io_state;
 
   State *const state = (State *)state_v;
+
+  if (state->threads.was_found) {
+    cleanup_parallel(state);
+
+    return;
+  }
+
+#ifdef MMC_HAS_LIBDEFLATE
+  if (state->compressor) {
+    libdeflate_free_compressor(state->compressor);
+    state->compressor = NULL;
+  }
+#endif
+
   deflateEnd(&state->stream);
 }
 
-size_t max_compressed_size(size_t uncompressed_size) {
+static Error reset(AppIOState *io_state, void *state_v) {
+  assert(io_state);
+  assert(state_v);
+
+  (void)io_state;
+
+  State *const state = (State *)state_v;
+
+  // workers reset their streams before every chunk
+  if (state->threads.was_found) {
+    state->input_offset = 0;
+    state->adler = adler32(0, Z_NULL, 0);
+
+    return NULL_ERROR;
+  }
+
+#ifdef MMC_HAS_LIBDEFLATE
+  // libdeflate keeps no state between calls, but the next file may be too
+  // large for it
+  if (state->compressor) {
+    state->uses_compressor = fits_in_one_call(io_state);
+    io_state->runs_in_one_call = state->uses_compressor;
+  }
+#endif
+
+  const int reset_errc = deflateReset(&state->stream);
+
+  if (reset_errc != Z_OK) {
+    return make_deflate_error("couldn't reset deflate stream", reset_errc,
+                              &state->stream);
+  }
+
+  return set_dictionary(&state->stream, state);
+}
+
+static Error prepare(void *state_v) {
+  assert(state_v);
+
+  State *const state = (State *)state_v;
+
+  if (!state->dictionary.was_found) {
+    return NULL_ERROR;
+  }
+
+  const Error error = open_and_map_file(state->dictionary_parser.value,
+                                        &state->dictionary_file);
+
+  if (error.what) {
+    return error;
+  }
+
+  if (state->dictionary_file.file_size > (size_t)UINT_MAX) {
+    free_file(state->dictionary_file);
+
+    return eformat("dictionary '%s' is larger than %u bytes",
+                   state->dictionary_parser.value, UINT_MAX);
+  }
+
+  state->dictionary_data = (const Bytef *)state->dictionary_file.mapping;
+  state->dictionary_size = (uInt)state->dictionary_file.file_size;
+  state->dictionary_id = adler32(adler32(0, Z_NULL, 0), state->dictionary_data,
+                                 state->dictionary_size);
+
+  return NULL_ERROR;
+}
+
+static void release(void *state_v) {
+  assert(state_v);
+
+  State *const state = (State *)state_v;
+
+  if (!state->dictionary_data) {
+    return;
+  }
+
+  const Error error = free_file(state->dictionary_file);
+
+  if (error.what) {
+    print_warning(error);
+  }
+}
+
+static size_t max_compressed_size(size_t uncompressed_size) {
   static const size_t BLOCK_SIZE = 16000;
   static const size_t BYTES_PER_BLOCK = 5;
   static const size_t OVERHEAD_PER_STREAM;
@@ -269,3 +583,484 @@ size_t max_compressed_size(size_t uncompressed_size) {
 
   return uncompressed_size + num_blocks * BYTES_PER_BLOCK + OVERHEAD_PER_STREAM;
 }
+
+static size_t chunk_size_of(const State *state) {
+  assert(state);
+
+  if (state->chunk_size.was_found) {
+    return (size_t)state->chunk_size_parser.value;
+  }
+
+  return DEFAULT_CHUNK_SIZE;
+}
+
+// zlib's compressBound, which covers stored blocks, plus the empty stored
+// block emitted by Z_SYNC_FLUSH
+static size_t max_chunk_compressed_size(size_t uncompressed_size) {
+  return (size_t)compressBound((uLong)uncompressed_size) + 5;
+}
+
+static Error init_parallel(State *state) {
+  assert(state);
+
+  const size_t num_workers = (size_t)state->threads_parser.value;
+
+  state->workers = calloc(num_workers, sizeof(Worker));
+  state->num_workers = 0;
+  state->has_pool = false;
+
+  state->chunks_capacity = num_workers * CHUNKS_PER_THREAD;
+  state->chunks = calloc(state->chunks_capacity, sizeof(Chunk));
+  state->num_chunks = 0;
+
+  if (!state->workers || !state->chunks) {
+    free(state->workers);
+    free(state->chunks);
+
+    return ERROR_OUT_OF_MEMORY;
+  }
+
+  for (size_t i = 0; i < num_workers; ++i) {
+    Worker *const worker = &state->workers[i];
+
+    worker->state = state;
+    worker->stream =
+        (z_stream){.zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL};
+
+    // negative window bits make raw deflate streams, which we wrap ourselves
+    const int init_errc =
+        deflateInit2(&worker->stream, state->level_value, Z_DEFLATED, -15, 8,
+                     state->strategy_value);
+
+    if (init_errc != Z_OK) {
+      const Error error = make_deflate_error(
+          "couldn't initialize deflate stream", init_errc, &worker->stream);
+      cleanup_parallel(state);
+
+      return error;
+    }
+
+    ++state->num_workers;
+  }
+
+  const Error error = create_thread_pool(num_workers, &state->pool);
+
+  if (error.what) {
+    cleanup_parallel(state);
+
+    return error;
+  }
+
+  pthread_mutex_init(&state->chunks_mutex, NULL);
+  state->has_pool = true;
+
+  state->input_offset = 0;
+  state->adler = adler32(0, Z_NULL, 0);
+
+  return NULL_ERROR;
+}
+
+// each call compresses up to CHUNKS_PER_THREAD chunks per thread, then copies
+// them into the output mapping in order
+static Error run_parallel(AppIOState *io_state, bool *finished, State *state) {
+  assert(io_state);
+  assert(finished);
+  assert(state);
+
+  const FileAndMapping *const input_file = &io_state->input_file;
+  const size_t chunk_size = chunk_size_of(state);
+  const Bytef *const input_base =
+      (const Bytef *)input_file->mapping - input_file->mapping_offset;
+
+  FileAndMapping *const output_file = &io_state->output_file;
+  Error error = NULL_ERROR;
+
+  if (state->input_offset == 0) {
+    if ((error = reserve_output_mapping(
+             output_file, io_state->output_mapping_first_unused_offset, 6)),
+        error.what) {
+      return error;
+    }
+
+    const size_t header_size =
+        write_zlib_header((Bytef *)io_state->output_file.mapping +
+                              io_state->output_mapping_first_unused_offset,
+                          state);
+    io_state->output_mapping_first_unused_offset += header_size;
+    io_state->output_bytes_written += header_size;
+  }
+
+  state->num_chunks = 0;
+
+  for (size_t offset = state->input_offset;
+       state->num_chunks < state->chunks_capacity; offset += chunk_size) {
+    Chunk *const chunk = &state->chunks[state->num_chunks];
+    ++state->num_chunks;
+
+    chunk->input = input_base + offset;
+    chunk->input_size = MIN(input_file->file_size - offset, chunk_size);
+
+    // the first chunk is primed with the preset dictionary, if any
+    if (offset == 0) {
+      chunk->dictionary_size =
+          MIN((size_t)state->dictionary_size, DICTIONARY_SIZE);
+      chunk->dictionary = state->dictionary_data + state->dictionary_size -
+                          chunk->dictionary_size;
+    } else {
+      chunk->dictionary_size = MIN(offset, DICTIONARY_SIZE);
+      chunk->dictionary = chunk->input - chunk->dictionary_size;
+    }
+
+    chunk->is_last = offset + chunk->input_size == input_file->file_size;
+    chunk->error = NULL_ERROR;
+
+    if (chunk->is_last) {
+      break;
+    }
+  }
+
+  state->next_chunk_index = 0;
+
+  for (size_t i = 0; i < state->num_workers; ++i) {
+    if ((error = submit_task(&state->pool, compress_chunks,
+                             &state->workers[i])),
+        error.what) {
+      break;
+    }
+  }
+
+  wait_for_tasks(&state->pool);
+
+  for (size_t i = 0; i < state->num_chunks; ++i) {
+    Chunk *const chunk = &state->chunks[i];
+
+    if (chunk->error.what) {
+      if (error.what) {
+        print_error(error);
+      }
+
+      error = chunk->error;
+    }
+  }
+
+  if (error.what) {
+    return error;
+  }
+
+  size_t output_size = 0;
+
+  for (size_t i = 0; i < state->num_chunks; ++i) {
+    output_size += state->chunks[i].output_size;
+  }
+
+  if ((error = reserve_output_mapping(
+           output_file, io_state->output_mapping_first_unused_offset,
+           output_size)),
+      error.what) {
+    return error;
+  }
+
+  for (size_t i = 0; i < state->num_chunks; ++i) {
+    const Chunk *const chunk = &state->chunks[i];
+
+    memcpy((Bytef *)output_file->mapping +
+               io_state->output_mapping_first_unused_offset,
+           chunk->output, chunk->output_size);
+    io_state->output_mapping_first_unused_offset += chunk->output_size;
+    io_state->output_bytes_written += chunk->output_size;
+
+    state->adler = adler32_combine(state->adler, chunk->adler,
+                                   (z_off_t)chunk->input_size);
+    state->input_offset += chunk->input_size;
+  }
+
+  const Chunk *const last_chunk = &state->chunks[state->num_chunks - 1];
+
+  if (!last_chunk->is_last) {
+    // the next chunk's dictionary must stay mapped
+    const size_t first_needed_offset = state->input_offset - DICTIONARY_SIZE;
+
+    if (first_needed_offset > input_file->mapping_offset) {
+      io_state->input_mapping_first_unused_offset =
+          first_needed_offset - input_file->mapping_offset;
+    }
+
+    *finished = false;
+
+    return NULL_ERROR;
+  }
+
+  if ((error = reserve_output_mapping(
+           output_file, io_state->output_mapping_first_unused_offset, 4)),
+      error.what) {
+    return error;
+  }
+
+  Bytef *const trailer = (Bytef *)output_file->mapping +
+                         io_state->output_mapping_first_unused_offset;
+  trailer[0] = (Bytef)(state->adler >> 24);
+  trailer[1] = (Bytef)(state->adler >> 16);
+  trailer[2] = (Bytef)(state->adler >> 8);
+  trailer[3] = (Bytef)state->adler;
+
+  io_state->output_mapping_first_unused_offset += 4;
+  io_state->output_bytes_written += 4;
+  io_state->input_mapping_first_unused_offset = input_file->mapping_size;
+
+  *finished = true;
+
+  return NULL_ERROR;
+}
+
+static void cleanup_parallel(State *state) {
+  assert(state);
+
+  if (state->has_pool) {
+    free_thread_pool(&state->pool);
+    pthread_mutex_destroy(&state->chunks_mutex);
+  }
+
+  for (size_t i = 0; i < state->num_workers; ++i) {
+    deflateEnd(&state->workers[i].stream);
+  }
+
+  for (size_t i = 0; i < state->chunks_capacity; ++i) {
+    free(state->chunks[i].output);
+  }
+
+  free(state->workers);
+  free(state->chunks);
+}
+
+static void compress_chunks(void *worker_v) {
+  assert(worker_v);
+
+  Worker *const worker = (Worker *)worker_v;
+  State *const state = worker->state;
+
+  while (true) {
+    pthread_mutex_lock(&state->chunks_mutex);
+    const size_t index = state->next_chunk_index;
+
+    if (index < state->num_chunks) {
+      ++state->next_chunk_index;
+    }
+
+    pthread_mutex_unlock(&state->chunks_mutex);
+
+    if (index >= state->num_chunks) {
+      return;
+    }
+
+    Chunk *const chunk = &state->chunks[index];
+    chunk->error = compress_chunk(&worker->stream, chunk);
+  }
+}
+
+static Error compress_chunk(z_stream *stream, Chunk *chunk) {
+  assert(stream);
+  assert(chunk);
+
+  const size_t required_capacity =
+      max_chunk_compressed_size(chunk->input_size);
+
+  if (chunk->output_capacity < required_capacity) {
+    Bytef *const new_output = realloc(chunk->output, required_capacity);
+
+    if (!new_output) {
+      return ERROR_OUT_OF_MEMORY;
+    }
+
+    chunk->output = new_output;
+    chunk->output_capacity = required_capacity;
+  }
+
+  int errc = deflateReset(stream);
+  assert(errc == Z_OK);
+
+  if (chunk->dictionary_size > 0) {
+    errc = deflateSetDictionary(stream, chunk->dictionary,
+                                (uInt)chunk->dictionary_size);
+    assert(errc == Z_OK);
+  }
+
+  stream->next_in = (z_const Bytef *)chunk->input;
+  stream->avail_in = (uInt)chunk->input_size;
+  stream->next_out = chunk->output;
+  stream->avail_out = (uInt)chunk->output_capacity;
+
+  // a sync flush ends on a byte boundary without setting the final block
+  // bit, so the chunks can simply be concatenated
+  const int flag = chunk->is_last ? Z_FINISH : Z_SYNC_FLUSH;
+  errc = deflate(stream, flag);
+
+  if (chunk->is_last ? errc != Z_STREAM_END
+                     : (errc != Z_OK || stream->avail_out == 0)) {
+    return make_deflate_error("couldn't compress chunk", errc, stream);
+  }
+
+  assert(stream->avail_in == 0);
+
+  chunk->output_size = chunk->output_capacity - (size_t)stream->avail_out;
+  chunk->adler =
+      adler32(adler32(0, Z_NULL, 0), chunk->input, (uInt)chunk->input_size);
+
+  return NULL_ERROR;
+}
+
+#ifdef MMC_HAS_LIBDEFLATE
+// libdeflate writes the whole output in one call, into a reservation the size
+// of its bound. a shared mapping of the output file leaves that to the page
+// cache, but the staging buffers of --io=pwrite, --io=io_uring and streams
+// would hold all of it in anonymous memory before the first write, so larger
+// inputs are streamed through zlib for them
+static bool fits_in_one_call(const AppIOState *io_state) {
+  assert(io_state);
+
+  switch (io_state->output_file.io) {
+  case FILE_IO_MMAP:
+  case FILE_IO_MEMORY:
+    return true;
+  default:
+    return io_state->input_file.file_size <= ONE_CALL_MAX_STAGED_SIZE;
+  }
+}
+
+static Error compress_in_one_call(AppIOState *io_state, State *state) {
+  assert(io_state);
+  assert(state);
+  assert(state->compressor);
+
+  FileAndMapping *const output_file = &io_state->output_file;
+  const Error error = reserve_output_mapping(
+      output_file, 0,
+      libdeflate_zlib_compress_bound(state->compressor,
+                                     io_state->input_file.mapping_size));
+
+  if (error.what) {
+    return error;
+  }
+
+  const size_t output_size = libdeflate_zlib_compress(
+      state->compressor, io_state->input_file.mapping,
+      io_state->input_file.mapping_size, output_file->mapping,
+      output_file->mapping_size);
+
+  // only possible if the bound was wrong
+  if (output_size == 0) {
+    return eformat("couldn't compress input file '%s': output buffer of %zu "
+                   "bytes is too small",
+                   io_state->input_file.filename, output_file->mapping_size);
+  }
+
+  io_state->input_mapping_first_unused_offset =
+      io_state->input_file.mapping_size;
+  io_state->output_mapping_first_unused_offset = output_size;
+  io_state->output_bytes_written = output_size;
+
+  return NULL_ERROR;
+}
+#endif
+
+static Error set_dictionary(z_stream *stream, const State *state) {
+  assert(stream);
+  assert(state);
+
+  if (!state->dictionary_data) {
+    return NULL_ERROR;
+  }
+
+  const int errc = deflateSetDictionary(stream, state->dictionary_data,
+                                        state->dictionary_size);
+
+  if (errc != Z_OK) {
+    return make_deflate_error("couldn't set deflate dictionary", errc, stream);
+  }
+
+  return NULL_ERROR;
+}
+
+// matches the header that deflate writes for a zlib stream with 15 window
+// bits, including the preset dictionary's checksum if there is one. returns
+// the size of the header
+static size_t write_zlib_header(Bytef *output, const State *state) {
+  assert(output);
+  assert(state);
+
+  int level = state->level_value;
+  const int strategy = state->strategy_value;
+
+  if (level == Z_DEFAULT_COMPRESSION) {
+    level = 6;
+  }
+
+  unsigned level_flags;
+
+  if (strategy >= Z_HUFFMAN_ONLY || level < 2) {
+    level_flags = 0;
+  } else if (level < 6) {
+    level_flags = 1;
+  } else if (level == 6) {
+    level_flags = 2;
+  } else {
+    level_flags = 3;
+  }
+
+  unsigned header = (Z_DEFLATED + ((15 - 8) << 4)) << 8;
+  header |= level_flags << 6;
+
+  if (state->dictionary_data) {
+    header |= 0x20;
+  }
+
+  header += 31 - (header % 31);
+
+  output[0] = (Bytef)(header >> 8);
+  output[1] = (Bytef)header;
+
+  if (!state->dictionary_data) {
+    return 2;
+  }
+
+  output[2] = (Bytef)(state->dictionary_id >> 24);
+  output[3] = (Bytef)(state->dictionary_id >> 16);
+  output[4] = (Bytef)(state->dictionary_id >> 8);
+  output[5] = (Bytef)state->dictionary_id;
+
+  return 6;
+}
+
+static Error make_deflate_error(const char *action, int errc,
+                                const z_stream *stream) {
+  assert(action);
+  assert(stream);
+
+  const char *what;
+  switch (errc) {
+  case Z_OK:
+  case Z_BUF_ERROR:
+    what = "output buffer too small";
+
+    break;
+  case Z_MEM_ERROR:
+    what = "out of memory";
+
+    break;
+  case Z_VERSION_ERROR:
+    what = "zlib library version mismatch";
+
+    break;
+  case Z_STREAM_ERROR:
+    what = "invalid parameter";
+
+    break;
+  default:
+    what = "unknown error";
+  }
+
+  if (stream->msg) {
+    return eformat("%s: %s (%d): %s", action, what, errc, stream->msg);
+  }
+
+  return eformat("%s: %s (%d)", action, what, errc);
+}
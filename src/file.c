@@ -20,14 +20,75 @@
 
 #include <common/file.h>
 
+#include "uring.h"
+
 #include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#define MIN(X, Y) (((Y) < (X)) ? (Y) : (X))
+#define MAX(X, Y) (((Y) > (X)) ? (Y) : (X))
+
+// each of the two staging buffers starts out this large and is only grown if
+// a codec reserves more than that in one go
+#define STAGING_BUFFER_SIZE ((size_t)1 << 22)
+
+// files up to this size are prefaulted in one go with MAP_POPULATE, larger
+// ones PREFAULT_WINDOW_SIZE at a time ahead of the codec
+#define MAX_POPULATED_SIZE ((size_t)1 << 28)
+#define PREFAULT_WINDOW_SIZE ((size_t)1 << 26)
+
+// with write-behind, at most this much of the output is waiting to be
+// written back at any time
+#define WRITE_BEHIND_SIZE ((size_t)1 << 26)
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+// stdin is spooled this much at a time if it isn't a regular file
+#define SPOOL_STEP_SIZE ((size_t)1 << 20)
+
+#define STDIN_FILENAME "stdin"
+#define STDOUT_FILENAME "stdout"
+#define MEMORY_FILENAME "memory"
+
+// a multiple of the logical block size of any device we're likely to meet.
+// O_DIRECT transfers must be aligned to it in offset, size and address
+#define DIRECT_IO_ALIGNMENT ((size_t)1 << 12)
+
+static Error map_input_file(int fd, const char *filename,
+                            FileAndMapping *file);
+static Error spool_stdin(int *fd);
+static Error map_output_file(int fd, const char *filename, size_t size,
+                             FileAndMapping *file);
+static Error allocate_staging_buffers(const char *filename, void *buffers[2]);
+static Error grow_output_mapping(FileAndMapping *file, size_t size_increment);
+static size_t default_size_increment(const FileAndMapping *file);
+static bool huge_pages_are_enabled(void);
+static size_t huge_page_size(void);
+static Error swap_staging_buffers(FileAndMapping *file, size_t flushed_size,
+                                  size_t *first_unused_offset);
+static Error write_staging_buffer(FileAndMapping *file, size_t size);
+static void drop_cached_pages(FileAndMapping *file, size_t end);
+static void write_behind(FileAndMapping *file, size_t end);
+static Error sync_parent_directory(const char *filename);
+static Error write_at(const FileAndMapping *file, const void *buffer,
+                      size_t size, size_t offset);
+static Error write_stream(FileAndMapping *file, const void *buffer,
+                          size_t size);
+
 Error open_and_map_file(const char *filename, FileAndMapping *file) {
   assert(filename);
   assert(file);
@@ -38,6 +99,48 @@ Error open_and_map_file(const char *filename, FileAndMapping *file) {
     return ERRNO_EFORMAT("couldn't open file '%s' for reading", filename);
   }
 
+  return map_input_file(fd, filename, file);
+}
+
+// maps stdin if it's a regular file. anything else, such as a pipe, is spooled
+// to an unlinked temporary file first, since codecs need random access to all
+// of their input
+Error open_and_map_stdin(FileAndMapping *file) {
+  assert(file);
+
+  struct stat statbuf;
+
+  if (fstat(STDIN_FILENO, &statbuf) == -1) {
+    return ERRNO_EFORMAT("couldn't stat file '%s'", STDIN_FILENAME);
+  }
+
+  int fd = STDIN_FILENO;
+
+  if (!S_ISREG(statbuf.st_mode)) {
+    const Error error = spool_stdin(&fd);
+
+    if (error.what) {
+      return error;
+    }
+  }
+
+  const Error error = map_input_file(fd, STDIN_FILENAME, file);
+
+  if (error.what) {
+    return error;
+  }
+
+  file->is_standard_stream = true;
+
+  return NULL_ERROR;
+}
+
+// takes ownership of fd
+static Error map_input_file(int fd, const char *filename,
+                            FileAndMapping *file) {
+  assert(filename);
+  assert(file);
+
   struct stat statbuf;
 
   if (fstat(fd, &statbuf) == -1) {
@@ -71,6 +174,290 @@ Error open_and_map_file(const char *filename, FileAndMapping *file) {
   return NULL_ERROR;
 }
 
+// moves pages straight from a pipe into the spool with splice, and copies
+// anything else through a buffer
+static Error spool_stdin(int *fd) {
+  assert(fd);
+
+  FILE *const spool = tmpfile();
+
+  if (!spool) {
+    return ERRNO_EFORMAT("couldn't create a temporary file to hold '%s'",
+                         STDIN_FILENAME);
+  }
+
+  const int spool_fd = dup(fileno(spool));
+  fclose(spool);
+
+  if (spool_fd == -1) {
+    return ERRNO_EFORMAT("couldn't create a temporary file to hold '%s'",
+                         STDIN_FILENAME);
+  }
+
+  bool can_splice = true;
+  char *buffer = NULL;
+  Error error = NULL_ERROR;
+
+  while (true) {
+    ssize_t num_read;
+
+    if (can_splice) {
+      num_read = splice(STDIN_FILENO, NULL, spool_fd, NULL, SPOOL_STEP_SIZE,
+                        SPLICE_F_MOVE);
+
+      // neither end is a pipe, or the filesystem can't splice
+      if (num_read == -1 && errno == EINVAL) {
+        can_splice = false;
+
+        continue;
+      }
+    } else {
+      if (!buffer && !(buffer = malloc(SPOOL_STEP_SIZE))) {
+        error = ERROR_OUT_OF_MEMORY;
+
+        break;
+      }
+
+      num_read = read(STDIN_FILENO, buffer, SPOOL_STEP_SIZE);
+
+      for (ssize_t num_written = 0; num_written < num_read;) {
+        const ssize_t result =
+            write(spool_fd, buffer + num_written,
+                  (size_t)(num_read - num_written));
+
+        if (result == -1 && errno != EINTR) {
+          error = ERRNO_EFORMAT("couldn't spool file '%s'", STDIN_FILENAME);
+
+          break;
+        } else if (result > 0) {
+          num_written += result;
+        }
+      }
+
+      if (error.what) {
+        break;
+      }
+    }
+
+    if (num_read == -1 && errno == EINTR) {
+      continue;
+    } else if (num_read == -1) {
+      error = ERRNO_EFORMAT("couldn't spool file '%s'", STDIN_FILENAME);
+
+      break;
+    } else if (num_read == 0) {
+      break;
+    }
+  }
+
+  free(buffer);
+
+  if (error.what) {
+    close(spool_fd);
+
+    return error;
+  }
+
+  *fd = spool_fd;
+
+  return NULL_ERROR;
+}
+
+// replaces the mapping of a file opened by open_and_map_file according to
+// flags. must be called before anything is read from the mapping. if huge
+// pages can't be used, the file stays mapped and an error says so
+Error set_input_mapping(FileAndMapping *file, FileMapping flags) {
+  assert(file);
+  assert(file->mapping_offset == 0);
+
+  Error error = NULL_ERROR;
+
+  if ((flags & FILE_MAPPING_HUGE_PAGES) && !huge_pages_are_enabled()) {
+    flags &= ~FILE_MAPPING_HUGE_PAGES;
+    error = STATIC_ERROR("transparent huge pages are disabled, falling back "
+                         "to regular pages");
+  }
+
+  file->mapping_flags = flags;
+  file->prefaulted_size = 0;
+
+  const bool populate =
+      (flags & FILE_MAPPING_PREFAULT) && file->file_size <= MAX_POPULATED_SIZE;
+
+  if (!(flags & FILE_MAPPING_HUGE_PAGES)) {
+    if (!populate) {
+      return error;
+    }
+
+    // MAP_POPULATE faults in the whole file with one system call
+    void *const mapping = mmap(NULL, file->file_size, PROT_READ,
+                               MAP_SHARED | MAP_POPULATE, file->fd, 0);
+
+    if (mapping == MAP_FAILED) {
+      return ERRNO_EFORMAT("couldn't map file '%s' into memory",
+                           file->filename);
+    }
+
+    posix_madvise(mapping, file->file_size, POSIX_MADV_SEQUENTIAL);
+    munmap(file->mapping, file->mapping_size);
+    ++file->num_unmaps;
+
+    file->mapping = mapping;
+    file->prefaulted_size = file->file_size;
+
+    return error;
+  }
+
+  // a huge page can only back a mapping that is aligned to one, so reserve
+  // enough address space to slide the mapping to the next boundary
+  const size_t alignment = huge_page_size();
+  const size_t reserved_size = file->file_size + alignment;
+  char *const reserved = mmap(NULL, reserved_size, PROT_NONE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+                              0);
+
+  if (reserved == MAP_FAILED) {
+    return ERRNO_EFORMAT("couldn't reserve address space for file '%s'",
+                         file->filename);
+  }
+
+  char *const aligned =
+      reserved + (alignment - (uintptr_t)reserved % alignment) % alignment;
+  void *const mapping = mmap(aligned, file->file_size, PROT_READ,
+                             MAP_SHARED | MAP_FIXED, file->fd, 0);
+
+  if (mapping == MAP_FAILED) {
+    munmap(reserved, reserved_size);
+
+    return ERRNO_EFORMAT("couldn't map file '%s' into memory", file->filename);
+  }
+
+  const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  char *const mapping_end =
+      aligned + (file->file_size + page_size - 1) / page_size * page_size;
+
+  if (aligned > reserved) {
+    munmap(reserved, (size_t)(aligned - reserved));
+  }
+
+  if (mapping_end < reserved + reserved_size) {
+    munmap(mapping_end, (size_t)(reserved + reserved_size - mapping_end));
+  }
+
+  munmap(file->mapping, file->mapping_size);
+  ++file->num_unmaps;
+  file->mapping = mapping;
+
+  if (madvise(mapping, file->file_size, MADV_HUGEPAGE) == -1) {
+    file->mapping_flags &= ~FILE_MAPPING_HUGE_PAGES;
+    error = ERRNO_EFORMAT("couldn't use huge pages for file '%s', falling "
+                          "back to regular pages",
+                          file->filename);
+  }
+
+  posix_madvise(mapping, file->file_size, POSIX_MADV_SEQUENTIAL);
+
+  // the pages have to be faulted in after madvise to come out huge
+  if (populate &&
+      madvise(mapping, file->file_size, MADV_POPULATE_READ) == 0) {
+    file->prefaulted_size = file->file_size;
+  }
+
+  return error;
+}
+
+// keeps at least PREFAULT_WINDOW_SIZE / 2 bytes past the cursor faulted in,
+// one PREFAULT_WINDOW_SIZE step at a time. falls back to MADV_WILLNEED, which
+// only starts readahead, on kernels older than 5.14
+Error prefault_input(FileAndMapping *file, size_t first_unused_offset) {
+  assert(file);
+
+  if (!(file->mapping_flags & FILE_MAPPING_PREFAULT)) {
+    return NULL_ERROR;
+  }
+
+  const size_t mapping_end = file->mapping_offset + file->mapping_size;
+  const size_t cursor = file->mapping_offset + first_unused_offset;
+
+  // map_file_range may have moved the mapping anywhere in the file
+  if (file->prefaulted_size < file->mapping_offset ||
+      file->prefaulted_size > mapping_end) {
+    file->prefaulted_size = file->mapping_offset;
+  }
+
+  if (file->prefaulted_size >= mapping_end ||
+      file->prefaulted_size - MIN(file->prefaulted_size, cursor) >=
+          PREFAULT_WINDOW_SIZE / 2) {
+    return NULL_ERROR;
+  }
+
+  const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  const size_t begin = MAX(file->prefaulted_size, cursor);
+  const size_t end = MIN(begin + PREFAULT_WINDOW_SIZE, mapping_end);
+
+  // madvise wants a page aligned address
+  const size_t begin_in_mapping =
+      (begin - file->mapping_offset) / page_size * page_size;
+  char *const address = (char *)file->mapping + begin_in_mapping;
+  const size_t size = end - file->mapping_offset - begin_in_mapping;
+
+  if (madvise(address, size, MADV_POPULATE_READ) == -1) {
+    if (errno != EINVAL) {
+      file->mapping_flags &= ~FILE_MAPPING_PREFAULT;
+
+      return ERRNO_EFORMAT("couldn't prefault %zu bytes at offset %zu of file "
+                           "'%s'",
+                           end - begin, begin, file->filename);
+    }
+
+    posix_madvise(address, size, POSIX_MADV_WILLNEED);
+  }
+
+  file->prefaulted_size = end;
+
+  return NULL_ERROR;
+}
+
+// replaces the mapping of a file opened by open_and_map_file with one that only
+// covers [offset, offset + size). the new mapping starts at the page boundary
+// before offset, so *offset_in_mapping is set to where offset ends up
+Error map_file_range(FileAndMapping *file, size_t offset, size_t size,
+                     size_t *offset_in_mapping) {
+  assert(file);
+  assert(size > 0);
+  assert(offset_in_mapping);
+
+  const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  const size_t mapping_offset = offset - offset % page_size;
+  const size_t mapping_size = size + (offset - mapping_offset);
+
+  void *const mapping = mmap(NULL, mapping_size, PROT_READ, MAP_SHARED,
+                             file->fd, (off_t)mapping_offset);
+
+  if (mapping == MAP_FAILED) {
+    return ERRNO_EFORMAT("couldn't map %zu bytes at offset %zu of file '%s' "
+                         "into memory",
+                         size, offset, file->filename);
+  }
+
+  posix_madvise(mapping, mapping_size, POSIX_MADV_SEQUENTIAL);
+
+  if (munmap(file->mapping, file->mapping_size) == -1) {
+    munmap(mapping, mapping_size);
+
+    return ERRNO_EFORMAT("couldn't unmap file '%s' from memory",
+                         file->filename);
+  }
+
+  ++file->num_unmaps;
+  file->mapping = mapping;
+  file->mapping_size = mapping_size;
+  file->mapping_offset = mapping_offset;
+  *offset_in_mapping = offset - mapping_offset;
+
+  return NULL_ERROR;
+}
+
 Error create_and_map_file(const char *filename, size_t size,
                           FileAndMapping *file) {
   assert(filename);
@@ -83,8 +470,115 @@ Error create_and_map_file(const char *filename, size_t size,
     return ERRNO_EFORMAT("couldn't create file '%s' for writing", filename);
   }
 
+  return map_output_file(fd, filename, size, file);
+}
+
+// maps stdout like create_and_map_file if it's a regular file whose offset is
+// at its start, since the mapping always starts there too. the caller must
+// seek stdout past the output once it's done. anything else, such as a pipe or
+// a file something was already written to, is written in order from the
+// current offset through staging buffers with FILE_IO_STREAM
+Error create_and_map_stdout(size_t size, FileAndMapping *file) {
+  assert(file);
+
+  struct stat statbuf;
+
+  if (fstat(STDOUT_FILENO, &statbuf) == -1) {
+    return ERRNO_EFORMAT("couldn't stat file '%s'", STDOUT_FILENAME);
+  }
+
+  const int flags = fcntl(STDOUT_FILENO, F_GETFL);
+
+  if (S_ISREG(statbuf.st_mode) && flags != -1 && !(flags & O_APPEND) &&
+      lseek(STDOUT_FILENO, 0, SEEK_CUR) == 0) {
+    // a shared writable mapping needs the file to be open for reading too,
+    // which shells don't do for redirections
+    const int fd = open("/proc/self/fd/1", O_RDWR);
+
+    if (fd != -1) {
+      const Error error = map_output_file(fd, STDOUT_FILENAME, size, file);
+
+      if (error.what) {
+        return error;
+      }
+
+      file->is_standard_stream = true;
+
+      return NULL_ERROR;
+    }
+  }
+
+  void *buffers[2];
+  const Error error = allocate_staging_buffers(STDOUT_FILENAME, buffers);
+
+  if (error.what) {
+    return error;
+  }
+
+  *file = (FileAndMapping){
+      .filename = STDOUT_FILENAME,
+      .is_standard_stream = true,
+
+      .fd = STDOUT_FILENO,
+      .file_size = 0,
+
+      .mapping = buffers[0],
+      .mapping_size = STAGING_BUFFER_SIZE,
+      .mapping_offset = 0,
+
+      .allocation = FILE_ALLOCATION_SPARSE,
+      .allocated_size = 0,
+
+      .io = FILE_IO_STREAM,
+      .spare_mapping = buffers[1],
+      .spare_mapping_size = STAGING_BUFFER_SIZE,
+      .is_pipe = S_ISFIFO(statbuf.st_mode),
+  };
+
+  return NULL_ERROR;
+}
+
+// the mapping grows like a staging buffer, but is never flushed or unmapped
+// until free_file, so everything the codec wrote stays in place
+Error create_memory_output(size_t size, FileAndMapping *file) {
+  assert(file);
+
+  void *const mapping = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (mapping == MAP_FAILED) {
+    return ERRNO_EFORMAT("couldn't allocate %zu bytes of output memory", size);
+  }
+
+  *file = (FileAndMapping){
+      .filename = MEMORY_FILENAME,
+
+      .fd = -1,
+      .file_size = 0,
+
+      .mapping = mapping,
+      .mapping_size = size,
+      .mapping_offset = 0,
+
+      .allocation = FILE_ALLOCATION_SPARSE,
+      .allocated_size = 0,
+
+      .io = FILE_IO_MEMORY,
+  };
+
+  return NULL_ERROR;
+}
+
+// takes ownership of fd
+static Error map_output_file(int fd, const char *filename, size_t size,
+                             FileAndMapping *file) {
+  assert(filename);
+  assert(file);
+
   if (size > 0) {
     if (ftruncate(fd, (off_t)size) == -1) {
+      close(fd);
+
       return ERRNO_EFORMAT("couldn't set length of file '%s' to '%zu'",
                            filename, size);
     }
@@ -110,18 +604,233 @@ Error create_and_map_file(const char *filename, size_t size,
       .mapping = mapping,
       .mapping_size = size,
       .mapping_offset = 0,
+
+      .allocation = FILE_ALLOCATION_SPARSE,
+      .allocated_size = 0,
+
+      .num_truncates = size > 0 ? 1 : 0,
   };
 
   return NULL_ERROR;
 }
 
+// replaces the shared mapping of a file created by create_and_map_file with
+// staging buffers if io isn't FILE_IO_MMAP. must be called before anything is
+// written to the mapping. if an io_uring can't be set up, this falls back to
+// FILE_IO_PWRITE and returns an error saying so
+Error set_output_io(FileAndMapping *file, FileIO io) {
+  assert(file);
+  assert(file->io == FILE_IO_MMAP || file->io == FILE_IO_STREAM);
+  assert(io != FILE_IO_STREAM);
+  assert(file->mapping_offset == 0);
+
+  if (io == FILE_IO_MMAP) {
+    return NULL_ERROR;
+  } else if (file->io == FILE_IO_STREAM) {
+    return eformat("file '%s' can only be written in order, falling back to "
+                   "writing it as a stream",
+                   file->filename);
+  }
+
+  void *buffers[2];
+  const Error allocate_error =
+      allocate_staging_buffers(file->filename, buffers);
+
+  if (allocate_error.what) {
+    return allocate_error;
+  }
+
+  if (munmap(file->mapping, file->mapping_size) == -1) {
+    munmap(buffers[0], STAGING_BUFFER_SIZE);
+    munmap(buffers[1], STAGING_BUFFER_SIZE);
+
+    return ERRNO_EFORMAT("couldn't unmap file '%s' from memory",
+                         file->filename);
+  }
+
+  ++file->num_unmaps;
+  file->mapping = buffers[0];
+  file->mapping_size = STAGING_BUFFER_SIZE;
+  file->spare_mapping = buffers[1];
+  file->spare_mapping_size = STAGING_BUFFER_SIZE;
+  file->io = FILE_IO_PWRITE;
+
+  if (io != FILE_IO_URING) {
+    return NULL_ERROR;
+  }
+
+  const Error error = create_uring(file->fd, file->filename, &file->uring);
+
+  if (!error.what) {
+    file->io = FILE_IO_URING;
+
+    return NULL_ERROR;
+  }
+
+  const Error fallback = eformat("%s, falling back to pwrite", error.what);
+
+  if (error.allocated) {
+    free(error.what);
+  }
+
+  return fallback;
+}
+
+static Error allocate_staging_buffers(const char *filename, void *buffers[2]) {
+  assert(filename);
+  assert(buffers);
+
+  for (size_t i = 0; i < 2; ++i) {
+    buffers[i] = mmap(NULL, STAGING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (buffers[i] == MAP_FAILED) {
+      if (i > 0) {
+        munmap(buffers[0], STAGING_BUFFER_SIZE);
+      }
+
+      return ERRNO_EFORMAT("couldn't allocate staging buffers for file '%s'",
+                           filename);
+    }
+  }
+
+  return NULL_ERROR;
+}
+
+// FILE_CACHE_DROP applies to input files and to output written through
+// staging buffers, FILE_CACHE_BYPASS only to the latter. if the filesystem
+// doesn't support O_DIRECT, this falls back to FILE_CACHE_DROP and returns an
+// error saying so
+Error set_file_cache(FileAndMapping *file, FileCache cache) {
+  assert(file);
+  assert(cache != FILE_CACHE_BYPASS || file->io != FILE_IO_MMAP);
+
+  file->dropped_size = file->mapping_offset;
+
+  if (file->io == FILE_IO_STREAM) {
+    // offsets in a stream don't correspond to those in the file, and
+    // O_DIRECT's padding could never be truncated away. pipes aren't cached
+    // in the first place
+    file->cache = FILE_CACHE_KEEP;
+
+    if (file->is_pipe) {
+      return NULL_ERROR;
+    }
+
+    return eformat("file '%s' can only be written in order, so it stays in "
+                   "the page cache",
+                   file->filename);
+  }
+
+  if (cache != FILE_CACHE_BYPASS) {
+    file->cache = cache;
+
+    return NULL_ERROR;
+  }
+
+  const int flags = fcntl(file->fd, F_GETFL);
+
+  if (flags == -1 || fcntl(file->fd, F_SETFL, flags | O_DIRECT) == -1) {
+    file->cache = FILE_CACHE_DROP;
+
+    return ERRNO_EFORMAT("couldn't enable O_DIRECT for file '%s', falling "
+                         "back to dropping it from the page cache",
+                         file->filename);
+  }
+
+  file->cache = FILE_CACHE_BYPASS;
+
+  return NULL_ERROR;
+}
+
+// writes [0, *first_unused_offset) of the staging buffer to the file, then
+// moves on to the spare buffer. a no-op for FILE_IO_MMAP, where the kernel
+// writes back dirty pages by itself, and for FILE_IO_MEMORY. with
+// FILE_CACHE_BYPASS, only whole blocks are written and the unaligned tail is
+// carried over to the spare buffer
+Error flush_output(FileAndMapping *file, size_t *first_unused_offset) {
+  assert(file);
+  assert(first_unused_offset);
+  assert(*first_unused_offset <= file->mapping_size);
+
+  if (file->io == FILE_IO_MMAP || file->io == FILE_IO_MEMORY) {
+    return NULL_ERROR;
+  }
+
+  size_t size = *first_unused_offset;
+
+  if (file->cache == FILE_CACHE_BYPASS) {
+    size -= size % DIRECT_IO_ALIGNMENT;
+  }
+
+  if (size == 0) {
+    return NULL_ERROR;
+  }
+
+  const Error error = write_staging_buffer(file, size);
+
+  if (error.what) {
+    return error;
+  }
+
+  return swap_staging_buffers(file, size, first_unused_offset);
+}
+
+// writes whatever flush_output left in the staging buffer, then waits for
+// every write to complete. an unaligned tail is padded out to a whole block
+// for O_DIRECT, so the file must be truncated to its real length afterwards
+Error finish_output_writes(FileAndMapping *file, size_t first_unused_offset) {
+  assert(file);
+
+  if (file->io == FILE_IO_MMAP || file->io == FILE_IO_MEMORY) {
+    return NULL_ERROR;
+  }
+
+  Error error;
+
+  if (first_unused_offset > 0) {
+    size_t size = first_unused_offset;
+
+    if (file->cache == FILE_CACHE_BYPASS) {
+      size += (DIRECT_IO_ALIGNMENT - size % DIRECT_IO_ALIGNMENT) %
+              DIRECT_IO_ALIGNMENT;
+
+      if ((error = reserve_output_mapping(file, first_unused_offset,
+                                          size - first_unused_offset)),
+          error.what) {
+        return error;
+      }
+
+      memset((char *)file->mapping + first_unused_offset, 0,
+             size - first_unused_offset);
+    }
+
+    if ((error = write_staging_buffer(file, size)), error.what) {
+      return error;
+    }
+  }
+
+  if (file->uring) {
+    if ((error = drain_uring(file->uring)), error.what) {
+      return error;
+    }
+  }
+
+  if (file->cache == FILE_CACHE_DROP) {
+    drop_cached_pages(file, file->mapping_offset + first_unused_offset);
+  }
+
+  return NULL_ERROR;
+}
+
 Error unmap_unused_pages(FileAndMapping *file, size_t *first_unused_offset) {
   assert(file);
   assert(first_unused_offset);
 
   static const size_t UNMAP_SPAN_SIZE = 1 << 16;
 
-  if (*first_unused_offset == 0) {
+  // staging buffers are reused rather than unmapped
+  if (*first_unused_offset == 0 || file->io != FILE_IO_MMAP) {
     return NULL_ERROR;
   }
 
@@ -139,22 +848,79 @@ Error unmap_unused_pages(FileAndMapping *file, size_t *first_unused_offset) {
                          file->filename);
   }
 
+  ++file->num_unmaps;
   file->mapping = (char *)file->mapping + num_bytes_to_unmap;
   file->mapping_size -= num_bytes_to_unmap;
   file->mapping_offset += num_bytes_to_unmap;
   *first_unused_offset -= num_bytes_to_unmap;
 
+  write_behind(file, file->mapping_offset);
+
+  if (file->cache == FILE_CACHE_DROP) {
+    drop_cached_pages(file, file->mapping_offset);
+  }
+
   return NULL_ERROR;
 }
 
 Error expand_output_mapping(FileAndMapping *file, size_t first_unused_offset) {
   assert(file);
 
-  if (file->mapping_size < first_unused_offset) {
+  // only grow once the codec has filled every byte of the current mapping
+  if (first_unused_offset < file->mapping_size) {
+    return NULL_ERROR;
+  }
+
+  return grow_output_mapping(file, default_size_increment(file));
+}
+
+Error reserve_output_mapping(FileAndMapping *file, size_t first_unused_offset,
+                             size_t size) {
+  assert(file);
+  assert(first_unused_offset <= file->mapping_size);
+
+  const size_t available = file->mapping_size - first_unused_offset;
+
+  if (available >= size) {
+    return NULL_ERROR;
+  }
+
+  // grow at least geometrically so that many small reservations stay cheap
+  size_t size_increment = size - available;
+
+  size_increment = MAX(size_increment, default_size_increment(file));
+
+  return grow_output_mapping(file, size_increment);
+}
+
+static Error grow_output_mapping(FileAndMapping *file, size_t size_increment) {
+  assert(file);
+
+  // don't crawl up from tiny initial sizes one doubling at a time
+  static const size_t MIN_SIZE_INCREMENT = 1 << 20;
+
+  if (size_increment < MIN_SIZE_INCREMENT) {
+    size_increment = MIN_SIZE_INCREMENT;
+  }
+
+  if (file->io != FILE_IO_MMAP) {
+    const size_t new_mapping_size = file->mapping_size + size_increment;
+    void *const new_mapping = mremap(file->mapping, file->mapping_size,
+                                     new_mapping_size, MREMAP_MAYMOVE);
+
+    if (new_mapping == MAP_FAILED) {
+      return ERRNO_EFORMAT("couldn't grow staging buffer for file '%s' by %zu "
+                           "bytes",
+                           file->filename, size_increment);
+    }
+
+    ++file->num_remaps;
+    file->mapping = new_mapping;
+    file->mapping_size = new_mapping_size;
+
     return NULL_ERROR;
   }
 
-  const size_t size_increment = file->file_size;
   const size_t new_size = file->file_size + size_increment;
 
   if (ftruncate(file->fd, (off_t)new_size) == -1) {
@@ -162,6 +928,7 @@ Error expand_output_mapping(FileAndMapping *file, size_t first_unused_offset) {
                          file->filename, new_size);
   }
 
+  ++file->num_truncates;
   file->file_size = new_size;
 
   const size_t new_mapping_size = file->mapping_size + size_increment;
@@ -176,19 +943,421 @@ Error expand_output_mapping(FileAndMapping *file, size_t first_unused_offset) {
 
   posix_madvise(new_mapping, new_mapping_size, POSIX_MADV_SEQUENTIAL);
 
+  ++file->num_remaps;
   file->mapping = new_mapping;
   file->mapping_size = new_mapping_size;
 
   return NULL_ERROR;
 }
 
+// keeps at least RESERVE_AHEAD_SIZE / 2 bytes past the cursor allocated, one
+// RESERVE_AHEAD_SIZE step at a time, so that writing to a fresh page of the
+// mapping doesn't also have to allocate a block for it
+Error reserve_output_extents(FileAndMapping *file, size_t first_unused_offset) {
+  assert(file);
+
+  static const size_t RESERVE_AHEAD_SIZE = (size_t)1 << 26;
+
+  if (file->allocation != FILE_ALLOCATION_RESERVE ||
+      file->io == FILE_IO_STREAM) {
+    return NULL_ERROR;
+  }
+
+  const size_t cursor = file->mapping_offset + first_unused_offset;
+
+  if (file->allocated_size >= file->file_size ||
+      file->allocated_size - MIN(file->allocated_size, cursor) >=
+          RESERVE_AHEAD_SIZE / 2) {
+    return NULL_ERROR;
+  }
+
+  const size_t begin = MAX(file->allocated_size, cursor);
+  const size_t end = MIN(begin + RESERVE_AHEAD_SIZE, file->file_size);
+
+  if (fallocate(file->fd, 0, (off_t)begin, (off_t)(end - begin)) == -1) {
+    if (errno != EOPNOTSUPP && errno != ENOSYS) {
+      return ERRNO_EFORMAT("couldn't allocate %zu bytes at offset %zu of file "
+                           "'%s'",
+                           end - begin, begin, file->filename);
+    }
+
+    file->allocation = FILE_ALLOCATION_SPARSE;
+
+    return eformat("the filesystem holding file '%s' doesn't support "
+                   "fallocate, falling back to sparse allocation",
+                   file->filename);
+  }
+
+  file->allocated_size = end;
+
+  return NULL_ERROR;
+}
+
+// only "never" keeps madvise(MADV_HUGEPAGE) from having any effect
+static bool huge_pages_are_enabled(void) {
+  FILE *const file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+
+  if (!file) {
+    return false;
+  }
+
+  char buffer[64];
+  const bool is_enabled =
+      fgets(buffer, sizeof(buffer), file) && !strstr(buffer, "[never]");
+  fclose(file);
+
+  return is_enabled;
+}
+
+// starts writing back everything before end, then waits for whatever is more
+// than WRITE_BEHIND_SIZE behind end, which bounds the amount of dirty output.
+// errors are ignored here, since sync_output reports them at the end
+static void write_behind(FileAndMapping *file, size_t end) {
+  assert(file);
+
+  if (file->sync == FILE_SYNC_NONE || file->io == FILE_IO_STREAM ||
+      end <= file->written_back_size) {
+    return;
+  }
+
+  sync_file_range(file->fd, (off_t)file->written_back_size,
+                  (off_t)(end - file->written_back_size),
+                  SYNC_FILE_RANGE_WRITE);
+  file->written_back_size = end;
+
+  if (end - file->waited_size <= WRITE_BEHIND_SIZE) {
+    return;
+  }
+
+  const size_t wait_end = end - WRITE_BEHIND_SIZE;
+
+  sync_file_range(file->fd, (off_t)file->waited_size,
+                  (off_t)(wait_end - file->waited_size),
+                  SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                      SYNC_FILE_RANGE_WAIT_AFTER);
+  file->waited_size = wait_end;
+}
+
+// a new file's directory entry is only durable once its directory is synced
+static Error sync_parent_directory(const char *filename) {
+  assert(filename);
+
+  const char *const last_slash = strrchr(filename, '/');
+  char *directory;
+
+  if (!last_slash) {
+    directory = strdup(".");
+  } else if (last_slash == filename) {
+    directory = strdup("/");
+  } else {
+    directory = strndup(filename, (size_t)(last_slash - filename));
+  }
+
+  if (!directory) {
+    return ERROR_OUT_OF_MEMORY;
+  }
+
+  const int fd = open(directory, O_RDONLY | O_DIRECTORY);
+
+  if (fd == -1) {
+    const Error error =
+        ERRNO_EFORMAT("couldn't open directory '%s' to sync it", directory);
+    free(directory);
+
+    return error;
+  }
+
+  if (fsync(fd) == -1) {
+    const Error error =
+        ERRNO_EFORMAT("couldn't sync directory '%s'", directory);
+    close(fd);
+    free(directory);
+
+    return error;
+  }
+
+  close(fd);
+  free(directory);
+
+  return NULL_ERROR;
+}
+
+// the size of a PMD mapped transparent huge page, 2 MiB on x86-64
+static size_t huge_page_size(void) {
+  size_t size = (size_t)1 << 21;
+  FILE *const file =
+      fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+
+  if (file) {
+    unsigned long long value;
+
+    if (fscanf(file, "%llu", &value) == 1 && value > 0) {
+      size = (size_t)value;
+    }
+
+    fclose(file);
+  }
+
+  return size;
+}
+
+// a mapping of the file grows with the file, a staging buffer with itself
+static size_t default_size_increment(const FileAndMapping *file) {
+  assert(file);
+
+  if (file->io == FILE_IO_MMAP) {
+    return file->file_size;
+  }
+
+  return file->mapping_size;
+}
+
+// the buffer that was just flushed becomes the spare, so it stays intact
+// while the codec fills the other one. codecs such as LZ4F_decompress keep
+// pointing at their previous output as a dictionary. anything past
+// flushed_size is copied to the start of the new buffer
+static Error swap_staging_buffers(FileAndMapping *file, size_t flushed_size,
+                                  size_t *first_unused_offset) {
+  assert(file);
+  assert(first_unused_offset);
+  assert(flushed_size <= *first_unused_offset);
+
+  if (file->uring) {
+    const Error error =
+        wait_for_uring(file->uring, (size_t)(uintptr_t)file->spare_mapping);
+
+    if (error.what) {
+      return error;
+    }
+  }
+
+  // every write before this buffer has completed
+  write_behind(file, file->mapping_offset);
+
+  if (file->cache == FILE_CACHE_DROP) {
+    drop_cached_pages(file, file->mapping_offset);
+  }
+
+  // pages given to a pipe with vmsplice may still be read from after the
+  // reader has consumed them, for example if it spliced them on to another
+  // pipe, so they're swapped for fresh ones before they're written to again
+  if (file->is_pipe) {
+    madvise(file->spare_mapping, file->spare_mapping_size, MADV_DONTNEED);
+  }
+
+  const size_t carried_size = *first_unused_offset - flushed_size;
+  assert(carried_size <= file->spare_mapping_size);
+
+  memcpy(file->spare_mapping, (const char *)file->mapping + flushed_size,
+         carried_size);
+
+  void *const mapping = file->mapping;
+  const size_t mapping_size = file->mapping_size;
+
+  file->mapping = file->spare_mapping;
+  file->mapping_size = file->spare_mapping_size;
+  file->spare_mapping = mapping;
+  file->spare_mapping_size = mapping_size;
+
+  file->mapping_offset += flushed_size;
+  *first_unused_offset = carried_size;
+
+  return NULL_ERROR;
+}
+
+static Error write_staging_buffer(FileAndMapping *file, size_t size) {
+  assert(file);
+  assert(size <= file->mapping_size);
+
+  const size_t end = file->mapping_offset + size;
+  Error error;
+
+  if (file->uring) {
+    // writes are tagged with their staging buffer so that it isn't reused
+    // before they complete
+    error = submit_uring_write(file->uring, file->mapping, size,
+                               file->mapping_offset,
+                               (size_t)(uintptr_t)file->mapping);
+  } else if (file->io == FILE_IO_STREAM) {
+    error = write_stream(file, file->mapping, size);
+  } else {
+    error = write_at(file, file->mapping, size, file->mapping_offset);
+  }
+
+  if (error.what) {
+    return error;
+  }
+
+  file->file_size = MAX(file->file_size, end);
+
+  return NULL_ERROR;
+}
+
+// pages written by a staging backend are written back first, since
+// posix_fadvise won't drop dirty pages. this is only advice, so errors are
+// ignored
+static void drop_cached_pages(FileAndMapping *file, size_t end) {
+  assert(file);
+
+  if (end <= file->dropped_size) {
+    return;
+  }
+
+  const size_t size = end - file->dropped_size;
+
+  if (file->io != FILE_IO_MMAP) {
+    sync_file_range(file->fd, (off_t)file->dropped_size, (off_t)size,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+  }
+
+  posix_fadvise(file->fd, (off_t)file->dropped_size, (off_t)size,
+                POSIX_FADV_DONTNEED);
+  file->dropped_size = end;
+}
+
+static Error write_at(const FileAndMapping *file, const void *buffer,
+                      size_t size, size_t offset) {
+  assert(file);
+  assert(buffer);
+
+  const char *next = (const char *)buffer;
+
+  while (size > 0) {
+    const ssize_t result = pwrite(file->fd, next, size, (off_t)offset);
+
+    if (result == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return ERRNO_EFORMAT("couldn't write %zu bytes at offset %zu of file "
+                           "'%s'",
+                           size, offset, file->filename);
+    } else if (result == 0) {
+      return eformat("couldn't write %zu bytes at offset %zu of file '%s': "
+                     "no space left",
+                     size, offset, file->filename);
+    }
+
+    next += result;
+    size -= (size_t)result;
+    offset += (size_t)result;
+  }
+
+  return NULL_ERROR;
+}
+
+// splices buffer into the pipe if the file is one, gifting its pages so that
+// they don't have to be copied. falls back to write if the pipe won't take them
+static Error write_stream(FileAndMapping *file, const void *buffer,
+                          size_t size) {
+  assert(file);
+  assert(buffer);
+
+  struct iovec iov = {.iov_base = (void *)buffer, .iov_len = size};
+
+  while (iov.iov_len > 0) {
+    ssize_t result;
+
+    if (file->is_pipe) {
+      result = vmsplice(file->fd, &iov, 1, SPLICE_F_GIFT);
+
+      if (result == -1 && errno == EINVAL) {
+        file->is_pipe = false;
+
+        continue;
+      }
+    } else {
+      result = write(file->fd, iov.iov_base, iov.iov_len);
+    }
+
+    if (result == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return ERRNO_EFORMAT("couldn't write %zu bytes to file '%s'",
+                           iov.iov_len, file->filename);
+    } else if (result == 0) {
+      return eformat("couldn't write %zu bytes to file '%s'", iov.iov_len,
+                     file->filename);
+    }
+
+    iov.iov_base = (char *)iov.iov_base + result;
+    iov.iov_len -= (size_t)result;
+  }
+
+  return NULL_ERROR;
+}
+
+// makes the output durable according to file->sync. must be called once the
+// output is complete and has been truncated to its final length. write-behind
+// has already taken care of all but the tail of the output by then
+Error sync_output(FileAndMapping *file) {
+  assert(file);
+
+  // there's nothing to sync in a pipe or a terminal
+  if (file->sync == FILE_SYNC_NONE || file->is_pipe) {
+    return NULL_ERROR;
+  }
+
+  switch (file->sync) {
+  case FILE_SYNC_NONE:
+    return NULL_ERROR;
+  case FILE_SYNC_DATA:
+    if (fdatasync(file->fd) == -1 &&
+        !(file->io == FILE_IO_STREAM && errno == EINVAL)) {
+      return ERRNO_EFORMAT("couldn't sync data of file '%s'", file->filename);
+    }
+
+    return NULL_ERROR;
+  case FILE_SYNC_FULL:
+    if (fsync(file->fd) == -1 &&
+        !(file->io == FILE_IO_STREAM && errno == EINVAL)) {
+      return ERRNO_EFORMAT("couldn't sync file '%s'", file->filename);
+    }
+
+    // the shell that redirected stdout made its directory entry
+    if (file->is_standard_stream) {
+      return NULL_ERROR;
+    }
+
+    return sync_parent_directory(file->filename);
+  }
+
+  assert(false);
+
+  return NULL_ERROR;
+}
+
 Error free_file(FileAndMapping file) {
+  if (file.io == FILE_IO_MEMORY) {
+    if (munmap(file.mapping, file.mapping_size) == -1) {
+      return ERRNO_EFORMAT("couldn't free %zu bytes of output memory",
+                           file.mapping_size);
+    }
+
+    return NULL_ERROR;
+  }
+
+  if (file.io != FILE_IO_MMAP) {
+    // the kernel may still be reading from the staging buffers
+    free_uring(file.uring);
+    munmap(file.spare_mapping, file.spare_mapping_size);
+  }
+
   if (munmap(file.mapping, file.mapping_size) == -1) {
     close(file.fd);
 
     return ERRNO_EFORMAT("couldn't unmap file '%s' from memory", file.filename);
   }
 
+  // whatever was still mapped can only be dropped now
+  if (file.io == FILE_IO_MMAP && file.cache == FILE_CACHE_DROP) {
+    drop_cached_pages(&file, file.file_size);
+  }
+
   if (close(file.fd) == -1) {
     return ERRNO_EFORMAT("couldn't close file '%s'", file.filename);
   }
@@ -0,0 +1,34 @@
+// Copyright (c) 2019 Gregory Meyer
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef FRONTENDS_H
+#define FRONTENDS_H
+
+// entry points of each frontend. each is main() of its own executable, and mmc
+// dispatches to them when they are built with MMC_MULTI_CALL
+int deflate_main(int argc, const char *const argv[]);
+int inflate_main(int argc, const char *const argv[]);
+int lz4_compress_main(int argc, const char *const argv[]);
+int lz4_decompress_main(int argc, const char *const argv[]);
+int zstd_compress_main(int argc, const char *const argv[]);
+int zstd_decompress_main(int argc, const char *const argv[]);
+int zstd_train_main(int argc, const char *const argv[]);
+
+#endif
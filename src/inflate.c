@@ -19,24 +19,96 @@
 // SOFTWARE.
 
 #include <common/app.h>
+#include <common/argparse.h>
 #include <common/error.h>
 #include <common/mmc.h>
 
+#include "frontends.h"
+
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include <zlib.h>
 
-#define MIN(X, Y) (((Y) < (X)) ? (Y) : (X))
+#ifdef MMC_HAS_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 
-size_t size(size_t input_file_size, void *stream_v);
-Error init(AppIOState *io_state, void *stream_v);
-Error run(AppIOState *io_state, bool *finished, void *stream_v);
-void cleanup(AppIOState *io_state, void *stream_v);
+#define MIN(X, Y) (((Y) < (X)) ? (Y) : (X))
+#define MAX(X, Y) (((Y) < (X)) ? (X) : (Y))
+
+#ifdef MMC_HAS_LIBDEFLATE
+// zlib streams don't record their uncompressed size, so libdeflate is tried
+// with output buffers of 4, 16 and 64 times the size of the input before
+// giving up and streaming with zlib
+#define ONE_CALL_INITIAL_RATIO 4
+#define ONE_CALL_RATIO_GROWTH 4
+#define ONE_CALL_MAX_ATTEMPTS 3
+#endif
+
+typedef struct State {
+  PassthroughArgumentParser dictionary_parser;
+  KeywordArgument dictionary;
+
+  // loaded by prepare and shared by every copy of the state in batch mode
+  FileAndMapping dictionary_file;
+  const Bytef *dictionary_data;
+  uInt dictionary_size;
 
-int main(int argc, const char *const argv[]) {
   z_stream stream;
+  // whether stream is about to read the header of a new member, and whether
+  // the member it's reading is gzip. only gzip members may be concatenated
+  bool is_at_member_start;
+  bool is_gzip_member;
+
+#ifdef MMC_HAS_LIBDEFLATE
+  // tried once per file before falling back to stream
+  struct libdeflate_decompressor *decompressor;
+  bool tried_one_call;
+#endif
+} State;
+
+static size_t size(const FileAndMapping *input_file, void *state_v);
+static Error init(AppIOState *io_state, void *state_v);
+static Error run(AppIOState *io_state, bool *finished, void *state_v);
+static void cleanup(AppIOState *io_state, void *state_v);
+static Error reset(AppIOState *io_state, void *state_v);
+static Error prepare(void *state_v);
+static void release(void *state_v);
+
+static bool starts_gzip_member(const AppIOState *io_state);
+static Error trailing_data_error(const AppIOState *io_state);
+
+#ifdef MMC_HAS_LIBDEFLATE
+static Error decompress_in_one_call(AppIOState *io_state, bool *decompressed,
+                                    State *state);
+#endif
+
+#ifndef MMC_MULTI_CALL
+int main(int argc, const char *const argv[]) {
+  return inflate_main(argc, argv);
+}
+#endif
+
+int inflate_main(int argc, const char *const argv[]) {
+  State state = {
+      .dictionary_parser = make_passthrough_parser("-D, --dict", "FILE"),
+      .dictionary = {.short_name = 'D',
+                     .long_name = "dict",
+                     .help_text =
+                         "Preset dictionary that the input was compressed "
+                         "with, which zlib streams ask for by its Adler-32 "
+                         "checksum. The file is mapped read-only once for "
+                         "every file decompressed with --batch.",
+                     .parser = &state.dictionary_parser.argument_parser},
+
+      .dictionary_data = NULL,
+      .dictionary_size = 0,
+  };
+
+  KeywordArgument *keyword_args[] = {&state.dictionary};
 
   return run_decompression_app(
       argc, argv,
@@ -46,33 +118,80 @@ int main(int argc, const char *const argv[]) {
           .author = MMC_AUTHOR,
           .description =
               "mmap-inflate (mi) decompresses a file that was compressed by "
-              "mmap-deflate (md) using the DEFLATE compression algorithm. zlib "
-              "is "
-              "used for decompression and memory-mapped files are used to read "
-              "and "
-              "write data to disk.",
+              "mmap-deflate (md) or gzip(1) using the DEFLATE compression "
+              "algorithm. zlib is used for decompression and memory-mapped "
+              "files are used to read and write data to disk.",
+
+          .keyword_args = keyword_args,
+          .num_keyword_args = sizeof(keyword_args) / sizeof(keyword_args[0]),
 
           .size = size,
           .init = init,
           .run = run,
           .cleanup = cleanup,
-          .arg = &stream,
+          .reset = reset,
+          .prepare = prepare,
+          .release = release,
+          .arg = &state,
+          .arg_size = sizeof(state),
       });
 }
 
-size_t size(size_t input_file_size, void *stream_v) {
-  assert(stream_v);
+static size_t size(const FileAndMapping *input_file, void *state_v) {
+  assert(input_file);
+  assert(state_v);
+
+  (void)state_v;
 
-  (void)stream_v;
+  const unsigned char *const input = (const unsigned char *)input_file->mapping;
+  const size_t input_size = input_file->file_size;
 
-  return input_file_size;
+  // zlib streams don't record their uncompressed size, so guess and let the
+  // driver grow the output if that's too small
+  if (input_size < 18 || input[0] != 0x1f || input[1] != 0x8b) {
+    return input_size;
+  }
+
+  // gzip members end with their uncompressed size modulo 2^32. stored blocks
+  // grow incompressible input by only 5 bytes per 64 KiB, so anything much
+  // smaller than the input must have wrapped around. the header and trailer
+  // alone can outweigh the payload of a tiny member
+  const unsigned char *const trailer = input + input_size - 4;
+  uint64_t uncompressed_size = (uint64_t)trailer[0] |
+                               ((uint64_t)trailer[1] << 8) |
+                               ((uint64_t)trailer[2] << 16) |
+                               ((uint64_t)trailer[3] << 24);
+  const uint64_t overhead = (uint64_t)input_size / 8192 + 32;
+  const uint64_t min_uncompressed_size =
+      input_size > overhead ? input_size - overhead : 0;
+
+  while (uncompressed_size < min_uncompressed_size) {
+    uncompressed_size += (uint64_t)1 << 32;
+  }
+
+  return (size_t)MIN(uncompressed_size, (uint64_t)SIZE_MAX);
 }
 
-Error init(AppIOState *io_state, void *stream_v) {
+static Error init(AppIOState *io_state, void *state_v) {
   assert(io_state);
-  assert(stream_v);
+  assert(state_v);
 
-  z_stream *const stream = (z_stream *)stream_v;
+  State *const state = (State *)state_v;
+  z_stream *const stream = &state->stream;
+
+#ifdef MMC_HAS_LIBDEFLATE
+  // libdeflate can't take a preset dictionary
+  if (!state->dictionary_data) {
+    state->decompressor = libdeflate_alloc_decompressor();
+
+    if (!state->decompressor) {
+      return ERROR_OUT_OF_MEMORY;
+    }
+
+    // until the output turns out to be larger than size() guessed
+    io_state->runs_in_one_call = true;
+  }
+#endif
 
   *stream = (z_stream){.next_in = NULL,
                        .avail_in = 0,
@@ -80,7 +199,10 @@ Error init(AppIOState *io_state, void *stream_v) {
                        .zfree = Z_NULL,
                        .opaque = Z_NULL};
 
-  const int init_errc = inflateInit(stream);
+  state->is_at_member_start = true;
+
+  // 15 + 32 accepts both zlib and gzip headers
+  const int init_errc = inflateInit2(stream, 15 + 32);
 
   if (init_errc != Z_OK) {
     assert(init_errc != Z_STREAM_ERROR);
@@ -100,6 +222,13 @@ Error init(AppIOState *io_state, void *stream_v) {
       assert(false);
     }
 
+#ifdef MMC_HAS_LIBDEFLATE
+    if (state->decompressor) {
+      libdeflate_free_decompressor(state->decompressor);
+      state->decompressor = NULL;
+    }
+#endif
+
     if (stream->msg) {
       return eformat("couldn't initialize inflate stream: %s (%d): %s", what,
                      init_errc, stream->msg);
@@ -112,12 +241,36 @@ Error init(AppIOState *io_state, void *stream_v) {
   return NULL_ERROR;
 }
 
-Error run(AppIOState *io_state, bool *finished, void *stream_v) {
+static Error run(AppIOState *io_state, bool *finished, void *state_v) {
   assert(io_state);
   assert(finished);
-  assert(stream_v);
+  assert(state_v);
+
+  State *const state = (State *)state_v;
+  z_stream *const stream = &state->stream;
+
+#ifdef MMC_HAS_LIBDEFLATE
+  if (state->decompressor && !state->tried_one_call) {
+    state->tried_one_call = true;
+
+    bool decompressed;
+    const Error error =
+        decompress_in_one_call(io_state, &decompressed, state);
+
+    if (error.what || decompressed) {
+      *finished = true;
+
+      return error;
+    }
+
+    io_state->runs_in_one_call = false;
+  }
+#endif
 
-  z_stream *const stream = (z_stream *)stream_v;
+  if (state->is_at_member_start) {
+    state->is_at_member_start = false;
+    state->is_gzip_member = starts_gzip_member(io_state);
+  }
 
   stream->next_in = (z_const Bytef *)io_state->input_file.mapping +
                     io_state->input_mapping_first_unused_offset;
@@ -150,18 +303,61 @@ Error run(AppIOState *io_state, bool *finished, void *stream_v) {
     io_state->output_bytes_written += (size_t)stream->total_out;
   }
 
+  // inflate stops right after a zlib header that asks for a dictionary, but
+  // doesn't count the header in total_in
+  if (errc == Z_NEED_DICT && state->dictionary_data) {
+    io_state->input_mapping_first_unused_offset =
+        (size_t)(stream->next_in -
+                 (const Bytef *)io_state->input_file.mapping);
+
+    const int dictionary_errc = inflateSetDictionary(
+        stream, state->dictionary_data, state->dictionary_size);
+
+    if (dictionary_errc == Z_DATA_ERROR) {
+      return eformat("dictionary '%s' doesn't match the one the input was "
+                     "compressed with",
+                     state->dictionary_parser.value);
+    } else if (dictionary_errc != Z_OK) {
+      return eformat("couldn't set inflate dictionary (%d)", dictionary_errc);
+    }
+
+    *finished = false;
+
+    return NULL_ERROR;
+  }
+
   if (errc != Z_OK) {
     assert(errc != Z_STREAM_ERROR);
     assert(errc != Z_BUF_ERROR);
 
     const char *what;
     switch (errc) {
-    case Z_STREAM_END:
-      *finished = true;
+    case Z_STREAM_END: {
+      const size_t remaining = io_state->input_file.mapping_size -
+                               io_state->input_mapping_first_unused_offset;
+
+      // like gunzip, decompress concatenated gzip members one after another
+      if (remaining == 0 || !state->is_gzip_member) {
+        *finished = true;
+
+        return NULL_ERROR;
+      } else if (!starts_gzip_member(io_state)) {
+        return trailing_data_error(io_state);
+      }
+
+      const int reset_errc = inflateReset(stream);
+
+      if (reset_errc != Z_OK) {
+        return eformat("couldn't reset inflate stream (%d)", reset_errc);
+      }
+
+      state->is_at_member_start = true;
+      *finished = false;
 
       return NULL_ERROR;
+    }
     case Z_NEED_DICT:
-      what = "dictionary needed";
+      what = "dictionary needed, pass it with --dict";
 
       break;
     case Z_DATA_ERROR:
@@ -189,12 +385,223 @@ Error run(AppIOState *io_state, bool *finished, void *stream_v) {
   return NULL_ERROR;
 }
 
-void cleanup(AppIOState *io_state, void *stream_v) {
+static void cleanup(AppIOState *io_state, void *state_v) {
   assert(io_state);
-  assert(stream_v);
+  assert(state_v);
 
   (void)io_state;
 
-  z_stream *const stream = (z_stream *)stream_v;
-  inflateEnd(stream);
+  State *const state = (State *)state_v;
+
+  inflateEnd(&state->stream);
+
+#ifdef MMC_HAS_LIBDEFLATE
+  if (state->decompressor) {
+    libdeflate_free_decompressor(state->decompressor);
+    state->decompressor = NULL;
+  }
+#endif
+}
+
+static Error reset(AppIOState *io_state, void *state_v) {
+  assert(io_state);
+  assert(state_v);
+
+  (void)io_state;
+
+  State *const state = (State *)state_v;
+  z_stream *const stream = &state->stream;
+
+#ifdef MMC_HAS_LIBDEFLATE
+  state->tried_one_call = false;
+  io_state->runs_in_one_call = state->decompressor != NULL;
+#endif
+
+  const int reset_errc = inflateReset(stream);
+
+  if (reset_errc != Z_OK) {
+    return eformat("couldn't reset inflate stream (%d)", reset_errc);
+  }
+
+  state->is_at_member_start = true;
+
+  return NULL_ERROR;
+}
+
+static Error prepare(void *state_v) {
+  assert(state_v);
+
+  State *const state = (State *)state_v;
+
+  if (!state->dictionary.was_found) {
+    return NULL_ERROR;
+  }
+
+  const Error error = open_and_map_file(state->dictionary_parser.value,
+                                        &state->dictionary_file);
+
+  if (error.what) {
+    return error;
+  }
+
+  if (state->dictionary_file.file_size > (size_t)UINT_MAX) {
+    free_file(state->dictionary_file);
+
+    return eformat("dictionary '%s' is larger than %u bytes",
+                   state->dictionary_parser.value, UINT_MAX);
+  }
+
+  state->dictionary_data = (const Bytef *)state->dictionary_file.mapping;
+  state->dictionary_size = (uInt)state->dictionary_file.file_size;
+
+  return NULL_ERROR;
+}
+
+static void release(void *state_v) {
+  assert(state_v);
+
+  State *const state = (State *)state_v;
+
+  if (!state->dictionary_data) {
+    return;
+  }
+
+  const Error error = free_file(state->dictionary_file);
+
+  if (error.what) {
+    print_warning(error);
+  }
+}
+
+// whether the input left to decompress starts with the magic bytes of gzip
+static bool starts_gzip_member(const AppIOState *io_state) {
+  assert(io_state);
+
+  const unsigned char *const input =
+      (const unsigned char *)io_state->input_file.mapping +
+      io_state->input_mapping_first_unused_offset;
+  const size_t remaining = io_state->input_file.mapping_size -
+                           io_state->input_mapping_first_unused_offset;
+
+  return remaining >= 2 && input[0] == 0x1f && input[1] == 0x8b;
+}
+
+static Error trailing_data_error(const AppIOState *io_state) {
+  assert(io_state);
+
+  return eformat("input file '%s' has %zu bytes after a gzip member that "
+                 "aren't another gzip member",
+                 io_state->input_file.filename,
+                 io_state->input_file.mapping_size -
+                     io_state->input_mapping_first_unused_offset);
+}
+
+#ifdef MMC_HAS_LIBDEFLATE
+// sets decompressed if the whole stream was decompressed. concatenated gzip
+// members are decompressed one call each. if one of them can't be, the members
+// before it are kept and zlib picks up from its start, overwriting whatever
+// libdeflate wrote for it: libdeflate can't resume where it ran out of space,
+// and it reports corrupted input less precisely than zlib does
+static Error decompress_in_one_call(AppIOState *io_state, bool *decompressed,
+                                    State *state) {
+  assert(io_state);
+  assert(decompressed);
+  assert(state);
+  assert(state->decompressor);
+  assert(io_state->input_mapping_first_unused_offset == 0);
+
+  *decompressed = false;
+
+  const unsigned char *const input =
+      (const unsigned char *)io_state->input_file.mapping;
+  const size_t input_size = io_state->input_file.mapping_size;
+
+  if (input_size < 2) {
+    return NULL_ERROR;
+  }
+
+  const bool is_gzip = starts_gzip_member(io_state);
+
+  // FDICT is set in zlib headers that ask for a preset dictionary
+  if (!is_gzip && (input[1] & 0x20)) {
+    return NULL_ERROR;
+  }
+
+  FileAndMapping *const output_file = &io_state->output_file;
+
+  // size() already read the uncompressed size of the last gzip member
+  size_t output_capacity = output_file->mapping_size -
+                           io_state->output_mapping_first_unused_offset;
+
+  if (!is_gzip && input_size <= SIZE_MAX / ONE_CALL_INITIAL_RATIO) {
+    output_capacity =
+        MAX(output_capacity, input_size * ONE_CALL_INITIAL_RATIO);
+  }
+
+  int num_attempts = 0;
+
+  while (true) {
+    const size_t input_offset = io_state->input_mapping_first_unused_offset;
+    const size_t output_offset = io_state->output_mapping_first_unused_offset;
+    const Error error =
+        reserve_output_mapping(output_file, output_offset, output_capacity);
+
+    if (error.what) {
+      return error;
+    }
+
+    unsigned char *const output =
+        (unsigned char *)output_file->mapping + output_offset;
+    size_t input_consumed;
+    size_t output_produced;
+    enum libdeflate_result result;
+
+    if (is_gzip) {
+      result = libdeflate_gzip_decompress_ex(
+          state->decompressor, input + input_offset, input_size - input_offset,
+          output, output_capacity, &input_consumed, &output_produced);
+    } else {
+      result = libdeflate_zlib_decompress_ex(
+          state->decompressor, input + input_offset, input_size - input_offset,
+          output, output_capacity, &input_consumed, &output_produced);
+    }
+
+    if (result == LIBDEFLATE_SUCCESS) {
+      io_state->input_mapping_first_unused_offset += input_consumed;
+      io_state->output_mapping_first_unused_offset += output_produced;
+      io_state->output_bytes_written += output_produced;
+      output_capacity -= output_produced;
+
+      // a zlib stream ends the input, like it does for inflate
+      if (!is_gzip ||
+          io_state->input_mapping_first_unused_offset == input_size) {
+        *decompressed = true;
+
+        return NULL_ERROR;
+      } else if (!starts_gzip_member(io_state)) {
+        return trailing_data_error(io_state);
+      }
+
+      // only the size of the last member is known, so later ones are guessed
+      // like zlib streams
+      const size_t remaining =
+          input_size - io_state->input_mapping_first_unused_offset;
+
+      if (remaining <= SIZE_MAX / ONE_CALL_INITIAL_RATIO) {
+        output_capacity =
+            MAX(output_capacity, remaining * ONE_CALL_INITIAL_RATIO);
+      }
+
+      num_attempts = 0;
+
+      continue;
+    } else if (result != LIBDEFLATE_INSUFFICIENT_SPACE ||
+               ++num_attempts == ONE_CALL_MAX_ATTEMPTS ||
+               output_capacity > SIZE_MAX / ONE_CALL_RATIO_GROWTH) {
+      return NULL_ERROR;
+    }
+
+    output_capacity *= ONE_CALL_RATIO_GROWTH;
+  }
 }
+#endif
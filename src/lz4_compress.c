@@ -23,13 +23,52 @@
 #include <common/error.h>
 #include <common/mmc.h>
 
+#include <common/thread_pool.h>
+
+#include "frontends.h"
+#include "xxh32.h"
+
 #include <assert.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <lz4.h>
 #include <lz4frame.h>
 #include <lz4hc.h>
+#include <pthread.h>
+
+#define MIN(X, Y) (((Y) < (X)) ? (Y) : (X))
+
+// linked blocks can't refer back further than 64 KiB
+#define DICTIONARY_SIZE ((size_t)1 << 16)
+#define BLOCKS_PER_THREAD 4
+#define LZ4F_MAGIC_NUMBER 0x184D2204u
+#define UNCOMPRESSED_BLOCK_FLAG 0x80000000u
+
+typedef struct Block {
+  const char *input;
+  size_t input_size;
+  const char *dictionary;
+  size_t dictionary_size;
+  bool uses_preset_dictionary; // instead of the dictionary above
+
+  // points into the output mapping, starting with the block size word
+  unsigned char *output;
+  size_t output_size;
+
+  Error error;
+} Block;
+
+typedef struct Worker {
+  struct State *state;
+
+  LZ4_stream_t *stream;
+  LZ4_streamHC_t *stream_hc;
+} Worker;
 
 typedef struct State {
   StringArgumentParser block_mode_parser;
@@ -43,11 +82,65 @@ typedef struct State {
   IntegerArgumentParser level_parser;
   KeywordArgument level;
 
+  ThreadCountArgumentParser threads_parser;
+  KeywordArgument threads;
+
+  KeywordArgument block_checksum;
+  KeywordArgument content_checksum;
+
+  ParameterArgumentParser parameter_parser;
+  KeywordArgument parameter;
+
+  PassthroughArgumentParser dictionary_parser;
+  KeywordArgument dictionary;
+
+  // loaded by prepare and shared by every copy of the state in batch mode.
+  // workers copy whichever stream matches the level over their own before
+  // each block that starts from the dictionary
+  FileAndMapping dictionary_file;
+  LZ4_stream_t *dictionary_stream;
+  LZ4_streamHC_t *dictionary_stream_hc;
+
   LZ4F_preferences_t preferences;
+
+  // only used when compressing with multiple threads or a dictionary.
+  // has_pool is set once pool and blocks_mutex are created
+  ThreadPool pool;
+  bool has_pool;
+  Worker *workers;
+  size_t num_workers;
+
+  pthread_mutex_t blocks_mutex;
+  Block *blocks;
+  size_t num_blocks;
+  size_t blocks_capacity;
+  size_t next_block_index;
+
+  Xxh32State content_hash;
+  const char *content_hash_input;
+  size_t content_hash_input_size;
+
+  size_t input_offset;
+  size_t max_block_size;
 } State;
 
-size_t size(size_t input_file_size, void *state_v);
-Error run(AppIOState *io_state, bool *finished, void *state_v);
+static size_t size(const FileAndMapping *input_file, void *state_v);
+static Error init(AppIOState *io_state, void *state_v);
+static Error run(AppIOState *io_state, bool *finished, void *state_v);
+static void cleanup(AppIOState *io_state, void *state_v);
+static Error reset(AppIOState *io_state, void *state_v);
+static Error prepare(void *state_v);
+static void release(void *state_v);
+
+static bool has_dictionary(const State *state);
+static Error run_parallel(AppIOState *io_state, bool *finished, State *state);
+static void compress_blocks(void *worker_v);
+static void compress_block(Worker *worker, Block *block);
+static void hash_content(void *state_v);
+static size_t write_frame_header(unsigned char *output,
+                                 const LZ4F_preferences_t *preferences);
+static size_t max_block_size_of(LZ4F_blockSizeID_t block_size_id);
+static void write_le32(unsigned char *output, uint32_t value);
 
 static const char *const BLOCK_MODE_VALUES[] = {"linked", "independent"};
 static const LZ4F_blockMode_t BLOCK_MODE_MAPPING[] = {LZ4F_blockLinked,
@@ -58,7 +151,24 @@ static const char *const BLOCK_SIZE_VALUES[] = {"default", "64KB", "256KB",
 static const LZ4F_blockSizeID_t BLOCK_SIZE_MAPPING[] = {
     LZ4F_default, LZ4F_max64KB, LZ4F_max256KB, LZ4F_max1MB, LZ4F_max4MB};
 
+// the parameters of --param, named like the fields of LZ4F_preferences_t and
+// LZ4F_frameInfo_t that they set
+typedef enum Lz4Parameter {
+  PARAMETER_BLOCK_SIZE_ID,
+  PARAMETER_BLOCK_MODE,
+  PARAMETER_BLOCK_CHECKSUM_FLAG,
+  PARAMETER_CONTENT_CHECKSUM_FLAG,
+  PARAMETER_FAVOR_DEC_SPEED,
+  NUM_PARAMETERS,
+} Lz4Parameter;
+
+#ifndef MMC_MULTI_CALL
 int main(int argc, const char *const argv[]) {
+  return lz4_compress_main(argc, argv);
+}
+#endif
+
+int lz4_compress_main(int argc, const char *const argv[]) {
   char level_help_text[512];
   sprintf(
       level_help_text,
@@ -67,6 +177,24 @@ int main(int argc, const char *const argv[]) {
                             "Negative values trigger \"fast acceleration.\"",
       INT_MIN);
 
+  Parameter parameters[NUM_PARAMETERS] = {
+      [PARAMETER_BLOCK_SIZE_ID] = {.name = "blockSizeID",
+                                   .min_value = LZ4F_max64KB,
+                                   .max_value = LZ4F_max4MB},
+      [PARAMETER_BLOCK_MODE] = {.name = "blockMode",
+                                .min_value = LZ4F_blockLinked,
+                                .max_value = LZ4F_blockIndependent},
+      [PARAMETER_BLOCK_CHECKSUM_FLAG] = {.name = "blockChecksumFlag",
+                                         .min_value = 0,
+                                         .max_value = 1},
+      [PARAMETER_CONTENT_CHECKSUM_FLAG] = {.name = "contentChecksumFlag",
+                                           .min_value = 0,
+                                           .max_value = 1},
+      [PARAMETER_FAVOR_DEC_SPEED] = {.name = "favorDecSpeed",
+                                     .min_value = 0,
+                                     .max_value = 1},
+  };
+
   State state = {
       .block_mode_parser = make_string_parser("-m, --block-mode", "MODE",
                                               sizeof(BLOCK_MODE_VALUES) /
@@ -112,12 +240,74 @@ int main(int argc, const char *const argv[]) {
                 .help_text = level_help_text,
                 .parser = &state.level_parser.argument_parser},
 
+      .threads_parser =
+          make_thread_count_parser("-t, --threads", "THREADS", 1024),
+      .threads = {.short_name = 't',
+                  .long_name = "threads",
+                  .help_text =
+                      "Number of threads to compress with, or 'auto' to use "
+                      "one thread per online processor. An integer in the "
+                      "range [1, 1024]. If set, blocks are compressed "
+                      "concurrently and written directly into the output "
+                      "file. Linked blocks are primed with the 64 KiB of "
+                      "input before them. --favor-decompression-speed is "
+                      "ignored in this mode.",
+                  .parser = &state.threads_parser.argument_parser},
+
+      .block_checksum = {.short_name = 'b',
+                         .long_name = "block-checksum",
+                         .help_text = "If set, each block is followed by a "
+                                      "checksum of its compressed contents.",
+                         .parser = NULL},
+
+      .content_checksum = {.short_name = 'c',
+                           .long_name = "content-checksum",
+                           .help_text = "If set, the frame ends with a "
+                                        "checksum of the uncompressed input.",
+                           .parser = NULL},
+
+      .parameter_parser = make_parameter_parser("--param", "NAME=VALUE",
+                                                NUM_PARAMETERS, parameters),
+      .parameter =
+          {.short_name = '\0',
+           .long_name = "param",
+           .help_text =
+               "Sets one of LZ4F's frame preferences by the name of its "
+               "field, taking precedence over the options above. Can be "
+               "given any number of times. NAME is one of blockSizeID [4, 7] "
+               "(64 KiB to 4 MiB), blockMode [0, 1] (0 is linked), "
+               "blockChecksumFlag [0, 1], contentChecksumFlag [0, 1], or "
+               "favorDecSpeed [0, 1]. autoFlush isn't one of them, as frames "
+               "are compressed in one call, which always flushes.",
+           .parser = &state.parameter_parser.argument_parser},
+
+      .dictionary_parser = make_passthrough_parser("-D, --dict", "FILE"),
+      .dictionary =
+          {.short_name = 'D',
+           .long_name = "dict",
+           .help_text =
+               "Dictionary to compress with, such as one trained by mzt. Only "
+               "its last 64 KiB are used. The file is mapped read-only and "
+               "loaded once for every file compressed with --batch. Frames "
+               "are written by the same block compressor as with --threads, "
+               "on one thread unless --threads is given. Independent blocks "
+               "all start from the dictionary, and linked blocks only the "
+               "first. The same dictionary must be passed to mld or lz4 -D "
+               "to decompress the output.",
+           .parser = &state.dictionary_parser.argument_parser},
+
+      .dictionary_stream = NULL,
+      .dictionary_stream_hc = NULL,
+
       .preferences = LZ4F_INIT_PREFERENCES,
   };
 
-  KeywordArgument *keyword_args[] = {&state.block_mode, &state.block_size,
-                                     &state.favor_decompression_speed,
-                                     &state.level};
+  KeywordArgument *keyword_args[] = {
+      &state.block_mode,     &state.block_size,
+      &state.favor_decompression_speed,
+      &state.level,          &state.threads,
+      &state.block_checksum, &state.content_checksum,
+      &state.dictionary,     &state.parameter};
 
   return run_compression_app(
       argc, argv,
@@ -134,12 +324,19 @@ int main(int argc, const char *const argv[]) {
           .num_keyword_args = sizeof(keyword_args) / sizeof(keyword_args[0]),
 
           .size = size,
+          .init = init,
           .run = run,
+          .cleanup = cleanup,
+          .reset = reset,
+          .prepare = prepare,
+          .release = release,
           .arg = &state,
+          .arg_size = sizeof(state),
       });
 }
 
-size_t size(size_t input_file_size, void *state_v) {
+static size_t size(const FileAndMapping *input_file, void *state_v) {
+  assert(input_file);
   assert(state_v);
 
   State *const state = (State *)state_v;
@@ -162,21 +359,159 @@ size_t size(size_t input_file_size, void *state_v) {
         BLOCK_SIZE_MAPPING[state->block_size_parser.value_index];
   }
 
+  if (state->block_checksum.was_found) {
+    state->preferences.frameInfo.blockChecksumFlag = LZ4F_blockChecksumEnabled;
+  }
+
+  if (state->content_checksum.was_found) {
+    state->preferences.frameInfo.contentChecksumFlag =
+        LZ4F_contentChecksumEnabled;
+  }
+
+  const Parameter *const parameters = state->parameter_parser.parameters;
+
+  if (parameters[PARAMETER_BLOCK_SIZE_ID].was_set) {
+    state->preferences.frameInfo.blockSizeID =
+        (LZ4F_blockSizeID_t)parameters[PARAMETER_BLOCK_SIZE_ID].value;
+  }
+
+  if (parameters[PARAMETER_BLOCK_MODE].was_set) {
+    state->preferences.frameInfo.blockMode =
+        (LZ4F_blockMode_t)parameters[PARAMETER_BLOCK_MODE].value;
+  }
+
+  if (parameters[PARAMETER_BLOCK_CHECKSUM_FLAG].was_set) {
+    state->preferences.frameInfo.blockChecksumFlag =
+        (LZ4F_blockChecksum_t)parameters[PARAMETER_BLOCK_CHECKSUM_FLAG].value;
+  }
+
+  if (parameters[PARAMETER_CONTENT_CHECKSUM_FLAG].was_set) {
+    state->preferences.frameInfo.contentChecksumFlag =
+        (LZ4F_contentChecksum_t)parameters[PARAMETER_CONTENT_CHECKSUM_FLAG]
+            .value;
+  }
+
+  if (parameters[PARAMETER_FAVOR_DEC_SPEED].was_set) {
+    state->preferences.favorDecSpeed =
+        (unsigned)parameters[PARAMETER_FAVOR_DEC_SPEED].value;
+  }
+
   state->preferences.frameInfo.contentSize =
-      (unsigned long long)input_file_size;
+      (unsigned long long)input_file->file_size;
 
-  return LZ4F_compressFrameBound(input_file_size, &state->preferences);
+  return LZ4F_compressFrameBound(input_file->file_size, &state->preferences);
 }
 
-Error run(AppIOState *io_state, bool *finished, void *state_v) {
+static Error init(AppIOState *io_state, void *state_v) {
+  assert(io_state);
+  assert(state_v);
+
+  State *const state = (State *)state_v;
+
+  if (!state->threads.was_found) {
+    // run hands the whole input to LZ4F_compressFrame
+    if (!has_dictionary(state)) {
+      io_state->runs_in_one_call = true;
+
+      return NULL_ERROR;
+    }
+
+    // LZ4F can't be given a dictionary through its shared library, so the
+    // block compressor runs on this one thread instead
+    state->threads_parser.value = 1;
+  }
+
+  if (state->preferences.favorDecSpeed) {
+    print_warning(STATIC_ERROR("--favor-decompression-speed is ignored when "
+                               "compressing with multiple threads or a "
+                               "dictionary"));
+  }
+
+  const size_t num_workers = (size_t)state->threads_parser.value;
+  const bool is_high_compression =
+      state->preferences.compressionLevel >= LZ4HC_CLEVEL_MIN;
+
+  state->workers = calloc(num_workers, sizeof(Worker));
+  state->num_workers = 0;
+  state->has_pool = false;
+
+  state->blocks_capacity = num_workers * BLOCKS_PER_THREAD;
+  state->blocks = calloc(state->blocks_capacity, sizeof(Block));
+  state->num_blocks = 0;
+
+  if (!state->workers || !state->blocks) {
+    free(state->workers);
+    free(state->blocks);
+
+    return ERROR_OUT_OF_MEMORY;
+  }
+
+  for (size_t i = 0; i < num_workers; ++i) {
+    Worker *const worker = &state->workers[i];
+    worker->state = state;
+
+    if (is_high_compression) {
+      worker->stream_hc = LZ4_createStreamHC();
+    } else {
+      worker->stream = LZ4_createStream();
+    }
+
+    ++state->num_workers;
+
+    if (!worker->stream && !worker->stream_hc) {
+      cleanup(io_state, state);
+
+      return ERROR_OUT_OF_MEMORY;
+    }
+  }
+
+  // one extra thread hashes the input while the others compress it
+  const bool has_content_checksum =
+      state->preferences.frameInfo.contentChecksumFlag ==
+      LZ4F_contentChecksumEnabled;
+  const size_t num_threads = num_workers + (has_content_checksum ? 1 : 0);
+  const Error error = create_thread_pool(num_threads, &state->pool);
+
+  if (error.what) {
+    cleanup(io_state, state);
+
+    return error;
+  }
+
+  pthread_mutex_init(&state->blocks_mutex, NULL);
+  state->has_pool = true;
+  xxh32_reset(&state->content_hash, 0);
+
+  state->input_offset = 0;
+  state->max_block_size =
+      max_block_size_of(state->preferences.frameInfo.blockSizeID);
+
+  return NULL_ERROR;
+}
+
+static Error run(AppIOState *io_state, bool *finished, void *state_v) {
   assert(io_state);
   assert(finished);
   assert(state_v);
 
   State *const state = (State *)state_v;
 
+  if (state->threads.was_found || has_dictionary(state)) {
+    return run_parallel(io_state, finished, state);
+  }
+
+  FileAndMapping *const output_file = &io_state->output_file;
+  const Error error = reserve_output_mapping(
+      output_file, 0,
+      LZ4F_compressFrameBound(io_state->input_file.mapping_size,
+                              &state->preferences));
+
+  if (error.what) {
+    return error;
+  }
+
   const size_t output_final_size_or_error = LZ4F_compressFrame(
-      io_state->output_file.mapping, io_state->output_file.mapping_size,
+      output_file->mapping, output_file->mapping_size,
       io_state->input_file.mapping, io_state->input_file.mapping_size,
       &state->preferences);
 
@@ -197,3 +532,474 @@ Error run(AppIOState *io_state, bool *finished, void *state_v) {
 
   return NULL_ERROR;
 }
+
+static void cleanup(AppIOState *io_state, void *state_v) {
+  assert(io_state);
+  assert(state_v);
+
+  (void)io_state;
+
+  State *const state = (State *)state_v;
+
+  if (!state->threads.was_found && !has_dictionary(state)) {
+    return;
+  }
+
+  if (state->has_pool) {
+    free_thread_pool(&state->pool);
+    pthread_mutex_destroy(&state->blocks_mutex);
+  }
+
+  for (size_t i = 0; i < state->num_workers; ++i) {
+    LZ4_freeStream(state->workers[i].stream);
+    LZ4_freeStreamHC(state->workers[i].stream_hc);
+  }
+
+  free(state->workers);
+  free(state->blocks);
+}
+
+static Error reset(AppIOState *io_state, void *state_v) {
+  assert(io_state);
+  assert(state_v);
+
+  State *const state = (State *)state_v;
+
+  // LZ4F_compressFrame keeps nothing between calls, and workers reset their
+  // streams before every block
+  if (!state->threads.was_found && !has_dictionary(state)) {
+    io_state->runs_in_one_call = true;
+
+    return NULL_ERROR;
+  }
+
+  xxh32_reset(&state->content_hash, 0);
+  state->input_offset = 0;
+
+  return NULL_ERROR;
+}
+
+// the dictionary is loaded into a stream once, which is cheaper to copy than
+// to load again for every block
+static Error prepare(void *state_v) {
+  assert(state_v);
+
+  State *const state = (State *)state_v;
+
+  if (!state->dictionary.was_found) {
+    return NULL_ERROR;
+  }
+
+  const Error error = open_and_map_file(state->dictionary_parser.value,
+                                        &state->dictionary_file);
+
+  if (error.what) {
+    return error;
+  }
+
+  const size_t dictionary_size =
+      MIN(state->dictionary_file.file_size, DICTIONARY_SIZE);
+  const char *const dictionary = (const char *)state->dictionary_file.mapping +
+                                 state->dictionary_file.file_size -
+                                 dictionary_size;
+  const int level =
+      state->level.was_found ? (int)state->level_parser.value : 0;
+
+  if (level >= LZ4HC_CLEVEL_MIN) {
+    state->dictionary_stream_hc = LZ4_createStreamHC();
+
+    if (state->dictionary_stream_hc) {
+      LZ4_resetStreamHC(state->dictionary_stream_hc, level);
+      LZ4_loadDictHC(state->dictionary_stream_hc, dictionary,
+                     (int)dictionary_size);
+    }
+  } else {
+    state->dictionary_stream = LZ4_createStream();
+
+    if (state->dictionary_stream) {
+      LZ4_loadDict(state->dictionary_stream, dictionary, (int)dictionary_size);
+    }
+  }
+
+  if (!has_dictionary(state)) {
+    free_file(state->dictionary_file);
+
+    return ERROR_OUT_OF_MEMORY;
+  }
+
+  return NULL_ERROR;
+}
+
+static void release(void *state_v) {
+  assert(state_v);
+
+  State *const state = (State *)state_v;
+
+  if (!has_dictionary(state)) {
+    return;
+  }
+
+  LZ4_freeStream(state->dictionary_stream);
+  LZ4_freeStreamHC(state->dictionary_stream_hc);
+
+  const Error error = free_file(state->dictionary_file);
+
+  if (error.what) {
+    print_warning(error);
+  }
+}
+
+static bool has_dictionary(const State *state) {
+  assert(state);
+
+  return state->dictionary_stream || state->dictionary_stream_hc;
+}
+
+// each call compresses up to BLOCKS_PER_THREAD blocks per thread into
+// worst-case sized slots in the output mapping, then packs them together
+static Error run_parallel(AppIOState *io_state, bool *finished, State *state) {
+  assert(io_state);
+  assert(finished);
+  assert(state);
+
+  const FileAndMapping *const input_file = &io_state->input_file;
+  FileAndMapping *const output_file = &io_state->output_file;
+  const LZ4F_frameInfo_t *const frame_info = &state->preferences.frameInfo;
+
+  const char *const input_base =
+      (const char *)input_file->mapping - input_file->mapping_offset;
+
+  const bool is_linked = frame_info->blockMode == LZ4F_blockLinked;
+  const size_t checksum_size =
+      frame_info->blockChecksumFlag == LZ4F_blockChecksumEnabled ? 4 : 0;
+
+  Error error = NULL_ERROR;
+
+  if (state->input_offset == 0) {
+    if ((error = reserve_output_mapping(
+             output_file, io_state->output_mapping_first_unused_offset,
+             LZ4F_HEADER_SIZE_MAX)),
+        error.what) {
+      return error;
+    }
+
+    const size_t header_size = write_frame_header(
+        (unsigned char *)output_file->mapping +
+            io_state->output_mapping_first_unused_offset,
+        &state->preferences);
+    io_state->output_mapping_first_unused_offset += header_size;
+    io_state->output_bytes_written += header_size;
+  }
+
+  size_t slots_size = 0;
+  size_t offset = state->input_offset;
+  state->num_blocks = 0;
+
+  while (state->num_blocks < state->blocks_capacity &&
+         offset < input_file->file_size) {
+    Block *const block = &state->blocks[state->num_blocks];
+    ++state->num_blocks;
+
+    block->input = input_base + offset;
+    block->input_size =
+        MIN(input_file->file_size - offset, state->max_block_size);
+
+    if (is_linked) {
+      block->dictionary_size = MIN(offset, DICTIONARY_SIZE);
+    } else {
+      block->dictionary_size = 0;
+    }
+
+    block->dictionary = block->input - block->dictionary_size;
+    block->uses_preset_dictionary =
+        has_dictionary(state) && (!is_linked || offset == 0);
+
+    block->error = NULL_ERROR;
+
+    // an incompressible block is stored as-is, so this is the worst case
+    slots_size += 4 + block->input_size + checksum_size;
+    offset += block->input_size;
+  }
+
+  if ((error = reserve_output_mapping(
+           output_file, io_state->output_mapping_first_unused_offset,
+           slots_size)),
+      error.what) {
+    return error;
+  }
+
+  // reserving may have moved the mapping
+  unsigned char *const output_base = (unsigned char *)output_file->mapping;
+  size_t slot_offset = io_state->output_mapping_first_unused_offset;
+
+  for (size_t i = 0; i < state->num_blocks; ++i) {
+    Block *const block = &state->blocks[i];
+
+    block->output = output_base + slot_offset;
+    slot_offset += 4 + block->input_size + checksum_size;
+  }
+
+  state->next_block_index = 0;
+
+  if (frame_info->contentChecksumFlag == LZ4F_contentChecksumEnabled) {
+    state->content_hash_input = input_base + state->input_offset;
+    state->content_hash_input_size = offset - state->input_offset;
+
+    error = submit_task(&state->pool, hash_content, state);
+  }
+
+  for (size_t i = 0; i < state->num_workers && !error.what; ++i) {
+    error = submit_task(&state->pool, compress_blocks, &state->workers[i]);
+  }
+
+  wait_for_tasks(&state->pool);
+
+  for (size_t i = 0; i < state->num_blocks; ++i) {
+    const Block *const block = &state->blocks[i];
+
+    if (block->error.what) {
+      if (error.what) {
+        print_error(error);
+      }
+
+      error = block->error;
+    }
+  }
+
+  if (error.what) {
+    return error;
+  }
+
+  for (size_t i = 0; i < state->num_blocks; ++i) {
+    const Block *const block = &state->blocks[i];
+    unsigned char *const destination =
+        output_base + io_state->output_mapping_first_unused_offset;
+
+    if (block->output != destination) {
+      memmove(destination, block->output, block->output_size);
+    }
+
+    io_state->output_mapping_first_unused_offset += block->output_size;
+    io_state->output_bytes_written += block->output_size;
+  }
+
+  state->input_offset = offset;
+
+  if (state->input_offset < input_file->file_size) {
+    if (is_linked) {
+      // the next block's dictionary must stay mapped
+      const size_t first_needed_offset = state->input_offset - DICTIONARY_SIZE;
+
+      if (first_needed_offset > input_file->mapping_offset) {
+        io_state->input_mapping_first_unused_offset =
+            first_needed_offset - input_file->mapping_offset;
+      }
+    } else {
+      io_state->input_mapping_first_unused_offset =
+          state->input_offset - input_file->mapping_offset;
+    }
+
+    *finished = false;
+
+    return NULL_ERROR;
+  }
+
+  const size_t footer_size =
+      frame_info->contentChecksumFlag == LZ4F_contentChecksumEnabled ? 8 : 4;
+
+  if ((error = reserve_output_mapping(
+           output_file, io_state->output_mapping_first_unused_offset,
+           footer_size)),
+      error.what) {
+    return error;
+  }
+
+  unsigned char *const footer = (unsigned char *)output_file->mapping +
+                                io_state->output_mapping_first_unused_offset;
+  write_le32(footer, 0);
+
+  if (footer_size == 8) {
+    write_le32(footer + 4, xxh32_digest(&state->content_hash));
+  }
+
+  io_state->output_mapping_first_unused_offset += footer_size;
+  io_state->output_bytes_written += footer_size;
+  io_state->input_mapping_first_unused_offset = input_file->mapping_size;
+
+  *finished = true;
+
+  return NULL_ERROR;
+}
+
+static void compress_blocks(void *worker_v) {
+  assert(worker_v);
+
+  Worker *const worker = (Worker *)worker_v;
+  State *const state = worker->state;
+
+  while (true) {
+    pthread_mutex_lock(&state->blocks_mutex);
+    const size_t index = state->next_block_index;
+
+    if (index < state->num_blocks) {
+      ++state->next_block_index;
+    }
+
+    pthread_mutex_unlock(&state->blocks_mutex);
+
+    if (index >= state->num_blocks) {
+      return;
+    }
+
+    compress_block(worker, &state->blocks[index]);
+  }
+}
+
+static void compress_block(Worker *worker, Block *block) {
+  assert(worker);
+  assert(block);
+
+  const LZ4F_preferences_t *const preferences = &worker->state->preferences;
+  const int level = preferences->compressionLevel;
+  const int input_size = (int)block->input_size;
+  char *const data = (char *)block->output + 4;
+
+  // anything that doesn't shrink is stored uncompressed instead
+  const int max_compressed_size = input_size - 1;
+  int compressed_size = 0;
+
+  if (max_compressed_size > 0 && worker->stream_hc) {
+    if (block->uses_preset_dictionary) {
+      memcpy(worker->stream_hc, worker->state->dictionary_stream_hc,
+             sizeof(LZ4_streamHC_t));
+    } else {
+      LZ4_resetStreamHC(worker->stream_hc, level);
+
+      if (block->dictionary_size > 0) {
+        LZ4_loadDictHC(worker->stream_hc, block->dictionary,
+                       (int)block->dictionary_size);
+      }
+    }
+
+    compressed_size = LZ4_compress_HC_continue(
+        worker->stream_hc, block->input, data, input_size, max_compressed_size);
+  } else if (max_compressed_size > 0) {
+    // same mapping from level to acceleration as LZ4F
+    const int acceleration = (level < 0) ? -level + 1 : 1;
+
+    if (block->uses_preset_dictionary || block->dictionary_size > 0) {
+      if (block->uses_preset_dictionary) {
+        memcpy(worker->stream, worker->state->dictionary_stream,
+               sizeof(LZ4_stream_t));
+      } else {
+        LZ4_loadDict(worker->stream, block->dictionary,
+                     (int)block->dictionary_size);
+      }
+
+      compressed_size =
+          LZ4_compress_fast_continue(worker->stream, block->input, data,
+                                     input_size, max_compressed_size,
+                                     acceleration);
+    } else {
+      compressed_size = LZ4_compress_fast_extState(
+          worker->stream, block->input, data, input_size, max_compressed_size,
+          acceleration);
+    }
+  }
+
+  size_t stored_size;
+
+  if (compressed_size <= 0) {
+    memcpy(data, block->input, block->input_size);
+    write_le32(block->output,
+               (uint32_t)block->input_size | UNCOMPRESSED_BLOCK_FLAG);
+    stored_size = block->input_size;
+  } else {
+    write_le32(block->output, (uint32_t)compressed_size);
+    stored_size = (size_t)compressed_size;
+  }
+
+  block->output_size = 4 + stored_size;
+
+  if (preferences->frameInfo.blockChecksumFlag == LZ4F_blockChecksumEnabled) {
+    write_le32((unsigned char *)data + stored_size,
+               xxh32(data, stored_size, 0));
+    block->output_size += 4;
+  }
+
+  block->error = NULL_ERROR;
+}
+
+static void hash_content(void *state_v) {
+  assert(state_v);
+
+  State *const state = (State *)state_v;
+
+  xxh32_update(&state->content_hash, state->content_hash_input,
+               state->content_hash_input_size);
+}
+
+static size_t write_frame_header(unsigned char *output,
+                                 const LZ4F_preferences_t *preferences) {
+  assert(output);
+  assert(preferences);
+
+  const LZ4F_frameInfo_t *const frame_info = &preferences->frameInfo;
+  const bool has_content_size = frame_info->contentSize != 0;
+
+  LZ4F_blockSizeID_t block_size_id = frame_info->blockSizeID;
+
+  if (block_size_id == LZ4F_default) {
+    block_size_id = LZ4F_max64KB;
+  }
+
+  write_le32(output, LZ4F_MAGIC_NUMBER);
+
+  unsigned char *const descriptor = output + 4;
+  descriptor[0] =
+      (unsigned char)((1 << 6) |
+                      ((frame_info->blockMode == LZ4F_blockIndependent) << 5) |
+                      ((frame_info->blockChecksumFlag ==
+                        LZ4F_blockChecksumEnabled)
+                       << 4) |
+                      (has_content_size << 3) |
+                      ((frame_info->contentChecksumFlag ==
+                        LZ4F_contentChecksumEnabled)
+                       << 2));
+  descriptor[1] = (unsigned char)((block_size_id & 7) << 4);
+
+  size_t descriptor_size = 2;
+
+  if (has_content_size) {
+    for (size_t i = 0; i < 8; ++i) {
+      descriptor[2 + i] = (unsigned char)(frame_info->contentSize >> (8 * i));
+    }
+
+    descriptor_size += 8;
+  }
+
+  descriptor[descriptor_size] =
+      (unsigned char)(xxh32(descriptor, descriptor_size, 0) >> 8);
+
+  return 4 + descriptor_size + 1;
+}
+
+static size_t max_block_size_of(LZ4F_blockSizeID_t block_size_id) {
+  switch (block_size_id) {
+  case LZ4F_max256KB:
+    return (size_t)1 << 18;
+  case LZ4F_max1MB:
+    return (size_t)1 << 20;
+  case LZ4F_max4MB:
+    return (size_t)1 << 22;
+  default:
+    return (size_t)1 << 16;
+  }
+}
+
+static void write_le32(unsigned char *output, uint32_t value) {
+  output[0] = (unsigned char)value;
+  output[1] = (unsigned char)(value >> 8);
+  output[2] = (unsigned char)(value >> 16);
+  output[3] = (unsigned char)(value >> 24);
+}
@@ -19,23 +19,152 @@
 // SOFTWARE.
 
 #include <common/app.h>
+#include <common/argparse.h>
 #include <common/error.h>
 #include <common/mmc.h>
+#include <common/thread_pool.h>
+
+#include "frontends.h"
+#include "xxh32.h"
 
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <lz4.h>
 #include <lz4frame.h>
+#include <pthread.h>
+
+#define MIN(X, Y) (((Y) < (X)) ? (Y) : (X))
+
+// linked blocks can't refer back further than 64 KiB
+#define DICTIONARY_SIZE ((size_t)1 << 16)
+#define LZ4F_MAGIC_NUMBER 0x184D2204u
+#define SKIPPABLE_MAGIC_NUMBER 0x184D2A50u
+#define SKIPPABLE_MAGIC_NUMBER_MASK 0xFFFFFFF0u
+#define UNCOMPRESSED_BLOCK_FLAG 0x80000000u
+
+typedef struct Block {
+  const char *input;
+  size_t input_size;
+  bool is_compressed;
+  const char *checksum;
+
+  size_t output_offset;
+  size_t output_size;
+  char *output;
+
+  bool is_decoded;
+  Error error;
+} Block;
+
+typedef struct State {
+  ThreadCountArgumentParser threads_parser;
+  KeywordArgument threads;
+
+  PassthroughArgumentParser dictionary_parser;
+  KeywordArgument dictionary;
+
+  // loaded by prepare and shared by every copy of the state in batch mode.
+  // only the last 64 KiB of the file are kept
+  FileAndMapping dictionary_file;
+  const char *dictionary_data;
+  size_t dictionary_size;
 
-size_t size(size_t input_file_size, void *decompression_context_ptr_v);
-Error init(AppIOState *io_state, void *decompression_context_ptr_v);
-Error run(AppIOState *io_state, bool *finished,
-          void *decompression_context_ptr_v);
-void cleanup(AppIOState *io_state, void *decompression_context_ptr_v);
+  LZ4F_dctx *decompression_context;
 
+  // only used when decompressing with multiple threads or a dictionary
+  LZ4F_dctx *header_context;
+
+  // only used when decompressing with a dictionary. linked blocks are
+  // decoded with the 64 KiB of output before them, which is copied into
+  // history since the output may have been flushed since
+  bool is_in_dictionary_frame;
+  LZ4F_frameInfo_t frame_info;
+  uint64_t frame_output_size;
+  Xxh32State content_hash;
+  char *history;
+  const char *history_data;
+  size_t history_size;
+
+  // only used when decompressing with multiple threads. has_pool is set once
+  // pool and blocks_mutex are created
+  ThreadPool pool;
+  bool has_pool;
+  bool is_in_serial_frame;
+
+  pthread_mutex_t blocks_mutex;
+  Block *blocks;
+  size_t num_blocks;
+  size_t blocks_capacity;
+  size_t next_block_index;
+} State;
+
+static size_t size(const FileAndMapping *input_file, void *state_v);
+static Error init(AppIOState *io_state, void *state_v);
+static Error run(AppIOState *io_state, bool *finished, void *state_v);
+static void cleanup(AppIOState *io_state, void *state_v);
+static Error reset(AppIOState *io_state, void *state_v);
+static Error prepare(void *state_v);
+static void release(void *state_v);
+
+static Error run_serial(AppIOState *io_state, bool *frame_finished,
+                        State *state);
+static Error run_parallel(AppIOState *io_state, State *state);
+static Error decompress_dictionary_block(AppIOState *io_state, State *state);
+static Error finish_dictionary_frame(AppIOState *io_state, State *state);
+static void update_history(State *state, const char *output, size_t size);
+static Error decompress_frame(AppIOState *io_state, State *state,
+                              const LZ4F_frameInfo_t *frame_info,
+                              bool *is_decoded);
+static Error push_block(State *state, const Block *block);
+static void decompress_blocks(void *state_v);
+static void decompress_block(const State *state, Block *block);
+static size_t max_block_size_of(LZ4F_blockSizeID_t block_size_id);
+static uint32_t read_le32(const void *input);
+static uint64_t read_le64(const void *input);
+
+#ifndef MMC_MULTI_CALL
 int main(int argc, const char *const argv[]) {
-  LZ4F_dctx *decompression_context = NULL;
+  return lz4_decompress_main(argc, argv);
+}
+#endif
+
+int lz4_decompress_main(int argc, const char *const argv[]) {
+  State state = {
+      .threads_parser =
+          make_thread_count_parser("-t, --threads", "THREADS", 1024),
+      .threads = {.short_name = 't',
+                  .long_name = "threads",
+                  .help_text =
+                      "Number of threads to decompress with, or 'auto' to use "
+                      "one thread per online processor. An integer in the "
+                      "range [1, 1024]. If set, frames made of independent "
+                      "blocks are split at block boundaries and decompressed "
+                      "concurrently. Other frames are decompressed serially.",
+                  .parser = &state.threads_parser.argument_parser},
+
+      .dictionary_parser = make_passthrough_parser("-D, --dict", "FILE"),
+      .dictionary = {.short_name = 'D',
+                     .long_name = "dict",
+                     .help_text =
+                         "Dictionary that the input was compressed with, "
+                         "such as by mlc --dict or lz4 -D. Only its last 64 "
+                         "KiB are used. The file is mapped read-only once "
+                         "for every file decompressed with --batch.",
+                     .parser = &state.dictionary_parser.argument_parser},
+
+      .dictionary_data = NULL,
+      .dictionary_size = 0,
+      .decompression_context = NULL,
+      .header_context = NULL,
+      .history = NULL,
+  };
+
+  KeywordArgument *keyword_args[] = {&state.threads, &state.dictionary};
 
   return run_decompression_app(
       argc, argv,
@@ -48,50 +177,307 @@ int main(int argc, const char *const argv[]) {
               "compression algorithm. lz4 is used for decompression and "
               "memory-mapped files are used to read and write data to disk.",
 
+          .keyword_args = keyword_args,
+          .num_keyword_args = sizeof(keyword_args) / sizeof(keyword_args[0]),
+
           .size = size,
           .init = init,
           .run = run,
           .cleanup = cleanup,
-          .arg = &decompression_context,
+          .reset = reset,
+          .prepare = prepare,
+          .release = release,
+          .arg = &state,
+          .arg_size = sizeof(state),
       });
 }
 
-size_t size(size_t input_file_size, void *decompression_context_ptr_v) {
-  assert(decompression_context_ptr_v);
+// sums the content size in each frame header. frames without one are bounded
+// by their number of blocks, since no block decompresses to more than the
+// frame's maximum block size
+static size_t size(const FileAndMapping *input_file, void *state_v) {
+  assert(input_file);
+  assert(state_v);
+
+  (void)state_v;
+
+  const unsigned char *const input = (const unsigned char *)input_file->mapping;
+  const size_t input_size = input_file->file_size;
+
+  size_t offset = 0;
+  size_t output_size = 0;
+
+  while (input_size - offset >= 8) {
+    const uint32_t magic_number = read_le32(input + offset);
+
+    if ((magic_number & SKIPPABLE_MAGIC_NUMBER_MASK) ==
+        SKIPPABLE_MAGIC_NUMBER) {
+      const size_t frame_size = read_le32(input + offset + 4);
+
+      if (input_size - offset - 8 < frame_size) {
+        break;
+      }
+
+      offset += 8 + frame_size;
+
+      continue;
+    }
+
+    const size_t header_size =
+        LZ4F_headerSize(input + offset, input_size - offset);
+
+    if (magic_number != LZ4F_MAGIC_NUMBER || LZ4F_isError(header_size) ||
+        input_size - offset < header_size) {
+      break;
+    }
+
+    const unsigned char flags = input[offset + 4];
+    const unsigned block_size_id = (input[offset + 5] >> 4) & 7;
+    const bool has_content_size = flags & 0x08;
+    const size_t checksum_size = (flags & 0x10) ? 4 : 0;
+    const uint64_t content_size =
+        has_content_size ? read_le64(input + offset + 6) : 0;
+
+    offset += header_size;
+
+    size_t num_blocks = 0;
+    bool has_end_mark = false;
+
+    while (input_size - offset >= 4) {
+      const size_t block_size =
+          read_le32(input + offset) & ~UNCOMPRESSED_BLOCK_FLAG;
 
-  (void)decompression_context_ptr_v;
+      if (block_size == 0) {
+        offset += 4;
+        has_end_mark = true;
 
-  return input_file_size;
+        break;
+      } else if (input_size - offset - 4 < block_size + checksum_size) {
+        break;
+      }
+
+      offset += 4 + block_size + checksum_size;
+      ++num_blocks;
+    }
+
+    if (!has_end_mark) {
+      break;
+    }
+
+    if (flags & 0x04) {
+      offset += MIN(input_size - offset, (size_t)4);
+    }
+
+    const uint64_t frame_output_size =
+        has_content_size
+            ? content_size
+            : (uint64_t)num_blocks *
+                  max_block_size_of((LZ4F_blockSizeID_t)block_size_id);
+
+    if (frame_output_size > SIZE_MAX - output_size) {
+      return SIZE_MAX;
+    }
+
+    output_size += (size_t)frame_output_size;
+  }
+
+  // let the decoder find and report whatever stopped the scan
+  if (offset < input_size) {
+    output_size += input_size - offset;
+  }
+
+  return output_size;
 }
 
-Error init(AppIOState *io_state, void *decompression_context_ptr_v) {
+static Error init(AppIOState *io_state, void *state_v) {
   assert(io_state);
-  assert(decompression_context_ptr_v);
+  assert(state_v);
+
+  (void)io_state;
+
+  State *const state = (State *)state_v;
+
+  state->has_pool = false;
 
-  LZ4F_dctx **const decompression_context_ptr =
-      (LZ4F_dctx **)decompression_context_ptr_v;
+  LZ4F_errorCode_t errc = LZ4F_createDecompressionContext(
+      &state->decompression_context, LZ4F_VERSION);
 
-  const LZ4F_errorCode_t errc =
-      LZ4F_createDecompressionContext(decompression_context_ptr, LZ4F_VERSION);
+  if (!LZ4F_isError(errc) &&
+      (state->threads.was_found || state->dictionary_data)) {
+    errc = LZ4F_createDecompressionContext(&state->header_context,
+                                           LZ4F_VERSION);
+  }
 
   if (LZ4F_isError(errc)) {
     const char *const what = LZ4F_getErrorName(errc);
+    LZ4F_freeDecompressionContext(state->decompression_context);
+    state->decompression_context = NULL;
 
     return eformat("couldn't initialize decompression context: %s (%zu)", what,
                    errc);
   }
 
+  if (state->dictionary_data) {
+    state->history = malloc(DICTIONARY_SIZE);
+
+    if (!state->history) {
+      LZ4F_freeDecompressionContext(state->decompression_context);
+      LZ4F_freeDecompressionContext(state->header_context);
+      state->decompression_context = NULL;
+
+      return ERROR_OUT_OF_MEMORY;
+    }
+
+    state->is_in_dictionary_frame = false;
+  }
+
+  if (!state->threads.was_found) {
+    return NULL_ERROR;
+  }
+
+  const Error error =
+      create_thread_pool((size_t)state->threads_parser.value, &state->pool);
+
+  if (error.what) {
+    LZ4F_freeDecompressionContext(state->decompression_context);
+    LZ4F_freeDecompressionContext(state->header_context);
+    free(state->history);
+    state->decompression_context = NULL;
+
+    return error;
+  }
+
+  pthread_mutex_init(&state->blocks_mutex, NULL);
+  state->has_pool = true;
+
+  state->is_in_serial_frame = false;
+  state->blocks = NULL;
+  state->num_blocks = 0;
+  state->blocks_capacity = 0;
+
   return NULL_ERROR;
 }
 
-Error run(AppIOState *io_state, bool *finished,
-          void *decompression_context_ptr_v) {
+static Error run(AppIOState *io_state, bool *finished, void *state_v) {
   assert(io_state);
   assert(finished);
-  assert(decompression_context_ptr_v);
+  assert(state_v);
+
+  State *const state = (State *)state_v;
+  Error error;
+
+  if (state->threads.was_found || state->dictionary_data) {
+    error = run_parallel(io_state, state);
+  } else {
+    bool frame_finished;
+    error = run_serial(io_state, &frame_finished, state);
+  }
+
+  if (error.what) {
+    return error;
+  }
+
+  *finished = io_state->input_mapping_first_unused_offset ==
+              io_state->input_file.mapping_size;
+
+  return NULL_ERROR;
+}
+
+static void cleanup(AppIOState *io_state, void *state_v) {
+  assert(io_state);
+  assert(state_v);
+
+  (void)io_state;
+
+  State *const state = (State *)state_v;
+
+  if (state->has_pool) {
+    free_thread_pool(&state->pool);
+    pthread_mutex_destroy(&state->blocks_mutex);
+    free(state->blocks);
+  }
+
+  if (state->decompression_context) {
+    LZ4F_freeDecompressionContext(state->header_context);
+    free(state->history);
+  }
+
+  LZ4F_freeDecompressionContext(state->decompression_context);
+}
+
+static Error reset(AppIOState *io_state, void *state_v) {
+  assert(io_state);
+  assert(state_v);
+
+  (void)io_state;
+
+  State *const state = (State *)state_v;
 
-  LZ4F_dctx **const decompression_context_ptr =
-      (LZ4F_dctx **)decompression_context_ptr_v;
+  LZ4F_resetDecompressionContext(state->decompression_context);
+
+  if (state->header_context) {
+    LZ4F_resetDecompressionContext(state->header_context);
+
+    state->is_in_serial_frame = false;
+  }
+
+  if (state->threads.was_found) {
+    state->num_blocks = 0;
+  }
+
+  if (state->dictionary_data) {
+    state->is_in_dictionary_frame = false;
+  }
+
+  return NULL_ERROR;
+}
+
+static Error prepare(void *state_v) {
+  assert(state_v);
+
+  State *const state = (State *)state_v;
+
+  if (!state->dictionary.was_found) {
+    return NULL_ERROR;
+  }
+
+  const Error error = open_and_map_file(state->dictionary_parser.value,
+                                        &state->dictionary_file);
+
+  if (error.what) {
+    return error;
+  }
+
+  state->dictionary_size =
+      MIN(state->dictionary_file.file_size, DICTIONARY_SIZE);
+  state->dictionary_data = (const char *)state->dictionary_file.mapping +
+                           state->dictionary_file.file_size -
+                           state->dictionary_size;
+
+  return NULL_ERROR;
+}
+
+static void release(void *state_v) {
+  assert(state_v);
+
+  State *const state = (State *)state_v;
+
+  if (!state->dictionary_data) {
+    return;
+  }
+
+  const Error error = free_file(state->dictionary_file);
+
+  if (error.what) {
+    print_warning(error);
+  }
+}
+
+static Error run_serial(AppIOState *io_state, bool *frame_finished,
+                        State *state) {
+  assert(io_state);
+  assert(frame_finished);
+  assert(state);
 
   size_t input_unused_length_or_bytes_consumed =
       io_state->input_file.mapping_size -
@@ -100,7 +486,7 @@ Error run(AppIOState *io_state, bool *finished,
       io_state->output_file.mapping_size -
       io_state->output_mapping_first_unused_offset;
   const size_t maybe_decompress_errc =
-      LZ4F_decompress(*decompression_context_ptr,
+      LZ4F_decompress(state->decompression_context,
                       (char *)io_state->output_file.mapping +
                           io_state->output_mapping_first_unused_offset,
                       &output_unused_length_or_bytes_consumed,
@@ -121,18 +507,495 @@ Error run(AppIOState *io_state, bool *finished,
       output_unused_length_or_bytes_consumed;
   io_state->output_bytes_written += output_unused_length_or_bytes_consumed;
 
-  *finished = io_state->input_mapping_first_unused_offset ==
-              io_state->input_file.mapping_size;
+  // LZ4F_decompress returns 0 once it has reached the end of a frame
+  *frame_finished = maybe_decompress_errc == 0;
+
+  return NULL_ERROR;
+}
+
+// decodes at most one frame per call; frames that can't be split into
+// independent blocks are handed to LZ4F_decompress, or decoded one block per
+// call if there is a dictionary
+static Error run_parallel(AppIOState *io_state, State *state) {
+  assert(io_state);
+  assert(state);
+
+  if (state->is_in_dictionary_frame) {
+    return decompress_dictionary_block(io_state, state);
+  }
+
+  if (!state->is_in_serial_frame) {
+    const size_t frame_offset = io_state->input_mapping_first_unused_offset;
+    size_t header_size = io_state->input_file.mapping_size - frame_offset;
+    LZ4F_frameInfo_t frame_info;
+
+    // LZ4F_getFrameInfo leaves the context it reads with stale frame
+    // information that LZ4F_decompress trips over, so it gets its own
+    LZ4F_resetDecompressionContext(state->header_context);
+    const size_t errc = LZ4F_getFrameInfo(
+        state->header_context, &frame_info,
+        (const char *)io_state->input_file.mapping + frame_offset,
+        &header_size);
+
+    if (LZ4F_isError(errc)) {
+      const char *const what = LZ4F_getErrorName(errc);
+
+      return eformat("couldn't read frame header: %s (%zu)", what, errc);
+    }
+
+    if (state->threads.was_found && frame_info.frameType == LZ4F_frame &&
+        frame_info.blockMode == LZ4F_blockIndependent &&
+        frame_info.contentSize > 0 &&
+        (frame_info.dictID == 0 || state->dictionary_data)) {
+      io_state->input_mapping_first_unused_offset += header_size;
+
+      bool is_decoded;
+      const Error error =
+          decompress_frame(io_state, state, &frame_info, &is_decoded);
+
+      if (error.what) {
+        return error;
+      }
+
+      if (is_decoded) {
+        return NULL_ERROR;
+      }
+
+      // let the serial decoder find and report whatever is wrong with this
+      // frame
+      io_state->input_mapping_first_unused_offset = frame_offset;
+    }
+
+    // skippable frames don't need the dictionary
+    if (state->dictionary_data && frame_info.frameType == LZ4F_frame) {
+      io_state->input_mapping_first_unused_offset += header_size;
+
+      state->is_in_dictionary_frame = true;
+      state->frame_info = frame_info;
+      state->frame_output_size = 0;
+      state->history_data = state->dictionary_data;
+      state->history_size = state->dictionary_size;
+      xxh32_reset(&state->content_hash, 0);
+
+      return NULL_ERROR;
+    }
+
+    state->is_in_serial_frame = true;
+  }
+
+  bool frame_finished;
+  const Error error = run_serial(io_state, &frame_finished, state);
+
+  if (error.what) {
+    return error;
+  }
+
+  if (frame_finished) {
+    state->is_in_serial_frame = false;
+  }
 
   return NULL_ERROR;
 }
 
-void cleanup(AppIOState *io_state, void *decompression_context_ptr_v) {
+// the LZ4F functions that take a dictionary aren't exported by shared builds
+// of liblz4, so frames are decoded here one block per call instead. the first
+// block of a frame is decoded with the dictionary. every other block is too if
+// blocks are independent, and with the output before it if they are linked
+static Error decompress_dictionary_block(AppIOState *io_state, State *state) {
   assert(io_state);
-  assert(decompression_context_ptr_v);
+  assert(state);
+
+  const FileAndMapping *const input_file = &io_state->input_file;
+  const char *const input = (const char *)input_file->mapping +
+                            io_state->input_mapping_first_unused_offset;
+  const size_t available =
+      input_file->mapping_size - io_state->input_mapping_first_unused_offset;
+
+  if (available < 4) {
+    return eformat("input file '%s' ends in the middle of a frame",
+                   input_file->filename);
+  }
+
+  const uint32_t block_header = read_le32(input);
+
+  if (block_header == 0) {
+    return finish_dictionary_frame(io_state, state);
+  }
+
+  const LZ4F_frameInfo_t *const frame_info = &state->frame_info;
+  const size_t input_size = block_header & ~UNCOMPRESSED_BLOCK_FLAG;
+  const size_t max_block_size = max_block_size_of(frame_info->blockSizeID);
+  const size_t checksum_size =
+      frame_info->blockChecksumFlag == LZ4F_blockChecksumEnabled ? 4 : 0;
+  const char *const block_input = input + 4;
+
+  if (input_size > max_block_size ||
+      available - 4 < input_size + checksum_size) {
+    return eformat("block at offset %zu of input file '%s' is corrupted",
+                   input_file->mapping_offset +
+                       io_state->input_mapping_first_unused_offset,
+                   input_file->filename);
+  }
+
+  if (checksum_size > 0 && xxh32(block_input, input_size, 0) !=
+                               read_le32(block_input + input_size)) {
+    return STATIC_ERROR("block checksum mismatch");
+  }
+
+  FileAndMapping *const output_file = &io_state->output_file;
+  const Error error = reserve_output_mapping(
+      output_file, io_state->output_mapping_first_unused_offset,
+      max_block_size);
+
+  if (error.what) {
+    return error;
+  }
+
+  char *const output = (char *)output_file->mapping +
+                       io_state->output_mapping_first_unused_offset;
+  size_t output_size;
+
+  if (block_header & UNCOMPRESSED_BLOCK_FLAG) {
+    memcpy(output, block_input, input_size);
+    output_size = input_size;
+  } else {
+    const int decompressed_size = LZ4_decompress_safe_usingDict(
+        block_input, output, (int)input_size, (int)max_block_size,
+        state->history_data, (int)state->history_size);
+
+    if (decompressed_size < 0) {
+      return eformat("couldn't decompress block at offset %zu of input file "
+                     "'%s'",
+                     input_file->mapping_offset +
+                         io_state->input_mapping_first_unused_offset,
+                     input_file->filename);
+    }
+
+    output_size = (size_t)decompressed_size;
+  }
+
+  if (frame_info->contentChecksumFlag == LZ4F_contentChecksumEnabled) {
+    xxh32_update(&state->content_hash, output, output_size);
+  }
+
+  if (frame_info->blockMode == LZ4F_blockLinked) {
+    update_history(state, output, output_size);
+  }
+
+  state->frame_output_size += output_size;
+
+  io_state->input_mapping_first_unused_offset += 4 + input_size + checksum_size;
+  io_state->output_mapping_first_unused_offset += output_size;
+  io_state->output_bytes_written += output_size;
+
+  return NULL_ERROR;
+}
+
+// checks the end mark's content checksum and the content size, if the frame
+// has them
+static Error finish_dictionary_frame(AppIOState *io_state, State *state) {
+  assert(io_state);
+  assert(state);
+
+  const FileAndMapping *const input_file = &io_state->input_file;
+  const char *const input = (const char *)input_file->mapping +
+                            io_state->input_mapping_first_unused_offset;
+  const size_t available =
+      input_file->mapping_size - io_state->input_mapping_first_unused_offset;
+  const LZ4F_frameInfo_t *const frame_info = &state->frame_info;
+
+  size_t end_mark_size = 4;
+
+  if (frame_info->contentChecksumFlag == LZ4F_contentChecksumEnabled) {
+    end_mark_size += 4;
+
+    if (available < end_mark_size) {
+      return eformat("input file '%s' ends in the middle of a frame",
+                     input_file->filename);
+    } else if (xxh32_digest(&state->content_hash) != read_le32(input + 4)) {
+      return STATIC_ERROR("content checksum mismatch");
+    }
+  }
+
+  if (frame_info->contentSize > 0 &&
+      frame_info->contentSize != state->frame_output_size) {
+    return eformat("frame decompressed to %llu bytes, but its header says "
+                   "%llu",
+                   (unsigned long long)state->frame_output_size,
+                   (unsigned long long)frame_info->contentSize);
+  }
+
+  io_state->input_mapping_first_unused_offset += end_mark_size;
+  state->is_in_dictionary_frame = false;
+
+  return NULL_ERROR;
+}
+
+// keeps the last 64 KiB of the dictionary and output for the next linked block
+static void update_history(State *state, const char *output, size_t size) {
+  assert(state);
+  assert(output);
+
+  if (size >= DICTIONARY_SIZE) {
+    memcpy(state->history, output + size - DICTIONARY_SIZE, DICTIONARY_SIZE);
+    state->history_size = DICTIONARY_SIZE;
+  } else {
+    const size_t kept = MIN(state->history_size, DICTIONARY_SIZE - size);
+
+    memmove(state->history, state->history_data + state->history_size - kept,
+            kept);
+    memcpy(state->history + kept, output, size);
+    state->history_size = kept + size;
+  }
+
+  state->history_data = state->history;
+}
+
+// every block but the last decompresses to exactly the maximum block size,
+// so each block's position in the output is known before it is decoded.
+// *is_decoded is false if the frame doesn't fit that layout
+static Error decompress_frame(AppIOState *io_state, State *state,
+                              const LZ4F_frameInfo_t *frame_info,
+                              bool *is_decoded) {
+  assert(io_state);
+  assert(state);
+  assert(frame_info);
+  assert(is_decoded);
+
+  *is_decoded = false;
+
+  const FileAndMapping *const input_file = &io_state->input_file;
+  const char *const input_end =
+      (const char *)input_file->mapping + input_file->mapping_size;
+  const char *input = (const char *)input_file->mapping +
+                      io_state->input_mapping_first_unused_offset;
+
+  if (frame_info->contentSize > SIZE_MAX) {
+    return NULL_ERROR;
+  }
+
+  const size_t content_size = (size_t)frame_info->contentSize;
+  const size_t max_block_size = max_block_size_of(frame_info->blockSizeID);
+  const size_t checksum_size =
+      frame_info->blockChecksumFlag == LZ4F_blockChecksumEnabled ? 4 : 0;
+
+  state->num_blocks = 0;
+  size_t output_offset = 0;
+
+  while (true) {
+    if (input_end - input < 4) {
+      return NULL_ERROR;
+    }
+
+    const uint32_t block_header = read_le32(input);
+    input += 4;
+
+    if (block_header == 0) {
+      break;
+    }
+
+    const size_t input_size = block_header & ~UNCOMPRESSED_BLOCK_FLAG;
+
+    if (input_size > max_block_size ||
+        (size_t)(input_end - input) < input_size + checksum_size ||
+        output_offset >= content_size) {
+      return NULL_ERROR;
+    }
+
+    const Block block = {
+        .input = input,
+        .input_size = input_size,
+        .is_compressed = !(block_header & UNCOMPRESSED_BLOCK_FLAG),
+        .checksum = checksum_size > 0 ? input + input_size : NULL,
+
+        .output_offset = output_offset,
+        .output_size = MIN(content_size - output_offset, max_block_size),
+    };
+
+    const Error error = push_block(state, &block);
+
+    if (error.what) {
+      return error;
+    }
+
+    input += input_size + checksum_size;
+    output_offset += block.output_size;
+  }
+
+  const bool has_content_checksum =
+      frame_info->contentChecksumFlag == LZ4F_contentChecksumEnabled;
+
+  if (output_offset != content_size ||
+      (has_content_checksum && input_end - input < 4)) {
+    return NULL_ERROR;
+  }
+
+  FileAndMapping *const output_file = &io_state->output_file;
+  Error error = reserve_output_mapping(
+      output_file, io_state->output_mapping_first_unused_offset, content_size);
+
+  if (error.what) {
+    return error;
+  }
+
+  char *const output = (char *)output_file->mapping +
+                       io_state->output_mapping_first_unused_offset;
+
+  for (size_t i = 0; i < state->num_blocks; ++i) {
+    state->blocks[i].output = output + state->blocks[i].output_offset;
+  }
+
+  state->next_block_index = 0;
+
+  const size_t num_tasks = MIN((size_t)state->threads_parser.value,
+                               state->num_blocks);
+
+  for (size_t i = 0; i < num_tasks && !error.what; ++i) {
+    error = submit_task(&state->pool, decompress_blocks, state);
+  }
+
+  wait_for_tasks(&state->pool);
+
+  if (error.what) {
+    return error;
+  }
+
+  for (size_t i = 0; i < state->num_blocks; ++i) {
+    if (state->blocks[i].error.what) {
+      if (error.what) {
+        print_error(error);
+      }
+
+      error = state->blocks[i].error;
+    } else if (!state->blocks[i].is_decoded) {
+      return NULL_ERROR;
+    }
+  }
+
+  if (error.what) {
+    return error;
+  }
+
+  if (has_content_checksum) {
+    if (xxh32(output, content_size, 0) != read_le32(input)) {
+      return STATIC_ERROR("content checksum mismatch");
+    }
+
+    input += 4;
+  }
+
+  io_state->input_mapping_first_unused_offset =
+      (size_t)(input - (const char *)input_file->mapping);
+  io_state->output_mapping_first_unused_offset += content_size;
+  io_state->output_bytes_written += content_size;
+
+  *is_decoded = true;
+
+  return NULL_ERROR;
+}
+
+static Error push_block(State *state, const Block *block) {
+  assert(state);
+  assert(block);
+
+  if (state->num_blocks == state->blocks_capacity) {
+    const size_t new_capacity =
+        state->blocks_capacity > 0 ? state->blocks_capacity * 2 : 64;
+    Block *const new_blocks =
+        realloc(state->blocks, new_capacity * sizeof(Block));
+
+    if (!new_blocks) {
+      return ERROR_OUT_OF_MEMORY;
+    }
+
+    state->blocks = new_blocks;
+    state->blocks_capacity = new_capacity;
+  }
+
+  state->blocks[state->num_blocks] = *block;
+  ++state->num_blocks;
+
+  return NULL_ERROR;
+}
+
+static void decompress_blocks(void *state_v) {
+  assert(state_v);
+
+  State *const state = (State *)state_v;
+
+  while (true) {
+    pthread_mutex_lock(&state->blocks_mutex);
+    const size_t index = state->next_block_index;
+
+    if (index < state->num_blocks) {
+      ++state->next_block_index;
+    }
+
+    pthread_mutex_unlock(&state->blocks_mutex);
+
+    if (index >= state->num_blocks) {
+      return;
+    }
+
+    decompress_block(state, &state->blocks[index]);
+  }
+}
+
+static void decompress_block(const State *state, Block *block) {
+  assert(state);
+  assert(block);
+
+  block->is_decoded = false;
+  block->error = NULL_ERROR;
+
+  if (block->checksum &&
+      xxh32(block->input, block->input_size, 0) != read_le32(block->checksum)) {
+    block->error = STATIC_ERROR("block checksum mismatch");
+
+    return;
+  }
+
+  if (!block->is_compressed) {
+    if (block->input_size == block->output_size) {
+      memcpy(block->output, block->input, block->input_size);
+      block->is_decoded = true;
+    }
+
+    return;
+  }
+
+  // without a dictionary, this is the same as LZ4_decompress_safe
+  const int decompressed_size = LZ4_decompress_safe_usingDict(
+      block->input, block->output, (int)block->input_size,
+      (int)block->output_size, state->dictionary_data,
+      (int)state->dictionary_size);
+
+  block->is_decoded =
+      decompressed_size >= 0 && (size_t)decompressed_size == block->output_size;
+}
+
+static size_t max_block_size_of(LZ4F_blockSizeID_t block_size_id) {
+  switch (block_size_id) {
+  case LZ4F_max256KB:
+    return (size_t)1 << 18;
+  case LZ4F_max1MB:
+    return (size_t)1 << 20;
+  case LZ4F_max4MB:
+    return (size_t)1 << 22;
+  default:
+    return (size_t)1 << 16;
+  }
+}
+
+static uint32_t read_le32(const void *input) {
+  const unsigned char *const bytes = (const unsigned char *)input;
+
+  return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) |
+         ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
 
-  LZ4F_dctx **const decompression_context_ptr =
-      (LZ4F_dctx **)decompression_context_ptr_v;
+static uint64_t read_le64(const void *input) {
+  const unsigned char *const bytes = (const unsigned char *)input;
 
-  LZ4F_freeDecompressionContext(*decompression_context_ptr);
+  return (uint64_t)read_le32(bytes) | ((uint64_t)read_le32(bytes + 4) << 32);
 }
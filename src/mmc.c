@@ -0,0 +1,407 @@
+// Copyright (c) 2019 Gregory Meyer
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <common/error.h>
+#include <common/file.h>
+#include <common/mmc.h>
+
+#include "frontends.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define ZSTD_MAGIC 0xfd2fb528
+#define LZ4_MAGIC 0x184d2204
+// zstd and lz4 share skippable frames, whose magic numbers are
+// 0x184d2a50 through 0x184d2a5f
+#define SKIPPABLE_MAGIC 0x184d2a50
+#define SKIPPABLE_MAGIC_MASK 0xfffffff0
+#define SKIPPABLE_HEADER_SIZE 8
+
+typedef int(FrontendMain)(int argc, const char *const argv[]);
+
+typedef struct Frontend {
+  const char *name;
+  const char *long_name;
+  const char *description;
+  FrontendMain *main;
+} Frontend;
+
+static const Frontend FRONTENDS[] = {
+#ifdef MMC_HAS_ZLIB
+    {"md", "mmap-deflate", "compress to zlib", deflate_main},
+    {"mi", "mmap-inflate", "decompress zlib or gzip", inflate_main},
+#endif
+#ifdef MMC_HAS_LZ4
+    {"mlc", "mmap-lz4-compress", "compress to lz4", lz4_compress_main},
+    {"mld", "mmap-lz4-decompress", "decompress lz4", lz4_decompress_main},
+#endif
+#ifdef MMC_HAS_ZSTD
+    {"mzc", "mmap-zstd-compress", "compress to zstd", zstd_compress_main},
+    {"mzd", "mmap-zstd-decompress", "decompress zstd", zstd_decompress_main},
+    {"mzt", "mmap-zstd-train", "train a zstd dictionary", zstd_train_main},
+#endif
+};
+
+#define NUM_FRONTENDS (sizeof(FRONTENDS) / sizeof(FRONTENDS[0]))
+
+// long options of the driver in app.c that don't take a value, or only take
+// one after '='
+static const char *const FLAGS[] = {
+    "direct", "huge-pages",    "prefault", "fault-stats",
+    "stats",  "perf-counters", "batch",    "bench",
+};
+
+#define NUM_FLAGS (sizeof(FLAGS) / sizeof(FLAGS[0]))
+
+static const Frontend *find_frontend(const char *name);
+static int print_usage(void);
+static int decompress(int argc, const char *const argv[]);
+static const char *find_input_filename(int argc, const char *const argv[],
+                                       bool *is_batch, bool *has_help);
+static bool is_flag(const char *long_name);
+static Error detect_decompressor(const char *filename,
+                                 const Frontend **frontend);
+static Error map_input(const char *filename, FileAndMapping *file);
+static Error unmap_input(FileAndMapping file);
+static const char *detect_format(const unsigned char *data, size_t size,
+                                 const char **decompressor_name);
+static uint32_t read_le32(const unsigned char *data);
+
+int main(int argc, const char *const argv[]) {
+  executable_name = argv[0];
+
+  // invoked through a link named after one of the frontends
+  const char *const last_slash = strrchr(argv[0], '/');
+  const Frontend *frontend =
+      find_frontend(last_slash ? last_slash + 1 : argv[0]);
+
+  if (frontend) {
+    return frontend->main(argc, argv);
+  }
+
+  if (argc < 2) {
+    print_error(STATIC_ERROR("missing required argument COMMAND, see --help"));
+
+    return EXIT_FAILURE;
+  }
+
+  const char *const command = argv[1];
+
+  if (strcmp(command, "-h") == 0 || strcmp(command, "--help") == 0) {
+    return print_usage() < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  } else if (strcmp(command, "-v") == 0 || strcmp(command, "--version") == 0) {
+    return printf("mmc %s\n", MMC_VERSION) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  } else if (strcmp(command, "decompress") == 0) {
+    return decompress(argc - 1, argv + 1);
+  }
+
+  frontend = find_frontend(command);
+
+  if (!frontend) {
+    print_error(eformat("unknown command '%s', see --help", command));
+
+    return EXIT_FAILURE;
+  }
+
+  return frontend->main(argc - 1, argv + 1);
+}
+
+static const Frontend *find_frontend(const char *name) {
+  assert(name);
+
+  for (size_t i = 0; i < NUM_FRONTENDS; ++i) {
+    if (strcmp(name, FRONTENDS[i].name) == 0 ||
+        strcmp(name, FRONTENDS[i].long_name) == 0) {
+      return &FRONTENDS[i];
+    }
+  }
+
+  return NULL;
+}
+
+static int print_usage(void) {
+  if (printf("mmc %s\n%s\n\nmmc is every frontend of mmc in one executable. "
+             "Run it as mmc COMMAND, or\nthrough a link named after a "
+             "frontend such as 'ln -s mmc mzd', so that all of\nthem share "
+             "one copy of their code in the page cache.\n\nUSAGE:\n    %s "
+             "COMMAND [ARGS...]\n\nCOMMANDS:",
+             MMC_VERSION, MMC_AUTHOR, executable_name) < 0) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < NUM_FRONTENDS; ++i) {
+    if (printf("\n    %-4s %-21s %s", FRONTENDS[i].name,
+               FRONTENDS[i].long_name, FRONTENDS[i].description) < 0) {
+      return -1;
+    }
+  }
+
+  if (printf("\n    %-26s %s\n\nRun COMMAND --help for its options. "
+             "decompress takes the options of mi, mld\nand mzd and picks "
+             "one of them by the magic bytes at the start of its input.\n",
+             "decompress", "decompress any of the above") < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int decompress(int argc, const char *const argv[]) {
+  assert(argv);
+
+  bool is_batch = false;
+  bool has_help = false;
+  const char *const filename =
+      find_input_filename(argc, argv, &is_batch, &has_help);
+
+  if (has_help) {
+    return print_usage() < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  } else if (is_batch) {
+    print_error(STATIC_ERROR("can't detect the format of files in --batch "
+                             "mode, use mi, mld or mzd"));
+
+    return EXIT_FAILURE;
+  } else if (!filename) {
+    print_error(
+        STATIC_ERROR("missing required positional argument INPUT_FILE"));
+
+    return EXIT_FAILURE;
+  }
+
+  const Frontend *frontend;
+  const Error error = detect_decompressor(filename, &frontend);
+
+  if (error.what) {
+    print_error(error);
+
+    return EXIT_FAILURE;
+  }
+
+  const char *frontend_argv[argc + 1];
+  frontend_argv[0] = frontend->name;
+  memcpy(frontend_argv + 1, argv + 1, (size_t)argc * sizeof(const char *));
+
+  return frontend->main(argc, frontend_argv);
+}
+
+// returns NULL if there is no input file to be found, or --batch was given.
+// -h, -v, --help and --version all set has_help
+static const char *find_input_filename(int argc, const char *const argv[],
+                                       bool *is_batch, bool *has_help) {
+  assert(argv);
+  assert(is_batch);
+  assert(has_help);
+
+  const char *filename = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    const char *const arg = argv[i];
+
+    if (strcmp(arg, "--") == 0) {
+      if (!filename && i + 1 < argc) {
+        filename = argv[i + 1];
+      }
+
+      break;
+    } else if (arg[0] != '-' || arg[1] == '\0') {
+      if (!filename) {
+        filename = arg;
+      }
+    } else if (arg[1] != '-') {
+      // -kvalue and -k=value carry their value, -h and -v take none
+      if (arg[2] == '\0' && (arg[1] == 'h' || arg[1] == 'v')) {
+        *has_help = true;
+      } else if (arg[2] == '\0') {
+        ++i;
+      }
+    } else if (!strchr(arg, '=')) {
+      if (strcmp(arg + 2, "batch") == 0) {
+        *is_batch = true;
+      } else if (strcmp(arg + 2, "help") == 0 ||
+                 strcmp(arg + 2, "version") == 0) {
+        *has_help = true;
+      } else if (!is_flag(arg + 2)) {
+        ++i;
+      }
+    }
+  }
+
+  return *is_batch ? NULL : filename;
+}
+
+static bool is_flag(const char *long_name) {
+  assert(long_name);
+
+  for (size_t i = 0; i < NUM_FLAGS; ++i) {
+    if (strcmp(long_name, FLAGS[i]) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static Error detect_decompressor(const char *filename,
+                                 const Frontend **frontend) {
+  assert(filename);
+  assert(frontend);
+
+  FileAndMapping file;
+  Error error = map_input(filename, &file);
+
+  if (error.what) {
+    return error;
+  }
+
+  const char *decompressor_name;
+  const char *const format =
+      detect_format(file.mapping, file.file_size, &decompressor_name);
+
+  error = unmap_input(file);
+
+  if (error.what) {
+    return error;
+  }
+
+  if (!format) {
+    return eformat("couldn't detect the format of input file '%s'", filename);
+  }
+
+  *frontend = find_frontend(decompressor_name);
+
+  if (!*frontend) {
+    return eformat("input file '%s' is %s, but mmc was built without %s",
+                   filename, format, decompressor_name);
+  }
+
+  return NULL_ERROR;
+}
+
+// a pipe can only be read once, so stdin is pointed at its spooled copy for
+// the decompressor to map again
+static Error map_input(const char *filename, FileAndMapping *file) {
+  assert(filename);
+  assert(file);
+
+  if (strcmp(filename, "-") != 0) {
+    return open_and_map_file(filename, file);
+  }
+
+  const Error error = open_and_map_stdin(file);
+
+  if (error.what) {
+    return error;
+  }
+
+  if (file->fd != STDIN_FILENO && dup2(file->fd, STDIN_FILENO) == -1) {
+    const Error dup_error =
+        ERRNO_EFORMAT("couldn't redirect '%s'", file->filename);
+    free_file(*file);
+
+    return dup_error;
+  }
+
+  return NULL_ERROR;
+}
+
+static Error unmap_input(FileAndMapping file) {
+  if (file.fd != STDIN_FILENO) {
+    return free_file(file);
+  }
+
+  if (munmap(file.mapping, file.mapping_size) == -1) {
+    return ERRNO_EFORMAT("couldn't unmap file '%s' from memory", file.filename);
+  }
+
+  return NULL_ERROR;
+}
+
+// returns NULL if the format isn't known
+static const char *detect_format(const unsigned char *data, size_t size,
+                                 const char **decompressor_name) {
+  assert(data);
+  assert(decompressor_name);
+
+  size_t offset = 0;
+
+  while (size - offset >= SKIPPABLE_HEADER_SIZE &&
+         (read_le32(data + offset) & SKIPPABLE_MAGIC_MASK) ==
+             SKIPPABLE_MAGIC) {
+    const size_t frame_size = read_le32(data + offset + 4);
+
+    if (frame_size > size - offset - SKIPPABLE_HEADER_SIZE) {
+      return NULL;
+    }
+
+    offset += SKIPPABLE_HEADER_SIZE + frame_size;
+  }
+
+  const unsigned char *const start = data + offset;
+  const size_t remaining = size - offset;
+
+  if (offset > 0 && remaining == 0) {
+    // nothing but skippable frames, which mzd passes over
+    *decompressor_name = "mzd";
+
+    return "zstd";
+  } else if (remaining >= 4 && read_le32(start) == ZSTD_MAGIC) {
+    *decompressor_name = "mzd";
+
+    return "zstd";
+  } else if (remaining >= 4 && read_le32(start) == LZ4_MAGIC) {
+    *decompressor_name = "mld";
+
+    return "lz4";
+  } else if (offset > 0 || remaining < 2) {
+    return NULL;
+  } else if (start[0] == 0x1f && start[1] == 0x8b) {
+    *decompressor_name = "mi";
+
+    return "gzip";
+  }
+
+  // CM is 8 (deflate), CINFO is at most 7 (a 32 KiB window) and the first two
+  // bytes are a multiple of 31
+  const unsigned int header = ((unsigned int)start[0] << 8) | start[1];
+
+  if ((start[0] & 0x0f) == 8 && (start[0] >> 4) <= 7 && header % 31 == 0) {
+    *decompressor_name = "mi";
+
+    return "zlib";
+  }
+
+  return NULL;
+}
+
+static uint32_t read_le32(const unsigned char *data) {
+  assert(data);
+
+  return (uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+         ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
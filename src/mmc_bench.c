@@ -0,0 +1,1524 @@
+// Copyright (c) 2019 Gregory Meyer
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <common/argparse.h>
+#include <common/error.h>
+#include <common/file.h>
+#include <common/mmc.h>
+
+#include "frontends.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if !defined(MMC_HAS_ZLIB) && !defined(MMC_HAS_LZ4) && !defined(MMC_HAS_ZSTD)
+#error "mmc_bench needs at least one codec"
+#endif
+
+#define DEFAULT_RUNS 10
+#define DEFAULT_THRESHOLD_PERCENT 5
+// one-sided p < 0.01 under the normal approximation of the Mann-Whitney U
+// statistic
+#define SIGNIFICANT_Z_SCORE 2.326
+#define MAX_ARGS 16
+
+typedef int(FrontendMain)(int argc, const char *const argv[]);
+
+typedef struct Codec {
+  const char *compressor_name;
+  const char *decompressor_name;
+  FrontendMain *compress;
+  FrontendMain *decompress;
+  const char *const *levels;
+  size_t num_levels;
+} Codec;
+
+#ifdef MMC_HAS_ZLIB
+static const char *const DEFLATE_LEVELS[] = {"1", "6", "9"};
+#endif
+
+#ifdef MMC_HAS_LZ4
+static const char *const LZ4_LEVELS[] = {"1", "9", "12"};
+#endif
+
+#ifdef MMC_HAS_ZSTD
+static const char *const ZSTD_LEVELS[] = {"1", "3", "19"};
+#endif
+
+static const Codec CODECS[] = {
+#ifdef MMC_HAS_ZLIB
+    {"md", "mi", deflate_main, inflate_main, DEFLATE_LEVELS,
+     sizeof(DEFLATE_LEVELS) / sizeof(DEFLATE_LEVELS[0])},
+#endif
+#ifdef MMC_HAS_LZ4
+    {"mlc", "mld", lz4_compress_main, lz4_decompress_main, LZ4_LEVELS,
+     sizeof(LZ4_LEVELS) / sizeof(LZ4_LEVELS[0])},
+#endif
+#ifdef MMC_HAS_ZSTD
+    {"mzc", "mzd", zstd_compress_main, zstd_decompress_main, ZSTD_LEVELS,
+     sizeof(ZSTD_LEVELS) / sizeof(ZSTD_LEVELS[0])},
+#endif
+};
+
+#define NUM_CODECS (sizeof(CODECS) / sizeof(CODECS[0]))
+
+// where the output of each run goes. memory is --bench-output=memory, and the
+// rest are --io backends writing to a file with --bench-output=file
+static const char *const OUTPUTS[] = {"memory", "mmap", "pwrite", "io_uring"};
+
+#define NUM_OUTPUTS (sizeof(OUTPUTS) / sizeof(OUTPUTS[0]))
+
+typedef struct Result {
+  char *file;
+  char *codec;
+  char *operation;
+  long long level;
+  char *output;
+
+  long long input_bytes;
+  long long output_bytes;
+  double ratio;
+  double min_seconds;
+  double median_seconds;
+  double p99_seconds;
+  double megabytes_per_second;
+
+  // of the whole process, including startup and the untimed run
+  long long peak_rss_kib;
+  // of one run: the difference between processes doing one and two runs
+  long long minor_faults;
+  long long major_faults;
+  long long syscalls; // -1 if they couldn't be counted
+
+  double *seconds;
+  size_t num_seconds;
+} Result;
+
+typedef struct Bench {
+  long long num_runs;
+  char *compressed_filename;
+  char *decompressed_filename;
+  bool traces_syscalls;
+
+  FILE *output;
+  size_t num_results;
+
+  Result *baseline;
+  size_t num_baseline;
+  double threshold_percent;
+  size_t num_compared;
+  size_t num_slower;
+} Bench;
+
+static Error list_corpus(const char *directory, char ***names,
+                         size_t *num_names);
+static Error bench_file(Bench *bench, const char *directory, const char *name);
+static Error bench_level(Bench *bench, const char *filename, const char *name,
+                         const Codec *codec, const char *level);
+static Error check_round_trip(const Bench *bench, const char *filename);
+static Error bench_frontend(Bench *bench, FrontendMain *frontend_main,
+                            const char *argv[], size_t bench_arg_index,
+                            Result *result);
+static Error run_frontend(FrontendMain *frontend_main,
+                          const char *const argv[], char **output,
+                          struct rusage *usage, long long *num_syscalls);
+static Error trace_syscalls(pid_t pid, int *status, struct rusage *usage,
+                            long long *num_syscalls);
+static bool can_trace_children(void);
+static int exit_successfully(int argc, const char *const argv[]);
+static Error read_all(int fd, char **contents);
+static Error parse_bench_output(const char *line, Result *result);
+static Error parse_result(const char *line, Result *result);
+static const char *find_json_value(const char *line, const char *key);
+static Error parse_json_string(const char *value, const char *key,
+                               char **string);
+static Error parse_json_integer(const char *value, const char *key,
+                                long long *integer);
+static Error parse_json_number(const char *value, const char *key,
+                               double *number);
+static Error parse_json_numbers(const char *value, const char *key,
+                                double **numbers, size_t *num_numbers);
+static void write_result(Bench *bench, const Result *result);
+static void write_json_string(FILE *file, const char *string);
+static Error read_baseline(const char *filename, Result **results,
+                           size_t *num_results);
+static void compare_result(Bench *bench, const Result *result);
+static double mann_whitney_z(size_t num_samples,
+                             const double samples[num_samples],
+                             size_t num_baseline,
+                             const double baseline[num_baseline]);
+static void free_result(Result *result);
+static int compare_names(const void *lhs_v, const void *rhs_v);
+static void free_error(Error error);
+
+int main(int argc, const char *const argv[]) {
+  IntegerArgumentParser runs_parser =
+      make_integer_parser("-r, --runs", "RUNS", 1, 1000000);
+  KeywordArgument runs = {
+      .short_name = 'r',
+      .long_name = "runs",
+      .help_text = "Number of timed runs of each benchmark. An integer in the "
+                   "range [1, 1000000]. The default is 10.",
+      .parser = &runs_parser.argument_parser,
+  };
+
+  PassthroughArgumentParser output_parser =
+      make_passthrough_parser("-o, --output", "FILE");
+  KeywordArgument output = {
+      .short_name = 'o',
+      .long_name = "output",
+      .help_text = "File to write the results to. The default is stdout.",
+      .parser = &output_parser.argument_parser,
+  };
+
+  PassthroughArgumentParser baseline_parser =
+      make_passthrough_parser("-b, --baseline", "FILE");
+  KeywordArgument baseline = {
+      .short_name = 'b',
+      .long_name = "baseline",
+      .help_text =
+          "Results of an earlier run to compare with. Benchmarks whose times "
+          "are slower with p < 0.01 by a one-sided Mann-Whitney U test, and "
+          "whose median is slower by more than the threshold, are reported, "
+          "and mmc_bench exits with an error if there are any.",
+      .parser = &baseline_parser.argument_parser,
+  };
+
+  IntegerArgumentParser threshold_parser =
+      make_integer_parser("-t, --threshold", "PERCENT", 0, 1000);
+  KeywordArgument threshold = {
+      .short_name = 't',
+      .long_name = "threshold",
+      .help_text = "Smallest slowdown of the median that --baseline reports, "
+                   "in percent. An integer in the range [0, 1000]. The "
+                   "default is 5.",
+      .parser = &threshold_parser.argument_parser,
+  };
+
+  PassthroughArgumentParser scratch_parser =
+      make_passthrough_parser("-d, --scratch", "DIRECTORY");
+  KeywordArgument scratch = {
+      .short_name = 'd',
+      .long_name = "scratch",
+      .help_text = "Directory to write compressed and decompressed files to, "
+                   "which decides the filesystem that the file outputs are "
+                   "measured on. The default is $TMPDIR, or /tmp.",
+      .parser = &scratch_parser.argument_parser,
+  };
+
+  KeywordArgument *keyword_args[] = {&runs, &output, &baseline, &threshold,
+                                     &scratch};
+
+  PassthroughArgumentParser corpus_parser =
+      make_passthrough_parser("CORPUS_DIRECTORY", NULL);
+  PositionalArgument corpus = {
+      .name = "CORPUS_DIRECTORY",
+      .help_text = "Directory of files to benchmark on. Every regular, "
+                   "non-empty file directly in it is used.",
+      .parser = &corpus_parser.argument_parser,
+  };
+
+  PositionalArgument *positional_args[] = {&corpus};
+
+  Arguments arguments = {
+      .executable_name = "mmc_bench",
+      .version = MMC_VERSION,
+      .author = MMC_AUTHOR,
+      .description =
+          "mmc_bench runs every codec it was built with over a corpus, at a "
+          "low, default and high level and with every output path, and "
+          "writes the throughput, compression ratio, peak RSS, page faults "
+          "and system calls of each to JSON. Each benchmark is the --bench "
+          "mode of a frontend, run in a child process.",
+
+      .positional_args = positional_args,
+      .num_positional_args =
+          sizeof(positional_args) / sizeof(positional_args[0]),
+
+      .keyword_args = keyword_args,
+      .num_keyword_args = sizeof(keyword_args) / sizeof(keyword_args[0]),
+  };
+
+  runs_parser.value = DEFAULT_RUNS;
+  threshold_parser.value = DEFAULT_THRESHOLD_PERCENT;
+
+  Error error = parse_arguments(&arguments, argc, argv);
+
+  if (error.what) {
+    print_error(error);
+
+    return EXIT_FAILURE;
+  }
+
+  if (arguments.has_help) {
+    print_help(&arguments);
+
+    return EXIT_SUCCESS;
+  } else if (arguments.has_version) {
+    print_version(&arguments);
+
+    return EXIT_SUCCESS;
+  }
+
+  Bench bench = {
+      .num_runs = runs_parser.value,
+      .traces_syscalls = can_trace_children(),
+      .output = stdout,
+      .threshold_percent = (double)threshold_parser.value,
+  };
+
+  if (threshold.was_found && !baseline.was_found) {
+    print_error(STATIC_ERROR("--threshold can only be used with --baseline"));
+
+    return EXIT_FAILURE;
+  }
+
+  int exit_code = EXIT_FAILURE;
+
+  if (baseline.was_found &&
+      (error = read_baseline(baseline_parser.value, &bench.baseline,
+                             &bench.num_baseline),
+       error.what)) {
+    print_error(error);
+
+    return EXIT_FAILURE;
+  }
+
+  char **names = NULL;
+  size_t num_names = 0;
+
+  if ((error = list_corpus(corpus_parser.value, &names, &num_names)),
+      error.what) {
+    print_error(error);
+
+    goto cleanup_baseline;
+  }
+
+  const char *scratch_directory = getenv("TMPDIR");
+
+  if (scratch.was_found) {
+    scratch_directory = scratch_parser.value;
+  } else if (!scratch_directory || scratch_directory[0] == '\0') {
+    scratch_directory = "/tmp";
+  }
+
+  const size_t scratch_size = strlen(scratch_directory) + 32;
+  char *const scratch_filename = malloc(scratch_size);
+  bench.compressed_filename = malloc(scratch_size);
+  bench.decompressed_filename = malloc(scratch_size);
+
+  if (!scratch_filename || !bench.compressed_filename ||
+      !bench.decompressed_filename) {
+    print_error(ERROR_OUT_OF_MEMORY);
+
+    goto cleanup_filenames;
+  }
+
+  snprintf(scratch_filename, scratch_size, "%s/mmc_bench.XXXXXX",
+           scratch_directory);
+
+  if (!mkdtemp(scratch_filename)) {
+    print_error(ERRNO_EFORMAT("couldn't create a directory in '%s'",
+                              scratch_directory));
+
+    goto cleanup_filenames;
+  }
+
+  snprintf(bench.compressed_filename, scratch_size, "%s/compressed",
+           scratch_filename);
+  snprintf(bench.decompressed_filename, scratch_size, "%s/decompressed",
+           scratch_filename);
+
+  if (output.was_found) {
+    bench.output = fopen(output_parser.value, "w");
+
+    if (!bench.output) {
+      print_error(ERRNO_EFORMAT("couldn't open file '%s' for writing",
+                                output_parser.value));
+
+      goto cleanup_scratch;
+    }
+  }
+
+  fprintf(bench.output, "{\"version\":\"%s\",\"runs\":%lld,\"results\":[\n",
+          MMC_VERSION, bench.num_runs);
+
+  for (size_t i = 0; i < num_names; ++i) {
+    if ((error = bench_file(&bench, corpus_parser.value, names[i])),
+        error.what) {
+      print_error(error);
+
+      goto cleanup_output;
+    }
+  }
+
+  fputs("\n]}\n", bench.output);
+
+  if (fflush(bench.output) == EOF) {
+    print_error(ERRNO_EFORMAT("couldn't write file '%s'",
+                              output.was_found ? output_parser.value
+                                               : "stdout"));
+
+    goto cleanup_output;
+  }
+
+  exit_code = EXIT_SUCCESS;
+
+  if (baseline.was_found) {
+    fprintf(stderr,
+            "%s: %zu of %zu benchmarks were slower than the baseline\n",
+            executable_name, bench.num_slower, bench.num_compared);
+
+    if (bench.num_slower > 0) {
+      exit_code = EXIT_FAILURE;
+    }
+  }
+
+cleanup_output:
+  if (output.was_found && fclose(bench.output) == EOF) {
+    print_error(
+        ERRNO_EFORMAT("couldn't close file '%s'", output_parser.value));
+    exit_code = EXIT_FAILURE;
+  }
+
+cleanup_scratch:
+  unlink(bench.compressed_filename);
+  unlink(bench.decompressed_filename);
+
+  if (rmdir(scratch_filename) == -1) {
+    print_warning(
+        ERRNO_EFORMAT("couldn't remove directory '%s'", scratch_filename));
+  }
+
+cleanup_filenames:
+  free(bench.decompressed_filename);
+  free(bench.compressed_filename);
+  free(scratch_filename);
+
+  for (size_t i = 0; i < num_names; ++i) {
+    free(names[i]);
+  }
+
+  free(names);
+
+cleanup_baseline:
+  for (size_t i = 0; i < bench.num_baseline; ++i) {
+    free_result(&bench.baseline[i]);
+  }
+
+  free(bench.baseline);
+
+  return exit_code;
+}
+
+// lists the regular, non-empty files directly in directory, sorted by name
+static Error list_corpus(const char *directory, char ***names,
+                         size_t *num_names) {
+  assert(directory);
+  assert(names);
+  assert(num_names);
+
+  DIR *const dir = opendir(directory);
+
+  if (!dir) {
+    return ERRNO_EFORMAT("couldn't open directory '%s'", directory);
+  }
+
+  Error error = NULL_ERROR;
+  char **list = NULL;
+  size_t list_size = 0;
+  size_t list_capacity = 0;
+  const struct dirent *entry;
+
+  while (errno = 0, (entry = readdir(dir))) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+
+    struct stat statbuf;
+
+    if (fstatat(dirfd(dir), entry->d_name, &statbuf, 0) == -1) {
+      error = ERRNO_EFORMAT("couldn't stat file '%s/%s'", directory,
+                            entry->d_name);
+
+      goto cleanup;
+    }
+
+    if (!S_ISREG(statbuf.st_mode) || statbuf.st_size == 0) {
+      continue;
+    }
+
+    if (list_size == list_capacity) {
+      const size_t new_capacity = list_capacity == 0 ? 16 : list_capacity * 2;
+      char **const new_list = realloc(list, new_capacity * sizeof(char *));
+
+      if (!new_list) {
+        error = ERROR_OUT_OF_MEMORY;
+
+        goto cleanup;
+      }
+
+      list = new_list;
+      list_capacity = new_capacity;
+    }
+
+    if (!(list[list_size] = strdup(entry->d_name))) {
+      error = ERROR_OUT_OF_MEMORY;
+
+      goto cleanup;
+    }
+
+    ++list_size;
+  }
+
+  if (errno != 0) {
+    error = ERRNO_EFORMAT("couldn't read directory '%s'", directory);
+
+    goto cleanup;
+  }
+
+  if (list_size == 0) {
+    error = eformat("no files to benchmark in directory '%s'", directory);
+
+    goto cleanup;
+  }
+
+  qsort(list, list_size, sizeof(char *), compare_names);
+
+  *names = list;
+  *num_names = list_size;
+  list = NULL;
+  list_size = 0;
+
+cleanup:
+  for (size_t i = 0; i < list_size; ++i) {
+    free(list[i]);
+  }
+
+  free(list);
+  closedir(dir);
+
+  return error;
+}
+
+static Error bench_file(Bench *bench, const char *directory, const char *name) {
+  assert(bench);
+  assert(directory);
+  assert(name);
+
+  const size_t filename_size = strlen(directory) + strlen(name) + 2;
+  char *const filename = malloc(filename_size);
+
+  if (!filename) {
+    return ERROR_OUT_OF_MEMORY;
+  }
+
+  snprintf(filename, filename_size, "%s/%s", directory, name);
+
+  Error error = NULL_ERROR;
+
+  for (size_t i = 0; i < NUM_CODECS; ++i) {
+    for (size_t j = 0; j < CODECS[i].num_levels; ++j) {
+      if ((error = bench_level(bench, filename, name, &CODECS[i],
+                               CODECS[i].levels[j])),
+          error.what) {
+        goto cleanup;
+      }
+    }
+  }
+
+cleanup:
+  free(filename);
+
+  return error;
+}
+
+// compresses filename once to check that it round trips, then benchmarks
+// compressing it and decompressing the result into every output
+static Error bench_level(Bench *bench, const char *filename, const char *name,
+                         const Codec *codec, const char *level) {
+  assert(bench);
+  assert(filename);
+  assert(name);
+  assert(codec);
+  assert(level);
+
+  Error error = run_frontend(codec->compress,
+                             (const char *[]){codec->compressor_name, "-l",
+                                              level, filename,
+                                              bench->compressed_filename, NULL},
+                             NULL, NULL, NULL);
+
+  if (error.what) {
+    return error;
+  }
+
+  if ((error = run_frontend(codec->decompress,
+                            (const char *[]){codec->decompressor_name,
+                                             bench->compressed_filename,
+                                             bench->decompressed_filename,
+                                             NULL},
+                            NULL, NULL, NULL)),
+      error.what) {
+    return error;
+  }
+
+  if ((error = check_round_trip(bench, filename)), error.what) {
+    const Error located =
+        eformat("%s -l %s: %s", codec->compressor_name, level, error.what);
+    free_error(error);
+
+    return located;
+  }
+
+  char runs_arg[32];
+  snprintf(runs_arg, sizeof(runs_arg), "--bench=%lld", bench->num_runs);
+
+  for (size_t i = 0; i < NUM_OUTPUTS; ++i) {
+    char io_arg[32];
+    snprintf(io_arg, sizeof(io_arg), "--io=%s", OUTPUTS[i]);
+
+    // --io only applies to file outputs
+    const bool to_memory = i == 0;
+    const char *compress_argv[MAX_ARGS] = {codec->compressor_name,
+                                           "-l",
+                                           level,
+                                           runs_arg,
+                                           "--bench-format=json",
+                                           "--bench-output=memory"};
+    const char *decompress_argv[MAX_ARGS] = {codec->decompressor_name,
+                                             runs_arg, "--bench-format=json",
+                                             "--bench-output=memory"};
+    size_t num_compress_args = 6;
+    size_t num_decompress_args = 4;
+
+    if (!to_memory) {
+      compress_argv[5] = "--bench-output=file";
+      compress_argv[num_compress_args++] = io_arg;
+      decompress_argv[3] = "--bench-output=file";
+      decompress_argv[num_decompress_args++] = io_arg;
+    }
+
+    compress_argv[num_compress_args++] = filename;
+    compress_argv[num_compress_args++] = bench->compressed_filename;
+    decompress_argv[num_decompress_args++] = bench->compressed_filename;
+    decompress_argv[num_decompress_args++] = bench->decompressed_filename;
+
+    const struct {
+      FrontendMain *frontend_main;
+      const char **argv;
+      size_t bench_arg_index;
+      const char *operation;
+    } steps[] = {
+        {codec->compress, compress_argv, 3, "compress"},
+        {codec->decompress, decompress_argv, 1, "decompress"},
+    };
+
+    for (size_t j = 0; j < sizeof(steps) / sizeof(steps[0]); ++j) {
+      Result result = {
+          .file = (char *)name,
+          .codec = (char *)steps[j].argv[0],
+          .operation = (char *)steps[j].operation,
+          .level = strtoll(level, NULL, 10),
+          .output = (char *)OUTPUTS[i],
+      };
+
+      if ((error = bench_frontend(bench, steps[j].frontend_main,
+                                  steps[j].argv, steps[j].bench_arg_index,
+                                  &result)),
+          error.what) {
+        return error;
+      }
+
+      write_result(bench, &result);
+      compare_result(bench, &result);
+      free(result.seconds);
+    }
+  }
+
+  return NULL_ERROR;
+}
+
+// checks that the decompressed file matches filename
+static Error check_round_trip(const Bench *bench, const char *filename) {
+  assert(bench);
+  assert(filename);
+
+  FileAndMapping original;
+  Error error = open_and_map_file(filename, &original);
+
+  if (error.what) {
+    return error;
+  }
+
+  FileAndMapping decompressed;
+
+  if ((error = open_and_map_file(bench->decompressed_filename, &decompressed)),
+      error.what) {
+    goto cleanup_original;
+  }
+
+  if (original.file_size != decompressed.file_size ||
+      memcmp(original.mapping, decompressed.mapping, original.file_size) !=
+          0) {
+    error = eformat("'%s' didn't round trip", filename);
+  }
+
+  free_file(decompressed);
+
+cleanup_original:
+  free_file(original);
+
+  return error;
+}
+
+// runs a frontend in --bench mode, then once with one run and once with two to
+// get the page faults and system calls of a single run. argv[bench_arg_index]
+// is its --bench argument
+static Error bench_frontend(Bench *bench, FrontendMain *frontend_main,
+                            const char *argv[], size_t bench_arg_index,
+                            Result *result) {
+  assert(bench);
+  assert(frontend_main);
+  assert(argv);
+  assert(result);
+
+  char *output = NULL;
+  struct rusage usage;
+  Error error = run_frontend(frontend_main, argv, &output, &usage, NULL);
+
+  if (error.what) {
+    return error;
+  }
+
+  error = parse_bench_output(output, result);
+  free(output);
+
+  if (error.what) {
+    const Error located =
+        eformat("couldn't parse the output of %s: %s", argv[0], error.what);
+    free_error(error);
+
+    return located;
+  }
+
+  result->peak_rss_kib = usage.ru_maxrss;
+
+  const char *const runs_arg = argv[bench_arg_index];
+  struct rusage counted_usage[2];
+  long long num_syscalls[2] = {-1, -1};
+
+  for (size_t i = 0; i < 2; ++i) {
+    argv[bench_arg_index] = i == 0 ? "--bench=1" : "--bench=2";
+
+    if ((error = run_frontend(frontend_main, argv, NULL, &counted_usage[i],
+                              bench->traces_syscalls ? &num_syscalls[i]
+                                                     : NULL)),
+        error.what) {
+      break;
+    }
+  }
+
+  argv[bench_arg_index] = runs_arg;
+
+  if (error.what) {
+    return error;
+  }
+
+  result->minor_faults =
+      counted_usage[1].ru_minflt - counted_usage[0].ru_minflt;
+  result->major_faults =
+      counted_usage[1].ru_majflt - counted_usage[0].ru_majflt;
+  result->syscalls = bench->traces_syscalls
+                         ? num_syscalls[1] - num_syscalls[0]
+                         : -1;
+
+  // page faults are counted per process, so they can come out a few short
+  if (result->minor_faults < 0) {
+    result->minor_faults = 0;
+  }
+
+  if (result->major_faults < 0) {
+    result->major_faults = 0;
+  }
+
+  return NULL_ERROR;
+}
+
+// runs frontend_main(argv) in a child process, as if it were executed. if
+// output isn't NULL, the child's stdout is collected into it, and otherwise
+// it's discarded. if num_syscalls isn't NULL, the child is traced to count the
+// system calls made by it and all of its threads
+static Error run_frontend(FrontendMain *frontend_main,
+                          const char *const argv[], char **output,
+                          struct rusage *usage, long long *num_syscalls) {
+  assert(frontend_main);
+  assert(argv);
+
+  int argc = 0;
+
+  while (argv[argc]) {
+    ++argc;
+  }
+
+  int pipe_fds[2] = {-1, -1};
+
+  if (output && pipe(pipe_fds) == -1) {
+    return ERRNO_EFORMAT("couldn't create a pipe for %s", argv[0]);
+  }
+
+  // the child would flush our buffered output again when it exits
+  fflush(NULL);
+
+  const pid_t pid = fork();
+
+  if (pid == -1) {
+    const Error error = ERRNO_EFORMAT("couldn't fork to run %s", argv[0]);
+
+    if (output) {
+      close(pipe_fds[0]);
+      close(pipe_fds[1]);
+    }
+
+    return error;
+  }
+
+  if (pid == 0) {
+    const int stdout_fd = output ? pipe_fds[1] : open("/dev/null", O_WRONLY);
+
+    if (stdout_fd == -1 || dup2(stdout_fd, STDOUT_FILENO) == -1) {
+      _exit(EXIT_FAILURE);
+    }
+
+    close(stdout_fd);
+
+    if (output) {
+      close(pipe_fds[0]);
+    }
+
+    if (num_syscalls) {
+      if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1) {
+        _exit(EXIT_FAILURE);
+      }
+
+      // lets the parent set its options before anything is counted
+      raise(SIGSTOP);
+    }
+
+    exit(frontend_main(argc, argv));
+  }
+
+  Error error = NULL_ERROR;
+
+  if (output) {
+    close(pipe_fds[1]);
+    error = read_all(pipe_fds[0], output);
+    close(pipe_fds[0]);
+  }
+
+  int status;
+  struct rusage child_usage;
+
+  if (num_syscalls) {
+    const Error trace_error =
+        trace_syscalls(pid, &status, &child_usage, num_syscalls);
+
+    if (!error.what) {
+      error = trace_error;
+    } else {
+      free_error(trace_error);
+    }
+  } else {
+    while (wait4(pid, &status, 0, &child_usage) == -1) {
+      if (errno != EINTR) {
+        if (!error.what) {
+          error = ERRNO_EFORMAT("couldn't wait for %s", argv[0]);
+        }
+
+        goto cleanup;
+      }
+    }
+  }
+
+  if (usage) {
+    *usage = child_usage;
+  }
+
+  if (error.what) {
+    goto cleanup;
+  }
+
+  if (WIFSIGNALED(status)) {
+    error = eformat("%s was killed by signal %d", argv[0], WTERMSIG(status));
+  } else if (WEXITSTATUS(status) != EXIT_SUCCESS) {
+    error = eformat("%s exited with status %d", argv[0], WEXITSTATUS(status));
+  }
+
+cleanup:
+  if (error.what && output) {
+    free(*output);
+    *output = NULL;
+  }
+
+  return error;
+}
+
+// follows a child that stopped itself after PTRACE_TRACEME until it exits,
+// counting the stops at system call entry and exit of all of its threads. the
+// exit_group of the process and each thread's final system call only stop at
+// entry, so the count is the stops plus one per thread, halved. the child is
+// always reaped, and its exit status and resource usage are stored
+static Error trace_syscalls(pid_t pid, int *status, struct rusage *usage,
+                            long long *num_syscalls) {
+  assert(status);
+  assert(usage);
+  assert(num_syscalls);
+
+  while (wait4(pid, status, __WALL, usage) == -1) {
+    if (errno != EINTR) {
+      return ERRNO_EFORMAT("couldn't wait for child %d", (int)pid);
+    }
+  }
+
+  if (!WIFSTOPPED(*status)) {
+    return STATIC_ERROR("couldn't trace a child process with ptrace");
+  }
+
+  Error error = NULL_ERROR;
+
+  if (ptrace(PTRACE_SETOPTIONS, pid, NULL,
+             (void *)(intptr_t)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE |
+                                PTRACE_O_EXITKILL)) == -1 ||
+      ptrace(PTRACE_SYSCALL, pid, NULL, NULL) == -1) {
+    error = ERRNO_EFORMAT("couldn't trace child %d", (int)pid);
+
+    goto kill;
+  }
+
+  long long num_stops = 0;
+  long long num_threads = 1;
+
+  while (true) {
+    int thread_status;
+    const pid_t tid = wait4(-1, &thread_status, __WALL, usage);
+
+    if (tid == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      error = ERRNO_EFORMAT("couldn't wait for child %d", (int)pid);
+
+      goto kill;
+    }
+
+    if (WIFEXITED(thread_status) || WIFSIGNALED(thread_status)) {
+      if (tid == pid) {
+        *status = thread_status;
+
+        break;
+      }
+
+      continue;
+    }
+
+    int signal = WSTOPSIG(thread_status);
+
+    if (signal == (SIGTRAP | 0x80)) {
+      ++num_stops;
+      signal = 0;
+    } else if (thread_status >> 16 == PTRACE_EVENT_CLONE) {
+      ++num_threads;
+      signal = 0;
+    } else if (signal == SIGSTOP || signal == SIGTRAP) {
+      // new threads start stopped with SIGSTOP
+      signal = 0;
+    }
+
+    // fails if the thread was killed in the meantime, which is fine
+    ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(intptr_t)signal);
+  }
+
+  *num_syscalls = (num_stops + num_threads) / 2;
+
+  return NULL_ERROR;
+
+kill:
+  kill(pid, SIGKILL);
+
+  while (wait4(pid, status, __WALL, usage) == -1 && errno == EINTR) {
+  }
+
+  return error;
+}
+
+// ptrace is often forbidden in containers
+static bool can_trace_children(void) {
+  long long num_syscalls;
+  const Error error =
+      run_frontend(exit_successfully, (const char *[]){"mmc_bench", NULL},
+                   NULL, NULL, &num_syscalls);
+
+  if (error.what) {
+    print_warning(
+        eformat("%s; system calls won't be counted", error.what));
+    free_error(error);
+
+    return false;
+  }
+
+  return true;
+}
+
+static int exit_successfully(int argc, const char *const argv[]) {
+  (void)argc;
+  (void)argv;
+
+  return EXIT_SUCCESS;
+}
+
+static Error read_all(int fd, char **contents) {
+  assert(contents);
+
+  size_t size = 0;
+  size_t capacity = 4096;
+  char *buffer = malloc(capacity);
+
+  if (!buffer) {
+    return ERROR_OUT_OF_MEMORY;
+  }
+
+  while (true) {
+    if (capacity - size < 2) {
+      char *const new_buffer = realloc(buffer, capacity * 2);
+
+      if (!new_buffer) {
+        free(buffer);
+
+        return ERROR_OUT_OF_MEMORY;
+      }
+
+      buffer = new_buffer;
+      capacity *= 2;
+    }
+
+    const ssize_t num_read = read(fd, buffer + size, capacity - size - 1);
+
+    if (num_read == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      free(buffer);
+
+      return ERRNO_EFORMAT("couldn't read from pipe");
+    } else if (num_read == 0) {
+      break;
+    }
+
+    size += (size_t)num_read;
+  }
+
+  buffer[size] = '\0';
+  *contents = buffer;
+
+  return NULL_ERROR;
+}
+
+// reads a line printed by --bench-format=json
+static Error parse_bench_output(const char *line, Result *result) {
+  assert(line);
+  assert(result);
+
+  Error error;
+
+  if ((error = parse_json_integer(find_json_value(line, "input_bytes"),
+                                  "input_bytes", &result->input_bytes)),
+      error.what) {
+    return error;
+  } else if ((error = parse_json_integer(find_json_value(line, "output_bytes"),
+                                         "output_bytes",
+                                         &result->output_bytes)),
+             error.what) {
+    return error;
+  } else if ((error = parse_json_number(find_json_value(line, "ratio"),
+                                        "ratio", &result->ratio)),
+             error.what) {
+    return error;
+  } else if ((error = parse_json_number(find_json_value(line, "min_seconds"),
+                                        "min_seconds", &result->min_seconds)),
+             error.what) {
+    return error;
+  } else if ((error =
+                  parse_json_number(find_json_value(line, "median_seconds"),
+                                    "median_seconds",
+                                    &result->median_seconds)),
+             error.what) {
+    return error;
+  } else if ((error = parse_json_number(find_json_value(line, "p99_seconds"),
+                                        "p99_seconds", &result->p99_seconds)),
+             error.what) {
+    return error;
+  } else if ((error = parse_json_number(
+                  find_json_value(line, "megabytes_per_second"),
+                  "megabytes_per_second", &result->megabytes_per_second)),
+             error.what) {
+    return error;
+  }
+
+  return parse_json_numbers(find_json_value(line, "seconds"), "seconds",
+                            &result->seconds, &result->num_seconds);
+}
+
+// reads a line printed by write_result. only the fields needed to match and
+// compare results are kept
+static Error parse_result(const char *line, Result *result) {
+  assert(line);
+  assert(result);
+
+  *result = (Result){0};
+
+  Error error;
+
+  if ((error = parse_json_string(find_json_value(line, "file"), "file",
+                                 &result->file)),
+      error.what) {
+    goto fail;
+  } else if ((error = parse_json_string(find_json_value(line, "codec"),
+                                        "codec", &result->codec)),
+             error.what) {
+    goto fail;
+  } else if ((error = parse_json_integer(find_json_value(line, "level"),
+                                         "level", &result->level)),
+             error.what) {
+    goto fail;
+  } else if ((error = parse_json_string(find_json_value(line, "output"),
+                                        "output", &result->output)),
+             error.what) {
+    goto fail;
+  } else if ((error =
+                  parse_json_number(find_json_value(line, "median_seconds"),
+                                    "median_seconds",
+                                    &result->median_seconds)),
+             error.what) {
+    goto fail;
+  } else if ((error = parse_json_numbers(find_json_value(line, "seconds"),
+                                         "seconds", &result->seconds,
+                                         &result->num_seconds)),
+             error.what) {
+    goto fail;
+  }
+
+  return NULL_ERROR;
+
+fail:
+  free_result(result);
+
+  return error;
+}
+
+// finds the value of "key": in a line of JSON printed by mmc_bench or
+// --bench-format=json. quotes in strings are always escaped there, so a key
+// can't match inside of a string. returns NULL if there is no such key
+static const char *find_json_value(const char *line, const char *key) {
+  assert(line);
+  assert(key);
+
+  const size_t key_length = strlen(key);
+
+  for (const char *c = strchr(line, '"'); c; c = strchr(c + 1, '"')) {
+    if (strncmp(c + 1, key, key_length) == 0 && c[key_length + 1] == '"' &&
+        c[key_length + 2] == ':') {
+      return c + key_length + 3;
+    }
+  }
+
+  return NULL;
+}
+
+// only unescapes what write_json_string escapes
+static Error parse_json_string(const char *value, const char *key,
+                               char **string) {
+  assert(key);
+  assert(string);
+
+  if (!value || *value != '"') {
+    return eformat("expected a string for \"%s\"", key);
+  }
+
+  ++value;
+
+  const char *end = value;
+
+  while (*end != '"') {
+    if (*end == '\0') {
+      return eformat("unterminated string for \"%s\"", key);
+    } else if (*end == '\\' && end[1] != '\0') {
+      ++end;
+    }
+
+    ++end;
+  }
+
+  char *const buffer = malloc((size_t)(end - value) + 1);
+
+  if (!buffer) {
+    return ERROR_OUT_OF_MEMORY;
+  }
+
+  char *out = buffer;
+
+  for (const char *c = value; c < end; ++c) {
+    if (*c != '\\') {
+      *out++ = *c;
+    } else if (c[1] == 'u' && end - c >= 6) {
+      char hex[5] = {c[2], c[3], c[4], c[5], '\0'};
+      *out++ = (char)strtol(hex, NULL, 16);
+      c += 5;
+    } else {
+      *out++ = *++c;
+    }
+  }
+
+  *out = '\0';
+  *string = buffer;
+
+  return NULL_ERROR;
+}
+
+static Error parse_json_integer(const char *value, const char *key,
+                                long long *integer) {
+  assert(key);
+  assert(integer);
+
+  char *end;
+
+  if (!value || (errno = 0, *integer = strtoll(value, &end, 10),
+                 end == value || errno != 0)) {
+    return eformat("expected an integer for \"%s\"", key);
+  }
+
+  return NULL_ERROR;
+}
+
+static Error parse_json_number(const char *value, const char *key,
+                               double *number) {
+  assert(key);
+  assert(number);
+
+  char *end;
+
+  if (!value || (*number = strtod(value, &end), end == value)) {
+    return eformat("expected a number for \"%s\"", key);
+  }
+
+  return NULL_ERROR;
+}
+
+static Error parse_json_numbers(const char *value, const char *key,
+                                double **numbers, size_t *num_numbers) {
+  assert(key);
+  assert(numbers);
+  assert(num_numbers);
+
+  if (!value || *value != '[') {
+    return eformat("expected an array for \"%s\"", key);
+  }
+
+  size_t count = 1;
+
+  for (const char *c = value; *c != ']' && *c != '\0'; ++c) {
+    count += *c == ',';
+  }
+
+  double *const array = malloc(count * sizeof(double));
+
+  if (!array) {
+    return ERROR_OUT_OF_MEMORY;
+  }
+
+  const char *c = value + 1;
+
+  for (size_t i = 0; i < count; ++i) {
+    char *end;
+    array[i] = strtod(c, &end);
+
+    if (end == c || (*end != ',' && *end != ']')) {
+      free(array);
+
+      return eformat("expected an array of numbers for \"%s\"", key);
+    }
+
+    c = end + 1;
+  }
+
+  *numbers = array;
+  *num_numbers = count;
+
+  return NULL_ERROR;
+}
+
+// one object per line, so that results can be compared or grepped line by line
+static void write_result(Bench *bench, const Result *result) {
+  assert(bench);
+  assert(result);
+
+  FILE *const file = bench->output;
+
+  fputs(bench->num_results == 0 ? "{\"file\":" : ",\n{\"file\":", file);
+  write_json_string(file, result->file);
+  fprintf(file,
+          ",\"codec\":\"%s\",\"operation\":\"%s\",\"level\":%lld,"
+          "\"output\":\"%s\",\"input_bytes\":%lld,\"output_bytes\":%lld,"
+          "\"ratio\":%.6f,\"min_seconds\":%.9f,\"median_seconds\":%.9f,"
+          "\"p99_seconds\":%.9f,\"megabytes_per_second\":%.3f,"
+          "\"peak_rss_kib\":%lld,\"minor_faults\":%lld,\"major_faults\":%lld,",
+          result->codec, result->operation, result->level, result->output,
+          result->input_bytes, result->output_bytes, result->ratio,
+          result->min_seconds, result->median_seconds, result->p99_seconds,
+          result->megabytes_per_second, result->peak_rss_kib,
+          result->minor_faults, result->major_faults);
+
+  if (result->syscalls >= 0) {
+    fprintf(file, "\"syscalls\":%lld,\"seconds\":[", result->syscalls);
+  } else {
+    fputs("\"syscalls\":null,\"seconds\":[", file);
+  }
+
+  for (size_t i = 0; i < result->num_seconds; ++i) {
+    fprintf(file, i == 0 ? "%.9f" : ",%.9f", result->seconds[i]);
+  }
+
+  fputs("]}", file);
+  fflush(file);
+  ++bench->num_results;
+}
+
+static void write_json_string(FILE *file, const char *string) {
+  assert(file);
+  assert(string);
+
+  fputc('"', file);
+
+  for (const unsigned char *c = (const unsigned char *)string; *c != '\0';
+       ++c) {
+    if (*c == '"' || *c == '\\') {
+      fputc('\\', file);
+      fputc(*c, file);
+    } else if (*c < 0x20) {
+      fprintf(file, "\\u%04x", (unsigned)*c);
+    } else {
+      fputc(*c, file);
+    }
+  }
+
+  fputc('"', file);
+}
+
+// reads every result from a file written by mmc_bench
+static Error read_baseline(const char *filename, Result **results,
+                           size_t *num_results) {
+  assert(filename);
+  assert(results);
+  assert(num_results);
+
+  FILE *const file = fopen(filename, "r");
+
+  if (!file) {
+    return ERRNO_EFORMAT("couldn't open file '%s' for reading", filename);
+  }
+
+  Error error = NULL_ERROR;
+  Result *list = NULL;
+  size_t list_size = 0;
+  size_t list_capacity = 0;
+  char *line = NULL;
+  size_t line_capacity = 0;
+  size_t line_number = 0;
+
+  while (errno = 0, getline(&line, &line_capacity, file) != -1) {
+    ++line_number;
+
+    if (!find_json_value(line, "codec")) {
+      continue;
+    }
+
+    if (list_size == list_capacity) {
+      const size_t new_capacity = list_capacity == 0 ? 64 : list_capacity * 2;
+      Result *const new_list = realloc(list, new_capacity * sizeof(Result));
+
+      if (!new_list) {
+        error = ERROR_OUT_OF_MEMORY;
+
+        goto cleanup;
+      }
+
+      list = new_list;
+      list_capacity = new_capacity;
+    }
+
+    if ((error = parse_result(line, &list[list_size])), error.what) {
+      const Error located =
+          eformat("%s:%zu: %s", filename, line_number, error.what);
+      free_error(error);
+      error = located;
+
+      goto cleanup;
+    }
+
+    ++list_size;
+  }
+
+  if (errno != 0) {
+    error = ERRNO_EFORMAT("couldn't read file '%s'", filename);
+
+    goto cleanup;
+  }
+
+  *results = list;
+  *num_results = list_size;
+  list = NULL;
+  list_size = 0;
+
+cleanup:
+  for (size_t i = 0; i < list_size; ++i) {
+    free_result(&list[i]);
+  }
+
+  free(list);
+  free(line);
+  fclose(file);
+
+  return error;
+}
+
+// reports a result that is slower than its baseline. results without one, such
+// as those of codecs that the baseline wasn't built with, are skipped
+static void compare_result(Bench *bench, const Result *result) {
+  assert(bench);
+  assert(result);
+
+  const Result *baseline = NULL;
+
+  for (size_t i = 0; i < bench->num_baseline; ++i) {
+    const Result *const candidate = &bench->baseline[i];
+
+    if (strcmp(candidate->file, result->file) == 0 &&
+        strcmp(candidate->codec, result->codec) == 0 &&
+        candidate->level == result->level &&
+        strcmp(candidate->output, result->output) == 0) {
+      baseline = candidate;
+
+      break;
+    }
+  }
+
+  if (!baseline || baseline->num_seconds == 0 || result->num_seconds == 0 ||
+      baseline->median_seconds <= 0) {
+    return;
+  }
+
+  ++bench->num_compared;
+
+  const double change =
+      (result->median_seconds / baseline->median_seconds - 1) * 100;
+  const double z = mann_whitney_z(result->num_seconds, result->seconds,
+                                  baseline->num_seconds, baseline->seconds);
+
+  if (z <= SIGNIFICANT_Z_SCORE || change <= bench->threshold_percent) {
+    return;
+  }
+
+  ++bench->num_slower;
+  fprintf(stderr,
+          "%s: slower: %s level %lld to %s on '%s': median %.6f s -> %.6f s "
+          "(%+.1f%%, z = %.2f)\n",
+          executable_name, result->codec, result->level, result->output,
+          result->file, baseline->median_seconds, result->median_seconds,
+          change, z);
+}
+
+// the z score of how much larger samples are than baseline, from the
+// Mann-Whitney U statistic and its normal approximation. ties count as half
+static double mann_whitney_z(size_t num_samples,
+                             const double samples[num_samples],
+                             size_t num_baseline,
+                             const double baseline[num_baseline]) {
+  assert(samples);
+  assert(baseline);
+
+  double u = 0;
+
+  for (size_t i = 0; i < num_samples; ++i) {
+    for (size_t j = 0; j < num_baseline; ++j) {
+      if (samples[i] > baseline[j]) {
+        u += 1;
+      } else if (samples[i] == baseline[j]) {
+        u += 0.5;
+      }
+    }
+  }
+
+  const double n = (double)num_samples;
+  const double m = (double)num_baseline;
+  const double mean = n * m / 2;
+  const double standard_deviation = sqrt(n * m * (n + m + 1) / 12);
+
+  return (u - mean) / standard_deviation;
+}
+
+static void free_result(Result *result) {
+  assert(result);
+
+  free(result->file);
+  free(result->codec);
+  free(result->output);
+  free(result->seconds);
+}
+
+static int compare_names(const void *lhs_v, const void *rhs_v) {
+  assert(lhs_v);
+  assert(rhs_v);
+
+  return strcmp(*(char *const *)lhs_v, *(char *const *)rhs_v);
+}
+
+static void free_error(Error error) {
+  if (error.allocated) {
+    free(error.what);
+  }
+}
@@ -0,0 +1,136 @@
+// Copyright (c) 2019 Gregory Meyer
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "readahead.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include <fcntl.h>
+
+#define MIN(X, Y) (((Y) < (X)) ? (Y) : (X))
+#define MAX(X, Y) (((Y) > (X)) ? (Y) : (X))
+
+// each readahead(2) call covers at most this much, so that a moving cursor is
+// noticed between calls
+#define READAHEAD_STEP_SIZE ((size_t)1 << 21)
+
+static void *read_ahead(void *readahead_v);
+
+Error create_readahead(int fd, size_t file_size, size_t distance,
+                       size_t max_distance, Readahead *readahead) {
+  assert(distance > 0);
+  assert(max_distance >= distance);
+  assert(readahead);
+
+  *readahead = (Readahead){
+      .fd = fd,
+      .file_size = file_size,
+
+      .cursor = 0,
+      .distance = distance,
+      .max_distance = max_distance,
+      .issued_size = 0,
+
+      .is_stopping = false,
+  };
+
+  pthread_mutex_init(&readahead->mutex, NULL);
+  pthread_cond_init(&readahead->cursor_moved, NULL);
+
+  const int errc =
+      pthread_create(&readahead->thread, NULL, read_ahead, readahead);
+
+  if (errc != 0) {
+    pthread_cond_destroy(&readahead->cursor_moved);
+    pthread_mutex_destroy(&readahead->mutex);
+
+    return eformat("couldn't start readahead thread: %s (%d)", strerror(errc),
+                   errc);
+  }
+
+  return NULL_ERROR;
+}
+
+// cursor is an offset into the file. stalled is whether the codec had to wait
+// for the input since the last call
+void advance_readahead(Readahead *readahead, size_t cursor, bool stalled) {
+  assert(readahead);
+
+  pthread_mutex_lock(&readahead->mutex);
+
+  readahead->cursor = cursor;
+
+  if (stalled) {
+    readahead->distance =
+        MIN(readahead->distance * 2, readahead->max_distance);
+  }
+
+  pthread_cond_signal(&readahead->cursor_moved);
+  pthread_mutex_unlock(&readahead->mutex);
+}
+
+void free_readahead(Readahead *readahead) {
+  assert(readahead);
+
+  pthread_mutex_lock(&readahead->mutex);
+  readahead->is_stopping = true;
+  pthread_cond_signal(&readahead->cursor_moved);
+  pthread_mutex_unlock(&readahead->mutex);
+
+  pthread_join(readahead->thread, NULL);
+
+  pthread_cond_destroy(&readahead->cursor_moved);
+  pthread_mutex_destroy(&readahead->mutex);
+}
+
+static void *read_ahead(void *readahead_v) {
+  assert(readahead_v);
+
+  Readahead *const self = (Readahead *)readahead_v;
+
+  pthread_mutex_lock(&self->mutex);
+
+  while (!self->is_stopping) {
+    const size_t end = MIN(self->cursor + self->distance, self->file_size);
+    const size_t begin = MAX(self->issued_size, self->cursor);
+
+    if (begin >= end) {
+      pthread_cond_wait(&self->cursor_moved, &self->mutex);
+
+      continue;
+    }
+
+    const size_t size = MIN(end - begin, READAHEAD_STEP_SIZE);
+    self->issued_size = begin + size;
+
+    pthread_mutex_unlock(&self->mutex);
+
+    // only advice, so errors are ignored. this can block until the reads
+    // have been submitted, which is why it runs on its own thread
+    readahead(self->fd, (off64_t)begin, size);
+
+    pthread_mutex_lock(&self->mutex);
+  }
+
+  pthread_mutex_unlock(&self->mutex);
+
+  return NULL;
+}
@@ -0,0 +1,56 @@
+// Copyright (c) 2019 Gregory Meyer
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef COMMON_INTERNAL_READAHEAD_H
+#define COMMON_INTERNAL_READAHEAD_H
+
+#include <common/error.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <pthread.h>
+
+// a helper thread that keeps the input read ahead of the codec, so that the
+// codec thread doesn't stall on major faults and never blocks on readahead(2)
+// itself. the distance doubles whenever the driver reports a stall, up to
+// max_distance
+typedef struct Readahead {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cursor_moved;
+
+  int fd;
+  size_t file_size;
+
+  size_t cursor;
+  size_t distance;
+  size_t max_distance;
+  size_t issued_size;
+
+  bool is_stopping;
+} Readahead;
+
+Error create_readahead(int fd, size_t file_size, size_t distance,
+                       size_t max_distance, Readahead *readahead);
+void advance_readahead(Readahead *readahead, size_t cursor, bool stalled);
+void free_readahead(Readahead *readahead);
+
+#endif
@@ -0,0 +1,181 @@
+// Copyright (c) 2019 Gregory Meyer
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <common/thread_pool.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+static void *work(void *pool_v);
+
+Error create_thread_pool(size_t num_threads, ThreadPool *pool) {
+  assert(num_threads > 0);
+  assert(pool);
+
+  *pool = (ThreadPool){
+      .threads = malloc(num_threads * sizeof(pthread_t)),
+      .num_threads = 0,
+
+      .tasks = malloc(num_threads * sizeof(ThreadPoolTask)),
+      .tasks_capacity = num_threads,
+      .first_task_index = 0,
+      .num_queued_tasks = 0,
+      .num_running_tasks = 0,
+
+      .is_stopping = false,
+  };
+
+  if (!pool->threads || !pool->tasks) {
+    free(pool->threads);
+    free(pool->tasks);
+
+    return ERROR_OUT_OF_MEMORY;
+  }
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->task_available, NULL);
+  pthread_cond_init(&pool->tasks_finished, NULL);
+
+  for (size_t i = 0; i < num_threads; ++i) {
+    const int errc = pthread_create(&pool->threads[i], NULL, work, pool);
+
+    if (errc != 0) {
+      free_thread_pool(pool);
+
+      return eformat("couldn't start worker thread %zu of %zu: %s (%d)", i + 1,
+                     num_threads, strerror(errc), errc);
+    }
+
+    ++pool->num_threads;
+  }
+
+  return NULL_ERROR;
+}
+
+Error submit_task(ThreadPool *pool, ThreadPoolTaskFunc *func, void *arg) {
+  assert(pool);
+  assert(func);
+
+  pthread_mutex_lock(&pool->mutex);
+
+  if (pool->num_queued_tasks == pool->tasks_capacity) {
+    const size_t new_capacity = pool->tasks_capacity * 2;
+    ThreadPoolTask *const new_tasks =
+        malloc(new_capacity * sizeof(ThreadPoolTask));
+
+    if (!new_tasks) {
+      pthread_mutex_unlock(&pool->mutex);
+
+      return ERROR_OUT_OF_MEMORY;
+    }
+
+    // unwrap the ring buffer into the front of the new one
+    for (size_t i = 0; i < pool->num_queued_tasks; ++i) {
+      new_tasks[i] =
+          pool->tasks[(pool->first_task_index + i) % pool->tasks_capacity];
+    }
+
+    free(pool->tasks);
+    pool->tasks = new_tasks;
+    pool->tasks_capacity = new_capacity;
+    pool->first_task_index = 0;
+  }
+
+  const size_t index = (pool->first_task_index + pool->num_queued_tasks) %
+                       pool->tasks_capacity;
+  pool->tasks[index] = (ThreadPoolTask){.func = func, .arg = arg};
+  ++pool->num_queued_tasks;
+
+  pthread_cond_signal(&pool->task_available);
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL_ERROR;
+}
+
+void wait_for_tasks(ThreadPool *pool) {
+  assert(pool);
+
+  pthread_mutex_lock(&pool->mutex);
+
+  while (pool->num_queued_tasks > 0 || pool->num_running_tasks > 0) {
+    pthread_cond_wait(&pool->tasks_finished, &pool->mutex);
+  }
+
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+void free_thread_pool(ThreadPool *pool) {
+  assert(pool);
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->is_stopping = true;
+  pthread_cond_broadcast(&pool->task_available);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (size_t i = 0; i < pool->num_threads; ++i) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&pool->tasks_finished);
+  pthread_cond_destroy(&pool->task_available);
+  pthread_mutex_destroy(&pool->mutex);
+
+  free(pool->tasks);
+  free(pool->threads);
+}
+
+static void *work(void *pool_v) {
+  assert(pool_v);
+
+  ThreadPool *const pool = (ThreadPool *)pool_v;
+
+  pthread_mutex_lock(&pool->mutex);
+
+  while (true) {
+    while (pool->num_queued_tasks == 0 && !pool->is_stopping) {
+      pthread_cond_wait(&pool->task_available, &pool->mutex);
+    }
+
+    // queued tasks are always run before stopping
+    if (pool->num_queued_tasks == 0) {
+      break;
+    }
+
+    const ThreadPoolTask task = pool->tasks[pool->first_task_index];
+    pool->first_task_index =
+        (pool->first_task_index + 1) % pool->tasks_capacity;
+    --pool->num_queued_tasks;
+    ++pool->num_running_tasks;
+
+    pthread_mutex_unlock(&pool->mutex);
+    task.func(task.arg);
+    pthread_mutex_lock(&pool->mutex);
+
+    --pool->num_running_tasks;
+
+    if (pool->num_queued_tasks == 0 && pool->num_running_tasks == 0) {
+      pthread_cond_broadcast(&pool->tasks_finished);
+    }
+  }
+
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
@@ -0,0 +1,376 @@
+// Copyright (c) 2019 Gregory Meyer
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "uring.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define MIN(X, Y) (((Y) < (X)) ? (Y) : (X))
+
+// enough for a few flushes to be in flight at once
+#define URING_ENTRIES 32
+
+// write(2) never transfers more than this in one go
+#define MAX_WRITE_SIZE ((size_t)0x7ffff000)
+
+typedef struct UringRequest {
+  const char *buffer;
+  size_t size;
+  size_t offset;
+  size_t tag;
+  bool is_in_flight;
+} UringRequest;
+
+struct Uring {
+  int ring_fd;
+  int fd;
+  const char *filename;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  UringRequest requests[URING_ENTRIES];
+  size_t num_in_flight;
+};
+
+static Error reap_completion(Uring *uring);
+static Error finish_short_write(Uring *uring, const UringRequest *request,
+                                size_t num_written);
+
+Error create_uring(int fd, const char *filename, Uring **uring) {
+  assert(filename);
+  assert(uring);
+
+  Uring *const self = calloc(1, sizeof(Uring));
+
+  if (!self) {
+    return ERROR_OUT_OF_MEMORY;
+  }
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  const long ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+
+  if (ring_fd == -1) {
+    free(self);
+
+    return ERRNO_EFORMAT("couldn't set up an io_uring for file '%s'",
+                         filename);
+  }
+
+  self->ring_fd = (int)ring_fd;
+  self->fd = fd;
+  self->filename = filename;
+
+  self->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  self->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+  // newer kernels map both rings with one mmap
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (self->cq_ring_size > self->sq_ring_size) {
+      self->sq_ring_size = self->cq_ring_size;
+    }
+
+    self->cq_ring_size = self->sq_ring_size;
+  }
+
+  self->sq_ring = mmap(NULL, self->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, self->ring_fd,
+                       IORING_OFF_SQ_RING);
+
+  if (self->sq_ring == MAP_FAILED) {
+    close(self->ring_fd);
+    free(self);
+
+    return ERRNO_EFORMAT("couldn't map io_uring submission queue for file "
+                         "'%s' into memory",
+                         filename);
+  }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    self->cq_ring = self->sq_ring;
+  } else {
+    self->cq_ring = mmap(NULL, self->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, self->ring_fd,
+                         IORING_OFF_CQ_RING);
+
+    if (self->cq_ring == MAP_FAILED) {
+      munmap(self->sq_ring, self->sq_ring_size);
+      close(self->ring_fd);
+      free(self);
+
+      return ERRNO_EFORMAT("couldn't map io_uring completion queue for file "
+                           "'%s' into memory",
+                           filename);
+    }
+  }
+
+  self->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  self->sqes = mmap(NULL, self->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, self->ring_fd, IORING_OFF_SQES);
+
+  if (self->sqes == MAP_FAILED) {
+    if (self->cq_ring != self->sq_ring) {
+      munmap(self->cq_ring, self->cq_ring_size);
+    }
+
+    munmap(self->sq_ring, self->sq_ring_size);
+    close(self->ring_fd);
+    free(self);
+
+    return ERRNO_EFORMAT("couldn't map io_uring submission entries for file "
+                         "'%s' into memory",
+                         filename);
+  }
+
+  char *const sq_ring = (char *)self->sq_ring;
+  self->sq_head = (unsigned *)(sq_ring + params.sq_off.head);
+  self->sq_tail = (unsigned *)(sq_ring + params.sq_off.tail);
+  self->sq_mask = *(unsigned *)(sq_ring + params.sq_off.ring_mask);
+  self->sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+
+  char *const cq_ring = (char *)self->cq_ring;
+  self->cq_head = (unsigned *)(cq_ring + params.cq_off.head);
+  self->cq_tail = (unsigned *)(cq_ring + params.cq_off.tail);
+  self->cq_mask = *(unsigned *)(cq_ring + params.cq_off.ring_mask);
+  self->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+
+  *uring = self;
+
+  return NULL_ERROR;
+}
+
+Error submit_uring_write(Uring *uring, const void *buffer, size_t size,
+                         size_t offset, size_t tag) {
+  assert(uring);
+  assert(buffer || size == 0);
+
+  const char *next = (const char *)buffer;
+
+  while (size > 0) {
+    Error error;
+
+    // every request slot is taken, so one has to complete before another
+    // write can be queued
+    while (uring->num_in_flight == URING_ENTRIES) {
+      if ((error = reap_completion(uring)), error.what) {
+        return error;
+      }
+    }
+
+    size_t index = 0;
+
+    while (uring->requests[index].is_in_flight) {
+      ++index;
+    }
+
+    const size_t write_size = MIN(size, MAX_WRITE_SIZE);
+    uring->requests[index] = (UringRequest){
+        .buffer = next,
+        .size = write_size,
+        .offset = offset,
+        .tag = tag,
+        .is_in_flight = true,
+    };
+
+    // only this thread produces submissions, so the tail can be read plainly
+    const unsigned tail = *uring->sq_tail;
+    const unsigned sqe_index = tail & uring->sq_mask;
+    struct io_uring_sqe *const sqe = &uring->sqes[sqe_index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = uring->fd;
+    sqe->off = (uint64_t)offset;
+    sqe->addr = (uint64_t)(uintptr_t)next;
+    sqe->len = (uint32_t)write_size;
+    sqe->user_data = (uint64_t)index;
+
+    uring->sq_array[sqe_index] = sqe_index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (syscall(__NR_io_uring_enter, uring->ring_fd, 1, 0, 0, NULL, 0) == -1) {
+      uring->requests[index].is_in_flight = false;
+
+      return ERRNO_EFORMAT("couldn't submit write to file '%s'",
+                           uring->filename);
+    }
+
+    ++uring->num_in_flight;
+    next += write_size;
+    offset += write_size;
+    size -= write_size;
+  }
+
+  return NULL_ERROR;
+}
+
+Error wait_for_uring(Uring *uring, size_t tag) {
+  assert(uring);
+
+  for (size_t i = 0; i < URING_ENTRIES; ++i) {
+    while (uring->requests[i].is_in_flight && uring->requests[i].tag == tag) {
+      const Error error = reap_completion(uring);
+
+      if (error.what) {
+        return error;
+      }
+    }
+  }
+
+  return NULL_ERROR;
+}
+
+Error drain_uring(Uring *uring) {
+  assert(uring);
+
+  while (uring->num_in_flight > 0) {
+    const Error error = reap_completion(uring);
+
+    if (error.what) {
+      return error;
+    }
+  }
+
+  return NULL_ERROR;
+}
+
+void free_uring(Uring *uring) {
+  if (!uring) {
+    return;
+  }
+
+  // the kernel may still be reading from buffers that are about to be freed
+  drain_uring(uring);
+
+  munmap(uring->sqes, uring->sqes_size);
+
+  if (uring->cq_ring != uring->sq_ring) {
+    munmap(uring->cq_ring, uring->cq_ring_size);
+  }
+
+  munmap(uring->sq_ring, uring->sq_ring_size);
+  close(uring->ring_fd);
+  free(uring);
+}
+
+// blocks until at least one write completes
+static Error reap_completion(Uring *uring) {
+  assert(uring);
+  assert(uring->num_in_flight > 0);
+
+  const unsigned head = *uring->cq_head;
+
+  while (__atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE) == head) {
+    if (syscall(__NR_io_uring_enter, uring->ring_fd, 0, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0) == -1 &&
+        errno != EINTR) {
+      return ERRNO_EFORMAT("couldn't wait for writes to file '%s'",
+                           uring->filename);
+    }
+  }
+
+  const struct io_uring_cqe *const cqe = &uring->cqes[head & uring->cq_mask];
+  const size_t index = (size_t)cqe->user_data;
+  const int result = cqe->res;
+
+  __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+  assert(index < URING_ENTRIES);
+  UringRequest *const request = &uring->requests[index];
+  assert(request->is_in_flight);
+
+  request->is_in_flight = false;
+  --uring->num_in_flight;
+
+  if (result < 0) {
+    errno = -result;
+
+    return ERRNO_EFORMAT("couldn't write %zu bytes at offset %zu of file '%s'",
+                         request->size, request->offset, uring->filename);
+  }
+
+  if ((size_t)result < request->size) {
+    return finish_short_write(uring, request, (size_t)result);
+  }
+
+  return NULL_ERROR;
+}
+
+// short writes are rare enough that the rest can just be written in place
+static Error finish_short_write(Uring *uring, const UringRequest *request,
+                                size_t num_written) {
+  assert(uring);
+  assert(request);
+
+  while (num_written < request->size) {
+    const ssize_t result =
+        pwrite(uring->fd, request->buffer + num_written,
+               request->size - num_written,
+               (off_t)(request->offset + num_written));
+
+    if (result == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return ERRNO_EFORMAT(
+          "couldn't write %zu bytes at offset %zu of file '%s'",
+          request->size - num_written, request->offset + num_written,
+          uring->filename);
+    } else if (result == 0) {
+      return eformat("couldn't write %zu bytes at offset %zu of file '%s': "
+                     "no space left",
+                     request->size - num_written,
+                     request->offset + num_written, uring->filename);
+    }
+
+    num_written += (size_t)result;
+  }
+
+  return NULL_ERROR;
+}
@@ -0,0 +1,50 @@
+// Copyright (c) 2019 Gregory Meyer
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef COMMON_INTERNAL_URING_H
+#define COMMON_INTERNAL_URING_H
+
+#include <common/error.h>
+
+#include <stddef.h>
+
+// a minimal io_uring that only knows how to write buffers to a file. built on
+// the raw system calls so that it doesn't need liburing
+typedef struct Uring Uring;
+
+// fails if io_uring is unavailable, e.g. on kernels older than 5.6 or when it
+// has been disabled by seccomp or sysctl
+Error create_uring(int fd, const char *filename, Uring **uring);
+
+// queues a write of [buffer, buffer + size) to offset in the file. the write
+// may still be in flight when this returns, so buffer must be left alone until
+// wait_for_uring is called with the same tag
+Error submit_uring_write(Uring *uring, const void *buffer, size_t size,
+                         size_t offset, size_t tag);
+
+// waits for every write submitted with tag to complete
+Error wait_for_uring(Uring *uring, size_t tag);
+
+// waits for every write in flight to complete
+Error drain_uring(Uring *uring);
+
+void free_uring(Uring *uring);
+
+#endif
@@ -0,0 +1,154 @@
+// Copyright (c) 2019 Gregory Meyer
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "xxh32.h"
+
+#include <assert.h>
+#include <string.h>
+
+static const uint32_t PRIME1 = 2654435761u;
+static const uint32_t PRIME2 = 2246822519u;
+static const uint32_t PRIME3 = 3266489917u;
+static const uint32_t PRIME4 = 668265263u;
+static const uint32_t PRIME5 = 374761393u;
+
+static uint32_t rotate_left(uint32_t value, unsigned amount);
+static uint32_t read_le32(const unsigned char *bytes);
+static uint32_t round_accumulator(uint32_t accumulator, uint32_t lane);
+
+void xxh32_reset(Xxh32State *state, uint32_t seed) {
+  assert(state);
+
+  *state = (Xxh32State){
+      .accumulators = {seed + PRIME1 + PRIME2, seed + PRIME2, seed,
+                       seed - PRIME1},
+      .total_length = 0,
+      .buffer_size = 0,
+      .seed = seed,
+  };
+}
+
+void xxh32_update(Xxh32State *state, const void *data, size_t size) {
+  assert(state);
+  assert(data || size == 0);
+
+  const unsigned char *bytes = (const unsigned char *)data;
+  state->total_length += size;
+
+  if (state->buffer_size + size < 16) {
+    memcpy(state->buffer + state->buffer_size, bytes, size);
+    state->buffer_size += size;
+
+    return;
+  }
+
+  if (state->buffer_size > 0) {
+    const size_t num_to_copy = 16 - state->buffer_size;
+    memcpy(state->buffer + state->buffer_size, bytes, num_to_copy);
+    bytes += num_to_copy;
+    size -= num_to_copy;
+
+    for (size_t i = 0; i < 4; ++i) {
+      state->accumulators[i] = round_accumulator(
+          state->accumulators[i], read_le32(state->buffer + 4 * i));
+    }
+
+    state->buffer_size = 0;
+  }
+
+  while (size >= 16) {
+    for (size_t i = 0; i < 4; ++i) {
+      state->accumulators[i] =
+          round_accumulator(state->accumulators[i], read_le32(bytes + 4 * i));
+    }
+
+    bytes += 16;
+    size -= 16;
+  }
+
+  memcpy(state->buffer, bytes, size);
+  state->buffer_size = size;
+}
+
+uint32_t xxh32_digest(const Xxh32State *state) {
+  assert(state);
+
+  uint32_t hash;
+
+  if (state->total_length >= 16) {
+    hash = rotate_left(state->accumulators[0], 1) +
+           rotate_left(state->accumulators[1], 7) +
+           rotate_left(state->accumulators[2], 12) +
+           rotate_left(state->accumulators[3], 18);
+  } else {
+    hash = state->seed + PRIME5;
+  }
+
+  hash += (uint32_t)state->total_length;
+
+  const unsigned char *bytes = state->buffer;
+  size_t size = state->buffer_size;
+
+  while (size >= 4) {
+    hash += read_le32(bytes) * PRIME3;
+    hash = rotate_left(hash, 17) * PRIME4;
+    bytes += 4;
+    size -= 4;
+  }
+
+  while (size > 0) {
+    hash += (uint32_t)*bytes * PRIME5;
+    hash = rotate_left(hash, 11) * PRIME1;
+    ++bytes;
+    --size;
+  }
+
+  hash ^= hash >> 15;
+  hash *= PRIME2;
+  hash ^= hash >> 13;
+  hash *= PRIME3;
+  hash ^= hash >> 16;
+
+  return hash;
+}
+
+uint32_t xxh32(const void *data, size_t size, uint32_t seed) {
+  Xxh32State state;
+  xxh32_reset(&state, seed);
+  xxh32_update(&state, data, size);
+
+  return xxh32_digest(&state);
+}
+
+static uint32_t rotate_left(uint32_t value, unsigned amount) {
+  return (value << amount) | (value >> (32 - amount));
+}
+
+static uint32_t read_le32(const unsigned char *bytes) {
+  return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) |
+         ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static uint32_t round_accumulator(uint32_t accumulator, uint32_t lane) {
+  accumulator += lane * PRIME2;
+  accumulator = rotate_left(accumulator, 13);
+
+  return accumulator * PRIME1;
+}
@@ -0,0 +1,42 @@
+// Copyright (c) 2019 Gregory Meyer
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef COMMON_INTERNAL_XXH32_H
+#define COMMON_INTERNAL_XXH32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// XXH32, as used by the LZ4 frame format for header, block, and content
+// checksums. liblz4 doesn't export its copy.
+typedef struct Xxh32State {
+  uint32_t accumulators[4];
+  uint64_t total_length;
+  unsigned char buffer[16];
+  size_t buffer_size;
+  uint32_t seed;
+} Xxh32State;
+
+void xxh32_reset(Xxh32State *state, uint32_t seed);
+void xxh32_update(Xxh32State *state, const void *data, size_t size);
+uint32_t xxh32_digest(const Xxh32State *state);
+uint32_t xxh32(const void *data, size_t size, uint32_t seed);
+
+#endif
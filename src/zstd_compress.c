@@ -23,12 +23,44 @@
 #include <common/error.h>
 #include <common/mmc.h>
 
+#include "frontends.h"
+
 #include <assert.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
+#define ZSTD_STATIC_LINKING_ONLY
 #include <zstd.h>
 
+#define MIN(X, Y) (((Y) < (X)) ? (Y) : (X))
+#define MAX(X, Y) (((Y) > (X)) ? (Y) : (X))
+
+// from the zstd seekable format specification
+#define SEEK_TABLE_MAGIC_NUMBER 0x184D2A5Eu
+#define SEEKABLE_MAGIC_NUMBER 0x8F92EAB1u
+#define SEEK_TABLE_FOOTER_SIZE 9
+#define SEEK_TABLE_ENTRY_SIZE 8
+#define MAX_SEEKABLE_FRAME_SIZE (1ll << 30)
+#define DEFAULT_SEEKABLE_FRAME_SIZE ((size_t)1 << 20)
+
+// the largest window zstd decompresses without being told it may use more, so
+// that --long output doesn't need mzd --memory
+#define DEFAULT_LONG_WINDOW_LOG ZSTD_WINDOWLOG_LIMIT_DEFAULT
+
+// levels past 19 need a larger window than the zstd CLI uses without --ultra
+#define DEFAULT_ADAPT_MIN_LEVEL 1
+#define DEFAULT_ADAPT_MAX_LEVEL 19
+// frames are larger than seekable ones, as no one seeks in them
+#define DEFAULT_ADAPT_FRAME_SIZE ((size_t)4 << 20)
+
+typedef struct SeekTableEntry {
+  uint32_t compressed_size;
+  uint32_t decompressed_size;
+} SeekTableEntry;
+
 typedef struct State {
   IntegerArgumentParser level_parser;
   KeywordArgument level;
@@ -36,13 +68,82 @@ typedef struct State {
   StringArgumentParser strategy_parser;
   KeywordArgument strategy;
 
+  ThreadCountArgumentParser threads_parser;
+  KeywordArgument threads;
+
+  IntegerArgumentParser job_size_parser;
+  KeywordArgument job_size;
+
+  IntegerArgumentParser overlap_log_parser;
+  KeywordArgument overlap_log;
+
+  KeywordArgument report_jobs;
+
+  KeywordArgument seekable;
+
+  IntegerArgumentParser frame_size_parser;
+  KeywordArgument frame_size;
+
+  RangeArgumentParser adapt_parser;
+  KeywordArgument adapt;
+
+  IntegerArgumentParser long_window_log_parser;
+  KeywordArgument long_window_log;
+
+  ParameterArgumentParser parameter_parser;
+  KeywordArgument parameter;
+
+  PassthroughArgumentParser dictionary_parser;
+  KeywordArgument dictionary;
+
+  // loaded by prepare and shared by every copy of the state in batch mode
+  FileAndMapping dictionary_file;
+  ZSTD_CDict *digested_dictionary;
+
   ZSTD_CCtx *compression_context;
+
+  SeekTableEntry *seek_table;
+  size_t num_frames;
+  size_t seek_table_capacity;
+
+  struct timespec start_time;
+  struct timespec last_job_time;
+  double last_job_seconds_in_zstd;
+  double seconds_in_zstd;
+  unsigned last_job_id;
+
+  // with --adapt, the level in use and how long runs and the time between
+  // them have taken since it last changed
+  int adapted_level;
+  struct timespec last_run_time;
+  double adapt_seconds_in_codec;
+  double adapt_seconds_in_io;
+  unsigned adapt_job_id;
 } State;
 
-size_t size(size_t input_file_size, void *state_v);
-Error init(AppIOState *io_state, void *state_v);
-Error run(AppIOState *io_state, bool *finished, void *state_v);
-void cleanup(AppIOState *io_state, void *state_v);
+static size_t size(const FileAndMapping *input_file, void *state_v);
+static Error init(AppIOState *io_state, void *state_v);
+static Error run(AppIOState *io_state, bool *finished, void *state_v);
+static void cleanup(AppIOState *io_state, void *state_v);
+static Error reset(AppIOState *io_state, void *state_v);
+static Error prepare(void *state_v);
+static void release(void *state_v);
+
+static bool compresses_in_one_call(const State *state);
+static Error compress_in_one_call(AppIOState *io_state, State *state);
+static Error compress_stream(AppIOState *io_state, bool *finished,
+                             State *state);
+static Error compress_frame(AppIOState *io_state, bool *finished,
+                            State *state);
+static Error write_seek_table(AppIOState *io_state, State *state);
+static void start_job_progress(State *state);
+static void report_job_progress(State *state, bool finished);
+static void start_adapting(State *state);
+static void start_adapt_run(State *state);
+static void finish_adapt_run(State *state);
+static void adapt_level(State *state);
+static void write_le32(unsigned char *output, uint32_t value);
+static double seconds_between(struct timespec first, struct timespec second);
 
 static const char *const STRATEGY_VALUES[] = {"fast",  "dfast",   "greedy",
                                               "lazy",  "lazy2",   "btlazy2",
@@ -51,7 +152,28 @@ static const ZSTD_strategy STRATEGY_MAPPING[] = {
     ZSTD_fast,    ZSTD_dfast, ZSTD_greedy,  ZSTD_lazy,    ZSTD_lazy2,
     ZSTD_btlazy2, ZSTD_btopt, ZSTD_btultra, ZSTD_btultra2};
 
+// named like the ZSTD_c_ constants they set
+static const char *const PARAMETER_NAMES[] = {
+    "windowLog",      "hashLog",          "chainLog",     "searchLog",
+    "minMatch",       "targetLength",     "jobSize",      "overlapLog",
+    "ldmHashLog",     "ldmMinMatch",      "ldmBucketSizeLog",
+    "ldmHashRateLog", "checksumFlag"};
+static const ZSTD_cParameter PARAMETER_MAPPING[] = {
+    ZSTD_c_windowLog,    ZSTD_c_hashLog,          ZSTD_c_chainLog,
+    ZSTD_c_searchLog,    ZSTD_c_minMatch,         ZSTD_c_targetLength,
+    ZSTD_c_jobSize,      ZSTD_c_overlapLog,       ZSTD_c_ldmHashLog,
+    ZSTD_c_ldmMinMatch,  ZSTD_c_ldmBucketSizeLog, ZSTD_c_ldmHashRateLog,
+    ZSTD_c_checksumFlag};
+
+#define NUM_PARAMETERS (sizeof(PARAMETER_NAMES) / sizeof(PARAMETER_NAMES[0]))
+
+#ifndef MMC_MULTI_CALL
 int main(int argc, const char *const argv[]) {
+  return zstd_compress_main(argc, argv);
+}
+#endif
+
+int zstd_compress_main(int argc, const char *const argv[]) {
   const int min_level = ZSTD_minCLevel();
   const int max_level = ZSTD_maxCLevel();
 
@@ -60,6 +182,103 @@ int main(int argc, const char *const argv[]) {
           "Compression level to use. An integer in the range [%d, %d].",
           min_level, max_level);
 
+  const ZSTD_bounds workers_bounds = ZSTD_cParam_getBounds(ZSTD_c_nbWorkers);
+  const int max_workers =
+      (ZSTD_isError(workers_bounds.error) || workers_bounds.upperBound < 1)
+          ? 1
+          : workers_bounds.upperBound;
+
+  char threads_help_text[512];
+  sprintf(threads_help_text,
+          "Number of worker threads to compress with, or 'auto' to use one "
+          "worker per online processor. An integer in the range [1, %d]. If "
+          "set, input is streamed to zstd's worker pool one job at a time "
+          "and compressed jobs are flushed directly into the output file. If "
+          "not set, the input is compressed by the calling thread.",
+          max_workers);
+
+  const ZSTD_bounds job_size_bounds = ZSTD_cParam_getBounds(ZSTD_c_jobSize);
+  assert(!ZSTD_isError(job_size_bounds.error));
+
+  char job_size_help_text[512];
+  sprintf(job_size_help_text,
+          "Size of each compression job in bytes when compressing with "
+          "multiple threads. An integer in the range [%d, %d]. 0 selects a "
+          "size based on the compression parameters; other values are "
+          "raised to zstd's minimum job size.",
+          job_size_bounds.lowerBound, job_size_bounds.upperBound);
+
+  const ZSTD_bounds overlap_log_bounds =
+      ZSTD_cParam_getBounds(ZSTD_c_overlapLog);
+  assert(!ZSTD_isError(overlap_log_bounds.error));
+
+  char overlap_log_help_text[512];
+  sprintf(overlap_log_help_text,
+          "Amount of data reloaded from the previous job when compressing "
+          "with multiple threads. An integer in the range [%d, %d]. 0 "
+          "selects an amount based on the strategy, 1 reloads nothing, and "
+          "9 reloads a full window; each step in between doubles the size.",
+          overlap_log_bounds.lowerBound, overlap_log_bounds.upperBound);
+
+  const ZSTD_bounds window_log_bounds = ZSTD_cParam_getBounds(ZSTD_c_windowLog);
+  assert(!ZSTD_isError(window_log_bounds.error));
+
+  char long_help_text[1024];
+  sprintf(long_help_text,
+          "If set, enables long-distance matching with a window of "
+          "2^WINDOWLOG bytes, which finds repeats that are too far apart for "
+          "the window of the compression level, such as those in disk images "
+          "and database dumps. An integer in the range [%d, %d]; the default "
+          "is %d (128 MiB), the largest window mzd and zstd decompress "
+          "without being told they may. Larger windows may need mzd "
+          "--memory=2^(WINDOWLOG - 20) to decompress.",
+          window_log_bounds.lowerBound, window_log_bounds.upperBound,
+          DEFAULT_LONG_WINDOW_LOG);
+
+  Parameter parameters[NUM_PARAMETERS];
+
+  char parameter_help_text[2048];
+  int parameter_help_text_size =
+      sprintf(parameter_help_text,
+              "Sets one of zstd's advanced compression parameters, which "
+              "take precedence over those of the level. Can be given any "
+              "number of times. NAME is one of");
+
+  for (size_t i = 0; i < NUM_PARAMETERS; ++i) {
+    const ZSTD_bounds bounds = ZSTD_cParam_getBounds(PARAMETER_MAPPING[i]);
+    assert(!ZSTD_isError(bounds.error));
+
+    parameters[i] = (Parameter){
+        .name = PARAMETER_NAMES[i],
+        .min_value = (long long)bounds.lowerBound,
+        .max_value = (long long)bounds.upperBound,
+    };
+
+    parameter_help_text_size +=
+        sprintf(parameter_help_text + parameter_help_text_size,
+                " %s [%d, %d]%s", PARAMETER_NAMES[i], bounds.lowerBound,
+                bounds.upperBound, (i + 1 < NUM_PARAMETERS) ? "," : ".");
+  }
+
+  sprintf(parameter_help_text + parameter_help_text_size,
+          " The ldm parameters only take effect with --long.");
+
+  char adapt_help_text[1024];
+  sprintf(adapt_help_text,
+          "If set, raises or lowers the compression level between frames, or "
+          "between jobs when compressing with multiple threads, so that "
+          "compression runs at the speed the output is written back. The "
+          "level is raised by one when more time was spent writing back "
+          "output than compressing, and lowered by one when less than half "
+          "as much was. Both ends of the range are integers in [%d, %d]; the "
+          "default is %d:%d. On one thread, the input is compressed as "
+          "independent frames of --frame-size bytes. Output that the kernel "
+          "writes back on its own time costs nothing to measure, so this is "
+          "most useful with --io=pwrite or io_uring, --sync=data, or a "
+          "pipe.",
+          min_level, max_level, DEFAULT_ADAPT_MIN_LEVEL,
+          DEFAULT_ADAPT_MAX_LEVEL);
+
   State state = {
       .level_parser = make_integer_parser(
           "-l, --level", "LEVEL", (long long)min_level, (long long)max_level),
@@ -86,9 +305,149 @@ int main(int argc, const char *const argv[]) {
                            "order of compression ratio and time.",
               .parser = &state.strategy_parser.argument_parser,
           },
+
+      .threads_parser =
+          make_thread_count_parser("-t, --threads", "THREADS", max_workers),
+      .threads =
+          {
+              .short_name = 't',
+              .long_name = "threads",
+              .help_text = threads_help_text,
+              .parser = &state.threads_parser.argument_parser,
+          },
+
+      .job_size_parser = make_integer_parser(
+          "-j, --job-size", "SIZE", (long long)job_size_bounds.lowerBound,
+          (long long)job_size_bounds.upperBound),
+      .job_size =
+          {
+              .short_name = 'j',
+              .long_name = "job-size",
+              .help_text = job_size_help_text,
+              .parser = &state.job_size_parser.argument_parser,
+          },
+
+      .overlap_log_parser =
+          make_integer_parser("-o, --overlap-log", "LOG",
+                              (long long)overlap_log_bounds.lowerBound,
+                              (long long)overlap_log_bounds.upperBound),
+      .overlap_log =
+          {
+              .short_name = 'o',
+              .long_name = "overlap-log",
+              .help_text = overlap_log_help_text,
+              .parser = &state.overlap_log_parser.argument_parser,
+          },
+
+      .report_jobs =
+          {
+              .short_name = 'r',
+              .long_name = "report-jobs",
+              .help_text =
+                  "If set, prints a line to stderr each time a new "
+                  "compression job is started when compressing with "
+                  "multiple threads. Each line reports the time since the "
+                  "previous job, how much of that time was spent in zstd "
+                  "(which includes flushing to the output mapping), and how "
+                  "many compressed bytes are still waiting to be flushed. "
+                  "With --adapt, also prints each change of level.",
+              .parser = NULL,
+          },
+
+      .seekable =
+          {
+              .short_name = 'S',
+              .long_name = "seekable",
+              .help_text =
+                  "If set, writes the zstd seekable format: the input is "
+                  "split into independent frames of --frame-size bytes and "
+                  "a seek table is appended in a skippable frame, so that "
+                  "ranges of the output can be decompressed on their own "
+                  "with mzd --offset and --length. The output is still "
+                  "readable by any zstd decoder.",
+              .parser = NULL,
+          },
+
+      .frame_size_parser = make_integer_parser("-f, --frame-size", "SIZE", 1,
+                                               MAX_SEEKABLE_FRAME_SIZE),
+      .frame_size =
+          {
+              .short_name = 'f',
+              .long_name = "frame-size",
+              .help_text =
+                  "Number of input bytes in each frame when writing the "
+                  "seekable format or adapting the level on one thread. An "
+                  "integer in the range [1, 1073741824]. Smaller frames make "
+                  "range extraction cheaper and compression worse. The "
+                  "default is 1048576 (1 MiB) for the seekable format and "
+                  "4194304 (4 MiB) otherwise.",
+              .parser = &state.frame_size_parser.argument_parser,
+          },
+
+      .adapt_parser = make_range_parser("--adapt", "MIN:MAX",
+                                        (long long)min_level,
+                                        (long long)max_level),
+      .adapt =
+          {
+              .short_name = '\0',
+              .long_name = "adapt",
+              .help_text = adapt_help_text,
+              .parser = &state.adapt_parser.argument_parser,
+              .has_optional_value = true,
+          },
+
+      .long_window_log_parser = make_integer_parser(
+          "--long", "WINDOWLOG", (long long)window_log_bounds.lowerBound,
+          (long long)window_log_bounds.upperBound),
+      .long_window_log =
+          {
+              .short_name = '\0',
+              .long_name = "long",
+              .help_text = long_help_text,
+              .parser = &state.long_window_log_parser.argument_parser,
+              .has_optional_value = true,
+          },
+
+      .parameter_parser = make_parameter_parser(
+          "--param", "NAME=VALUE", NUM_PARAMETERS, parameters),
+      .parameter =
+          {
+              .short_name = '\0',
+              .long_name = "param",
+              .help_text = parameter_help_text,
+              .parser = &state.parameter_parser.argument_parser,
+          },
+
+      .dictionary_parser = make_passthrough_parser("-D, --dict", "FILE"),
+      .dictionary =
+          {
+              .short_name = 'D',
+              .long_name = "dict",
+              .help_text =
+                  "Dictionary to compress with, such as one trained by mzt. "
+                  "The file is mapped read-only and digested once for "
+                  "every file compressed with --batch. The same dictionary "
+                  "must be passed to mzd to decompress the output.",
+              .parser = &state.dictionary_parser.argument_parser,
+          },
+
+      .digested_dictionary = NULL,
+      .seek_table = NULL,
+      .num_frames = 0,
+      .seek_table_capacity = 0,
   };
 
-  KeywordArgument *keyword_args[] = {&state.level, &state.strategy};
+  // for --adapt and --long without a value
+  state.adapt_parser.lower_value = DEFAULT_ADAPT_MIN_LEVEL;
+  state.adapt_parser.upper_value = DEFAULT_ADAPT_MAX_LEVEL;
+  state.long_window_log_parser.value = DEFAULT_LONG_WINDOW_LOG;
+
+  KeywordArgument *keyword_args[] = {
+      &state.level,      &state.strategy,        &state.threads,
+      &state.job_size,   &state.overlap_log,     &state.report_jobs,
+      &state.seekable,   &state.frame_size,      &state.adapt,
+      &state.dictionary, &state.long_window_log, &state.parameter,
+  };
 
   return run_compression_app(
       argc, argv,
@@ -108,19 +467,24 @@ int main(int argc, const char *const argv[]) {
           .init = init,
           .run = run,
           .cleanup = cleanup,
+          .reset = reset,
+          .prepare = prepare,
+          .release = release,
           .arg = &state,
+          .arg_size = sizeof(state),
       });
 }
 
-size_t size(size_t input_file_size, void *state_v) {
+static size_t size(const FileAndMapping *input_file, void *state_v) {
+  assert(input_file);
   assert(state_v);
 
   (void)state_v;
 
-  return ZSTD_compressBound(input_file_size);
+  return ZSTD_compressBound(input_file->file_size);
 }
 
-Error init(AppIOState *io_state, void *state_v) {
+static Error init(AppIOState *io_state, void *state_v) {
   assert(io_state);
   assert(state_v);
 
@@ -147,23 +511,271 @@ Error init(AppIOState *io_state, void *state_v) {
     (void)result;
   }
 
+  if (state->threads.was_found) {
+    const size_t result =
+        ZSTD_CCtx_setParameter(compression_context, ZSTD_c_nbWorkers,
+                               (int)state->threads_parser.value);
+
+    if (ZSTD_isError(result)) {
+      ZSTD_freeCCtx(compression_context);
+
+      return eformat("couldn't use %lld worker threads: %s (%zu)",
+                     state->threads_parser.value, ZSTD_getErrorName(result),
+                     result);
+    }
+
+    // the streaming API can't infer the content size, but seekable frames
+    // are compressed with ZSTD_compress2, which sets it itself
+    if (!state->seekable.was_found) {
+      const size_t pledge_result = ZSTD_CCtx_setPledgedSrcSize(
+          compression_context,
+          (unsigned long long)io_state->input_file.mapping_size);
+      assert(!ZSTD_isError(pledge_result));
+      (void)pledge_result;
+    }
+  }
+
+  if (state->job_size.was_found) {
+    const size_t result =
+        ZSTD_CCtx_setParameter(compression_context, ZSTD_c_jobSize,
+                               (int)state->job_size_parser.value);
+    assert(!ZSTD_isError(result));
+    (void)result;
+  }
+
+  if (state->overlap_log.was_found) {
+    const size_t result =
+        ZSTD_CCtx_setParameter(compression_context, ZSTD_c_overlapLog,
+                               (int)state->overlap_log_parser.value);
+    assert(!ZSTD_isError(result));
+    (void)result;
+  }
+
+  // the input is mapped in full, so a large window costs no copy of it. zstd
+  // still shrinks the window to fit smaller inputs
+  if (state->long_window_log.was_found) {
+    size_t result = ZSTD_CCtx_setParameter(
+        compression_context, ZSTD_c_enableLongDistanceMatching, 1);
+    assert(!ZSTD_isError(result));
+
+    result = ZSTD_CCtx_setParameter(compression_context, ZSTD_c_windowLog,
+                                    (int)state->long_window_log_parser.value);
+    assert(!ZSTD_isError(result));
+    (void)result;
+  }
+
+  // after the options above, so that --param overrides them
+  for (size_t i = 0; i < NUM_PARAMETERS; ++i) {
+    const Parameter *const parameter = &state->parameter_parser.parameters[i];
+
+    if (!parameter->was_set) {
+      continue;
+    }
+
+    const size_t result = ZSTD_CCtx_setParameter(
+        compression_context, PARAMETER_MAPPING[i], (int)parameter->value);
+
+    if (ZSTD_isError(result)) {
+      ZSTD_freeCCtx(compression_context);
+
+      return eformat("couldn't set parameter %s to %lld: %s (%zu)",
+                     parameter->name, parameter->value,
+                     ZSTD_getErrorName(result), result);
+    }
+  }
+
   // no need to call ZSTD_CCtx_setPledgedSize, as ZSTD_compress2 overwrites it
 
+  // the reference survives ZSTD_CCtx_reset, so reset doesn't repeat this
+  if (state->digested_dictionary) {
+    const size_t result = ZSTD_CCtx_refCDict(compression_context,
+                                             state->digested_dictionary);
+    assert(!ZSTD_isError(result));
+    (void)result;
+  }
+
   state->compression_context = compression_context;
 
+  if (state->adapt.was_found) {
+    const int level = state->level.was_found ? (int)state->level_parser.value
+                                             : ZSTD_CLEVEL_DEFAULT;
+    state->adapted_level =
+        (int)MAX(MIN((long long)level, state->adapt_parser.upper_value),
+                 state->adapt_parser.lower_value);
+
+    const size_t result =
+        ZSTD_CCtx_setParameter(compression_context, ZSTD_c_compressionLevel,
+                               state->adapted_level);
+    assert(!ZSTD_isError(result));
+    (void)result;
+
+    start_adapting(state);
+  }
+
+  start_job_progress(state);
+  io_state->runs_in_one_call = compresses_in_one_call(state);
+
   return NULL_ERROR;
 }
 
-Error run(AppIOState *io_state, bool *finished, void *state_v) {
+static Error run(AppIOState *io_state, bool *finished, void *state_v) {
   assert(io_state);
   assert(finished);
   assert(state_v);
 
   State *const state = state_v;
 
+  if (state->adapt.was_found) {
+    start_adapt_run(state);
+  }
+
+  Error error;
+
+  // on one thread, a new level only takes effect with the next frame
+  if (state->seekable.was_found ||
+      (state->adapt.was_found && !state->threads.was_found)) {
+    error = compress_frame(io_state, finished, state);
+  } else if (state->threads.was_found) {
+    error = compress_stream(io_state, finished, state);
+  } else {
+    *finished = true;
+    error = compress_in_one_call(io_state, state);
+  }
+
+  if (!error.what && state->adapt.was_found) {
+    finish_adapt_run(state);
+  }
+
+  return error;
+}
+
+static void cleanup(AppIOState *io_state, void *state_v) {
+  assert(io_state);
+  assert(state_v);
+
+  (void)io_state;
+
+  State *const state = state_v;
+
+  assert(state->compression_context);
+
+  const size_t result = ZSTD_freeCCtx(state->compression_context);
+  assert(!ZSTD_isError(result));
+  (void)result;
+
+  free(state->seek_table);
+}
+
+static Error reset(AppIOState *io_state, void *state_v) {
+  assert(io_state);
+  assert(state_v);
+
+  State *const state = state_v;
+
+  // keeps the parameters set by init
+  const size_t result = ZSTD_CCtx_reset(state->compression_context,
+                                        ZSTD_reset_session_only);
+  assert(!ZSTD_isError(result));
+  (void)result;
+
+  if (state->threads.was_found && !state->seekable.was_found) {
+    const size_t pledge_result = ZSTD_CCtx_setPledgedSrcSize(
+        state->compression_context,
+        (unsigned long long)io_state->input_file.mapping_size);
+    assert(!ZSTD_isError(pledge_result));
+    (void)pledge_result;
+  }
+
+  state->num_frames = 0;
+  start_job_progress(state);
+  io_state->runs_in_one_call = compresses_in_one_call(state);
+
+  // the level carries over, as the next file is most likely written to the
+  // same place
+  if (state->adapt.was_found) {
+    start_adapting(state);
+  }
+
+  return NULL_ERROR;
+}
+
+// the dictionary is digested at the compression level once, instead of by
+// every context that loads it
+static Error prepare(void *state_v) {
+  assert(state_v);
+
+  State *const state = state_v;
+
+  if (!state->dictionary.was_found) {
+    return NULL_ERROR;
+  }
+
+  const Error error = open_and_map_file(state->dictionary_parser.value,
+                                        &state->dictionary_file);
+
+  if (error.what) {
+    return error;
+  }
+
+  const int level = state->level.was_found ? (int)state->level_parser.value
+                                           : ZSTD_CLEVEL_DEFAULT;
+
+  // referencing the mapping keeps its only copy in the page cache
+  state->digested_dictionary = ZSTD_createCDict_byReference(
+      state->dictionary_file.mapping, state->dictionary_file.file_size, level);
+
+  if (!state->digested_dictionary) {
+    free_file(state->dictionary_file);
+
+    return eformat("couldn't digest dictionary '%s'",
+                   state->dictionary_parser.value);
+  }
+
+  return NULL_ERROR;
+}
+
+static void release(void *state_v) {
+  assert(state_v);
+
+  State *const state = state_v;
+
+  if (!state->digested_dictionary) {
+    return;
+  }
+
+  ZSTD_freeCDict(state->digested_dictionary);
+
+  const Error error = free_file(state->dictionary_file);
+
+  if (error.what) {
+    print_warning(error);
+  }
+}
+
+// without worker threads, frames or level changes to make, the whole input is
+// handed to ZSTD_compress2
+static bool compresses_in_one_call(const State *state) {
+  assert(state);
+
+  return !state->seekable.was_found && !state->adapt.was_found &&
+         !state->threads.was_found;
+}
+
+static Error compress_in_one_call(AppIOState *io_state, State *state) {
+  assert(io_state);
+  assert(state);
+
+  FileAndMapping *const output_file = &io_state->output_file;
+  const Error error = reserve_output_mapping(
+      output_file, 0, ZSTD_compressBound(io_state->input_file.mapping_size));
+
+  if (error.what) {
+    return error;
+  }
+
   const size_t output_final_size_or_error = ZSTD_compress2(
-      state->compression_context, io_state->output_file.mapping,
-      io_state->output_file.mapping_size, io_state->input_file.mapping,
+      state->compression_context, output_file->mapping,
+      output_file->mapping_size, io_state->input_file.mapping,
       io_state->input_file.mapping_size);
 
   if (ZSTD_isError(output_final_size_or_error)) {
@@ -179,22 +791,337 @@ Error run(AppIOState *io_state, bool *finished, void *state_v) {
   io_state->output_mapping_first_unused_offset = output_final_size_or_error;
   io_state->output_bytes_written = output_final_size_or_error;
 
-  *finished = true;
+  return NULL_ERROR;
+}
+
+// each call hands zstd as much of the input as its worker pool will accept
+// and collects whatever compressed jobs are ready, returning to the driver
+// so that consumed input and flushed output can be unmapped as we go
+static Error compress_stream(AppIOState *io_state, bool *finished,
+                             State *state) {
+  assert(io_state);
+  assert(finished);
+  assert(state);
+
+  ZSTD_inBuffer in_buffer = {
+      .src = io_state->input_file.mapping,
+      .size = io_state->input_file.mapping_size,
+      .pos = io_state->input_mapping_first_unused_offset,
+  };
+
+  ZSTD_outBuffer out_buffer = {
+      .dst = io_state->output_file.mapping,
+      .size = io_state->output_file.mapping_size,
+      .pos = io_state->output_mapping_first_unused_offset,
+  };
+
+  struct timespec before;
+  clock_gettime(CLOCK_MONOTONIC, &before);
+
+  // ZSTD_e_end doesn't return until the frame is complete or the output is
+  // full, so only switch to it once all input has been handed to zstd
+  const ZSTD_EndDirective end_op =
+      (in_buffer.pos == in_buffer.size) ? ZSTD_e_end : ZSTD_e_continue;
+
+  const size_t remaining_or_error = ZSTD_compressStream2(
+      state->compression_context, &out_buffer, &in_buffer, end_op);
+
+  struct timespec after;
+  clock_gettime(CLOCK_MONOTONIC, &after);
+  state->seconds_in_zstd += seconds_between(before, after);
+
+  if (ZSTD_isError(remaining_or_error)) {
+    const char *const what = ZSTD_getErrorName(remaining_or_error);
+
+    return eformat("couldn't compress input file '%s': %s (%zu)",
+                   io_state->input_file.filename, what, remaining_or_error);
+  }
+
+  const size_t output_bytes_written =
+      out_buffer.pos - io_state->output_mapping_first_unused_offset;
+
+  io_state->input_mapping_first_unused_offset = in_buffer.pos;
+  io_state->output_mapping_first_unused_offset = out_buffer.pos;
+  io_state->output_bytes_written += output_bytes_written;
+
+  *finished = (end_op == ZSTD_e_end && remaining_or_error == 0);
+
+  if (state->report_jobs.was_found) {
+    report_job_progress(state, *finished);
+  }
 
   return NULL_ERROR;
 }
 
-void cleanup(AppIOState *io_state, void *state_v) {
+// each call compresses one frame of at most --frame-size bytes. seekable
+// frames are recorded in the seek table, which is written after the last one
+static Error compress_frame(AppIOState *io_state, bool *finished,
+                            State *state) {
   assert(io_state);
-  assert(state_v);
+  assert(finished);
+  assert(state);
 
-  (void)io_state;
+  const size_t default_frame_size = state->seekable.was_found
+                                        ? DEFAULT_SEEKABLE_FRAME_SIZE
+                                        : DEFAULT_ADAPT_FRAME_SIZE;
+  const size_t frame_size = state->frame_size.was_found
+                                ? (size_t)state->frame_size_parser.value
+                                : default_frame_size;
+  const size_t input_size =
+      MIN(io_state->input_file.mapping_size -
+              io_state->input_mapping_first_unused_offset,
+          frame_size);
 
-  State *const state = state_v;
+  if (input_size > 0) {
+    if (state->seekable.was_found &&
+        state->num_frames == state->seek_table_capacity) {
+      const size_t new_capacity =
+          state->seek_table_capacity > 0 ? state->seek_table_capacity * 2 : 64;
+      SeekTableEntry *const new_seek_table =
+          realloc(state->seek_table, new_capacity * sizeof(SeekTableEntry));
 
-  assert(state->compression_context);
+      if (!new_seek_table) {
+        return ERROR_OUT_OF_MEMORY;
+      }
 
-  const size_t result = ZSTD_freeCCtx(state->compression_context);
+      state->seek_table = new_seek_table;
+      state->seek_table_capacity = new_capacity;
+    }
+
+    FileAndMapping *const output_file = &io_state->output_file;
+    const Error error = reserve_output_mapping(
+        output_file, io_state->output_mapping_first_unused_offset,
+        ZSTD_compressBound(input_size));
+
+    if (error.what) {
+      return error;
+    }
+
+    const size_t output_size_or_error = ZSTD_compress2(
+        state->compression_context,
+        (char *)output_file->mapping +
+            io_state->output_mapping_first_unused_offset,
+        output_file->mapping_size -
+            io_state->output_mapping_first_unused_offset,
+        (const char *)io_state->input_file.mapping +
+            io_state->input_mapping_first_unused_offset,
+        input_size);
+
+    if (ZSTD_isError(output_size_or_error)) {
+      const char *const what = ZSTD_getErrorName(output_size_or_error);
+
+      return eformat("couldn't compress input file '%s': %s (%zu)",
+                     io_state->input_file.filename, what,
+                     output_size_or_error);
+    }
+
+    if (state->seekable.was_found) {
+      state->seek_table[state->num_frames] = (SeekTableEntry){
+          .compressed_size = (uint32_t)output_size_or_error,
+          .decompressed_size = (uint32_t)input_size,
+      };
+      ++state->num_frames;
+    }
+
+    io_state->input_mapping_first_unused_offset += input_size;
+    io_state->output_mapping_first_unused_offset += output_size_or_error;
+    io_state->output_bytes_written += output_size_or_error;
+  }
+
+  if (io_state->input_mapping_first_unused_offset <
+      io_state->input_file.mapping_size) {
+    *finished = false;
+
+    return NULL_ERROR;
+  }
+
+  *finished = true;
+
+  if (!state->seekable.was_found) {
+    return NULL_ERROR;
+  }
+
+  return write_seek_table(io_state, state);
+}
+
+static Error write_seek_table(AppIOState *io_state, State *state) {
+  assert(io_state);
+  assert(state);
+
+  if (state->num_frames >
+      (UINT32_MAX - SEEK_TABLE_FOOTER_SIZE) / SEEK_TABLE_ENTRY_SIZE) {
+    return eformat("too many frames (%zu) for a seek table", state->num_frames);
+  }
+
+  const size_t frame_content_size =
+      state->num_frames * SEEK_TABLE_ENTRY_SIZE + SEEK_TABLE_FOOTER_SIZE;
+  const size_t seek_table_size = 8 + frame_content_size;
+
+  FileAndMapping *const output_file = &io_state->output_file;
+  const Error error = reserve_output_mapping(
+      output_file, io_state->output_mapping_first_unused_offset,
+      seek_table_size);
+
+  if (error.what) {
+    return error;
+  }
+
+  unsigned char *output = (unsigned char *)output_file->mapping +
+                          io_state->output_mapping_first_unused_offset;
+
+  write_le32(output, SEEK_TABLE_MAGIC_NUMBER);
+  write_le32(output + 4, (uint32_t)frame_content_size);
+  output += 8;
+
+  for (size_t i = 0; i < state->num_frames; ++i) {
+    write_le32(output, state->seek_table[i].compressed_size);
+    write_le32(output + 4, state->seek_table[i].decompressed_size);
+    output += SEEK_TABLE_ENTRY_SIZE;
+  }
+
+  // the descriptor byte is 0: no per-frame checksums
+  write_le32(output, (uint32_t)state->num_frames);
+  output[4] = 0;
+  write_le32(output + 5, SEEKABLE_MAGIC_NUMBER);
+
+  io_state->output_mapping_first_unused_offset += seek_table_size;
+  io_state->output_bytes_written += seek_table_size;
+
+  return NULL_ERROR;
+}
+
+static void start_job_progress(State *state) {
+  assert(state);
+
+  clock_gettime(CLOCK_MONOTONIC, &state->start_time);
+  state->last_job_time = state->start_time;
+  state->last_job_seconds_in_zstd = 0.0;
+  state->seconds_in_zstd = 0.0;
+  state->last_job_id = 0;
+}
+
+static void report_job_progress(State *state, bool finished) {
+  assert(state);
+
+  const ZSTD_frameProgression progression =
+      ZSTD_getFrameProgression(state->compression_context);
+
+  if (!finished && progression.currentJobID == state->last_job_id) {
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  const double seconds_since_start = seconds_between(state->start_time, now);
+  const double seconds_since_last_job =
+      seconds_between(state->last_job_time, now);
+  const double seconds_in_zstd_since_last_job =
+      state->seconds_in_zstd - state->last_job_seconds_in_zstd;
+
+  fprintf(stderr,
+          "%s: job %u%s at %.3f ms: %.3f ms since job %u (%.3f ms in zstd), "
+          "%llu bytes consumed, %llu produced, %llu waiting to be flushed, "
+          "%u active workers\n",
+          executable_name, progression.currentJobID,
+          finished ? " (finished)" : "", seconds_since_start * 1e3,
+          seconds_since_last_job * 1e3, state->last_job_id,
+          seconds_in_zstd_since_last_job * 1e3, progression.consumed,
+          progression.produced, progression.produced - progression.flushed,
+          progression.nbActiveWorkers);
+
+  state->last_job_time = now;
+  state->last_job_seconds_in_zstd = state->seconds_in_zstd;
+  state->last_job_id = progression.currentJobID;
+}
+
+static void start_adapting(State *state) {
+  assert(state);
+
+  clock_gettime(CLOCK_MONOTONIC, &state->last_run_time);
+  state->adapt_seconds_in_codec = 0.0;
+  state->adapt_seconds_in_io = 0.0;
+  state->adapt_job_id = 0;
+}
+
+// between runs, the driver hands the output to the kernel and waits for as
+// much of it to be written back as --io and --sync call for
+static void start_adapt_run(State *state) {
+  assert(state);
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  state->adapt_seconds_in_io += seconds_between(state->last_run_time, now);
+  state->last_run_time = now;
+}
+
+static void finish_adapt_run(State *state) {
+  assert(state);
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  state->adapt_seconds_in_codec += seconds_between(state->last_run_time, now);
+  state->last_run_time = now;
+
+  // zstd's workers only pick up a new level with their next job, so there's
+  // no use in changing it more often than jobs start
+  if (state->threads.was_found && !state->seekable.was_found) {
+    const ZSTD_frameProgression progression =
+        ZSTD_getFrameProgression(state->compression_context);
+
+    if (progression.currentJobID == state->adapt_job_id) {
+      return;
+    }
+
+    state->adapt_job_id = progression.currentJobID;
+  }
+
+  adapt_level(state);
+}
+
+static void adapt_level(State *state) {
+  assert(state);
+
+  int level = state->adapted_level;
+
+  if (state->adapt_seconds_in_io > state->adapt_seconds_in_codec &&
+      level < state->adapt_parser.upper_value) {
+    ++level;
+  } else if (state->adapt_seconds_in_io * 2.0 < state->adapt_seconds_in_codec &&
+             level > state->adapt_parser.lower_value) {
+    --level;
+  }
+
+  state->adapt_seconds_in_codec = 0.0;
+  state->adapt_seconds_in_io = 0.0;
+
+  if (level == state->adapted_level) {
+    return;
+  }
+
+  const size_t result = ZSTD_CCtx_setParameter(
+      state->compression_context, ZSTD_c_compressionLevel, level);
   assert(!ZSTD_isError(result));
   (void)result;
+
+  if (state->report_jobs.was_found) {
+    fprintf(stderr, "%s: level %d -> %d\n", executable_name,
+            state->adapted_level, level);
+  }
+
+  state->adapted_level = level;
+}
+
+static double seconds_between(struct timespec first, struct timespec second) {
+  return (double)(second.tv_sec - first.tv_sec) +
+         (double)(second.tv_nsec - first.tv_nsec) / 1e9;
+}
+
+static void write_le32(unsigned char *output, uint32_t value) {
+  output[0] = (unsigned char)value;
+  output[1] = (unsigned char)(value >> 8);
+  output[2] = (unsigned char)(value >> 16);
+  output[3] = (unsigned char)(value >> 24);
 }
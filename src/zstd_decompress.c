@@ -22,21 +22,219 @@
 #include <common/argparse.h>
 #include <common/error.h>
 #include <common/mmc.h>
+#include <common/thread_pool.h>
+
+#include "frontends.h"
 
 #include <assert.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <unistd.h>
 
+#define ZSTD_STATIC_LINKING_ONLY
 #include <zstd.h>
+#include <zstd_errors.h>
 
-size_t size(size_t input_file_size, void *decompression_stream_ptr_v);
-Error init(AppIOState *io_state, void *decompression_stream_ptr_v);
-Error run(AppIOState *io_state, bool *finished,
-          void *decompression_stream_ptr_v);
-void cleanup(AppIOState *io_state, void *decompression_stream_ptr_v);
+#define MIN(X, Y) (((Y) < (X)) ? (Y) : (X))
+
+// from the zstd seekable format specification
+#define SEEK_TABLE_MAGIC_NUMBER 0x184D2A5Eu
+#define SEEKABLE_MAGIC_NUMBER 0x8F92EAB1u
+#define SEEK_TABLE_FOOTER_SIZE 9
+#define SEEK_TABLE_CHECKSUM_FLAG 0x80
+#define SEEK_TABLE_RESERVED_BITS 0x7C
+
+typedef struct Frame {
+  const void *input;
+  size_t input_offset;
+  size_t input_size;
+
+  size_t output_offset;
+  size_t output_size;
+  void *output;
+
+  Error error;
+} Frame;
+
+typedef struct Worker {
+  struct State *state;
+
+  ZSTD_DCtx *context;
+} Worker;
+
+typedef struct State {
+  ThreadCountArgumentParser threads_parser;
+  KeywordArgument threads;
+
+  IntegerArgumentParser offset_parser;
+  KeywordArgument offset;
+
+  IntegerArgumentParser length_parser;
+  KeywordArgument length;
+
+  PassthroughArgumentParser dictionary_parser;
+  KeywordArgument dictionary;
+
+  IntegerArgumentParser memory_parser;
+  KeywordArgument memory;
+
+  // loaded by prepare and shared by every copy of the state in batch mode
+  FileAndMapping dictionary_file;
+  ZSTD_DDict *digested_dictionary;
 
-int main(int argc, const char *const argv[]) {
   ZSTD_DStream *decompression_stream;
 
+  // only used when extracting a range. frame i starts at compressed_offsets[i]
+  // in the input and decompressed_offsets[i] in the decompressed content
+  size_t *compressed_offsets;
+  size_t *decompressed_offsets;
+  size_t num_frames_in_table;
+  size_t next_frame;
+  size_t end_frame;
+  size_t range_offset;
+  size_t range_remaining;
+
+  // only used when decompressing with multiple threads. has_pool is set once
+  // pool and frames_mutex are created
+  ThreadPool pool;
+  bool has_pool;
+  Worker *workers;
+  size_t num_workers;
+  bool is_in_serial_frame;
+
+  pthread_mutex_t frames_mutex;
+  const char *input_filename;
+  Frame *frames;
+  size_t num_frames;
+  size_t frames_capacity;
+  size_t next_frame_index;
+} State;
+
+static size_t size(const FileAndMapping *input_file, void *state_v);
+static Error init(AppIOState *io_state, void *state_v);
+static Error run(AppIOState *io_state, bool *finished, void *state_v);
+static void cleanup(AppIOState *io_state, void *state_v);
+static Error reset(AppIOState *io_state, void *state_v);
+static Error prepare(void *state_v);
+static void release(void *state_v);
+
+static Error run_serial(AppIOState *io_state, bool *frame_finished,
+                        State *state);
+static Error run_parallel(AppIOState *io_state, State *state);
+static Error run_range(AppIOState *io_state, bool *finished, State *state);
+static Error init_range(AppIOState *io_state, State *state);
+static size_t range_size(const FileAndMapping *input_file,
+                         const State *state);
+static Error read_seek_table(const FileAndMapping *input_file, State *state);
+static Error read_seek_table_entries(const FileAndMapping *input_file,
+                                     unsigned char **entries,
+                                     size_t *num_frames, size_t *entry_size,
+                                     size_t *seek_table_offset);
+static Error read_exactly(const FileAndMapping *file, void *buffer, size_t size,
+                          size_t offset);
+static Error init_parallel(State *state);
+static void cleanup_parallel(State *state);
+static Error decompress_frames(AppIOState *io_state, State *state);
+static Error push_frame(State *state, const Frame *frame);
+static void decompress_frames_task(void *worker_v);
+static void decompress_frame(ZSTD_DCtx *context, Frame *frame,
+                             const char *filename);
+static Error window_too_large_error(const AppIOState *io_state,
+                                    const State *state);
+static int window_log_max(const State *state);
+static uint32_t read_le32(const void *input);
+
+#ifndef MMC_MULTI_CALL
+int main(int argc, const char *const argv[]) {
+  return zstd_decompress_main(argc, argv);
+}
+#endif
+
+int zstd_decompress_main(int argc, const char *const argv[]) {
+  const ZSTD_bounds window_log_max_bounds =
+      ZSTD_dParam_getBounds(ZSTD_d_windowLogMax);
+  assert(!ZSTD_isError(window_log_max_bounds.error));
+
+  const long long max_memory = 1ll << (window_log_max_bounds.upperBound - 20);
+
+  char memory_help_text[512];
+  sprintf(memory_help_text,
+          "Largest window in MiB that a frame, such as one written by mzc "
+          "--long, may need when it's decompressed through a window of its "
+          "own: frames without a content size, and output through --io=pwrite "
+          "or io_uring or to a pipe. An integer in the range [1, %lld], "
+          "rounded down to a power of two. The default is %d, which bounds "
+          "the memory mzd allocates for frames from untrusted sources. Other "
+          "frames are decoded straight into the output and need no window.",
+          max_memory, 1 << (ZSTD_WINDOWLOG_LIMIT_DEFAULT - 20));
+
+  State state = {
+      .threads_parser =
+          make_thread_count_parser("-t, --threads", "THREADS", 1024),
+      .threads = {.short_name = 't',
+                  .long_name = "threads",
+                  .help_text =
+                      "Number of threads to decompress with, or 'auto' to use "
+                      "one thread per online processor. An integer in the "
+                      "range [1, 1024]. If set, concatenated frames whose "
+                      "content size is stored in their header are "
+                      "decompressed concurrently. Frames without a content "
+                      "size are decompressed serially.",
+                  .parser = &state.threads_parser.argument_parser},
+
+      .offset_parser =
+          make_integer_parser("-o, --offset", "OFFSET", 0, LLONG_MAX),
+      .offset = {.short_name = 'o',
+                 .long_name = "offset",
+                 .help_text =
+                     "Offset in the decompressed content to start extracting "
+                     "from. Requires an input in the zstd seekable format, "
+                     "such as one written by mzc --seekable. Only the frames "
+                     "covering the requested range are mapped and "
+                     "decompressed. The default is 0.",
+                 .parser = &state.offset_parser.argument_parser},
+
+      .length_parser =
+          make_integer_parser("-l, --length", "LENGTH", 0, LLONG_MAX),
+      .length = {.short_name = 'l',
+                 .long_name = "length",
+                 .help_text =
+                     "Number of decompressed bytes to extract. Requires an "
+                     "input in the zstd seekable format. The default is "
+                     "everything from --offset to the end of the content.",
+                 .parser = &state.length_parser.argument_parser},
+
+      .dictionary_parser = make_passthrough_parser("-D, --dict", "FILE"),
+      .dictionary = {.short_name = 'D',
+                     .long_name = "dict",
+                     .help_text =
+                         "Dictionary that the input was compressed with. The "
+                         "file is mapped read-only and digested once for "
+                         "every file decompressed with --batch.",
+                     .parser = &state.dictionary_parser.argument_parser},
+
+      .memory_parser = make_integer_parser("--memory", "MIB", 1, max_memory),
+      .memory = {.short_name = '\0',
+                 .long_name = "memory",
+                 .help_text = memory_help_text,
+                 .parser = &state.memory_parser.argument_parser},
+
+      .digested_dictionary = NULL,
+      .decompression_stream = NULL,
+      .compressed_offsets = NULL,
+      .decompressed_offsets = NULL,
+  };
+
+  KeywordArgument *keyword_args[] = {&state.threads, &state.offset,
+                                     &state.length, &state.dictionary,
+                                     &state.memory};
+
   return run_decompression_app(
       argc, argv,
       &(AppParams){
@@ -48,46 +246,251 @@ int main(int argc, const char *const argv[]) {
                          "for decompression and memory-mapped files are used "
                          "to read and write data to disk.",
 
+          .keyword_args = keyword_args,
+          .num_keyword_args = sizeof(keyword_args) / sizeof(keyword_args[0]),
+
           .size = size,
           .init = init,
           .run = run,
           .cleanup = cleanup,
-          .arg = &decompression_stream,
+          .reset = reset,
+          .prepare = prepare,
+          .release = release,
+          .arg = &state,
+          .arg_size = sizeof(state),
       });
 }
 
-size_t size(size_t input_file_size, void *decompression_stream_ptr_v) {
-  assert(decompression_stream_ptr_v);
+static size_t size(const FileAndMapping *input_file, void *state_v) {
+  assert(input_file);
+  assert(state_v);
 
-  (void)decompression_stream_ptr_v;
+  const State *const state = (const State *)state_v;
 
-  return input_file_size;
+  // walking every frame header would fault in the parts of the input that
+  // range extraction is meant to skip
+  if (state->offset.was_found || state->length.was_found) {
+    return range_size(input_file, state);
+  }
+
+  unsigned long long output_size =
+      ZSTD_findDecompressedSize(input_file->mapping, input_file->file_size);
+
+  // at least one frame doesn't record its size, but its block count bounds it
+  if (output_size == ZSTD_CONTENTSIZE_UNKNOWN) {
+    output_size =
+        ZSTD_decompressBound(input_file->mapping, input_file->file_size);
+  }
+
+  // let the decoder report what's wrong with the input
+  if (output_size == ZSTD_CONTENTSIZE_ERROR) {
+    return input_file->file_size;
+  }
+
+  return (size_t)MIN(output_size, (unsigned long long)SIZE_MAX);
 }
 
-Error init(AppIOState *io_state, void *decompression_stream_ptr_v) {
+static Error init(AppIOState *io_state, void *state_v) {
   assert(io_state);
-  assert(decompression_stream_ptr_v);
+  assert(state_v);
+
+  (void)io_state;
 
-  ZSTD_DStream **const decompression_stream_ptr = decompression_stream_ptr_v;
+  State *const state = (State *)state_v;
   ZSTD_DStream *const decompression_stream = ZSTD_createDStream();
 
   if (!decompression_stream) {
     return ERROR_OUT_OF_MEMORY;
   }
 
-  *decompression_stream_ptr = decompression_stream;
+  state->decompression_stream = decompression_stream;
+
+  // kept by ZSTD_DCtx_reset like the dictionary below
+  if (state->memory.was_found) {
+    const size_t result = ZSTD_DCtx_setParameter(
+        decompression_stream, ZSTD_d_windowLogMax, window_log_max(state));
+    assert(!ZSTD_isError(result));
+    (void)result;
+  }
+
+  // the reference survives ZSTD_DCtx_reset, so reset doesn't repeat this
+  if (state->digested_dictionary) {
+    const size_t result =
+        ZSTD_DCtx_refDDict(decompression_stream, state->digested_dictionary);
+    assert(!ZSTD_isError(result));
+    (void)result;
+  }
+
+  if (state->offset.was_found || state->length.was_found) {
+    const Error error = init_range(io_state, state);
+
+    if (error.what) {
+      free(state->compressed_offsets);
+      free(state->decompressed_offsets);
+      ZSTD_freeDStream(state->decompression_stream);
+    }
+
+    // ranges are extracted one frame at a time on the calling thread
+    return error;
+  }
+
+  if (state->threads.was_found) {
+    const Error error = init_parallel(state);
+
+    if (error.what) {
+      ZSTD_freeDStream(state->decompression_stream);
+
+      return error;
+    }
+  }
 
   return NULL_ERROR;
 }
 
-Error run(AppIOState *io_state, bool *finished,
-          void *decompression_stream_ptr_v) {
+static Error run(AppIOState *io_state, bool *finished, void *state_v) {
   assert(io_state);
   assert(finished);
-  assert(decompression_stream_ptr_v);
+  assert(state_v);
+
+  State *const state = (State *)state_v;
+  Error error;
+
+  if (state->offset.was_found || state->length.was_found) {
+    return run_range(io_state, finished, state);
+  } else if (state->threads.was_found) {
+    error = run_parallel(io_state, state);
+  } else {
+    bool frame_finished;
+    error = run_serial(io_state, &frame_finished, state);
+  }
+
+  if (error.what) {
+    return error;
+  }
+
+  *finished = io_state->input_mapping_first_unused_offset ==
+              io_state->input_file.mapping_size;
+
+  return NULL_ERROR;
+}
+
+static void cleanup(AppIOState *io_state, void *state_v) {
+  assert(io_state);
+  assert(state_v);
+
+  (void)io_state;
+
+  State *const state = (State *)state_v;
+
+  if (state->offset.was_found || state->length.was_found) {
+    free(state->compressed_offsets);
+    free(state->decompressed_offsets);
+  } else if (state->threads.was_found) {
+    cleanup_parallel(state);
+  }
+
+  const size_t result = ZSTD_freeDStream(state->decompression_stream);
+  assert(!ZSTD_isError(result));
+  (void)result;
+}
+
+static Error reset(AppIOState *io_state, void *state_v) {
+  assert(io_state);
+  assert(state_v);
+
+  State *const state = (State *)state_v;
+
+  const size_t result = ZSTD_DCtx_reset(state->decompression_stream,
+                                        ZSTD_reset_session_only);
+  assert(!ZSTD_isError(result));
+  (void)result;
+
+  if (state->offset.was_found || state->length.was_found) {
+    free(state->compressed_offsets);
+    free(state->decompressed_offsets);
+    state->compressed_offsets = NULL;
+    state->decompressed_offsets = NULL;
+
+    // cleanup frees whatever this leaves behind if it fails
+    return init_range(io_state, state);
+  }
+
+  if (state->threads.was_found) {
+    state->is_in_serial_frame = false;
+  }
+
+  return NULL_ERROR;
+}
+
+static Error prepare(void *state_v) {
+  assert(state_v);
 
-  ZSTD_DStream *const decompression_stream =
-      *(ZSTD_DStream *const *)decompression_stream_ptr_v;
+  State *const state = (State *)state_v;
+
+  // the end of the range must be addressable and a valid file offset
+  const unsigned long long max_range_end =
+      MIN((unsigned long long)SIZE_MAX, (unsigned long long)LLONG_MAX);
+  const unsigned long long offset =
+      (unsigned long long)state->offset_parser.value;
+  const unsigned long long length =
+      (unsigned long long)state->length_parser.value;
+
+  if (offset > max_range_end || length > max_range_end - offset) {
+    return eformat("--offset %llu plus --length %llu is larger than the "
+                   "largest supported offset, %llu",
+                   offset, length, max_range_end);
+  }
+
+  if (!state->dictionary.was_found) {
+    return NULL_ERROR;
+  }
+
+  const Error error = open_and_map_file(state->dictionary_parser.value,
+                                        &state->dictionary_file);
+
+  if (error.what) {
+    return error;
+  }
+
+  // referencing the mapping keeps its only copy in the page cache
+  state->digested_dictionary = ZSTD_createDDict_byReference(
+      state->dictionary_file.mapping, state->dictionary_file.file_size);
+
+  if (!state->digested_dictionary) {
+    free_file(state->dictionary_file);
+
+    return eformat("couldn't digest dictionary '%s'",
+                   state->dictionary_parser.value);
+  }
+
+  return NULL_ERROR;
+}
+
+static void release(void *state_v) {
+  assert(state_v);
+
+  State *const state = (State *)state_v;
+
+  if (!state->digested_dictionary) {
+    return;
+  }
+
+  ZSTD_freeDDict(state->digested_dictionary);
+
+  const Error error = free_file(state->dictionary_file);
+
+  if (error.what) {
+    print_warning(error);
+  }
+}
+
+static Error run_serial(AppIOState *io_state, bool *frame_finished,
+                        State *state) {
+  assert(io_state);
+  assert(frame_finished);
+  assert(state);
+
+  ZSTD_DStream *const decompression_stream = state->decompression_stream;
 
   assert(decompression_stream);
 
@@ -106,7 +509,10 @@ Error run(AppIOState *io_state, bool *finished,
   const size_t output_bytes_written_or_error =
       ZSTD_decompressStream(decompression_stream, &out_buffer, &in_buffer);
 
-  if (ZSTD_isError(output_bytes_written_or_error)) {
+  if (ZSTD_getErrorCode(output_bytes_written_or_error) ==
+      ZSTD_error_frameParameter_windowTooLarge) {
+    return window_too_large_error(io_state, state);
+  } else if (ZSTD_isError(output_bytes_written_or_error)) {
     const char *const what = ZSTD_getErrorName(output_bytes_written_or_error);
 
     return eformat("couldn't decompress input file '%s': %s (%zu)",
@@ -123,23 +529,687 @@ Error run(AppIOState *io_state, bool *finished,
   io_state->output_mapping_first_unused_offset += output_bytes_written;
   io_state->output_bytes_written += output_bytes_written;
 
-  *finished = (in_buffer.pos == in_buffer.size);
+  // ZSTD_decompressStream returns 0 once a frame is decoded and flushed
+  *frame_finished = output_bytes_written_or_error == 0;
 
   return NULL_ERROR;
 }
 
-void cleanup(AppIOState *io_state, void *decompression_stream_ptr_v) {
+// decodes every frame up to the next one without a content size in parallel,
+// then streams that frame through the DStream before trying again
+static Error run_parallel(AppIOState *io_state, State *state) {
   assert(io_state);
-  assert(decompression_stream_ptr_v);
+  assert(state);
 
-  (void)io_state;
+  if (!state->is_in_serial_frame) {
+    const Error error = decompress_frames(io_state, state);
 
-  ZSTD_DStream *const decompression_stream =
-      *(ZSTD_DStream *const *)decompression_stream_ptr_v;
+    if (error.what) {
+      return error;
+    }
 
-  assert(decompression_stream);
+    if (io_state->input_mapping_first_unused_offset ==
+        io_state->input_file.mapping_size) {
+      return NULL_ERROR;
+    }
 
-  const size_t result = ZSTD_freeDStream(decompression_stream);
-  assert(!ZSTD_isError(result));
-  (void)result;
+    state->is_in_serial_frame = true;
+  }
+
+  bool frame_finished;
+  const Error error = run_serial(io_state, &frame_finished, state);
+
+  if (error.what) {
+    return error;
+  }
+
+  if (frame_finished) {
+    state->is_in_serial_frame = false;
+  }
+
+  return NULL_ERROR;
+}
+
+// decompresses the next frame that overlaps the requested range directly into
+// the output, then moves the part of it that's in the range into place
+static Error run_range(AppIOState *io_state, bool *finished, State *state) {
+  assert(io_state);
+  assert(finished);
+  assert(state);
+
+  if (state->next_frame == state->end_frame || state->range_remaining == 0) {
+    *finished = true;
+
+    return NULL_ERROR;
+  }
+
+  const size_t frame = state->next_frame;
+  const size_t input_size =
+      state->compressed_offsets[frame + 1] - state->compressed_offsets[frame];
+  const size_t content_start = state->decompressed_offsets[frame];
+  const size_t content_size =
+      state->decompressed_offsets[frame + 1] - content_start;
+
+  FileAndMapping *const output_file = &io_state->output_file;
+  Error error = reserve_output_mapping(
+      output_file, io_state->output_mapping_first_unused_offset, content_size);
+
+  if (error.what) {
+    return error;
+  }
+
+  char *const output = (char *)output_file->mapping +
+                       io_state->output_mapping_first_unused_offset;
+  const size_t output_size_or_error = ZSTD_decompressDCtx(
+      state->decompression_stream, output, content_size,
+      (const char *)io_state->input_file.mapping +
+          io_state->input_mapping_first_unused_offset,
+      input_size);
+
+  if (ZSTD_isError(output_size_or_error)) {
+    const char *const what = ZSTD_getErrorName(output_size_or_error);
+
+    return eformat("couldn't decompress frame at offset %zu of input file "
+                   "'%s': %s (%zu)",
+                   state->compressed_offsets[frame],
+                   io_state->input_file.filename, what, output_size_or_error);
+  } else if (output_size_or_error != content_size) {
+    return eformat("frame at offset %zu of input file '%s' decompressed to "
+                   "%zu bytes, but the seek table says %zu",
+                   state->compressed_offsets[frame],
+                   io_state->input_file.filename, output_size_or_error,
+                   content_size);
+  }
+
+  const size_t skipped = state->range_offset > content_start
+                             ? state->range_offset - content_start
+                             : 0;
+  const size_t kept = MIN(content_size - skipped, state->range_remaining);
+
+  if (skipped > 0) {
+    memmove(output, output + skipped, kept);
+  }
+
+  io_state->input_mapping_first_unused_offset += input_size;
+  io_state->output_mapping_first_unused_offset += kept;
+  io_state->output_bytes_written += kept;
+
+  state->range_remaining -= kept;
+  ++state->next_frame;
+
+  *finished = state->next_frame == state->end_frame ||
+              state->range_remaining == 0;
+
+  return NULL_ERROR;
+}
+
+static Error init_range(AppIOState *io_state, State *state) {
+  assert(io_state);
+  assert(state);
+
+  Error error = read_seek_table(&io_state->input_file, state);
+
+  if (error.what) {
+    return error;
+  }
+
+  const size_t num_frames = state->num_frames_in_table;
+  const size_t content_size = state->decompressed_offsets[num_frames];
+  const size_t offset = (size_t)state->offset_parser.value;
+
+  if (offset > content_size) {
+    return eformat("offset %zu is past the end of the %zu bytes of content in "
+                   "input file '%s'",
+                   offset, content_size, io_state->input_file.filename);
+  }
+
+  size_t length = content_size - offset;
+
+  if (state->length.was_found) {
+    length = MIN(length, (size_t)state->length_parser.value);
+  }
+
+  state->range_offset = offset;
+  state->range_remaining = length;
+
+  // the first frame that ends after offset and the first that starts at or
+  // after its end
+  size_t first = 0;
+  size_t last = num_frames;
+
+  while (first < last) {
+    const size_t middle = first + (last - first) / 2;
+
+    if (state->decompressed_offsets[middle + 1] <= offset) {
+      first = middle + 1;
+    } else {
+      last = middle;
+    }
+  }
+
+  size_t end = first;
+
+  while (end < num_frames &&
+         state->decompressed_offsets[end] < offset + length) {
+    ++end;
+  }
+
+  state->next_frame = first;
+  state->end_frame = end;
+
+  if (first == end) {
+    return NULL_ERROR;
+  }
+
+  const size_t input_offset = state->compressed_offsets[first];
+
+  return map_file_range(&io_state->input_file, input_offset,
+                        state->compressed_offsets[end] - input_offset,
+                        &io_state->input_mapping_first_unused_offset);
+}
+
+// the smaller of --length and the content after --offset, read from the seek
+// table like init_range does. if the table can't be read, init reports why
+static size_t range_size(const FileAndMapping *input_file,
+                         const State *state) {
+  assert(input_file);
+  assert(state);
+
+  unsigned char *entries;
+  size_t num_frames;
+  size_t entry_size;
+  size_t seek_table_offset;
+  const Error error = read_seek_table_entries(
+      input_file, &entries, &num_frames, &entry_size, &seek_table_offset);
+
+  if (error.what) {
+    if (error.allocated) {
+      free(error.what);
+    }
+
+    return input_file->file_size;
+  }
+
+  size_t content_size = 0;
+
+  for (size_t i = 0; i < num_frames; ++i) {
+    content_size += read_le32(entries + 8 + i * entry_size + 4);
+  }
+
+  free(entries);
+
+  const size_t offset = (size_t)state->offset_parser.value;
+
+  if (offset >= content_size) {
+    return 0;
+  }
+
+  const size_t remaining = content_size - offset;
+
+  if (!state->length.was_found) {
+    return remaining;
+  }
+
+  return MIN(remaining, (size_t)state->length_parser.value);
+}
+
+static Error read_seek_table(const FileAndMapping *input_file, State *state) {
+  assert(input_file);
+  assert(state);
+
+  unsigned char *entries;
+  size_t num_frames;
+  size_t entry_size;
+  size_t seek_table_offset;
+  const Error error = read_seek_table_entries(
+      input_file, &entries, &num_frames, &entry_size, &seek_table_offset);
+
+  if (error.what) {
+    return error;
+  }
+
+  state->compressed_offsets = malloc((num_frames + 1) * sizeof(size_t));
+  state->decompressed_offsets = malloc((num_frames + 1) * sizeof(size_t));
+
+  if (!state->compressed_offsets || !state->decompressed_offsets) {
+    free(entries);
+
+    return ERROR_OUT_OF_MEMORY;
+  }
+
+  state->compressed_offsets[0] = 0;
+  state->decompressed_offsets[0] = 0;
+
+  for (size_t i = 0; i < num_frames; ++i) {
+    const unsigned char *const entry = entries + 8 + i * entry_size;
+
+    state->compressed_offsets[i + 1] =
+        state->compressed_offsets[i] + read_le32(entry);
+    state->decompressed_offsets[i + 1] =
+        state->decompressed_offsets[i] + read_le32(entry + 4);
+  }
+
+  free(entries);
+
+  if (state->compressed_offsets[num_frames] > seek_table_offset) {
+    return eformat("seek table in input file '%s' describes more frames "
+                   "than the file holds",
+                   input_file->filename);
+  }
+
+  state->num_frames_in_table = num_frames;
+
+  return NULL_ERROR;
+}
+
+// the seek table is a skippable frame at the end of the file, so it's read
+// with pread before any of the input is mapped in. entries points to its
+// header, followed by num_frames entries of entry_size bytes each
+static Error read_seek_table_entries(const FileAndMapping *input_file,
+                                     unsigned char **entries,
+                                     size_t *num_frames, size_t *entry_size,
+                                     size_t *seek_table_offset) {
+  assert(input_file);
+  assert(entries);
+  assert(num_frames);
+  assert(entry_size);
+  assert(seek_table_offset);
+
+  unsigned char footer[SEEK_TABLE_FOOTER_SIZE];
+
+  if (input_file->file_size < 8 + SEEK_TABLE_FOOTER_SIZE) {
+    return eformat("input file '%s' is too small to have a seek table",
+                   input_file->filename);
+  }
+
+  Error error = read_exactly(input_file, footer, sizeof(footer),
+                             input_file->file_size - sizeof(footer));
+
+  if (error.what) {
+    return error;
+  }
+
+  const uint32_t num_table_frames = read_le32(footer);
+  const unsigned char descriptor = footer[4];
+
+  if (read_le32(footer + 5) != SEEKABLE_MAGIC_NUMBER ||
+      (descriptor & SEEK_TABLE_RESERVED_BITS)) {
+    return eformat("input file '%s' doesn't end with a seek table; was it "
+                   "compressed with mzc --seekable?",
+                   input_file->filename);
+  }
+
+  const size_t table_entry_size =
+      (descriptor & SEEK_TABLE_CHECKSUM_FLAG) ? 12 : 8;
+  const size_t entries_size = (size_t)num_table_frames * table_entry_size;
+
+  if (entries_size > input_file->file_size - 8 - SEEK_TABLE_FOOTER_SIZE) {
+    return eformat("seek table in input file '%s' is truncated",
+                   input_file->filename);
+  }
+
+  const size_t table_offset =
+      input_file->file_size - 8 - SEEK_TABLE_FOOTER_SIZE - entries_size;
+  unsigned char *const table = malloc(8 + entries_size);
+
+  if (!table) {
+    return ERROR_OUT_OF_MEMORY;
+  }
+
+  if ((error = read_exactly(input_file, table, 8 + entries_size,
+                            table_offset)),
+      error.what) {
+    free(table);
+
+    return error;
+  }
+
+  if (read_le32(table) != SEEK_TABLE_MAGIC_NUMBER ||
+      read_le32(table + 4) != entries_size + SEEK_TABLE_FOOTER_SIZE) {
+    free(table);
+
+    return eformat("seek table in input file '%s' is corrupt",
+                   input_file->filename);
+  }
+
+  *entries = table;
+  *num_frames = num_table_frames;
+  *entry_size = table_entry_size;
+  *seek_table_offset = table_offset;
+
+  return NULL_ERROR;
+}
+
+static Error read_exactly(const FileAndMapping *file, void *buffer, size_t size,
+                          size_t offset) {
+  assert(file);
+  assert(buffer);
+
+  while (size > 0) {
+    const ssize_t bytes_read = pread(file->fd, buffer, size, (off_t)offset);
+
+    if (bytes_read == -1) {
+      return ERRNO_EFORMAT("couldn't read from file '%s'", file->filename);
+    } else if (bytes_read == 0) {
+      return eformat("unexpected end of file '%s'", file->filename);
+    }
+
+    buffer = (char *)buffer + bytes_read;
+    size -= (size_t)bytes_read;
+    offset += (size_t)bytes_read;
+  }
+
+  return NULL_ERROR;
+}
+
+static Error init_parallel(State *state) {
+  assert(state);
+
+  const size_t num_workers = (size_t)state->threads_parser.value;
+
+  state->workers = calloc(num_workers, sizeof(Worker));
+  state->num_workers = 0;
+  state->has_pool = false;
+
+  if (!state->workers) {
+    return ERROR_OUT_OF_MEMORY;
+  }
+
+  for (size_t i = 0; i < num_workers; ++i) {
+    Worker *const worker = &state->workers[i];
+    worker->state = state;
+    worker->context = ZSTD_createDCtx();
+
+    if (!worker->context) {
+      cleanup_parallel(state);
+
+      return ERROR_OUT_OF_MEMORY;
+    }
+
+    if (state->digested_dictionary) {
+      const size_t result =
+          ZSTD_DCtx_refDDict(worker->context, state->digested_dictionary);
+      assert(!ZSTD_isError(result));
+      (void)result;
+    }
+
+    ++state->num_workers;
+  }
+
+  const Error error = create_thread_pool(num_workers, &state->pool);
+
+  if (error.what) {
+    cleanup_parallel(state);
+
+    return error;
+  }
+
+  pthread_mutex_init(&state->frames_mutex, NULL);
+  state->has_pool = true;
+
+  state->is_in_serial_frame = false;
+  state->frames = NULL;
+  state->num_frames = 0;
+  state->frames_capacity = 0;
+
+  return NULL_ERROR;
+}
+
+static void cleanup_parallel(State *state) {
+  assert(state);
+
+  if (state->has_pool) {
+    free_thread_pool(&state->pool);
+    pthread_mutex_destroy(&state->frames_mutex);
+    free(state->frames);
+  }
+
+  for (size_t i = 0; i < state->num_workers; ++i) {
+    ZSTD_freeDCtx(state->workers[i].context);
+  }
+
+  free(state->workers);
+}
+
+static Error decompress_frames(AppIOState *io_state, State *state) {
+  assert(io_state);
+  assert(state);
+
+  const FileAndMapping *const input_file = &io_state->input_file;
+  const char *const input_begin = (const char *)input_file->mapping;
+  size_t input_offset = io_state->input_mapping_first_unused_offset;
+
+  state->input_filename = input_file->filename;
+  state->num_frames = 0;
+  size_t output_size = 0;
+
+  while (input_offset < input_file->mapping_size) {
+    const char *const input = input_begin + input_offset;
+    const size_t input_remaining = input_file->mapping_size - input_offset;
+    const size_t absolute_offset = input_file->mapping_offset + input_offset;
+
+    const unsigned long long content_size =
+        ZSTD_getFrameContentSize(input, input_remaining);
+
+    if (content_size == ZSTD_CONTENTSIZE_UNKNOWN) {
+      break;
+    } else if (content_size == ZSTD_CONTENTSIZE_ERROR) {
+      return eformat("couldn't read frame header at offset %zu of input "
+                     "file '%s'",
+                     absolute_offset, input_file->filename);
+    } else if (content_size > SIZE_MAX - output_size) {
+      return eformat("frame at offset %zu of input file '%s' is too large",
+                     absolute_offset, input_file->filename);
+    }
+
+    const size_t compressed_size_or_error =
+        ZSTD_findFrameCompressedSize(input, input_remaining);
+
+    if (ZSTD_isError(compressed_size_or_error)) {
+      const char *const what = ZSTD_getErrorName(compressed_size_or_error);
+
+      return eformat("couldn't find the end of the frame at offset %zu of "
+                     "input file '%s': %s (%zu)",
+                     absolute_offset, input_file->filename, what,
+                     compressed_size_or_error);
+    }
+
+    const Frame frame = {
+        .input = input,
+        .input_offset = absolute_offset,
+        .input_size = compressed_size_or_error,
+
+        .output_offset = output_size,
+        .output_size = (size_t)content_size,
+    };
+
+    const Error error = push_frame(state, &frame);
+
+    if (error.what) {
+      return error;
+    }
+
+    input_offset += compressed_size_or_error;
+    output_size += (size_t)content_size;
+  }
+
+  if (state->num_frames == 0) {
+    return NULL_ERROR;
+  }
+
+  FileAndMapping *const output_file = &io_state->output_file;
+  Error error = reserve_output_mapping(
+      output_file, io_state->output_mapping_first_unused_offset, output_size);
+
+  if (error.what) {
+    return error;
+  }
+
+  char *const output = (char *)output_file->mapping +
+                       io_state->output_mapping_first_unused_offset;
+
+  for (size_t i = 0; i < state->num_frames; ++i) {
+    state->frames[i].output = output + state->frames[i].output_offset;
+  }
+
+  state->next_frame_index = 0;
+
+  const size_t num_tasks = MIN(state->num_workers, state->num_frames);
+
+  for (size_t i = 0; i < num_tasks && !error.what; ++i) {
+    error = submit_task(&state->pool, decompress_frames_task,
+                        &state->workers[i]);
+  }
+
+  wait_for_tasks(&state->pool);
+
+  for (size_t i = 0; i < state->num_frames; ++i) {
+    if (state->frames[i].error.what) {
+      if (error.what) {
+        print_error(error);
+      }
+
+      error = state->frames[i].error;
+    }
+  }
+
+  if (error.what) {
+    return error;
+  }
+
+  io_state->input_mapping_first_unused_offset = input_offset;
+  io_state->output_mapping_first_unused_offset += output_size;
+  io_state->output_bytes_written += output_size;
+
+  return NULL_ERROR;
+}
+
+static Error push_frame(State *state, const Frame *frame) {
+  assert(state);
+  assert(frame);
+
+  if (state->num_frames == state->frames_capacity) {
+    const size_t new_capacity =
+        state->frames_capacity > 0 ? state->frames_capacity * 2 : 64;
+    Frame *const new_frames =
+        realloc(state->frames, new_capacity * sizeof(Frame));
+
+    if (!new_frames) {
+      return ERROR_OUT_OF_MEMORY;
+    }
+
+    state->frames = new_frames;
+    state->frames_capacity = new_capacity;
+  }
+
+  state->frames[state->num_frames] = *frame;
+  state->frames[state->num_frames].error = NULL_ERROR;
+  ++state->num_frames;
+
+  return NULL_ERROR;
+}
+
+static void decompress_frames_task(void *worker_v) {
+  assert(worker_v);
+
+  Worker *const worker = (Worker *)worker_v;
+  State *const state = worker->state;
+
+  while (true) {
+    pthread_mutex_lock(&state->frames_mutex);
+    const size_t index = state->next_frame_index;
+
+    if (index < state->num_frames) {
+      ++state->next_frame_index;
+    }
+
+    pthread_mutex_unlock(&state->frames_mutex);
+
+    if (index >= state->num_frames) {
+      return;
+    }
+
+    decompress_frame(worker->context, &state->frames[index],
+                     state->input_filename);
+  }
+}
+
+static void decompress_frame(ZSTD_DCtx *context, Frame *frame,
+                             const char *filename) {
+  assert(context);
+  assert(frame);
+
+  const size_t decompressed_size_or_error = ZSTD_decompressDCtx(
+      context, frame->output, frame->output_size, frame->input,
+      frame->input_size);
+
+  if (ZSTD_isError(decompressed_size_or_error)) {
+    const char *const what = ZSTD_getErrorName(decompressed_size_or_error);
+
+    frame->error = eformat("couldn't decompress frame at offset %zu of input "
+                           "file '%s': %s (%zu)",
+                           frame->input_offset, filename, what,
+                           decompressed_size_or_error);
+  } else if (decompressed_size_or_error != frame->output_size) {
+    frame->error = eformat("frame at offset %zu of input file '%s' "
+                           "decompressed to %zu bytes, expected %zu",
+                           frame->input_offset, filename,
+                           decompressed_size_or_error, frame->output_size);
+  }
+}
+
+// ZSTD_decompressStream returns after every frame, so the frame that was
+// refused starts where the call did
+static Error window_too_large_error(const AppIOState *io_state,
+                                    const State *state) {
+  assert(io_state);
+  assert(state);
+
+  const unsigned long long max_window_size = 1ull << window_log_max(state);
+  ZSTD_frameHeader header;
+
+  if (ZSTD_getFrameHeader(&header,
+                          (const char *)io_state->input_file.mapping +
+                              io_state->input_mapping_first_unused_offset,
+                          io_state->input_file.mapping_size -
+                              io_state->input_mapping_first_unused_offset) !=
+          0 ||
+      header.windowSize <= max_window_size) {
+    return eformat("couldn't decompress input file '%s': a frame needs a "
+                   "window larger than %llu MiB, pass a larger --memory",
+                   io_state->input_file.filename, max_window_size >> 20);
+  }
+
+  unsigned long long memory = 1;
+
+  while (memory << 20 < header.windowSize) {
+    memory <<= 1;
+  }
+
+  return eformat("couldn't decompress input file '%s': a frame needs a %llu "
+                 "MiB window, pass --memory=%llu",
+                 io_state->input_file.filename, memory, memory);
+}
+
+static int window_log_max(const State *state) {
+  assert(state);
+
+  if (!state->memory.was_found) {
+    return ZSTD_WINDOWLOG_LIMIT_DEFAULT;
+  }
+
+  int log = 20;
+
+  while ((1ll << (log + 1 - 20)) <= state->memory_parser.value) {
+    ++log;
+  }
+
+  return log;
+}
+
+static uint32_t read_le32(const void *input) {
+  const unsigned char *const bytes = (const unsigned char *)input;
+
+  return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) |
+         ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
 }
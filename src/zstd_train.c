@@ -0,0 +1,303 @@
+// Copyright (c) 2019 Gregory Meyer
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <common/argparse.h>
+#include <common/error.h>
+#include <common/file.h>
+#include <common/mmc.h>
+
+#include "frontends.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zdict.h>
+
+// the default of zstd --train
+#define DEFAULT_DICTIONARY_SIZE 112640
+
+static Error read_samples(size_t num_samples,
+                          const char *const filenames[num_samples],
+                          char **samples, size_t sample_sizes[num_samples]);
+static Error train_dictionary(const char *filename, size_t max_size,
+                              const char *samples, size_t num_samples,
+                              const size_t sample_sizes[num_samples]);
+
+#ifndef MMC_MULTI_CALL
+int main(int argc, const char *const argv[]) {
+  return zstd_train_main(argc, argv);
+}
+#endif
+
+int zstd_train_main(int argc, const char *const argv[]) {
+  IntegerArgumentParser size_parser =
+      make_integer_parser("-s, --size", "SIZE", 256, 1ll << 30);
+  KeywordArgument size = {
+      .short_name = 's',
+      .long_name = "size",
+      .help_text =
+          "Maximum size of the dictionary in bytes. An integer in the range "
+          "[256, 1073741824]. The default is 112640 (110 KiB), like zstd "
+          "--train. md and mlc only use the last 32 KiB and 64 KiB of the "
+          "dictionary, which is where zstd puts the content it found most "
+          "useful.",
+      .parser = &size_parser.argument_parser,
+  };
+
+  KeywordArgument *keyword_args[] = {&size};
+
+  PassthroughArgumentParser dictionary_filename_parser =
+      make_passthrough_parser("DICTIONARY_FILE", NULL);
+  PassthroughArgumentParser sample_filename_parser =
+      make_passthrough_parser("SAMPLE_FILE", NULL);
+
+  // checked below, since any number of samples can be given
+  const char *filenames[argc];
+
+  Arguments arguments = {
+      .executable_name = "mmap-zstd-train",
+      .version = MMC_VERSION,
+      .author = MMC_AUTHOR,
+      .description =
+          "mmap-zstd-train (mzt) trains a zstd dictionary on sample files, "
+          "such as many small records like the ones it will compress. "
+          "Samples are mapped and copied into one buffer, and the dictionary "
+          "is trained straight into a mapping of its file. Pass it to any "
+          "frontend with --dict.",
+
+      .positional_args =
+          (PositionalArgument *[]){
+              &(PositionalArgument){
+                  .name = "DICTIONARY_FILE",
+                  .help_text =
+                      "Filename of the dictionary to create. If this file "
+                      "already exists, it is truncated to length 0 before "
+                      "being written to. Should mmap-zstd-train exit with an "
+                      "error after truncating this file, it will be deleted.",
+                  .parser = &dictionary_filename_parser.argument_parser,
+              },
+              &(PositionalArgument){
+                  .name = "SAMPLE_FILE",
+                  .help_text =
+                      "Files to train the dictionary on. Any number of them "
+                      "can be given, and the more there are, the better the "
+                      "dictionary. Empty files are skipped.",
+                  .parser = &sample_filename_parser.argument_parser,
+              },
+          },
+      .num_positional_args = 2,
+      .collected_positional_args = filenames,
+
+      .keyword_args = keyword_args,
+      .num_keyword_args = sizeof(keyword_args) / sizeof(keyword_args[0]),
+  };
+
+  Error error = parse_arguments(&arguments, argc, argv);
+
+  if (error.what) {
+    print_error(error);
+
+    return EXIT_FAILURE;
+  }
+
+  if (arguments.has_help) {
+    print_help(&arguments);
+
+    return EXIT_SUCCESS;
+  } else if (arguments.has_version) {
+    print_version(&arguments);
+
+    return EXIT_SUCCESS;
+  }
+
+  const size_t num_filenames = arguments.num_collected_positional_args;
+
+  if (num_filenames < 2) {
+    print_error(eformat("missing required positional argument %s",
+                        num_filenames == 0 ? "DICTIONARY_FILE"
+                                           : "SAMPLE_FILE"));
+
+    return EXIT_FAILURE;
+  }
+
+  const size_t num_samples = num_filenames - 1;
+  size_t *const sample_sizes = malloc(num_samples * sizeof(size_t));
+  char *samples = NULL;
+
+  if (!sample_sizes) {
+    print_error(ERROR_OUT_OF_MEMORY);
+
+    return EXIT_FAILURE;
+  }
+
+  if ((error = read_samples(num_samples, filenames + 1, &samples,
+                            sample_sizes)),
+      error.what) {
+    print_error(error);
+    free(sample_sizes);
+
+    return EXIT_FAILURE;
+  }
+
+  const size_t max_size =
+      size.was_found ? (size_t)size_parser.value : DEFAULT_DICTIONARY_SIZE;
+  error = train_dictionary(filenames[0], max_size, samples, num_samples,
+                           sample_sizes);
+
+  free(samples);
+  free(sample_sizes);
+
+  if (error.what) {
+    print_error(error);
+
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+// ZDICT_trainFromBuffer takes the samples back to back in one buffer, so each
+// is mapped in turn and copied there
+static Error read_samples(size_t num_samples,
+                          const char *const filenames[num_samples],
+                          char **samples, size_t sample_sizes[num_samples]) {
+  assert(filenames);
+  assert(samples);
+  assert(sample_sizes);
+
+  size_t total_size = 0;
+
+  for (size_t i = 0; i < num_samples; ++i) {
+    struct stat statbuf;
+
+    if (stat(filenames[i], &statbuf) == -1) {
+      return ERRNO_EFORMAT("couldn't stat file '%s'", filenames[i]);
+    }
+
+    sample_sizes[i] = (size_t)statbuf.st_size;
+
+    if (sample_sizes[i] > SIZE_MAX - total_size) {
+      return STATIC_ERROR("samples are too large to fit in memory");
+    }
+
+    total_size += sample_sizes[i];
+  }
+
+  if (total_size == 0) {
+    return STATIC_ERROR("every sample is empty");
+  }
+
+  char *const buffer = malloc(total_size);
+
+  if (!buffer) {
+    return ERROR_OUT_OF_MEMORY;
+  }
+
+  size_t offset = 0;
+
+  for (size_t i = 0; i < num_samples; ++i) {
+    // mmap can't map an empty file
+    if (sample_sizes[i] == 0) {
+      continue;
+    }
+
+    FileAndMapping file;
+    Error error = open_and_map_file(filenames[i], &file);
+
+    if (error.what) {
+      free(buffer);
+
+      return error;
+    }
+
+    if (file.file_size != sample_sizes[i]) {
+      free_file(file);
+      free(buffer);
+
+      return eformat("file '%s' changed size while it was being read",
+                     filenames[i]);
+    }
+
+    memcpy(buffer + offset, file.mapping, file.file_size);
+    offset += file.file_size;
+
+    if ((error = free_file(file)), error.what) {
+      free(buffer);
+
+      return error;
+    }
+  }
+
+  *samples = buffer;
+
+  return NULL_ERROR;
+}
+
+// the output file is removed if anything goes wrong
+static Error train_dictionary(const char *filename, size_t max_size,
+                              const char *samples, size_t num_samples,
+                              const size_t sample_sizes[num_samples]) {
+  assert(filename);
+  assert(samples);
+  assert(sample_sizes);
+
+  if (num_samples > UINT_MAX) {
+    return eformat("expected at most %u samples, got %zu", UINT_MAX,
+                   num_samples);
+  }
+
+  FileAndMapping file;
+  Error error = create_and_map_file(filename, max_size, &file);
+
+  if (error.what) {
+    return error;
+  }
+
+  const size_t size_or_error = ZDICT_trainFromBuffer(
+      file.mapping, max_size, samples, sample_sizes, (unsigned)num_samples);
+
+  if (ZDICT_isError(size_or_error)) {
+    error = eformat("couldn't train dictionary: %s (%zu)",
+                    ZDICT_getErrorName(size_or_error), size_or_error);
+  } else if (ftruncate(file.fd, (off_t)size_or_error) == -1) {
+    error = ERRNO_EFORMAT("couldn't resize output file '%s'", filename);
+  }
+
+  const Error free_error = free_file(file);
+
+  if (!error.what) {
+    error = free_error;
+  } else if (free_error.what) {
+    print_error(free_error);
+  }
+
+  if (error.what && unlink(filename) == -1) {
+    print_error(ERRNO_EFORMAT("couldn't remove file '%s'", filename));
+  }
+
+  return error;
+}
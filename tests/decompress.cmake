@@ -0,0 +1,29 @@
+# cmake -DDECOMPRESSOR=PATH -DINPUT=FILE -DEXPECTED=TEXT -DOUTPUT=FILE
+#     -P decompress.cmake
+#
+# decompresses INPUT to OUTPUT and checks that OUTPUT contains exactly EXPECTED
+
+foreach(variable DECOMPRESSOR INPUT OUTPUT)
+    if(NOT DEFINED ${variable})
+        message(FATAL_ERROR "${variable} must be set")
+    endif()
+endforeach()
+
+file(REMOVE "${OUTPUT}")
+
+execute_process(
+    COMMAND "${DECOMPRESSOR}" "${INPUT}" "${OUTPUT}"
+    RESULT_VARIABLE result
+    TIMEOUT 10
+)
+
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "'${DECOMPRESSOR} ${INPUT}' failed: ${result}")
+endif()
+
+file(READ "${OUTPUT}" actual)
+
+if(NOT actual STREQUAL "${EXPECTED}")
+    message(FATAL_ERROR
+        "'${DECOMPRESSOR} ${INPUT}' wrote '${actual}', expected '${EXPECTED}'")
+endif()